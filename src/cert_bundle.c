@@ -0,0 +1,634 @@
+/*-
+ * Copyright (c) 2026 Varnish Software
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Precompiled certificate bundles.
+ *
+ * A bundle holds the certificates of a configuration already decoded:
+ * the DER chains and keys, the SNI names, and what the configuration
+ * said about each PEM file. It is written by hitch --compile-certs and
+ * mapped read-only at startup, so that loading tens of thousands of
+ * certificates takes one open and no base64 decoding.
+ *
+ * The layout is, all integers little endian:
+ *
+ *	header:	"HITCHCB\n", u32 version, u32 entries,
+ *		u64 index offset, u64 file size
+ *	entry:	u32 flags, i32 ocsp_vfy, u32 names, u32 certs, u64 mtim,
+ *		then the blobs filename, ocspfn, key, dh, names..., certs...
+ *	blob:	u32 length, the bytes and a NUL, padded to 4 bytes
+ *	index:	u64 offset of each entry
+ *
+ * Entries start on 8 byte boundaries. Every entry is checked when the
+ * bundle is opened, and the blobs point into the mapping afterwards.
+ *
+ * A bundle can also be built in memory with CB_Create_Mem(), and mapped
+ * shared and read-only with CB_Map() so that processes forked afterwards
+ * use the same pages.
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "foreign/miniobj.h"
+#include "foreign/vas.h"
+#include "cert_bundle.h"
+
+#define CB_MAGIC_STR		"HITCHCB\n"
+#define CB_VERSION		1
+#define CB_HDR_LEN		32
+#define CB_ENT_LEN		24
+
+struct cert_bundle {
+	unsigned		magic;
+#define CERT_BUNDLE_MAGIC	0x3cb01a55
+	unsigned		refcnt;
+	const uint8_t		*base;
+	size_t			size;
+	unsigned		nents;
+	const uint8_t		*index;
+};
+
+struct cb_writer {
+	unsigned		magic;
+#define CB_WRITER_MAGIC		0x3cb0417e
+	FILE			*f;
+	uint8_t			*buf;		/* In memory, if no f */
+	size_t			buf_sz;
+	char			*path;
+	char			*tmp;
+	uint64_t		off;
+	uint64_t		*offs;
+	unsigned		nents;
+	unsigned		sz;
+	int			error;
+};
+
+static uint32_t
+cb_le32(const uint8_t *p)
+{
+
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	    (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static uint64_t
+cb_le64(const uint8_t *p)
+{
+
+	return (cb_le32(p) | (uint64_t)cb_le32(p + 4) << 32);
+}
+
+static void
+cb_le32enc(uint8_t *p, uint32_t u)
+{
+
+	p[0] = u & 0xff;
+	p[1] = (u >> 8) & 0xff;
+	p[2] = (u >> 16) & 0xff;
+	p[3] = (u >> 24) & 0xff;
+}
+
+static void
+cb_le64enc(uint8_t *p, uint64_t u)
+{
+
+	cb_le32enc(p, (uint32_t)u);
+	cb_le32enc(p + 4, (uint32_t)(u >> 32));
+}
+
+static size_t
+cb_pad4(size_t n)
+{
+
+	return ((n + 3) & ~(size_t)3);
+}
+
+/* Read the blob at *off and move past it. Returns -1 if the blob is out
+ * of bounds or not NUL terminated. */
+static int
+cb_blob(const struct cert_bundle *cb, uint64_t *off, struct cb_blob *b)
+{
+	uint64_t len;
+
+	if (cb->size < 4 || *off > cb->size - 4)
+		return (-1);
+	len = cb_le32(cb->base + *off);
+	if (len >= cb->size - *off - 4 || cb->base[*off + 4 + len] != '\0')
+		return (-1);
+	b->ptr = cb->base + *off + 4;
+	b->len = len;
+	*off += 4 + cb_pad4(len + 1);
+	return (0);
+}
+
+/* Decode an entry. The arrays of the entry are allocated, the strings and
+ * blobs point into the mapping. */
+static int
+cb_entry(const struct cert_bundle *cb, unsigned idx, struct cb_entry *e)
+{
+	struct cb_blob b;
+	const uint8_t *p;
+	uint64_t off, u;
+	unsigned i;
+
+	memset(e, 0, sizeof *e);
+	off = cb_le64(cb->index + 8 * (size_t)idx);
+	if (cb->size < CB_ENT_LEN || off % 8 != 0 || off < CB_HDR_LEN ||
+	    off > cb->size - CB_ENT_LEN)
+		return (-1);
+	p = cb->base + off;
+	e->flags = cb_le32(p);
+	e->ocsp_vfy = (int32_t)cb_le32(p + 4);
+	e->nnames = cb_le32(p + 8);
+	e->ncerts = cb_le32(p + 12);
+	u = cb_le64(p + 16);
+	memcpy(&e->mtim, &u, sizeof e->mtim);
+	off += CB_ENT_LEN;
+
+	/* Each blob takes at least 8 bytes */
+	if (e->ncerts == 0 || e->nnames > cb->size / 8 ||
+	    e->ncerts > cb->size / 8)
+		return (-1);
+
+	if (cb_blob(cb, &off, &b) != 0 || b.len == 0)
+		return (-1);
+	e->filename = b.ptr;
+	if (cb_blob(cb, &off, &b) != 0)
+		return (-1);
+	e->ocspfn = b.len > 0 ? b.ptr : NULL;
+	if (cb_blob(cb, &off, &e->key) != 0 || e->key.len == 0)
+		return (-1);
+	if (cb_blob(cb, &off, &e->dh) != 0)
+		return (-1);
+
+	e->names = calloc(e->nnames + 1, sizeof *e->names);
+	e->certs = calloc(e->ncerts, sizeof *e->certs);
+	if (e->names == NULL || e->certs == NULL) {
+		CB_Entry_Free(e);
+		return (-1);
+	}
+	for (i = 0; i < e->nnames; i++) {
+		if (cb_blob(cb, &off, &b) != 0 || b.len == 0) {
+			CB_Entry_Free(e);
+			return (-1);
+		}
+		e->names[i] = b.ptr;
+	}
+	for (i = 0; i < e->ncerts; i++) {
+		if (cb_blob(cb, &off, &e->certs[i]) != 0 ||
+		    e->certs[i].len == 0) {
+			CB_Entry_Free(e);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static struct cert_bundle *cb_init(const void *base, size_t size);
+
+/* Map a bundle and check all of its entries. Returns NULL with errno set,
+ * EINVAL if the file is not a valid bundle.
+ *
+ * The entries are only checked once, and the file stays mapped for as
+ * long as certificates use it: a bundle must never be written in place,
+ * as truncating it would get the processes mapping it killed by SIGBUS.
+ * CB_Close() writes a temporary file and renames it over the bundle,
+ * which leaves the mapped file untouched. */
+struct cert_bundle *
+CB_Open(const char *path)
+{
+	struct stat st;
+	void *base;
+	int fd, err;
+
+	AN(path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (NULL);
+	if (fstat(fd, &st) != 0) {
+		err = errno;
+		(void)close(fd);
+		errno = err;
+		return (NULL);
+	}
+	if (st.st_size < CB_HDR_LEN || (uint64_t)st.st_size > SIZE_MAX) {
+		(void)close(fd);
+		errno = EINVAL;
+		return (NULL);
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	err = errno;
+	(void)close(fd);
+	if (base == MAP_FAILED) {
+		errno = err;
+		return (NULL);
+	}
+	return (cb_init(base, st.st_size));
+}
+
+/* Check the bundle mapped at base, which it takes over */
+static struct cert_bundle *
+cb_init(const void *base, size_t size)
+{
+	struct cert_bundle *cb;
+	struct cb_entry e;
+	uint64_t index;
+	unsigned u;
+	int err;
+
+	ALLOC_OBJ(cb, CERT_BUNDLE_MAGIC);
+	AN(cb);
+	cb->refcnt = 1;
+	cb->base = base;
+	cb->size = size;
+
+	err = EINVAL;
+	if (cb->size < CB_HDR_LEN ||
+	    memcmp(cb->base, CB_MAGIC_STR, 8) != 0 ||
+	    cb_le32(cb->base + 8) != CB_VERSION ||
+	    cb_le64(cb->base + 24) != cb->size)
+		goto err;
+	cb->nents = cb_le32(cb->base + 12);
+	index = cb_le64(cb->base + 16);
+	if (index < CB_HDR_LEN || index > cb->size ||
+	    (cb->size - index) / 8 < cb->nents)
+		goto err;
+	cb->index = cb->base + index;
+
+	for (u = 0; u < cb->nents; u++) {
+		if (cb_entry(cb, u, &e) != 0)
+			goto err;
+		CB_Entry_Free(&e);
+	}
+	return (cb);
+
+err:
+	CB_Deref(&cb);
+	errno = err;
+	return (NULL);
+}
+
+unsigned
+CB_Count(const struct cert_bundle *cb)
+{
+
+	CHECK_OBJ_NOTNULL(cb, CERT_BUNDLE_MAGIC);
+	return (cb->nents);
+}
+
+size_t
+CB_Size(const struct cert_bundle *cb)
+{
+
+	CHECK_OBJ_NOTNULL(cb, CERT_BUNDLE_MAGIC);
+	return (cb->size);
+}
+
+/* The entry must be freed with CB_Entry_Free(), and not be used after
+ * the last reference to the bundle is gone. */
+int
+CB_Entry(const struct cert_bundle *cb, unsigned idx, struct cb_entry *e)
+{
+
+	CHECK_OBJ_NOTNULL(cb, CERT_BUNDLE_MAGIC);
+	AN(e);
+	if (idx >= cb->nents)
+		return (-1);
+	return (cb_entry(cb, idx, e));
+}
+
+void
+CB_Entry_Free(struct cb_entry *e)
+{
+
+	AN(e);
+	free(e->names);
+	free(e->certs);
+	memset(e, 0, sizeof *e);
+}
+
+struct cert_bundle *
+CB_Ref(struct cert_bundle *cb)
+{
+
+	CHECK_OBJ_NOTNULL(cb, CERT_BUNDLE_MAGIC);
+	AN(cb->refcnt);
+	cb->refcnt++;
+	return (cb);
+}
+
+void
+CB_Deref(struct cert_bundle **cbp)
+{
+	struct cert_bundle *cb;
+
+	AN(cbp);
+	cb = *cbp;
+	*cbp = NULL;
+	if (cb == NULL)
+		return;
+	CHECK_OBJ(cb, CERT_BUNDLE_MAGIC);
+	AN(cb->refcnt);
+	if (--cb->refcnt > 0)
+		return;
+	AZ(munmap((void *)(uintptr_t)cb->base, cb->size));
+	FREE_OBJ(cb);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+cb_put(struct cb_writer *w, const void *p, size_t len)
+{
+
+	if (w->error != 0 || len == 0) {
+		w->off += len;
+		return;
+	}
+	if (w->f == NULL) {
+		if (w->off + len > w->buf_sz) {
+			while (w->off + len > w->buf_sz)
+				w->buf_sz = w->buf_sz ? w->buf_sz * 2 : 65536;
+			w->buf = realloc(w->buf, w->buf_sz);
+			AN(w->buf);
+		}
+		memcpy(w->buf + w->off, p, len);
+	} else if (fwrite(p, len, 1, w->f) != 1)
+		w->error = errno != 0 ? errno : EIO;
+	w->off += len;
+}
+
+static void
+cb_put_blob(struct cb_writer *w, const void *p, size_t len)
+{
+	static const uint8_t zero[4];
+	uint8_t buf[4];
+
+	if (len > UINT32_MAX - 4) {
+		w->error = EFBIG;
+		return;
+	}
+	cb_le32enc(buf, (uint32_t)len);
+	cb_put(w, buf, 4);
+	cb_put(w, p, len);
+	cb_put(w, zero, cb_pad4(len + 1) - len);
+}
+
+/* Start a bundle, written to a temporary file until CB_Close(). The keys
+ * it holds are not encrypted, it is only readable by its owner. */
+struct cb_writer *
+CB_Create(const char *path)
+{
+	struct cb_writer *w;
+	uint8_t hdr[CB_HDR_LEN];
+	size_t l;
+	int fd;
+
+	AN(path);
+	ALLOC_OBJ(w, CB_WRITER_MAGIC);
+	AN(w);
+	w->path = strdup(path);
+	AN(w->path);
+	l = strlen(path) + 5;
+	w->tmp = malloc(l);
+	AN(w->tmp);
+	(void)snprintf(w->tmp, l, "%s.tmp", path);
+
+	fd = open(w->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd >= 0)
+		w->f = fdopen(fd, "w");
+	if (w->f == NULL) {
+		if (fd >= 0)
+			(void)close(fd);
+		free(w->tmp);
+		free(w->path);
+		FREE_OBJ(w);
+		return (NULL);
+	}
+
+	/* Written again when closing */
+	memset(hdr, 0, sizeof hdr);
+	cb_put(w, hdr, sizeof hdr);
+	return (w);
+}
+
+/* Start a bundle in memory, see CB_Map() */
+struct cb_writer *
+CB_Create_Mem(void)
+{
+	struct cb_writer *w;
+	uint8_t hdr[CB_HDR_LEN];
+
+	ALLOC_OBJ(w, CB_WRITER_MAGIC);
+	AN(w);
+	memset(hdr, 0, sizeof hdr);
+	cb_put(w, hdr, sizeof hdr);
+	return (w);
+}
+
+/* The number of entries written so far, the index of the next one */
+unsigned
+CB_Entries(const struct cb_writer *w)
+{
+
+	CHECK_OBJ_NOTNULL(w, CB_WRITER_MAGIC);
+	return (w->nents);
+}
+
+int
+CB_Write(struct cb_writer *w, const struct cb_entry *e)
+{
+	static const uint8_t zero[8];
+	uint8_t buf[CB_ENT_LEN];
+	uint64_t u;
+	unsigned i;
+
+	CHECK_OBJ_NOTNULL(w, CB_WRITER_MAGIC);
+	AN(e);
+	AN(e->filename);
+	assert(e->ncerts > 0);
+	assert(e->key.len > 0);
+
+	if (w->nents == w->sz) {
+		w->sz = w->sz ? w->sz * 2 : 1024;
+		w->offs = realloc(w->offs, w->sz * sizeof *w->offs);
+		AN(w->offs);
+	}
+	cb_put(w, zero, (8 - w->off % 8) % 8);
+	w->offs[w->nents++] = w->off;
+
+	cb_le32enc(buf, e->flags);
+	cb_le32enc(buf + 4, (uint32_t)e->ocsp_vfy);
+	cb_le32enc(buf + 8, e->nnames);
+	cb_le32enc(buf + 12, e->ncerts);
+	memcpy(&u, &e->mtim, sizeof u);
+	cb_le64enc(buf + 16, u);
+	cb_put(w, buf, sizeof buf);
+
+	cb_put_blob(w, e->filename, strlen(e->filename));
+	cb_put_blob(w, e->ocspfn, e->ocspfn ? strlen(e->ocspfn) : 0);
+	cb_put_blob(w, e->key.ptr, e->key.len);
+	cb_put_blob(w, e->dh.ptr, e->dh.len);
+	for (i = 0; i < e->nnames; i++)
+		cb_put_blob(w, e->names[i], strlen(e->names[i]));
+	for (i = 0; i < e->ncerts; i++)
+		cb_put_blob(w, e->certs[i].ptr, e->certs[i].len);
+
+	if (w->error != 0) {
+		errno = w->error;
+		return (-1);
+	}
+	return (0);
+}
+
+/* Write the index, and the header to hdr */
+static void
+cb_finish(struct cb_writer *w, uint8_t *hdr)
+{
+	uint8_t buf[8];
+	uint64_t index;
+	unsigned u;
+
+	memset(buf, 0, sizeof buf);
+	cb_put(w, buf, (8 - w->off % 8) % 8);
+	index = w->off;
+	for (u = 0; u < w->nents; u++) {
+		cb_le64enc(buf, w->offs[u]);
+		cb_put(w, buf, 8);
+	}
+
+	memcpy(hdr, CB_MAGIC_STR, 8);
+	cb_le32enc(hdr + 8, CB_VERSION);
+	cb_le32enc(hdr + 12, w->nents);
+	cb_le64enc(hdr + 16, index);
+	cb_le64enc(hdr + 24, w->off);
+}
+
+/* Write the index and header and move the bundle in place if commit is
+ * set, or else remove it. */
+int
+CB_Close(struct cb_writer **wp, int commit)
+{
+	struct cb_writer *w;
+	uint8_t buf[CB_HDR_LEN];
+	int err;
+
+	AN(wp);
+	w = *wp;
+	*wp = NULL;
+	CHECK_OBJ_NOTNULL(w, CB_WRITER_MAGIC);
+
+	AN(w->f);
+
+	if (commit) {
+		cb_finish(w, buf);
+		if (w->error == 0 && (fflush(w->f) != 0 ||
+		    fseek(w->f, 0, SEEK_SET) != 0))
+			w->error = errno;
+		cb_put(w, buf, sizeof buf);
+		if (w->error == 0 && (fflush(w->f) != 0 ||
+		    fsync(fileno(w->f)) != 0))
+			w->error = errno;
+	}
+	if (fclose(w->f) != 0 && w->error == 0)
+		w->error = errno;
+	if (commit && w->error == 0 && rename(w->tmp, w->path) != 0)
+		w->error = errno;
+	if (!commit || w->error != 0)
+		(void)unlink(w->tmp);
+
+	err = w->error;
+	free(w->offs);
+	free(w->tmp);
+	free(w->path);
+	FREE_OBJ(w);
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+	return (0);
+}
+
+/* Map a bundle built in memory shared and read-only. Returns NULL with
+ * errno set on failure. */
+struct cert_bundle *
+CB_Map(struct cb_writer **wp)
+{
+	struct cb_writer *w;
+	uint8_t hdr[CB_HDR_LEN];
+	uint8_t *base;
+	size_t size;
+	int err;
+
+	AN(wp);
+	w = *wp;
+	*wp = NULL;
+	CHECK_OBJ_NOTNULL(w, CB_WRITER_MAGIC);
+	AZ(w->f);
+
+	base = MAP_FAILED;
+	size = 0;
+	cb_finish(w, hdr);
+	err = w->error;
+	if (err == 0)
+		memcpy(w->buf, hdr, sizeof hdr);
+	if (err == 0 && w->off > SIZE_MAX)
+		err = EFBIG;
+	if (err == 0) {
+		size = w->off;
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED)
+			err = errno;
+	}
+	if (err == 0) {
+		memcpy(base, w->buf, size);
+		if (mprotect(base, size, PROT_READ) != 0) {
+			err = errno;
+			AZ(munmap(base, size));
+		}
+	}
+	free(w->buf);
+	free(w->offs);
+	FREE_OBJ(w);
+	if (err != 0) {
+		errno = err;
+		return (NULL);
+	}
+	return (cb_init(base, size));
+}
@@ -0,0 +1,48 @@
+/*-
+ * Precompiled certificate bundles, see cert_bundle.c
+ */
+
+#ifndef CERT_BUNDLE_H_INCLUDED
+#define CERT_BUNDLE_H_INCLUDED
+
+#include <stddef.h>
+
+struct cert_bundle;
+struct cb_writer;
+
+struct cb_blob {
+	const void		*ptr;
+	size_t			len;
+};
+
+struct cb_entry {
+	const char		*filename;	/* The PEM file compiled */
+	const char		*ocspfn;	/* Or NULL */
+	double			mtim;
+	int			ocsp_vfy;
+	unsigned		flags;
+#define CB_DEFAULT		(1U << 0)	/* The default certificate */
+	unsigned		nnames;
+	const char		**names;	/* SNI names */
+	unsigned		ncerts;
+	struct cb_blob		*certs;		/* DER, leaf first */
+	struct cb_blob		key;		/* DER */
+	struct cb_blob		dh;		/* PEM, empty if none */
+};
+
+struct cert_bundle *CB_Open(const char *path);
+unsigned CB_Count(const struct cert_bundle *cb);
+size_t CB_Size(const struct cert_bundle *cb);
+int CB_Entry(const struct cert_bundle *cb, unsigned idx, struct cb_entry *e);
+void CB_Entry_Free(struct cb_entry *e);
+struct cert_bundle *CB_Ref(struct cert_bundle *cb);
+void CB_Deref(struct cert_bundle **cbp);
+
+struct cb_writer *CB_Create(const char *path);
+struct cb_writer *CB_Create_Mem(void);
+unsigned CB_Entries(const struct cb_writer *w);
+int CB_Write(struct cb_writer *w, const struct cb_entry *e);
+int CB_Close(struct cb_writer **wp, int commit);
+struct cert_bundle *CB_Map(struct cb_writer **wp);
+
+#endif	/* CERT_BUNDLE_H_INCLUDED */
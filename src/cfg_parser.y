@@ -58,9 +58,17 @@ extern char input_line[512];
 %token TOK_SESSION_CACHE TOK_SHARED_CACHE_LISTEN TOK_SHARED_CACHE_PEER
 %token TOK_SHARED_CACHE_IF TOK_PRIVATE_KEY TOK_BACKEND_REFRESH
 %token TOK_OCSP_REFRESH_INTERVAL TOK_PEM_DIR TOK_PEM_DIR_GLOB
+%token TOK_PEM_DIR_WATCH TOK_PEM_DIR_WATCH_DELAY
 %token TOK_LOG_LEVEL TOK_PROXY_TLV TOK_PROXY_AUTHORITY TOK_TFO
 %token TOK_CLIENT_VERIFY TOK_VERIFY_NONE TOK_VERIFY_OPT TOK_VERIFY_REQ
-%token TOK_CLIENT_VERIFY_CA TOK_PROXY_CCERT
+%token TOK_CLIENT_VERIFY_CA TOK_PROXY_CCERT TOK_RING_POOL_MAX TOK_KTLS
+%token TOK_READ_BUDGET TOK_BACKEND_CONNECT_EARLY TOK_ACCEPT_BATCH
+%token TOK_EVENT_BACKEND TOK_ASYNC_SIGN_THREADS TOK_SHARED_CACHE_SHARDS
+%token TOK_SHARED_CACHE_BYTES TOK_SHARED_CACHE_FILE
+%token TOK_SHARED_CACHE_REPLICATOR TOK_TICKET_KEY_FILE TOK_TICKET_KEY_ROTATE
+%token TOK_LAZY_CERTS TOK_CERT_CACHE_SIZE TOK_CERT_LOAD_THREADS
+%token TOK_CERT_STORE TOK_URING_RECV_BUFS
+%token TOK_CERT_BUNDLE TOK_HOT_CERT_RELOAD
 
 %parse-param { hitch_config *cfg }
 
@@ -111,14 +119,36 @@ CFG_RECORD
 	| OCSP_DIR
 	| PEM_DIR
 	| PEM_DIR_GLOB
+	| PEM_DIR_WATCH
+	| PEM_DIR_WATCH_DELAY
 	| SESSION_CACHE_REC
 	| SHARED_CACHE_LISTEN_REC
 	| SHARED_CACHE_PEER_REC
 	| SHARED_CACHE_IF_REC
+	| SHARED_CACHE_SHARDS_REC
+	| SHARED_CACHE_BYTES_REC
+	| SHARED_CACHE_FILE_REC
+	| SHARED_CACHE_REPLICATOR_REC
 	| LOG_FILENAME_REC
 	| LOG_LEVEL_REC
 	| SEND_BUFSIZE_REC
 	| RECV_BUFSIZE_REC
+	| RING_POOL_MAX_REC
+	| KTLS_REC
+	| READ_BUDGET_REC
+	| BACKEND_CONNECT_EARLY_REC
+	| ACCEPT_BATCH_REC
+	| EVENT_BACKEND_REC
+	| URING_RECV_BUFS_REC
+	| ASYNC_SIGN_THREADS_REC
+	| TICKET_KEY_FILE_REC
+	| TICKET_KEY_ROTATE_REC
+	| LAZY_CERTS_REC
+	| CERT_CACHE_SIZE_REC
+	| CERT_STORE_REC
+	| CERT_LOAD_THREADS_REC
+	| CERT_BUNDLE_REC
+	| HOT_CERT_RELOAD_REC
 	| BACKEND_REFRESH_REC
 	| TFO
 	| ECDH_CURVE_REC
@@ -230,6 +260,14 @@ PEM_DIR_GLOB: TOK_PEM_DIR_GLOB '=' STRING {
 
 };
 
+PEM_DIR_WATCH: TOK_PEM_DIR_WATCH '=' BOOL {
+	cfg->PEM_DIR_WATCH = $3;
+};
+
+PEM_DIR_WATCH_DELAY: TOK_PEM_DIR_WATCH_DELAY '=' UINT {
+	cfg->PEM_DIR_WATCH_DELAY = $3;
+};
+
 OCSP_DIR: TOK_OCSP_DIR '=' STRING {
 	free(cfg->OCSP_DIR);
 	if ($3)
@@ -544,6 +582,70 @@ SEND_BUFSIZE_REC: TOK_SEND_BUFSIZE '=' UINT { cfg->SEND_BUFSIZE = $3; };
 
 RECV_BUFSIZE_REC: TOK_RECV_BUFSIZE '=' UINT { cfg->RECV_BUFSIZE = $3; };
 
+RING_POOL_MAX_REC: TOK_RING_POOL_MAX '=' UINT { cfg->RING_POOL_MAX = $3; };
+
+KTLS_REC: TOK_KTLS '=' BOOL { cfg->KTLS = $3; };
+
+READ_BUDGET_REC: TOK_READ_BUDGET '=' UINT { cfg->READ_BUDGET = $3; };
+
+BACKEND_CONNECT_EARLY_REC: TOK_BACKEND_CONNECT_EARLY '=' BOOL {
+	cfg->BACKEND_CONNECT_EARLY = $3;
+};
+
+ACCEPT_BATCH_REC: TOK_ACCEPT_BATCH '=' UINT {
+	if ($3 < 1) {
+		config_error_set("accept-batch must be at least 1.");
+		YYABORT;
+	}
+	cfg->ACCEPT_BATCH = $3;
+};
+
+EVENT_BACKEND_REC: TOK_EVENT_BACKEND '=' STRING {
+	/* XXX: passing an empty string for file */
+	if ($3 &&
+	    config_param_validate("event-backend", $3, cfg, "",
+	    yyget_lineno()) != 0)
+		YYABORT;
+};
+
+URING_RECV_BUFS_REC: TOK_URING_RECV_BUFS '=' UINT {
+	cfg->URING_RECV_BUFS = $3;
+};
+
+ASYNC_SIGN_THREADS_REC: TOK_ASYNC_SIGN_THREADS '=' UINT {
+	cfg->ASYNC_SIGN_THREADS = $3;
+};
+
+TICKET_KEY_FILE_REC: TOK_TICKET_KEY_FILE '=' STRING {
+	if ($3 && *$3 != '\0')
+		cfg->TICKET_KEY_FILE = strdup($3);
+};
+
+TICKET_KEY_ROTATE_REC: TOK_TICKET_KEY_ROTATE '=' UINT {
+	cfg->TICKET_KEY_ROTATE = $3;
+};
+
+LAZY_CERTS_REC: TOK_LAZY_CERTS '=' BOOL { cfg->LAZY_CERTS = $3; };
+
+CERT_STORE_REC: TOK_CERT_STORE '=' BOOL { cfg->CERT_STORE = $3; };
+
+CERT_CACHE_SIZE_REC: TOK_CERT_CACHE_SIZE '=' UINT {
+	cfg->CERT_CACHE_SIZE = $3;
+};
+
+CERT_LOAD_THREADS_REC: TOK_CERT_LOAD_THREADS '=' UINT {
+	cfg->CERT_LOAD_THREADS = $3;
+};
+
+CERT_BUNDLE_REC: TOK_CERT_BUNDLE '=' STRING {
+	if ($3 && *$3 != '\0')
+		cfg->CERT_BUNDLE = strdup($3);
+};
+
+HOT_CERT_RELOAD_REC: TOK_HOT_CERT_RELOAD '=' BOOL {
+	cfg->HOT_CERT_RELOAD = $3;
+};
+
 LOG_FILENAME_REC: TOK_LOG_FILENAME '=' STRING {
 	/* XXX: passing an empty string for file */
 	if ($3 &&
@@ -603,6 +705,47 @@ SHARED_CACHE_IF_REC: TOK_SHARED_CACHE_IF '=' STRING {
 #endif
 };
 
+SHARED_CACHE_SHARDS_REC: TOK_SHARED_CACHE_SHARDS '=' UINT {
+#ifdef USE_SHARED_CACHE
+	cfg->SHARED_CACHE_SHARDS = $3;
+#else
+	fprintf(stderr, "Hitch needs to be compiled with --enable-sessioncache "
+			"for '%s'", input_line);
+	YYABORT;
+#endif
+};
+
+SHARED_CACHE_BYTES_REC: TOK_SHARED_CACHE_BYTES '=' UINT {
+#ifdef USE_SHARED_CACHE
+	cfg->SHARED_CACHE_BYTES = $3;
+#else
+	fprintf(stderr, "Hitch needs to be compiled with --enable-sessioncache "
+			"for '%s'", input_line);
+	YYABORT;
+#endif
+};
+
+SHARED_CACHE_FILE_REC: TOK_SHARED_CACHE_FILE '=' STRING {
+#ifdef USE_SHARED_CACHE
+	if ($3)
+		cfg->SHARED_CACHE_FILE = strdup($3);
+#else
+	fprintf(stderr, "Hitch needs to be compiled with --enable-sessioncache "
+			"for '%s'", input_line);
+	YYABORT;
+#endif
+};
+
+SHARED_CACHE_REPLICATOR_REC: TOK_SHARED_CACHE_REPLICATOR '=' BOOL {
+#ifdef USE_SHARED_CACHE
+	cfg->SHCUPD_REPLICATOR = $3;
+#else
+	fprintf(stderr, "Hitch needs to be compiled with --enable-sessioncache "
+			"for '%s'", input_line);
+	YYABORT;
+#endif
+};
+
 TFO: TOK_TFO '=' BOOL {
 #ifdef TCP_FASTOPEN_WORKS
 	{ cfg->TFO = $3; };
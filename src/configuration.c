@@ -26,13 +26,21 @@
 #include <libgen.h>
 #include <limits.h>
 
+#include <openssl/evp.h>
+
+#include "cert_bundle.h"
 #include "configuration.h"
+#include "ringbuffer.h"
 #include "foreign/miniobj.h"
 #include "foreign/vas.h"
 #include "foreign/vsb.h"
 
 #include "cfg_parser.h"
 
+#ifdef USE_SHARED_CACHE
+#include "shctx.h"
+#endif
+
 #define ADDR_LEN 150
 #define PORT_LEN 6
 #define CFG_BOOL_ON "on"
@@ -74,6 +82,34 @@
 #define CFG_LOG_LEVEL "log-level"
 #define CFG_RING_SLOTS "ring-slots"
 #define CFG_RING_DATA_LEN "ring-data-len"
+#define CFG_RING_POOL_MAX "ring-pool-max"
+#define CFG_PARAM_RING_POOL_MAX 11020
+#define CFG_KTLS "ktls"
+#define CFG_READ_BUDGET "read-budget"
+#define CFG_PARAM_READ_BUDGET 11021
+#define CFG_BACKEND_CONNECT_EARLY "backend-connect-early"
+#define CFG_ACCEPT_BATCH "accept-batch"
+#define CFG_PARAM_ACCEPT_BATCH 11022
+#define CFG_EVENT_BACKEND "event-backend"
+#define CFG_PARAM_EVENT_BACKEND 11023
+#define CFG_ASYNC_SIGN_THREADS "async-sign-threads"
+#define CFG_PARAM_ASYNC_SIGN_THREADS 11024
+#define CFG_TICKET_KEY_FILE "ticket-key-file"
+#define CFG_PARAM_TICKET_KEY_FILE 11029
+#define CFG_TICKET_KEY_ROTATE "ticket-key-rotate"
+#define CFG_PARAM_TICKET_KEY_ROTATE 11030
+#define CFG_LAZY_CERTS "lazy-certs"
+#define CFG_CERT_CACHE_SIZE "cert-cache-size"
+#define CFG_CERT_STORE "cert-store"
+#define CFG_PARAM_CERT_CACHE_SIZE 11031
+#define CFG_CERT_LOAD_THREADS "cert-load-threads"
+#define CFG_PARAM_CERT_LOAD_THREADS 11032
+#define CFG_CERT_BUNDLE "cert-bundle"
+#define CFG_PARAM_CERT_BUNDLE 11033
+#define CFG_PARAM_COMPILE_CERTS 11034
+#define CFG_URING_RECV_BUFS "uring-recv-bufs"
+#define CFG_PARAM_URING_RECV_BUFS 11035
+#define CFG_HOT_CERT_RELOAD "hot-cert-reload"
 #define CFG_PIDFILE "pidfile"
 #define CFG_SNI_NOMATCH_ABORT "sni-nomatch-abort"
 #define CFG_OCSP_DIR "ocsp-dir"
@@ -90,6 +126,14 @@
 	#define CFG_SHARED_CACHE_LISTEN "shared-cache-listen"
 	#define CFG_SHARED_CACHE_PEER "shared-cache-peer"
 	#define CFG_SHARED_CACHE_MCASTIF "shared-cache-if"
+	#define CFG_SHARED_CACHE_SHARDS "shared-cache-shards"
+	#define CFG_PARAM_SHARED_CACHE_SHARDS 11025
+	#define CFG_SHARED_CACHE_BYTES "shared-cache-bytes"
+	#define CFG_PARAM_SHARED_CACHE_BYTES 11026
+	#define CFG_SHARED_CACHE_FILE "shared-cache-file"
+	#define CFG_PARAM_SHARED_CACHE_FILE 11027
+	#define CFG_SHARED_CACHE_REPLICATOR "shared-cache-replicator"
+	#define CFG_PARAM_SHARED_CACHE_REPLICATOR 11028
 #endif
 
 #define FMT_STR "%s = %s\n"
@@ -215,6 +259,8 @@ config_new(void)
 	r->CERT_FILES			= NULL;
 	r->LISTEN_ARGS			= NULL;
 	r->PEM_DIR			= NULL;
+	r->PEM_DIR_WATCH		= 0;
+	r->PEM_DIR_WATCH_DELAY		= 1;
 	r->OCSP_DIR			= strdup("/var/lib/hitch/");
 	AN(r->OCSP_DIR);
 	r->OCSP_VFY			= 0;
@@ -236,6 +282,10 @@ config_new(void)
 		memset(&r->SHCUPD_PEERS[i], 0, sizeof(shcupd_peer_opt));
 
 	r->SHCUPD_MCASTIF		= NULL;
+	r->SHARED_CACHE_SHARDS		= 0;
+	r->SHARED_CACHE_BYTES		= 0;
+	r->SHARED_CACHE_FILE		= NULL;
+	r->SHCUPD_REPLICATOR		= 0;
 	r->SHCUPD_MCASTTTL		= NULL;
 #endif
 
@@ -259,6 +309,23 @@ config_new(void)
 
 	r->RING_SLOTS			= 0;
 	r->RING_DATA_LEN		= 0;
+	r->RING_POOL_MAX		= DEF_RING_POOL_MAX;
+	r->KTLS				= 0;
+	r->READ_BUDGET			= 128 * 1024;
+	r->BACKEND_CONNECT_EARLY	= 0;
+	r->ACCEPT_BATCH			= 16;
+	r->EVENT_BACKEND		= EVENT_BACKEND_AUTO;
+	r->URING_RECV_BUFS		= 512;
+	r->ASYNC_SIGN_THREADS		= 0;
+	r->TICKET_KEY_FILE		= NULL;
+	r->TICKET_KEY_ROTATE		= 3600;
+	r->LAZY_CERTS			= 0;
+	r->CERT_CACHE_SIZE		= 1000;
+	r->CERT_STORE			= 0;
+	r->CERT_LOAD_THREADS		= 0;
+	r->CERT_BUNDLE			= NULL;
+	r->COMPILE_CERTS		= NULL;
+	r->HOT_CERT_RELOAD		= 1;
 
 	fa = front_arg_new();
 	fa->port = strdup("8443");
@@ -306,6 +373,9 @@ config_destroy(hitch_config *cfg)
 	free(cfg->ALPN_PROTOS);
 	free(cfg->ALPN_PROTOS_LV);
 	free(cfg->PEM_DIR);
+	free(cfg->TICKET_KEY_FILE);
+	free(cfg->CERT_BUNDLE);
+	free(cfg->COMPILE_CERTS);
 	free(cfg->PEM_DIR_GLOB);
 	free(cfg->CLIENT_VERIFY_CA);
 #ifdef USE_SHARED_CACHE
@@ -320,6 +390,7 @@ config_destroy(hitch_config *cfg)
 
 	free(cfg->SHCUPD_MCASTIF);
 	free(cfg->SHCUPD_MCASTTTL);
+	free(cfg->SHARED_CACHE_FILE);
 #endif
 	free(cfg);
 }
@@ -566,6 +637,58 @@ cfg_cert_file_new(void)
 	return (cert);
 }
 
+/* A copy of a certificate entry that outlives the configuration */
+struct cfg_cert_file *
+cfg_cert_file_dup(const struct cfg_cert_file *cf)
+{
+	struct cfg_cert_file *cert;
+
+	CHECK_OBJ_NOTNULL(cf, CFG_CERT_FILE_MAGIC);
+	cert = cfg_cert_file_new();
+	cert->filename = strdup(cf->filename);
+	AN(cert->filename);
+	if (cf->priv_key_filename != NULL) {
+		cert->priv_key_filename = strdup(cf->priv_key_filename);
+		AN(cert->priv_key_filename);
+	}
+	if (cf->ocspfn != NULL) {
+		cert->ocspfn = strdup(cf->ocspfn);
+		AN(cert->ocspfn);
+	}
+	cert->ocsp_mtim = cf->ocsp_mtim;
+	cert->ocsp_vfy = cf->ocsp_vfy;
+	cert->mtim = cf->mtim;
+	if (cf->pem != NULL) {
+		cert->pem = malloc(cf->pem_len);
+		AN(cert->pem);
+		memcpy(cert->pem, cf->pem, cf->pem_len);
+		cert->pem_len = cf->pem_len;
+	}
+	if (cf->key_pem != NULL) {
+		cert->key_pem = malloc(cf->key_pem_len);
+		AN(cert->key_pem);
+		memcpy(cert->key_pem, cf->key_pem, cf->key_pem_len);
+		cert->key_pem_len = cf->key_pem_len;
+	}
+	if (cf->ocsp != NULL) {
+		cert->ocsp = malloc(cf->ocsp_len);
+		AN(cert->ocsp);
+		memcpy(cert->ocsp, cf->ocsp, cf->ocsp_len);
+		cert->ocsp_len = cf->ocsp_len;
+	}
+	if (cf->ocsp_cached != NULL) {
+		cert->ocsp_cached = malloc(cf->ocsp_cached_len);
+		AN(cert->ocsp_cached);
+		memcpy(cert->ocsp_cached, cf->ocsp_cached,
+		    cf->ocsp_cached_len);
+		cert->ocsp_cached_len = cf->ocsp_cached_len;
+	}
+	if (cf->bundle != NULL)
+		cert->bundle = CB_Ref(cf->bundle);
+	cert->bundle_idx = cf->bundle_idx;
+	return (cert);
+}
+
 void
 cfg_cert_file_free(struct cfg_cert_file **cfptr)
 {
@@ -574,7 +697,13 @@ cfg_cert_file_free(struct cfg_cert_file **cfptr)
 	CHECK_OBJ_NOTNULL(*cfptr, CFG_CERT_FILE_MAGIC);
 	cf = *cfptr;
 	free(cf->filename);
+	free(cf->priv_key_filename);
 	free(cf->ocspfn);
+	free(cf->pem);
+	free(cf->key_pem);
+	free(cf->ocsp);
+	free(cf->ocsp_cached);
+	CB_Deref(&cf->bundle);
 	FREE_OBJ(cf);
 	*cfptr = NULL;
 }
@@ -913,6 +1042,14 @@ config_param_validate(const char *k, char *v, hitch_config *cfg,
 	} else if (strcmp(k, CFG_SHARED_CACHE_MCASTIF) == 0) {
 		r = config_param_shcupd_mcastif(v, &cfg->SHCUPD_MCASTIF,
 		    &cfg->SHCUPD_MCASTTTL);
+	} else if (strcmp(k, CFG_SHARED_CACHE_SHARDS) == 0) {
+		r = config_param_val_int(v, &cfg->SHARED_CACHE_SHARDS, 1);
+	} else if (strcmp(k, CFG_SHARED_CACHE_BYTES) == 0) {
+		r = config_param_val_long(v, &cfg->SHARED_CACHE_BYTES, 1);
+	} else if (strcmp(k, CFG_SHARED_CACHE_FILE) == 0) {
+		config_assign_str(&cfg->SHARED_CACHE_FILE, v);
+	} else if (strcmp(k, CFG_SHARED_CACHE_REPLICATOR) == 0) {
+		r = config_param_val_bool(v, &cfg->SHCUPD_REPLICATOR);
 	}
 #endif
 	else if (strcmp(k, CFG_CHROOT) == 0) {
@@ -1029,6 +1166,66 @@ config_param_validate(const char *k, char *v, hitch_config *cfg,
 		r = config_param_val_int(v, &cfg->RING_SLOTS, 1);
 	} else if (strcmp(k, CFG_RING_DATA_LEN) == 0) {
 		r = config_param_val_int(v, &cfg->RING_DATA_LEN, 1);
+	} else if (strcmp(k, CFG_RING_POOL_MAX) == 0) {
+		r = config_param_val_int(v, &cfg->RING_POOL_MAX, 1);
+	} else if (strcmp(k, CFG_KTLS) == 0) {
+		r = config_param_val_bool(v, &cfg->KTLS);
+	} else if (strcmp(k, CFG_READ_BUDGET) == 0) {
+		r = config_param_val_int(v, &cfg->READ_BUDGET, 1);
+	} else if (strcmp(k, CFG_BACKEND_CONNECT_EARLY) == 0) {
+		r = config_param_val_bool(v, &cfg->BACKEND_CONNECT_EARLY);
+	} else if (strcmp(k, CFG_ACCEPT_BATCH) == 0) {
+		r = config_param_val_int(v, &cfg->ACCEPT_BATCH, 1);
+		if (r && cfg->ACCEPT_BATCH < 1) {
+			config_error_set("accept-batch must be at least 1.");
+			r = 0;
+		}
+	} else if (strcmp(k, CFG_EVENT_BACKEND) == 0) {
+		if (!strcmp(v, "auto"))
+			cfg->EVENT_BACKEND = EVENT_BACKEND_AUTO;
+		else if (!strcmp(v, "epoll"))
+			cfg->EVENT_BACKEND = EVENT_BACKEND_EPOLL;
+		else if (!strcmp(v, "io_uring")) {
+#if defined(HAVE_EV_IOURING) || defined(HAVE_IO_URING)
+			cfg->EVENT_BACKEND = EVENT_BACKEND_IOURING;
+#else
+			config_error_set("Hitch was built without io_uring "
+			    "support.");
+			r = 0;
+#endif
+		} else {
+			config_error_set("Invalid event backend '%s'.", v);
+			r = 0;
+		}
+	} else if (strcmp(k, CFG_URING_RECV_BUFS) == 0) {
+		r = config_param_val_int(v, &cfg->URING_RECV_BUFS, 1);
+	} else if (strcmp(k, CFG_ASYNC_SIGN_THREADS) == 0) {
+		r = config_param_val_int(v, &cfg->ASYNC_SIGN_THREADS, 1);
+#ifndef HAVE_SSL_ASYNC
+		if (r && cfg->ASYNC_SIGN_THREADS > 0) {
+			config_error_set("Hitch was built without "
+			    "asynchronous private key support.");
+			r = 0;
+		}
+#endif
+	} else if (strcmp(k, CFG_TICKET_KEY_FILE) == 0) {
+		if (strlen(v) > 0)
+			config_assign_str(&cfg->TICKET_KEY_FILE, v);
+	} else if (strcmp(k, CFG_TICKET_KEY_ROTATE) == 0) {
+		r = config_param_val_int(v, &cfg->TICKET_KEY_ROTATE, 1);
+	} else if (strcmp(k, CFG_LAZY_CERTS) == 0) {
+		r = config_param_val_bool(v, &cfg->LAZY_CERTS);
+	} else if (strcmp(k, CFG_CERT_CACHE_SIZE) == 0) {
+		r = config_param_val_int(v, &cfg->CERT_CACHE_SIZE, 1);
+	} else if (strcmp(k, CFG_CERT_STORE) == 0) {
+		r = config_param_val_bool(v, &cfg->CERT_STORE);
+	} else if (strcmp(k, CFG_CERT_LOAD_THREADS) == 0) {
+		r = config_param_val_int(v, &cfg->CERT_LOAD_THREADS, 1);
+	} else if (strcmp(k, CFG_HOT_CERT_RELOAD) == 0) {
+		r = config_param_val_bool(v, &cfg->HOT_CERT_RELOAD);
+	} else if (strcmp(k, CFG_CERT_BUNDLE) == 0) {
+		if (strlen(v) > 0)
+			config_assign_str(&cfg->CERT_BUNDLE, v);
 	} else if (strcmp(k, CFG_SNI_NOMATCH_ABORT) == 0) {
 		r = config_param_val_bool(v, &cfg->SNI_NOMATCH_ABORT);
 	} else if (strcmp(k, CFG_OCSP_DIR) == 0) {
@@ -1070,10 +1267,44 @@ config_param_validate(const char *k, char *v, hitch_config *cfg,
 	return (0);
 }
 
+/* Chain bytes of the configuration into its digest */
+static void
+config_digest_update(hitch_config *cfg, const void *p, size_t len)
+{
+	EVP_MD_CTX *md;
+	unsigned l;
+
+	md = EVP_MD_CTX_new();
+	AN(md);
+	AN(EVP_DigestInit_ex(md, EVP_sha256(), NULL));
+	AN(EVP_DigestUpdate(md, cfg->CFG_DIGEST, sizeof cfg->CFG_DIGEST));
+	AN(EVP_DigestUpdate(md, p, len));
+	AN(EVP_DigestFinal_ex(md, cfg->CFG_DIGEST, &l));
+	assert(l == sizeof cfg->CFG_DIGEST);
+	EVP_MD_CTX_free(md);
+}
+
+/* Two configurations parsed out of the same configuration files and
+ * command line can only differ in what was read from the file system:
+ * the certificate files, the pem-dir listing and OCSP files. */
+int
+config_same_settings(const hitch_config *a, const hitch_config *b)
+{
+
+	AN(a);
+	AN(b);
+	if (a->CFG_FROM_STDIN || b->CFG_FROM_STDIN)
+		return (0);
+	return (memcmp(a->CFG_DIGEST, b->CFG_DIGEST,
+	    sizeof a->CFG_DIGEST) == 0);
+}
+
 static int
 config_file_parse(char *file, hitch_config *cfg)
 {
 	FILE *fp = NULL;
+	char buf[4096];
+	size_t l;
 	int r = 0;
 
 	AN(cfg);
@@ -1090,6 +1321,19 @@ config_file_parse(char *file, hitch_config *cfg)
 		return (1);
 	}
 
+	if (fp == stdin)
+		cfg->CFG_FROM_STDIN = 1;
+	else {
+		while ((l = fread(buf, 1, sizeof buf, fp)) > 0)
+			config_digest_update(cfg, buf, l);
+		if (ferror(fp) || fseek(fp, 0, SEEK_SET) != 0) {
+			config_error_set("Unable to read configuration file"
+			    " '%s': %s\n", file, strerror(errno));
+			fclose(fp);
+			return (1);
+		}
+	}
+
 	yyin = fp;
 	do {
 		if (yyparse(cfg) != 0) {
@@ -1159,6 +1403,19 @@ config_disp_hostport(char *host, char *port)
 	return (tmp_buf);
 }
 
+static const char *
+config_disp_event_backend(EVENT_BACKEND_TYPE eb)
+{
+	switch (eb) {
+	case EVENT_BACKEND_EPOLL:
+		return ("epoll");
+	case EVENT_BACKEND_IOURING:
+		return ("io_uring");
+	default:
+		return ("auto");
+	}
+}
+
 static const char *
 config_disp_log_facility (int facility)
 {
@@ -1250,6 +1507,65 @@ config_scan_pem_dir(char *pemdir, hitch_config *cfg)
 	return (retval);
 }
 
+/* Add the certificates of a bundle made by --compile-certs. The PEM
+ * files are not looked at, a certificate already configured by name is
+ * skipped. */
+int
+config_load_cert_bundle(const char *path, hitch_config *cfg)
+{
+	struct cert_bundle *cb;
+	struct cfg_cert_file *cert, *tmp;
+	struct cb_entry e;
+	struct stat st;
+	unsigned u;
+	int retval = 0;
+
+	cb = CB_Open(path);
+	if (cb == NULL) {
+		config_error_set("Unable to open certificate bundle '%s': %s",
+		    path, errno == EINVAL ? "Invalid bundle" : strerror(errno));
+		return (1);
+	}
+	for (u = 0; u < CB_Count(cb) && retval == 0; u++) {
+		AZ(CB_Entry(cb, u, &e));
+		HASH_FIND_STR(cfg->CERT_FILES, e.filename, tmp);
+		if (tmp != NULL || (cfg->CERT_DEFAULT != NULL &&
+		    strcmp(cfg->CERT_DEFAULT->filename, e.filename) == 0)) {
+			CB_Entry_Free(&e);
+			continue;
+		}
+
+		cert = cfg_cert_file_new();
+		cert->filename = strdup(e.filename);
+		AN(cert->filename);
+		cert->mtim = e.mtim;
+		cert->ocsp_vfy = e.ocsp_vfy;
+		cert->bundle = CB_Ref(cb);
+		cert->bundle_idx = u;
+		if (e.ocspfn != NULL) {
+			cert->ocspfn = strdup(e.ocspfn);
+			AN(cert->ocspfn);
+			if (stat(cert->ocspfn, &st) != 0) {
+				config_error_set("Unable to stat OCSP "
+				    "stapling file '%s': %s", cert->ocspfn,
+				    strerror(errno));
+				retval = 1;
+			} else
+				cert->ocsp_mtim = mtim2double(&st);
+		}
+
+		if (retval != 0)
+			cfg_cert_file_free(&cert);
+		else if ((e.flags & CB_DEFAULT) && cfg->CERT_DEFAULT == NULL)
+			cfg->CERT_DEFAULT = cert;
+		else
+			cfg_cert_add(cert, &cfg->CERT_FILES);
+		CB_Entry_Free(&e);
+	}
+	CB_Deref(&cb);
+	return (retval);
+}
+
 void
 config_print_usage_fd(char *prog, FILE *out)
 {
@@ -1336,12 +1652,98 @@ config_print_usage_fd(char *prog, FILE *out)
 	fprintf(out, "\t-R  --backend-refresh=SECS\n");
 	fprintf(out, "\t\tPeriodic backend IP lookup, 0 to disable (Default: %d)\n",
 	    cfg->BACKEND_REFRESH_TIME);
+	fprintf(out, "\t--ring-pool-max=NUM\n");
+	fprintf(out, "\t\tRing buffer blocks kept for reuse per worker,"
+	    " 0 to disable\n");
+	fprintf(out, "\t\t(Default: %d)\n", cfg->RING_POOL_MAX);
+	fprintf(out, "\t--ktls[=on|off]\n");
+	fprintf(out, "\t\tOffload TLS records to the kernel when possible"
+	    " (Default: %s)\n", config_disp_bool(cfg->KTLS));
+	fprintf(out, "\t--read-budget=BYTES\n");
+	fprintf(out, "\t\tBytes read per connection and event loop wakeup,"
+	    " 0 for a single read\n");
+	fprintf(out, "\t\t(Default: %d)\n", cfg->READ_BUDGET);
+	fprintf(out, "\t--backend-connect-early[=on|off]\n");
+	fprintf(out, "\t\tConnect to the backend during the TLS handshake"
+	    " (Default: %s)\n", config_disp_bool(cfg->BACKEND_CONNECT_EARLY));
+	fprintf(out, "\t--accept-batch=NUM\n");
+	fprintf(out, "\t\tMaximum clients accepted per listener wakeup"
+	    " (Default: %d)\n", cfg->ACCEPT_BATCH);
+	fprintf(out, "\t--event-backend=auto|epoll|io_uring\n");
+	fprintf(out, "\t\tEvent loop backend used by the workers"
+	    " (Default: %s)\n", config_disp_event_backend(cfg->EVENT_BACKEND));
+	fprintf(out, "\t--uring-recv-bufs=NUM\n");
+	fprintf(out, "\t\tio_uring receive buffers per worker, 0 to receive"
+	    " through\n");
+	fprintf(out, "\t\tthe event loop (Default: %d)\n",
+	    cfg->URING_RECV_BUFS);
+	fprintf(out, "\t--async-sign-threads=NUM\n");
+	fprintf(out, "\t\tPrivate key threads per worker for asynchronous"
+	    " handshakes,\n");
+	fprintf(out, "\t\t0 to sign in the event loop (Default: %d)\n",
+	    cfg->ASYNC_SIGN_THREADS);
+	fprintf(out, "\t--ticket-key-file=FILE\n");
+	fprintf(out, "\t\tLoad session ticket keys from FILE instead of"
+	    " using\n");
+	fprintf(out, "\t\trandom ones (Default: %s)\n",
+	    config_disp_str(cfg->TICKET_KEY_FILE));
+	fprintf(out, "\t--ticket-key-rotate=SECS\n");
+	fprintf(out, "\t\tSeconds between rotations of random ticket keys,"
+	    " or reloads\n");
+	fprintf(out, "\t\tof the ticket key file, 0 to never rotate"
+	    " (Default: %d)\n", cfg->TICKET_KEY_ROTATE);
+	fprintf(out, "\t--lazy-certs[=on|off]\n");
+	fprintf(out, "\t\tLoad certificates on the first handshake for"
+	    " one of their names\n");
+	fprintf(out, "\t\t(Default: %s)\n", config_disp_bool(cfg->LAZY_CERTS));
+	fprintf(out, "\t--cert-cache-size=NUM\n");
+	fprintf(out, "\t\tLazily loaded certificates kept per worker,"
+	    " 0 for no limit\n");
+	fprintf(out, "\t\t(Default: %d)\n", cfg->CERT_CACHE_SIZE);
+	fprintf(out, "\t--cert-store[=on|off]\n");
+	fprintf(out, "\t\tKeep lazily loaded certificates in memory shared"
+	    " by the workers\n");
+	fprintf(out, "\t\t(Default: %s)\n", config_disp_bool(cfg->CERT_STORE));
+	fprintf(out, "\t--cert-load-threads=NUM\n");
+	fprintf(out, "\t\tThreads loading certificates, 0 for one per"
+	    " CPU (Default: %d)\n", cfg->CERT_LOAD_THREADS);
+	fprintf(out, "\t--cert-bundle=FILE\n");
+	fprintf(out, "\t\tLoad the certificates compiled in FILE"
+	    " (Default: %s)\n", config_disp_str(cfg->CERT_BUNDLE));
+	fprintf(out, "\t--hot-cert-reload[=on|off]\n");
+	fprintf(out, "\t\tApply reloads changing only certificates to the"
+	    " running\n");
+	fprintf(out, "\t\tworkers (Default: %s)\n",
+	    config_disp_bool(cfg->HOT_CERT_RELOAD));
+	fprintf(out, "\t--compile-certs=FILE\n");
+	fprintf(out, "\t\tCompile the global certificates into a bundle"
+	    " FILE and exit\n");
 
 #ifdef USE_SHARED_CACHE
 	fprintf(out, "\t-C  --session-cache=NUM\n");
 	fprintf(out,
 	    "\t\tEnable and set SSL session cache to specified number\n");
 	fprintf(out, "\t\tof sessions (Default: %d)\n", cfg->SHARED_CACHE);
+	fprintf(out, "\t--shared-cache-shards=NUM\n");
+	fprintf(out, "\t\tNumber of independently locked parts of the session"
+	    " cache,\n");
+	fprintf(out, "\t\t0 for one per worker (Default: %d)\n",
+	    cfg->SHARED_CACHE_SHARDS);
+	fprintf(out, "\t--shared-cache-bytes=NUM\n");
+	fprintf(out, "\t\tEnable and set SSL session cache to specified"
+	    " size in bytes,\n");
+	fprintf(out, "\t\toverrides --session-cache (Default: %ld)\n",
+	    cfg->SHARED_CACHE_BYTES);
+	fprintf(out, "\t--shared-cache-file=FILE\n");
+	fprintf(out, "\t\tKeep the SSL session cache in FILE across"
+	    " restarts.\n");
+	fprintf(out, "\t\tThe file holds session secrets (Default: %s)\n",
+	    config_disp_str(cfg->SHARED_CACHE_FILE));
+	fprintf(out, "\t--shared-cache-replicator[=on|off]\n");
+	fprintf(out, "\t\tApply session updates from the peers in a"
+	    " dedicated\n");
+	fprintf(out, "\t\tprocess instead of the master (Default: %s)\n",
+	    config_disp_bool(cfg->SHCUPD_REPLICATOR));
 #endif
 #ifdef TCP_FASTOPEN_WORKS
 	fprintf(out, "\t--enable-tcp-fastopen[=on|off]\n");
@@ -1520,6 +1922,14 @@ config_parse_cli(int argc, char **argv, hitch_config *cfg)
 		{ CFG_SHARED_CACHE_LISTEN, 1, NULL, 'U' },
 		{ CFG_SHARED_CACHE_PEER, 1, NULL, 'P' },
 		{ CFG_SHARED_CACHE_MCASTIF, 1, NULL, 'M' },
+		{ CFG_SHARED_CACHE_SHARDS, 1, NULL,
+		    CFG_PARAM_SHARED_CACHE_SHARDS },
+		{ CFG_SHARED_CACHE_BYTES, 1, NULL,
+		    CFG_PARAM_SHARED_CACHE_BYTES },
+		{ CFG_SHARED_CACHE_FILE, 1, NULL,
+		    CFG_PARAM_SHARED_CACHE_FILE },
+		{ CFG_SHARED_CACHE_REPLICATOR, 2, NULL,
+		    CFG_PARAM_SHARED_CACHE_REPLICATOR },
 #endif
 		{ CFG_PIDFILE, 1, NULL, 'p' },
 		{ CFG_KEEPALIVE, 1, NULL, 'k' },
@@ -1534,6 +1944,22 @@ config_parse_cli(int argc, char **argv, hitch_config *cfg)
 		{ CFG_SYSLOG_FACILITY, 1, NULL, CFG_PARAM_SYSLOG_FACILITY },
 		{ CFG_SEND_BUFSIZE, 1, NULL, CFG_PARAM_SEND_BUFSIZE },
 		{ CFG_RECV_BUFSIZE, 1, NULL, CFG_PARAM_RECV_BUFSIZE },
+		{ CFG_RING_POOL_MAX, 1, NULL, CFG_PARAM_RING_POOL_MAX },
+		{ CFG_READ_BUDGET, 1, NULL, CFG_PARAM_READ_BUDGET },
+		{ CFG_ACCEPT_BATCH, 1, NULL, CFG_PARAM_ACCEPT_BATCH },
+		{ CFG_EVENT_BACKEND, 1, NULL, CFG_PARAM_EVENT_BACKEND },
+		{ CFG_URING_RECV_BUFS, 1, NULL, CFG_PARAM_URING_RECV_BUFS },
+		{ CFG_ASYNC_SIGN_THREADS, 1, NULL,
+		    CFG_PARAM_ASYNC_SIGN_THREADS },
+		{ CFG_TICKET_KEY_FILE, 1, NULL, CFG_PARAM_TICKET_KEY_FILE },
+		{ CFG_TICKET_KEY_ROTATE, 1, NULL,
+		    CFG_PARAM_TICKET_KEY_ROTATE },
+		{ CFG_CERT_CACHE_SIZE, 1, NULL, CFG_PARAM_CERT_CACHE_SIZE },
+		{ CFG_CERT_STORE, 2, NULL, 1 },
+		{ CFG_CERT_LOAD_THREADS, 1, NULL,
+		    CFG_PARAM_CERT_LOAD_THREADS },
+		{ CFG_CERT_BUNDLE, 1, NULL, CFG_PARAM_CERT_BUNDLE },
+		{ "compile-certs", 1, NULL, CFG_PARAM_COMPILE_CERTS },
 #ifdef TCP_FASTOPEN_WORKS
 		{ CFG_TFO, 2, NULL, 1 },
 #endif
@@ -1545,6 +1971,10 @@ config_parse_cli(int argc, char **argv, hitch_config *cfg)
 		{ CFG_PROXY_PROXY, 2, NULL, 1 },
 		{ CFG_ALPN_PROTOS, 1, NULL, CFG_PARAM_ALPN_PROTOS },
 		{ CFG_SNI_NOMATCH_ABORT, 2, NULL, 1 },
+		{ CFG_KTLS, 2, NULL, 1 },
+		{ CFG_BACKEND_CONNECT_EARLY, 2, NULL, 1 },
+		{ CFG_LAZY_CERTS, 2, NULL, 1 },
+		{ CFG_HOT_CERT_RELOAD, 2, NULL, 1 },
 		{ CFG_OCSP_DIR, 1, NULL, 'o' },
 		{ CFG_TLS_PROTOS, 1, NULL, CFG_PARAM_TLS_PROTOS },
 		{ CFG_DBG_LISTEN, 1, NULL, CFG_PARAM_DBG_LISTEN },
@@ -1583,6 +2013,11 @@ config_parse_cli(int argc, char **argv, hitch_config *cfg)
 		}
 	}
 
+	/* After the pass above: getopt_long() has put argv in the order
+	 * it keeps on reload */
+	for (i = 0; i < argc; i++)
+		config_digest_update(cfg, argv[i], strlen(argv[i]) + 1);
+
 	int tls_protos_config_file = cfg->SELECTED_TLS_PROTOS;
 
 	optind = 1;
@@ -1615,6 +2050,17 @@ config_parse_cli(int argc, char **argv, hitch_config *cfg)
 CFG_ARG(CFG_PARAM_SYSLOG_FACILITY, CFG_SYSLOG_FACILITY);
 CFG_ARG(CFG_PARAM_SEND_BUFSIZE, CFG_SEND_BUFSIZE);
 CFG_ARG(CFG_PARAM_RECV_BUFSIZE, CFG_RECV_BUFSIZE);
+CFG_ARG(CFG_PARAM_RING_POOL_MAX, CFG_RING_POOL_MAX);
+CFG_ARG(CFG_PARAM_READ_BUDGET, CFG_READ_BUDGET);
+CFG_ARG(CFG_PARAM_ACCEPT_BATCH, CFG_ACCEPT_BATCH);
+CFG_ARG(CFG_PARAM_EVENT_BACKEND, CFG_EVENT_BACKEND);
+CFG_ARG(CFG_PARAM_URING_RECV_BUFS, CFG_URING_RECV_BUFS);
+CFG_ARG(CFG_PARAM_ASYNC_SIGN_THREADS, CFG_ASYNC_SIGN_THREADS);
+CFG_ARG(CFG_PARAM_TICKET_KEY_FILE, CFG_TICKET_KEY_FILE);
+CFG_ARG(CFG_PARAM_TICKET_KEY_ROTATE, CFG_TICKET_KEY_ROTATE);
+CFG_ARG(CFG_PARAM_CERT_CACHE_SIZE, CFG_CERT_CACHE_SIZE);
+CFG_ARG(CFG_PARAM_CERT_LOAD_THREADS, CFG_CERT_LOAD_THREADS);
+CFG_ARG(CFG_PARAM_CERT_BUNDLE, CFG_CERT_BUNDLE);
 CFG_ARG(CFG_PARAM_ALPN_PROTOS, CFG_ALPN_PROTOS);
 CFG_ARG(CFG_PARAM_TLS_PROTOS, CFG_TLS_PROTOS);
 CFG_ARG(CFG_PARAM_DBG_LISTEN, CFG_DBG_LISTEN);
@@ -1629,6 +2075,10 @@ CFG_ARG('C', CFG_SHARED_CACHE);
 CFG_ARG('U', CFG_SHARED_CACHE_LISTEN);
 CFG_ARG('P', CFG_SHARED_CACHE_PEER);
 CFG_ARG('M', CFG_SHARED_CACHE_MCASTIF);
+CFG_ARG(CFG_PARAM_SHARED_CACHE_SHARDS, CFG_SHARED_CACHE_SHARDS);
+CFG_ARG(CFG_PARAM_SHARED_CACHE_BYTES, CFG_SHARED_CACHE_BYTES);
+CFG_ARG(CFG_PARAM_SHARED_CACHE_FILE, CFG_SHARED_CACHE_FILE);
+CFG_BOOL(CFG_PARAM_SHARED_CACHE_REPLICATOR, CFG_SHARED_CACHE_REPLICATOR);
 #endif
 CFG_ARG('p', CFG_PIDFILE);
 CFG_ARG('k', CFG_KEEPALIVE);
@@ -1665,6 +2115,9 @@ CFG_BOOL('s', CFG_SYSLOG);
 		case 't':
 			cfg->TEST = 1;
 			break;
+		case CFG_PARAM_COMPILE_CERTS:
+			config_assign_str(&cfg->COMPILE_CERTS, optarg);
+			break;
 		case 'V':
 			printf("%s %s\n", basename(argv[0]), VERSION);
 			exit(0);
@@ -1734,6 +2187,11 @@ CFG_BOOL('s', CFG_SYSLOG);
 
 
 #ifdef USE_SHARED_CACHE
+	/* A cache sized in bytes enables it as well */
+	if (cfg->SHARED_CACHE_BYTES > 0)
+		cfg->SHARED_CACHE =
+		    cfg->SHARED_CACHE_BYTES / SHSESS_ENTRY_LEN + 1;
+
 	if (cfg->SHCUPD_IP != NULL && ! cfg->SHARED_CACHE) {
 		config_error_set("Shared cache update listener is defined,"
 		    " but shared cache is disabled.");
@@ -1804,6 +2262,19 @@ CFG_BOOL('s', CFG_SYSLOG);
 			return (1);
 	}
 
+#ifndef HAVE_SYS_INOTIFY_H
+	if (cfg->PEM_DIR_WATCH) {
+		config_error_set("Hitch was built without inotify support, "
+		    "pem-dir-watch is not available.");
+		return (1);
+	}
+#endif
+
+	if (cfg->CERT_BUNDLE != NULL) {
+		if (config_load_cert_bundle(cfg->CERT_BUNDLE, cfg))
+			return (1);
+	}
+
 	if (cfg->PMODE == SSL_SERVER && cfg->CERT_DEFAULT == NULL) {
 		HASH_ITER(hh, cfg->LISTEN_ARGS, fa, fatmp)
 			if (HASH_CNT(hh, fa->certs) == 0) {
@@ -9,10 +9,13 @@
 #define CONFIGURATION_H_INCLUDED
 
 #include <sys/types.h>
+#include <openssl/sha.h>
 #include <openssl/ssl.h>
 
 #include "foreign/uthash.h"
 
+struct cert_bundle;
+
 /* This macro disables NPN even in openssl/ssl.h */
 #ifdef OPENSSL_NO_NEXTPROTONEG
 #  undef OPENSSL_WITH_NPN
@@ -54,6 +57,12 @@ typedef enum {
 	SSL_CLIENT
 } PROXY_MODE;
 
+typedef enum {
+	EVENT_BACKEND_AUTO,
+	EVENT_BACKEND_EPOLL,
+	EVENT_BACKEND_IOURING
+} EVENT_BACKEND_TYPE;
+
 struct cfg_cert_file {
 	unsigned	magic;
 #define CFG_CERT_FILE_MAGIC 0x58c280d2
@@ -64,6 +73,18 @@ struct cfg_cert_file {
 	int		mark;
 	int		ocsp_vfy;
 	double		mtim;
+	/* File contents read ahead for lazy-certs, or NULL */
+	char		*pem;
+	size_t		pem_len;
+	char		*key_pem;
+	size_t		key_pem_len;
+	char		*ocsp;		/* Of ocspfn */
+	size_t		ocsp_len;
+	char		*ocsp_cached;	/* Under ocsp-dir */
+	size_t		ocsp_cached_len;
+	/* Entry of a precompiled bundle, or NULL */
+	struct cert_bundle *bundle;
+	unsigned	bundle_idx;
 	UT_hash_handle	hh;
 };
 
@@ -124,6 +145,10 @@ struct __hitch_config {
 	shcupd_peer_opt		SHCUPD_PEERS[MAX_SHCUPD_PEERS+1];
 	char			*SHCUPD_MCASTIF;
 	char			*SHCUPD_MCASTTTL;
+	int			SHARED_CACHE_SHARDS;
+	long			SHARED_CACHE_BYTES;
+	char			*SHARED_CACHE_FILE;
+	int			SHCUPD_REPLICATOR;
 #endif
 	int			LOG_LEVEL;
 	int			SYSLOG;
@@ -139,11 +164,30 @@ struct __hitch_config {
 	char			*LOG_FILENAME;
 	int			RING_SLOTS;
 	int			RING_DATA_LEN;
+	int			RING_POOL_MAX;
+	int			KTLS;
+	int			READ_BUDGET;
+	int			BACKEND_CONNECT_EARLY;
+	int			ACCEPT_BATCH;
+	EVENT_BACKEND_TYPE	EVENT_BACKEND;
+	int			URING_RECV_BUFS;
+	int			ASYNC_SIGN_THREADS;
+	char			*TICKET_KEY_FILE;
+	int			TICKET_KEY_ROTATE;
+	int			LAZY_CERTS;
+	int			CERT_CACHE_SIZE;
+	int			CERT_STORE;
+	int			CERT_LOAD_THREADS;
+	char			*CERT_BUNDLE;
+	char			*COMPILE_CERTS;
+	int			HOT_CERT_RELOAD;
 	char			*PIDFILE;
 	int			SNI_NOMATCH_ABORT;
 	int			TEST;
 	char			*PEM_DIR;
 	char			*PEM_DIR_GLOB;
+	int			PEM_DIR_WATCH;
+	int			PEM_DIR_WATCH_DELAY;
 	char			*ECDH_CURVE;
 	int			OCSP_VFY;
 	char			*OCSP_DIR;
@@ -154,13 +198,22 @@ struct __hitch_config {
 #ifdef TCP_FASTOPEN_WORKS
 	int			TFO;
 #endif
+	/* Digest of the configuration files and command line */
+	unsigned char		CFG_DIGEST[SHA256_DIGEST_LENGTH];
+	int			CFG_FROM_STDIN;
 };
 
 typedef struct __hitch_config hitch_config;
 
 const char * config_error_get (void);
 hitch_config * config_new (void);
+struct cfg_cert_file *cfg_cert_file_new(void);
+struct cfg_cert_file *cfg_cert_file_dup(const struct cfg_cert_file *cf);
+void cfg_cert_file_free(struct cfg_cert_file **cfptr);
+int cfg_cert_vfy(struct cfg_cert_file *cf);
+void cfg_cert_add(struct cfg_cert_file *cf, struct cfg_cert_file **dst);
 void config_destroy (hitch_config *cfg);
 int config_parse_cli(int argc, char **argv, hitch_config *cfg);
+int config_same_settings(const hitch_config *a, const hitch_config *b);
 
 #endif  /* CONFIGURATION_H_INCLUDED */
@@ -41,6 +41,7 @@
 #include <openssl/x509_vfy.h>
 #include <openssl/engine.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -54,17 +55,29 @@
 #  include <sys/filio.h>
 #endif
 
+#ifdef HAVE_SYS_INOTIFY_H
+#  include <sys/inotify.h>
+#endif
+
+#ifdef HAVE_KTLS
+#  include <linux/tls.h>	/* TLS_GET_RECORD_TYPE */
+#endif
+
 #include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>  /* TCP_NODELAY */
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <grp.h>
 #include <libgen.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <sched.h>
 #include <signal.h>
@@ -75,14 +88,20 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "cert_bundle.h"
 #include "configuration.h"
 #include "hitch.h"
+#include "hssl_async.h"
 #include "hssl_locks.h"
+#include "hssl_tickets.h"
 #include "logging.h"
 #include "proxyv2.h"
 #include "ocsp.h"
 #include "shctx.h"
+#include "sni_index.h"
+#include "uring.h"
 #include "foreign/vpf.h"
+#include "foreign/vsb.h"
 #include "foreign/uthash.h"
 #include "foreign/vsa.h"
 
@@ -152,12 +171,28 @@ static SSL_SESSION *client_session;
 /* The current number of active client connections. */
 static uint64_t n_conns;
 
+/* Per-worker free list of ring buffer memory */
+static struct ringpool *ring_pool;
+
+/* Per-worker I/O counters, logged when the worker exits */
+static struct worker_stats {
+	uint64_t	read_events;
+	uint64_t	read_calls;
+	uint64_t	write_events;
+	uint64_t	write_calls;
+	uint64_t	accept_wakeups;
+	uint64_t	accepts;
+	unsigned	accept_max;
+} worker_stats;
+
 /* Current generation of worker processes. Bumped after a sighup prior
  * to launching new children. */
 static unsigned worker_gen;
 
 static volatile unsigned n_sighup;
 static volatile unsigned n_sigchld;
+static volatile unsigned n_sigalrm;
+static volatile sig_atomic_t n_sigterm;	/* Signal number */
 
 enum worker_state_e {
 	WORKER_ACTIVE,
@@ -170,11 +205,13 @@ struct worker_proc {
 	unsigned			magic;
 #define WORKER_PROC_MAGIC		0xbc7fe9e6
 
-	/* Writer end of pipe(2) for mgt -> worker ipc */
+	/* Master end of the socketpair(2) for mgt <-> worker ipc */
 	int				pfd;
 	pid_t				pid;
 	unsigned			gen;
 	int				core_id;
+	int				hot_pending;	/* Answer to a
+							 * hot_msg() */
 	VTAILQ_ENTRY(worker_proc)	list;
 };
 
@@ -189,6 +226,7 @@ struct listen_sock {
 	int			sock;
 	char			*name;
 	ev_io			listener;
+	struct uring_op		uring_accept;
 	struct sockaddr_storage	addr;
 	VTAILQ_ENTRY(listen_sock)	list;
 };
@@ -201,6 +239,7 @@ struct frontend {
 	int			match_global_certs;
 	int			sni_nomatch_abort;
 	struct sni_name_s	*sni_names;
+	struct sni_index	*sni_idx;
 	struct sslctx_s		*ssl_ctxs;
 	struct sslctx_s		*default_ctx;
 	const struct front_arg	*arg;
@@ -216,6 +255,8 @@ static struct frontend_head frontends;
 #ifdef USE_SHARED_CACHE
 static ev_io shcupd_listener;
 static int shcupd_socket;
+static pid_t shcupd_proc_pid;
+static int shcupd_replicator;	/* This process only applies updates */
 struct addrinfo *shcupd_peers[MAX_SHCUPD_PEERS+1];
 static unsigned char shared_secret[SHA_DIGEST_LENGTH];
 #endif /*USE_SHARED_CACHE*/
@@ -241,22 +282,37 @@ static const char *SHUTDOWN_STR[] = {
 #ifndef OPENSSL_NO_TLSEXT
 
 sni_name *sni_names;
+static struct sni_index *sni_idx;
 static sslctx *ssl_ctxs;
 static sslctx *default_ctx;
 
 static void insert_sni_names(sslctx *sc, sni_name **sn_tab);
 static int load_cert_ctx(sslctx *so);
+static int load_bundle_names(sslctx *so, const struct cfg_cert_file *cf);
+static sslctx *lazy_ctx_get(sslctx *stub);
+static void lazy_ctx_drop(sslctx *stub);
 #endif /* OPENSSL_NO_TLSEXT */
+static void ctx_src_del(sslctx *sc);
+static int ocsp_cfg_changed(const struct cfg_cert_file *cf, const sslctx *sc);
+static int hot_apply(const char *msg, size_t len);
+static void terminate(int signo);
+static void terminate_watch(struct ev_loop *l);
+struct cert_store;
+static int compile_cert(struct cert_store *cs, const struct cfg_cert_file *cf,
+    unsigned flags, sslctx *so, unsigned *idx);
 
 
 enum worker_update_type {
 	WORKER_GEN,
-	BACKEND_REFRESH
+	BACKEND_REFRESH,
+	CERT_UPDATE
 };
 
 union worker_update_payload {
 	unsigned		gen;
 	struct sockaddr_storage	addr;
+	size_t			certs_len;	/* Followed by the message,
+						 * see hot_msg() */
 };
 
 struct worker_update {
@@ -300,23 +356,214 @@ settcpkeepalive(int fd)
 }
 
 
+/*
+ * PEM files are read once, and every object is decoded in the same pass:
+ * the certificate and its chain, the private key and the DH parameters.
+ */
+#define PO_CERTS	(1 << 0)
+#define PO_KEY		(1 << 1)
+#define PO_DH		(1 << 2)
+
+struct pem_objs {
+	X509			*x509;		/* First certificate */
+	STACK_OF(X509)		*chain;		/* The others */
+	EVP_PKEY		*pkey;		/* First private key */
+#ifndef OPENSSL_NO_DH
+	DH			*dh;
+#endif
+};
+
+static void
+pem_objs_free(struct pem_objs *po)
+{
+
+	X509_free(po->x509);
+	sk_X509_pop_free(po->chain, X509_free);
+	EVP_PKEY_free(po->pkey);
 #ifndef OPENSSL_NO_DH
-static int
-init_dh(SSL_CTX *ctx, const char *cert)
+	DH_free(po->dh);
+#endif
+	memset(po, 0, sizeof *po);
+}
+
+/* Encrypted keys go through the regular reader for the password */
+static EVP_PKEY *
+pem_decode_key(const char *name, const char *header, const unsigned char *der,
+    long len, SSL_CTX *ctx)
 {
-	DH *dh;
+	const unsigned char *p = der;
+	EVP_PKEY *pkey;
 	BIO *bio;
 
-	AN(cert);
+	if (strcmp(name, PEM_STRING_PKCS8) != 0 && *header == '\0')
+		return (d2i_AutoPrivateKey(NULL, &p, len));
+
+	bio = BIO_new(BIO_s_mem());
+	if (bio == NULL)
+		return (NULL);
+	pkey = NULL;
+	if (PEM_write_bio(bio, name, header, der, len) > 0)
+		pkey = PEM_read_bio_PrivateKey(bio, NULL,
+		    ctx == NULL ? NULL : SSL_CTX_get_default_passwd_cb(ctx),
+		    ctx == NULL ? NULL :
+		    SSL_CTX_get_default_passwd_cb_userdata(ctx));
+	BIO_free(bio);
+	return (pkey);
+}
+
+/* Decode the objects of a PEM file, or of its contents if they were read
+ * ahead. Objects not wanted are skipped without decoding. */
+static int
+pem_objs_load(struct pem_objs *po, const char *file, const char *data,
+    size_t len, SSL_CTX *ctx, unsigned want)
+{
+	const unsigned char *p;
+	char *name, *header;
+	unsigned char *der;
+	unsigned long e;
+	long l;
+	X509 *x;
+	BIO *bio;
+	int r = 0;
 
-	bio = BIO_new_file(cert, "r");
-	if (!bio) {
+	memset(po, 0, sizeof *po);
+	if (data != NULL)
+		bio = BIO_new_mem_buf(data, (int)len);
+	else
+		bio = BIO_new_file(file, "r");
+	if (bio == NULL) {
 		log_ssl_error(NULL, "{core} BIO_new_file");
 		return (-1);
 	}
 
-	dh = PEM_read_bio_DHparams(bio, NULL, NULL, NULL);
+	while (r == 0 && PEM_read_bio(bio, &name, &header, &der, &l) > 0) {
+		p = der;
+		if ((want & PO_CERTS) && (strcmp(name, PEM_STRING_X509) == 0 ||
+		    strcmp(name, PEM_STRING_X509_OLD) == 0 ||
+		    strcmp(name, PEM_STRING_X509_TRUSTED) == 0)) {
+			if (strcmp(name, PEM_STRING_X509_TRUSTED) == 0)
+				x = d2i_X509_AUX(NULL, &p, l);
+			else
+				x = d2i_X509(NULL, &p, l);
+			if (x == NULL)
+				r = -1;
+			else if (po->x509 == NULL)
+				po->x509 = x;
+			else if ((po->chain == NULL &&
+			    (po->chain = sk_X509_new_null()) == NULL) ||
+			    !sk_X509_push(po->chain, x)) {
+				X509_free(x);
+				r = -1;
+			}
+		} else if ((want & PO_KEY) && po->pkey == NULL &&
+		    strstr(name, "PRIVATE KEY") != NULL) {
+			po->pkey = pem_decode_key(name, header, der, l, ctx);
+			if (po->pkey == NULL)
+				r = -1;
+#ifndef OPENSSL_NO_DH
+		} else if ((want & PO_DH) && po->dh == NULL &&
+		    strcmp(name, PEM_STRING_DHPARAMS) == 0) {
+			po->dh = d2i_DHparams(NULL, &p, l);
+			if (po->dh == NULL)
+				r = -1;
+		} else if ((want & PO_DH) && po->dh == NULL &&
+		    strcmp(name, PEM_STRING_DHXPARAMS) == 0) {
+			po->dh = d2i_DHxparams(NULL, &p, l);
+			if (po->dh == NULL)
+				r = -1;
+#endif
+		}
+		OPENSSL_free(name);
+		OPENSSL_free(header);
+		OPENSSL_free(der);
+	}
 	BIO_free(bio);
+
+	/* Running out of objects is how the loop ends */
+	e = ERR_peek_last_error();
+	if (r == 0 && ERR_GET_LIB(e) == ERR_LIB_PEM &&
+	    ERR_GET_REASON(e) == PEM_R_NO_START_LINE)
+		ERR_clear_error();
+	else if (r == 0 && e != 0)
+		r = -1;
+	if (r != 0)
+		log_ssl_error(NULL, "{core} Error decoding %s", file);
+	return (r);
+}
+
+/* The same out of a precompiled bundle, where the objects are DER */
+static int
+bundle_objs_load(struct pem_objs *po, const struct cfg_cert_file *cf,
+    unsigned want)
+{
+	struct pem_objs dpo;
+	struct cb_entry e;
+	const unsigned char *p;
+	unsigned u;
+	X509 *x;
+	int r = 0;
+
+	memset(po, 0, sizeof *po);
+	if (CB_Entry(cf->bundle, cf->bundle_idx, &e) != 0) {
+		ERR("{core} Invalid bundle entry for %s\n", cf->filename);
+		return (-1);
+	}
+	for (u = 0; r == 0 && (want & PO_CERTS) && u < e.ncerts; u++) {
+		p = e.certs[u].ptr;
+		x = d2i_X509(NULL, &p, (long)e.certs[u].len);
+		if (x == NULL)
+			r = -1;
+		else if (po->x509 == NULL)
+			po->x509 = x;
+		else if ((po->chain == NULL &&
+		    (po->chain = sk_X509_new_null()) == NULL) ||
+		    !sk_X509_push(po->chain, x)) {
+			X509_free(x);
+			r = -1;
+		}
+	}
+	if (r == 0 && (want & PO_KEY)) {
+		p = e.key.ptr;
+		po->pkey = d2i_AutoPrivateKey(NULL, &p, (long)e.key.len);
+		if (po->pkey == NULL)
+			r = -1;
+	}
+	if (r == 0 && (want & PO_DH) && e.dh.len > 0) {
+		r = pem_objs_load(&dpo, cf->filename, e.dh.ptr, e.dh.len,
+		    NULL, PO_DH);
+#ifndef OPENSSL_NO_DH
+		po->dh = dpo.dh;
+		dpo.dh = NULL;
+#endif
+		pem_objs_free(&dpo);
+	}
+	CB_Entry_Free(&e);
+	if (r != 0) {
+		log_ssl_error(NULL, "{core} Error decoding %s from bundle",
+		    cf->filename);
+		pem_objs_free(po);
+	}
+	return (r);
+}
+
+static int
+cert_objs_load(struct pem_objs *po, const struct cfg_cert_file *cf,
+    SSL_CTX *ctx, unsigned want)
+{
+
+	if (cf->bundle != NULL)
+		return (bundle_objs_load(po, cf, want));
+	return (pem_objs_load(po, cf->filename, cf->pem, cf->pem_len, ctx,
+	    want));
+}
+
+#ifndef OPENSSL_NO_DH
+static int
+init_dh(SSL_CTX *ctx, const char *cert, DH *dh)
+{
+
+	AN(cert);
+
 	if (!dh) {
 		LOG("{core} Note: no DH parameters found in %s\n", cert);
 		return (-1);
@@ -324,12 +571,10 @@ init_dh(SSL_CTX *ctx, const char *cert)
 
 	LOG("{core} Using DH parameters from %s\n", cert);
 	if (!SSL_CTX_set_tmp_dh(ctx, dh)) {
-		DH_free(dh);
 		log_ssl_error(NULL, "{core} Error setting temp DH params");
 		return (-1);
 	}
 	LOG("{core} DH initialized with %d bit key\n", 8*DH_size(dh));
-	DH_free(dh);
 	return (0);
 }
 
@@ -425,85 +670,298 @@ static int alpn_select_cb(SSL *ssl,
 
 #ifdef USE_SHARED_CACHE
 
-/* Handle incoming message updates */
+/*
+ * Session updates are sent to the peers in batches. A datagram holds as
+ * many sessions as fit in SHCUPD_DGRAM_LEN and is signed once:
+ *
+ *	magic (1) | count (1) | records | HMAC-SHA1
+ *	record: length (2) | creation date (4) | padded id and ASN1 data
+ *
+ * The datagrams filled during an event loop iteration are sent to every
+ * peer with one sendmmsg() call before the worker goes back to sleep.
+ * Updates from older versions, one unbatched session per datagram, are
+ * still accepted.
+ */
+#define SHCUPD_MAGIC		0xc5
+#define SHCUPD_DGRAM_LEN	1400
+#define SHCUPD_REC_HDR_LEN	(sizeof(uint16_t) + sizeof(uint32_t))
+#define SHCUPD_MAX_DGRAM_LEN	(2 + SHCUPD_REC_HDR_LEN + \
+    SSL_MAX_SSL_SESSION_ID_LENGTH + SHSESS_MAX_DATA_LEN + SHA_DIGEST_LENGTH)
+#define SHCUPD_BATCH		16
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+#  define HAVE_MMSG 1
+#endif
+
+#ifdef HAVE_MMSG
+#  define shcupd_msg mmsghdr
+#else
+struct shcupd_msg {
+	struct msghdr	msg_hdr;
+	unsigned int	msg_len;
+};
+#endif
+
+struct shcupd_dgram {
+	unsigned	len;
+	unsigned char	buf[SHCUPD_MAX_DGRAM_LEN];
+};
+
+static struct shcupd_dgram shcupd_dgrams[SHCUPD_BATCH];
+static unsigned shcupd_ndgrams;	/* Being filled, the last one is open */
+static unsigned char shcupd_rbufs[SHCUPD_BATCH][SHCUPD_MAX_DGRAM_LEN];
+static ev_prepare shcupd_flusher;
+
+static struct {
+	uint64_t	sent_sessions;
+	uint64_t	sent_dgrams;
+	uint64_t	send_errors;
+	uint64_t	recv_dgrams;
+	uint64_t	applied;
+	uint64_t	stale;		/* Too old, or from a skewed clock */
+	uint64_t	dropped;	/* Bad signature or malformed */
+} shcupd_stats;
+
+/* Apply an update, unless it was created too long ago */
 static void
-handle_shcupd(struct ev_loop *loop, ev_io *w, int revents)
+shcupd_add(unsigned char *sess, unsigned len, long cdate, long now)
 {
-	(void)revents;
-	unsigned char msg[SHSESS_MAX_ENCODED_LEN], hash[EVP_MAX_MD_SIZE];
-	ssize_t r;
+
+	if (len <= SSL_MAX_SSL_SESSION_ID_LENGTH ||
+	    len > SSL_MAX_SSL_SESSION_ID_LENGTH + SHSESS_MAX_DATA_LEN) {
+		shcupd_stats.dropped++;
+		return;
+	}
+	if (labs(now - cdate) >= SSL_CTX_get_timeout(default_ctx->ctx)) {
+		shcupd_stats.stale++;
+		return;
+	}
+	shctx_sess_add(sess, len, now);
+	shcupd_stats.applied++;
+}
+
+/* Single session datagram, as sent by older versions */
+static void
+shcupd_apply_legacy(unsigned char *msg, size_t r, long now)
+{
+	unsigned char hash[EVP_MAX_MD_SIZE];
 	unsigned int hash_len;
 	uint32_t encdate;
-	long now = (time_t)ev_now(loop);
 
-	while ((r = recv(w->fd, msg, sizeof(msg), 0)) > 0) {
-		/* msg len must be greater than 1 Byte of data + sig length */
-		if (r < (int)(1+sizeof(shared_secret)))
-			continue;
+	/* msg len must be greater than 1 Byte of data + encdate + sig */
+	if (r < 1 + sizeof(encdate) + sizeof(shared_secret)) {
+		shcupd_stats.dropped++;
+		return;
+	}
+
+	/* compute sig */
+	r -= sizeof(shared_secret);
+	HMAC(EVP_sha1(), shared_secret, sizeof(shared_secret), msg,
+	    r, hash, &hash_len);
 
-		/* compute sig */
-		r -= sizeof(shared_secret);
-		HMAC(EVP_sha1(), shared_secret, sizeof(shared_secret), msg,
-		    r, hash, &hash_len);
+	/* check sign */
+	if (hash_len != sizeof(shared_secret) || memcmp(msg+r, hash, hash_len)) {
+		shcupd_stats.dropped++;
+		return;
+	}
 
-		if (hash_len != sizeof(shared_secret)) /* should never happen */
-		   continue;
+	r -= sizeof(encdate);
+	memcpy(&encdate, msg + r, sizeof(encdate));
+	shcupd_add(msg, r, (long)ntohl(encdate), now);
+}
 
-		/* check sign */
-		if (memcmp(msg+r, hash, hash_len))
-			continue;
+/* Apply the sessions of a received datagram */
+static void
+shcupd_apply(unsigned char *msg, size_t len, long now)
+{
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int hash_len, n;
+	uint16_t rlen;
+	uint32_t encdate;
+	size_t off;
 
-		/* msg len must be greater than 1 Byte of data +
-		 * encdate length */
-		if (r < (int)(1+sizeof(uint32_t)))
-			continue;
+	shcupd_stats.recv_dgrams++;
 
-		/* drop too unsync updates */
-		r -= sizeof(uint32_t);
-		encdate = *((uint32_t *)&msg[r]);
-		assert(now >= ntohl(encdate));
-		if ((now - ntohl(encdate)) >=
-		    SSL_CTX_get_timeout(default_ctx->ctx))
-			continue;
+	if (len < 2 + SHCUPD_REC_HDR_LEN + sizeof(shared_secret) ||
+	    msg[0] != SHCUPD_MAGIC) {
+		shcupd_apply_legacy(msg, len, now);
+		return;
+	}
+
+	len -= sizeof(shared_secret);
+	HMAC(EVP_sha1(), shared_secret, sizeof(shared_secret), msg,
+	    len, hash, &hash_len);
+	if (hash_len != sizeof(shared_secret) ||
+	    memcmp(msg + len, hash, hash_len)) {
+		shcupd_apply_legacy(msg, len + sizeof(shared_secret), now);
+		return;
+	}
+
+	for (n = msg[1], off = 2; n > 0; n--) {
+		if (len - off < SHCUPD_REC_HDR_LEN) {
+			shcupd_stats.dropped++;
+			return;
+		}
+		memcpy(&rlen, msg + off, sizeof(rlen));
+		memcpy(&encdate, msg + off + sizeof(rlen), sizeof(encdate));
+		off += SHCUPD_REC_HDR_LEN;
+		rlen = ntohs(rlen);
+		if (len - off < rlen) {
+			shcupd_stats.dropped++;
+			return;
+		}
+		shcupd_add(msg + off, rlen, (long)ntohl(encdate), now);
+		off += rlen;
+	}
+}
+
+/* Handle incoming message updates */
+static void
+handle_shcupd(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct shcupd_msg msgs[SHCUPD_BATCH];
+	struct iovec iov[SHCUPD_BATCH];
+	long now = (time_t)ev_now(loop);
+	int i, n;
+
+	(void)revents;
+	do {
+		memset(msgs, 0, sizeof msgs);
+		for (i = 0; i < SHCUPD_BATCH; i++) {
+			iov[i].iov_base = shcupd_rbufs[i];
+			iov[i].iov_len = sizeof shcupd_rbufs[i];
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+#ifdef HAVE_MMSG
+		n = recvmmsg(w->fd, msgs, SHCUPD_BATCH, 0, NULL);
+#else
+		n = recvmsg(w->fd, &msgs[0].msg_hdr, 0);
+		if (n >= 0) {
+			msgs[0].msg_len = n;
+			n = 1;
+		}
+#endif
+		for (i = 0; i < n; i++)
+			shcupd_apply(shcupd_rbufs[i], msgs[i].msg_len, now);
+	} while (n == SHCUPD_BATCH);
+}
+
+/* Sign and send the filled datagrams to every peer */
+static void
+shcupd_flush(void)
+{
+	struct shcupd_msg msgs[SHCUPD_BATCH * MAX_SHCUPD_PEERS];
+	struct iovec iov[SHCUPD_BATCH];
+	struct shcupd_dgram *d;
+	struct addrinfo **pai;
+	unsigned int hash_len, i, n;
+	int r;
+
+	for (i = 0; i < shcupd_ndgrams; i++) {
+		d = &shcupd_dgrams[i];
+		HMAC(EVP_sha1(), shared_secret, sizeof(shared_secret),
+		    d->buf, d->len, d->buf + d->len, &hash_len);
+		d->len += hash_len;
+		iov[i].iov_base = d->buf;
+		iov[i].iov_len = d->len;
+	}
+
+	memset(msgs, 0, sizeof msgs);
+	n = 0;
+	for (pai = shcupd_peers; *pai != NULL; pai++) {
+		for (i = 0; i < shcupd_ndgrams; i++, n++) {
+			msgs[n].msg_hdr.msg_name = (*pai)->ai_addr;
+			msgs[n].msg_hdr.msg_namelen = (*pai)->ai_addrlen;
+			msgs[n].msg_hdr.msg_iov = &iov[i];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+		}
+	}
+	shcupd_ndgrams = 0;
 
-		shctx_sess_add(msg, r, now);
+	for (i = 0; i < n; i += r) {
+#ifdef HAVE_MMSG
+		r = sendmmsg(shcupd_socket, msgs + i, n - i, 0);
+#else
+		r = sendmsg(shcupd_socket, &msgs[i].msg_hdr, 0) < 0 ? -1 : 1;
+#endif
+		if (r > 0) {
+			shcupd_stats.sent_dgrams += r;
+			continue;
+		}
+		/* skip the datagram that failed */
+		shcupd_stats.send_errors++;
+		r = 1;
 	}
 }
 
+static void
+shcupd_prepare_cb(struct ev_loop *loop, ev_prepare *w, int revents)
+{
+
+	(void)revents;
+	shcupd_flush();
+	ev_prepare_stop(loop, w);
+}
+
 /* Send remote updates messages callback */
 void
 shcupd_session_new(unsigned char *msg, unsigned int len, long cdate)
 {
-	unsigned int hash_len;
-	struct addrinfo **pai = shcupd_peers;
+	struct shcupd_dgram *d = NULL;
+	uint16_t nlen;
 	uint32_t ncdate;
 
-	/* add session creation encoded date to footer */
+	if (shcupd_ndgrams > 0)
+		d = &shcupd_dgrams[shcupd_ndgrams - 1];
+	if (d == NULL || d->buf[1] == UINT8_MAX ||
+	    d->len + SHCUPD_REC_HDR_LEN + len > SHCUPD_DGRAM_LEN) {
+		if (shcupd_ndgrams == SHCUPD_BATCH)
+			shcupd_flush();
+		d = &shcupd_dgrams[shcupd_ndgrams++];
+		d->buf[0] = SHCUPD_MAGIC;
+		d->buf[1] = 0;
+		d->len = 2;
+	}
+
+	nlen = htons((uint16_t)len);
 	ncdate = htonl((uint32_t)cdate);
-	memcpy(msg+len, &ncdate, sizeof(ncdate));
-	len += sizeof(ncdate);
+	memcpy(d->buf + d->len, &nlen, sizeof(nlen));
+	memcpy(d->buf + d->len + sizeof(nlen), &ncdate, sizeof(ncdate));
+	d->len += SHCUPD_REC_HDR_LEN;
+	memcpy(d->buf + d->len, msg, len);
+	d->len += len;
+	d->buf[1]++;
+	shcupd_stats.sent_sessions++;
+
+	/* send before the event loop sleeps again */
+	if (!ev_is_active(&shcupd_flusher)) {
+		ev_prepare_init(&shcupd_flusher, shcupd_prepare_cb);
+		ev_prepare_start(loop, &shcupd_flusher);
+	}
+}
 
-	/* add msg sign */
-	HMAC(EVP_sha1(), shared_secret, sizeof(shared_secret),
-	    msg, len, msg+len, &hash_len);
-	len += hash_len;
+/* Log the updates received from the peers */
+static void
+shcupd_log_recv_stats(void)
+{
 
-	/* send msg to peers */
-	while (*pai) {
-		sendto(shcupd_socket, msg, len, 0, (*pai)->ai_addr,
-		    (*pai)->ai_addrlen);
-		pai++;
-	}
+	LOGL("{core} Session replication: %ju datagrams received, "
+	    "%ju sessions applied, %ju stale, %ju dropped\n",
+	    (uintmax_t)shcupd_stats.recv_dgrams,
+	    (uintmax_t)shcupd_stats.applied, (uintmax_t)shcupd_stats.stale,
+	    (uintmax_t)shcupd_stats.dropped);
 }
 
-/* Compute a sha1 secret from an ASN1 rsa private key */
+/* Compute a sha1 secret from an ASN1 private key. For an RSA key, that
+ * is its RSAPrivateKey encoding. */
 static int
-compute_secret(RSA *rsa, unsigned char *secret)
+compute_secret(EVP_PKEY *pkey, unsigned char *secret)
 {
 	unsigned char *buf, *p;
-	unsigned int length;
+	int length;
 
-	length = i2d_RSAPrivateKey(rsa, NULL);
+	length = i2d_PrivateKey(pkey, NULL);
 	if (length <= 0)
 		return (-1);
 
@@ -511,7 +969,7 @@ compute_secret(RSA *rsa, unsigned char *secret)
 	if (!buf)
 		return (-1);
 
-	i2d_RSAPrivateKey(rsa,&p);
+	i2d_PrivateKey(pkey, &p);
 	SHA1(buf, length, secret);
 	free(buf);
 	return (0);
@@ -707,85 +1165,97 @@ create_shcupd_socket()
 	return (s);
 }
 
+/* Log the lock contention and storage of each session cache shard */
+static void
+shared_cache_log_stats(void)
+{
+	struct shctx_shard_stats st;
+	int i, n;
+
+	n = shared_context_nshards();
+	for (i = 0; i < n; i++) {
+		shared_context_shard_stats(i, &st);
+		LOGL("{core} Session cache shard %d: %ju locks, "
+		    "%ju contended (%.2f%%), %ju lookups, %ju hits, "
+		    "%ju stores, %ju evictions, %ju page moves\n", i,
+		    (uintmax_t)st.locks, (uintmax_t)st.contended,
+		    st.locks == 0 ? 0. : 100. * st.contended / st.locks,
+		    (uintmax_t)st.lookups, (uintmax_t)st.hits,
+		    (uintmax_t)st.stores, (uintmax_t)st.evictions,
+		    (uintmax_t)st.page_moves);
+	}
+}
+
 #endif /*USE_SHARED_CACHE */
 
 EVP_PKEY *
-load_privatekey(SSL_CTX *ctx, const char *file)
+load_privatekey(SSL_CTX *ctx, const char *file, const char *data, size_t len)
 {
-	BIO *bio;
+	struct pem_objs po;
 	EVP_PKEY *pkey;
 
-	bio = BIO_new_file(file, "r");
-	if (!bio) {
-		log_ssl_error(NULL, "{core} BIO_new_file");
-		return (NULL);
-	}
-
-	pkey = PEM_read_bio_PrivateKey(bio, NULL,
-	    SSL_CTX_get_default_passwd_cb(ctx),
-	    SSL_CTX_get_default_passwd_cb_userdata(ctx));
-	BIO_free(bio);
-
-	if (!pkey) {
-		log_ssl_error(NULL, "{core} PEM_read_bio_PrivateKey");
+	if (pem_objs_load(&po, file, data, len, ctx, PO_KEY) != 0)
 		return (NULL);
-	}
-
+	pkey = po.pkey;
+	po.pkey = NULL;
+	pem_objs_free(&po);
 	return (pkey);
 }
 
 #ifndef OPENSSL_NO_TLSEXT
-static int
-sni_match(const sni_name *sn, const char *srvname)
+/* Compile an SNI table into the index used by the handshakes. Names
+ * added later override earlier ones, like in the table. */
+static struct sni_index *
+build_sni_index(const sni_name *sn_tab)
 {
-	if (!sn->is_wildcard)
-		return (strcasecmp(srvname, sn->sni_key) == 0);
-	else {
-		char *s = strchr(srvname, '.');
-		if (s == NULL)
-			return (0);
-		return (strcasecmp(s, sn->sni_key + 1) == 0);
+	struct sni_index *si;
+	const sni_name *sn, *sntmp;
+
+	si = sni_index_new();
+	AN(si);
+	HASH_ITER(hh, sn_tab, sn, sntmp) {
+		CHECK_OBJ_NOTNULL(sn, SNI_NAME_MAGIC);
+		AN(sn->sni_key);
+		if (sni_index_add(si, sn->sni_key, sn->sctx) != 0)
+			ERR("Warning: SNI name '%s' from '%s' not indexed\n",
+			    sn->servername, sn->sctx->filename);
 	}
+	return (si);
 }
 
-static const sslctx *
-sni_lookup(const char *sni_key, const sni_name *sn_tab)
+/* Rebuild the SNI indexes after certificates were loaded or dropped,
+ * before the workers are started */
+static void
+rebuild_sni_indexes(void)
 {
-	const sni_name *sn;
-
-	AN(sni_key);
-	CHECK_OBJ_NOTNULL(sn_tab, SNI_NAME_MAGIC);
-
-	HASH_FIND_STR(sn_tab, sni_key, sn);
-	if (sn == NULL) {
-		char *s;
-		/* attempt another lookup for wildcard matches */
-		s = strchr(sni_key, '.');
-		if (s != NULL)
-			HASH_FIND_STR(sn_tab, s, sn);
-	}
+	struct frontend *fr;
 
-	if (sn != NULL) {
-		CHECK_OBJ_NOTNULL(sn, SNI_NAME_MAGIC);
-		if (sni_match(sn, sni_key))
-			return (sn->sctx);
+	sni_index_free(&sni_idx);
+	sni_idx = build_sni_index(sni_names);
+	VTAILQ_FOREACH(fr, &frontends, list) {
+		CHECK_OBJ_NOTNULL(fr, FRONTEND_MAGIC);
+		sni_index_free(&fr->sni_idx);
+		fr->sni_idx = build_sni_index(fr->sni_names);
 	}
-
-	return (NULL);
 }
 
 static int
-sni_try_lookup(SSL *ssl, const char *sni_key, const struct sni_name_s *sn_tab)
+sni_try_lookup(SSL *ssl, const char *servername, const struct sni_index *si)
 {
-	const sslctx *sc;
+	sslctx *sc;
 
 	AN(ssl);
-	AN(sni_key);
-	CHECK_OBJ_NOTNULL(sn_tab, SNI_NAME_MAGIC);
+	AN(servername);
 
-	sc = sni_lookup(sni_key, sn_tab);
+	sc = sni_index_lookup(si, servername);
 	if (sc == NULL)
 		return (0);
+	CHECK_OBJ(sc, SSLCTX_MAGIC);
+	if (sc->lazy_cf != NULL) {
+		sc = lazy_ctx_get(sc);
+		if (sc == NULL)
+			return (0);
+	}
 
 	CHECK_OBJ(sc, SSLCTX_MAGIC);
 	SSL_set_SSL_CTX(ssl, sc->ctx);
@@ -817,38 +1287,33 @@ sni_switch_ctx(SSL *ssl, int *al, void *data)
 {
 	const struct frontend *fr = NULL;
 	const char *servername;
-	char *sni_key;
+	proxystate *ps;
 	int lookup_global = 1;
 	int sni_nomatch_abort = CONFIG->SNI_NOMATCH_ABORT;
 
 	AN(ssl);
 	(void)al;
-	if (data != NULL)
-		CAST_OBJ_NOTNULL(fr, data, FRONTEND_MAGIC);
+	(void)data;
+	/* Contexts are shared by frontends, the connection tells which
+	 * one it came through */
+	CAST_OBJ_NOTNULL(ps, SSL_get_app_data(ssl), PROXYSTATE_MAGIC);
+	if (ps->sni_fr != NULL)
+		CAST_OBJ_NOTNULL(fr, ps->sni_fr, FRONTEND_MAGIC);
 
 	servername = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
 	if (servername == NULL)
 		return (SSL_TLSEXT_ERR_NOACK);
 
-	sni_key = sni_build_key(servername);
-	AN(sni_key);
-
 	if (fr != NULL) {
-		if (sni_try_lookup(ssl, sni_key, fr->sni_names)) {
-			free(sni_key);
+		if (sni_try_lookup(ssl, servername, fr->sni_idx))
 			return (SSL_TLSEXT_ERR_OK);
-		}
 		lookup_global = fr->match_global_certs;
 		if (fr->sni_nomatch_abort != -1)
 			sni_nomatch_abort = fr->sni_nomatch_abort;
 	}
 
-	if (lookup_global && sni_try_lookup(ssl, sni_key, sni_names)) {
-		free(sni_key);
+	if (lookup_global && sni_try_lookup(ssl, servername, sni_idx))
 		return (SSL_TLSEXT_ERR_OK);
-	}
-
-	free(sni_key);
 
 	/* No matching certs */
 	if (sni_nomatch_abort)
@@ -862,12 +1327,11 @@ static void
 sctx_free(sslctx *sc, sni_name **sn_tab)
 {
 	sni_name *sn, *sntmp;
+	sslctx *shared;
 
 	if (sc == NULL)
 		return;
 
-	HOCSP_free(&sc->staple);
-
 	if (sn_tab != NULL)
 		CHECK_OBJ_NOTNULL(*sn_tab, SNI_NAME_MAGIC);
 
@@ -882,9 +1346,42 @@ sctx_free(sslctx *sc, sni_name **sn_tab)
 		FREE_OBJ(sn);
 	}
 
+	/* Not shared anymore, and freed with the last context sharing it */
+	ctx_src_del(sc);
+	if (sc->nshared > 0) {
+		sc->dropped = 1;
+		return;
+	}
+
+	HOCSP_free(&sc->staple);
+	if (sc->ev_staple != NULL) {
+		/* Started in workers */
+		if (ev_is_active(sc->ev_staple))
+			ev_stat_stop(loop, sc->ev_staple);
+		free(sc->ev_staple);
+	}
+	free(sc->staple_fn);
+
+#ifndef OPENSSL_NO_TLSEXT
+	if (sc->lazy_sc != NULL)
+		lazy_ctx_drop(sc);
+#endif
+	if (sc->lazy_cf != NULL)
+		cfg_cert_file_free(&sc->lazy_cf);
+	X509_free(sc->x509);
 	free(sc->filename);
+	free(sc->settings);
+	free(sc->key_fn);
 	SSL_CTX_free(sc->ctx);
+	shared = sc->shared;
 	FREE_OBJ(sc);
+
+	if (shared != NULL) {
+		CHECK_OBJ_NOTNULL(shared, SSLCTX_MAGIC);
+		assert(shared->nshared > 0);
+		if (--shared->nshared == 0 && shared->dropped)
+			sctx_free(shared, NULL);
+	}
 }
 
 X509 *
@@ -921,6 +1418,77 @@ client_vfy_cb(int preverify_ok, X509_STORE_CTX *storectx)
 	return (preverify_ok);
 }
 
+/* Client verification CA files read by the master, for workers that may
+ * not be allowed to, see hot_msg() */
+struct ca_pem {
+	unsigned		magic;
+#define CA_PEM_MAGIC		0x2c81f5a7
+	char			*filename;
+	char			*pem;
+	size_t			len;
+	UT_hash_handle		hh;
+};
+
+static struct ca_pem *ca_pems;
+
+static void
+ca_pem_set(char *filename, char *pem, size_t len)
+{
+	struct ca_pem *cp;
+
+	AN(filename);
+	AN(pem);
+	HASH_FIND_STR(ca_pems, filename, cp);
+	if (cp != NULL) {
+		HASH_DEL(ca_pems, cp);
+		free(cp->filename);
+		free(cp->pem);
+		FREE_OBJ(cp);
+	}
+	ALLOC_OBJ(cp, CA_PEM_MAGIC);
+	AN(cp);
+	cp->filename = filename;
+	cp->pem = pem;
+	cp->len = len;
+	HASH_ADD_KEYPTR(hh, ca_pems, cp->filename, strlen(cp->filename), cp);
+}
+
+/* Like X509_STORE_load_locations() for a file, out of its contents */
+static int
+ca_pem_load(X509_STORE *vfy, const struct ca_pem *cp)
+{
+	STACK_OF(X509_INFO) *infos;
+	X509_INFO *xi;
+	BIO *bio;
+	int i, n = 0;
+
+	CHECK_OBJ_NOTNULL(cp, CA_PEM_MAGIC);
+	assert(cp->len <= INT_MAX);
+	bio = BIO_new_mem_buf(cp->pem, (int)cp->len);
+	AN(bio);
+	infos = PEM_X509_INFO_read_bio(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (infos == NULL)
+		return (0);
+	for (i = 0; i < sk_X509_INFO_num(infos); i++) {
+		xi = sk_X509_INFO_value(infos, i);
+		if (xi->x509 != NULL) {
+			if (!X509_STORE_add_cert(vfy, xi->x509))
+				break;
+			n++;
+		}
+		if (xi->crl != NULL) {
+			if (!X509_STORE_add_crl(vfy, xi->crl))
+				break;
+			n++;
+		}
+	}
+	if (i < sk_X509_INFO_num(infos))
+		n = 0;
+	sk_X509_INFO_pop_free(infos, X509_INFO_free);
+	return (n);
+}
+
 static int
 client_vfy_init(SSL_CTX *ctx, int flags, const char *cafile)
 {
@@ -928,6 +1496,7 @@ client_vfy_init(SSL_CTX *ctx, int flags, const char *cafile)
 	STACK_OF(X509_OBJECT) *objs;
 	X509_OBJECT *o;
 	X509 *crt;
+	struct ca_pem *cp;
 	int i;
 
 	AN(cafile);
@@ -939,7 +1508,9 @@ client_vfy_init(SSL_CTX *ctx, int flags, const char *cafile)
 		log_ssl_error(NULL, "X509_STORE_new: allocation failed");
 		return (1);
 	}
-	if (X509_STORE_load_locations(vfy, cafile, NULL) == 0) {
+	HASH_FIND_STR(ca_pems, cafile, cp);
+	if ((cp != NULL ? ca_pem_load(vfy, cp) :
+	    X509_STORE_load_locations(vfy, cafile, NULL)) == 0) {
 		log_ssl_error(NULL, "client_verify_ca: unable to "
 		    "load file '%s'",
 		    cafile);
@@ -975,42 +1546,125 @@ client_vfy_init(SSL_CTX *ctx, int flags, const char *cafile)
 	return (0);
 }
 
-/* Initialize an SSL context */
-static sslctx *
-make_ctx_fr(const struct cfg_cert_file *cf, const struct frontend *fr,
-    const struct front_arg *fa)
+/* Contexts are made by the certificate loading threads, this protects the
+ * global state set up along with them. */
+static pthread_mutex_t make_ctx_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* The TLS settings of a context, the global ones or those of a frontend */
+struct ctx_settings {
+	int			selected_protos;
+	const char		*ciphers;
+	const char		*ciphersuites;
+	int			pref_srv_ciphers;
+	int			client_verify;
+	const char		*client_verify_ca;
+};
+
+static void
+ctx_settings_get(const struct front_arg *fa, struct ctx_settings *cs)
 {
-	SSL_CTX *ctx;
-	sslctx *sc;
-	EVP_PKEY *pkey;
-	int selected_protos = CONFIG->SELECTED_TLS_PROTOS;
-	char *ciphers = CONFIG->CIPHERS_TLSv12;
-	char *ciphersuites = CONFIG->CIPHERSUITES_TLSv13;
-	int pref_srv_ciphers = CONFIG->PREFER_SERVER_CIPHERS;
-	int client_verify = CONFIG->CLIENT_VERIFY;
+
+	cs->selected_protos = CONFIG->SELECTED_TLS_PROTOS;
+	cs->ciphers = CONFIG->CIPHERS_TLSv12;
+	cs->ciphersuites = CONFIG->CIPHERSUITES_TLSv13;
+	cs->pref_srv_ciphers = CONFIG->PREFER_SERVER_CIPHERS;
+	cs->client_verify = CONFIG->CLIENT_VERIFY;
+	cs->client_verify_ca = CONFIG->CLIENT_VERIFY_CA;
 
 	if (fa != NULL) {
 		CHECK_OBJ_NOTNULL(fa, FRONT_ARG_MAGIC);
 		if (fa->selected_protos != 0)
-			selected_protos = fa->selected_protos;
+			cs->selected_protos = fa->selected_protos;
 		if (fa->ciphers_tlsv12 != NULL)
-			ciphers = fa->ciphers_tlsv12;
+			cs->ciphers = fa->ciphers_tlsv12;
 		if (fa->prefer_server_ciphers != -1)
-			pref_srv_ciphers = fa->prefer_server_ciphers;
+			cs->pref_srv_ciphers = fa->prefer_server_ciphers;
 		if (fa->ciphersuites_tlsv13)
-			ciphersuites = fa->ciphersuites_tlsv13;
+			cs->ciphersuites = fa->ciphersuites_tlsv13;
 		if (fa->client_verify != -1)
-			client_verify = fa->client_verify;
+			cs->client_verify = fa->client_verify;
+		if (fa->client_verify_ca)
+			cs->client_verify_ca = fa->client_verify_ca;
 	}
+}
 
-	long ssloptions = SSL_OP_NO_SSLv2 | SSL_OP_ALL |
-	    SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION;
+/* Contexts with the same settings string can be shared */
+static char *
+ctx_settings_str(const struct front_arg *fa)
+{
+	struct ctx_settings cs;
+	struct vsb *vsb;
+	char *p;
 
-#ifdef SSL_OP_NO_COMPRESSION
-	ssloptions |= SSL_OP_NO_COMPRESSION;
+	ctx_settings_get(fa, &cs);
+	vsb = VSB_new_auto();
+	AN(vsb);
+	VSB_printf(vsb, "%x\n%s\n%s\n%d\n%d\n%s", cs.selected_protos,
+	    cs.ciphers ? cs.ciphers : "",
+	    cs.ciphersuites ? cs.ciphersuites : "",
+	    cs.pref_srv_ciphers, cs.client_verify,
+	    cs.client_verify != SSL_VERIFY_NONE ? cs.client_verify_ca : "");
+	AZ(VSB_finish(vsb));
+	p = strdup(VSB_data(vsb));
+	AN(p);
+	VSB_delete(vsb);
+	return (p);
+}
+
+#ifndef OPENSSL_NO_TLSEXT
+/* Load a staple of cf, out of the contents read ahead with the
+ * certificate if it was */
+static int
+staple_load(const struct cfg_cert_file *cf, sslctx *sc, const char *fn,
+    int is_cached)
+{
+	const char *p;
+	size_t len;
+
+	if (cf->pem == NULL)
+		return (HOCSP_init_file(fn, sc, is_cached));
+	p = is_cached ? cf->ocsp_cached : cf->ocsp;
+	len = is_cached ? cf->ocsp_cached_len : cf->ocsp_len;
+	if (p == NULL) {
+		if (!is_cached)
+			ERR("Error loading status file '%s'\n", fn);
+		return (1);
+	}
+	return (HOCSP_init_mem(fn, p, len, sc));
+}
 #endif
-#ifdef SSL_OP_SINGLE_DH_USE
-	ssloptions |= SSL_OP_SINGLE_DH_USE;
+
+/* Initialize an SSL context. The certificates and private key of src are
+ * used if set, it was made out of the same files. */
+static sslctx *
+make_ctx_fr(const struct cfg_cert_file *cf, const struct front_arg *fa,
+    const sslctx *src)
+{
+	SSL_CTX *ctx;
+	sslctx *sc;
+	EVP_PKEY *pkey;
+	STACK_OF(X509) *chain;
+	struct pem_objs po;
+	struct ctx_settings cs;
+	unsigned want;
+	int selected_protos, pref_srv_ciphers, client_verify;
+	const char *ciphers, *ciphersuites;
+
+	ctx_settings_get(fa, &cs);
+	selected_protos = cs.selected_protos;
+	ciphers = cs.ciphers;
+	ciphersuites = cs.ciphersuites;
+	pref_srv_ciphers = cs.pref_srv_ciphers;
+	client_verify = cs.client_verify;
+
+	long ssloptions = SSL_OP_NO_SSLv2 | SSL_OP_ALL |
+	    SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION;
+
+#ifdef SSL_OP_NO_COMPRESSION
+	ssloptions |= SSL_OP_NO_COMPRESSION;
+#endif
+#ifdef SSL_OP_SINGLE_DH_USE
+	ssloptions |= SSL_OP_SINGLE_DH_USE;
 #endif
 #ifdef SSL_OP_SINGLE_ECDH_USE
 	ssloptions |= SSL_OP_SINGLE_ECDH_USE;
@@ -1059,11 +1713,8 @@ make_ctx_fr(const struct cfg_cert_file *cf, const struct frontend *fr,
 	(void) ciphersuites;
 #endif
 	if (client_verify != SSL_VERIFY_NONE) {
-		const char *ca = CONFIG->CLIENT_VERIFY_CA;
-		if (fa && fa->client_verify_ca)
-			ca = fa->client_verify_ca;
-		AN(ca);
-		if (client_vfy_init(ctx, client_verify, ca))
+		AN(cs.client_verify_ca);
+		if (client_vfy_init(ctx, client_verify, cs.client_verify_ca))
 			return (NULL);
 	}
 
@@ -1072,6 +1723,7 @@ make_ctx_fr(const struct cfg_cert_file *cf, const struct frontend *fr,
 
 	AN(SSL_CTX_set_session_id_context(ctx, (const unsigned char *) "hitch",
 		strlen("hitch")));
+	HSSL_Tickets_Install(ctx);
 
 	ALLOC_OBJ(sc, SSLCTX_MAGIC);
 	AN(sc);
@@ -1080,6 +1732,11 @@ make_ctx_fr(const struct cfg_cert_file *cf, const struct frontend *fr,
 	sc->ctx = ctx;
 	sc->staple_vfy = cf->ocsp_vfy;
 	VTAILQ_INIT(&sc->sni_list);
+	sc->settings = ctx_settings_str(fa);
+	if (cf->priv_key_filename != NULL) {
+		sc->key_fn = strdup(cf->priv_key_filename);
+		AN(sc->key_fn);
+	}
 
 	if (sc->staple_vfy > 0 ||
 	    (sc-> staple_vfy < 0 && CONFIG->OCSP_VFY))
@@ -1089,55 +1746,88 @@ make_ctx_fr(const struct cfg_cert_file *cf, const struct frontend *fr,
 		return (sc);
 
 	/* SSL_SERVER Mode stuff */
-	if (SSL_CTX_use_certificate_chain_file(ctx, cf->filename) <= 0) {
+	want = PO_CERTS | PO_DH;
+	if (cf->priv_key_filename == NULL)
+		want |= PO_KEY;
+	if (src != NULL) {
+		/* Shared with src, only the DH parameters are decoded */
+		want = PO_DH;
+		if (cert_objs_load(&po, cf, ctx, want) == 0) {
+			AN(X509_up_ref(src->x509));
+			po.x509 = src->x509;
+			if (SSL_CTX_get0_chain_certs(src->ctx, &chain) &&
+			    chain != NULL)
+				po.chain = X509_chain_up_ref(chain);
+			po.pkey = SSL_CTX_get0_privatekey(src->ctx);
+			AN(po.pkey);
+			AN(EVP_PKEY_up_ref(po.pkey));
+		}
+	}
+	if ((src == NULL && cert_objs_load(&po, cf, ctx, want) != 0) ||
+	    po.x509 == NULL ||
+	    SSL_CTX_use_certificate(ctx, po.x509) <= 0 ||
+	    (po.chain != NULL && SSL_CTX_set1_chain(ctx, po.chain) <= 0)) {
 		log_ssl_error(NULL,
 		    "Error loading certificate file %s\n", cf->filename);
+		pem_objs_free(&po);
 		sctx_free(sc, NULL);
 		return (NULL);
 	}
+	sc->x509 = po.x509;
+	po.x509 = NULL;
 
-	pkey = 0;
-	if (cf->priv_key_filename != 0) {
-		pkey = load_privatekey(ctx, cf->priv_key_filename);
+	if (src == NULL && cf->priv_key_filename != NULL) {
+		pkey = load_privatekey(ctx, cf->priv_key_filename,
+		    cf->key_pem, cf->key_pem_len);
 		if (!pkey) {
 			ERR("Error loading private key (%s)\n",
 			    cf->priv_key_filename);
+			pem_objs_free(&po);
 			sctx_free(sc, NULL);
 			return (NULL);
 		}
-	}
-	if (!pkey) {
-		pkey = load_privatekey(ctx, cf->filename);
+	} else {
+		pkey = po.pkey;
+		po.pkey = NULL;
 		if (!pkey) {
 			ERR("Error loading private key (%s)\n", cf->filename);
+			pem_objs_free(&po);
 			sctx_free(sc, NULL);
 			return (NULL);
 		}
 	}
 
+	/* Engines bring their own key methods, and the key of src is
+	 * already wrapped */
+	if (CONFIG->ASYNC_SIGN_THREADS > 0 && CONFIG->ENGINE == NULL &&
+	    src == NULL) {
+		AZ(pthread_mutex_lock(&make_ctx_mtx));
+		pkey = HSSL_Async_WrapKey(pkey);
+		AZ(pthread_mutex_unlock(&make_ctx_mtx));
+	}
+
 	if (SSL_CTX_use_PrivateKey(ctx, pkey) <= 0) {
 		log_ssl_error(NULL, "SSL_CTX_use_PrivateKey: %s",
 		    cf->filename);
 		EVP_PKEY_free(pkey);
+		pem_objs_free(&po);
 		sctx_free(sc, NULL);
 		return (NULL);
 	}
 
 #ifndef OPENSSL_NO_DH
-	init_dh(ctx, cf->filename);
+	init_dh(ctx, cf->filename, po.dh);
 	init_ecdh(ctx, CONFIG->ECDH_CURVE);
 #endif /* OPENSSL_NO_DH */
+	pem_objs_free(&po);
 
 #ifndef OPENSSL_NO_TLSEXT
 	if (!SSL_CTX_set_tlsext_servername_callback(ctx, sni_switch_ctx)) {
 		ERR("Error setting up SNI support.\n");
 	}
-	CHECK_OBJ_ORNULL(fr, FRONTEND_MAGIC);
-	if (!SSL_CTX_set_tlsext_servername_arg(ctx, (void *)fr)) {
-		ERR("Error setting SNI servername arg.\n");
-	}
 
-	if (load_cert_ctx(sc) != 0) {
+	if ((cf->bundle != NULL ? load_bundle_names(sc, cf) :
+	    load_cert_ctx(sc)) != 0) {
 		EVP_PKEY_free(pkey);
 		sctx_free(sc, NULL);
 		return (NULL);
@@ -1147,7 +1837,7 @@ make_ctx_fr(const struct cfg_cert_file *cf, const struct frontend *fr,
 		char *fn = HOCSP_fn(sc->filename);
 		/* attempt loading of cached ocsp staple */
 		if (fn != NULL) {
-			if (HOCSP_init_file(fn, sc, 1) == 0) {
+			if (staple_load(cf, sc, fn, 1) == 0) {
 				LOG("{core} Loaded cached OCSP staple "
 				    "for cert '%s'\n", sc->filename);
 				sc->staple_fn = fn;
@@ -1159,7 +1849,7 @@ make_ctx_fr(const struct cfg_cert_file *cf, const struct frontend *fr,
 	}
 
 	if (sc->staple == NULL && cf->ocspfn != NULL) {
-		if (HOCSP_init_file(cf->ocspfn, sc, 0) != 0) {
+		if (staple_load(cf, sc, cf->ocspfn, 0) != 0) {
 			ERR("Error loading OCSP response %s for stapling.\n",
 			    cf->ocspfn);
 			EVP_PKEY_free(pkey);
@@ -1179,30 +1869,51 @@ make_ctx_fr(const struct cfg_cert_file *cf, const struct frontend *fr,
 
 #ifdef USE_SHARED_CACHE
 	if (CONFIG->SHARED_CACHE) {
-		if (shared_context_init(ctx, CONFIG->SHARED_CACHE) < 0) {
-			ERR("Unable to alloc memory for shared cache.\n");
+		int r;
+
+		/* The cache and the shared secret are global */
+		AZ(pthread_mutex_lock(&make_ctx_mtx));
+		r = shared_context_init(ctx, CONFIG->SHARED_CACHE_BYTES > 0 ?
+		    (size_t)CONFIG->SHARED_CACHE_BYTES :
+		    (size_t)CONFIG->SHARED_CACHE * SHSESS_ENTRY_LEN,
+		    CONFIG->SHARED_CACHE_SHARDS > 0 ?
+		    CONFIG->SHARED_CACHE_SHARDS : (int)CONFIG->NCORES,
+		    CONFIG->SHARED_CACHE_FILE);
+		if (r < 0) {
+			if (CONFIG->SHARED_CACHE_FILE != NULL)
+				ERR("Unable to map shared cache file %s: %s\n",
+				    CONFIG->SHARED_CACHE_FILE,
+				    strerror(errno));
+			else
+				ERR("Unable to alloc memory for shared "
+				    "cache.\n");
+			AZ(pthread_mutex_unlock(&make_ctx_mtx));
 			EVP_PKEY_free(pkey);
 			sctx_free(sc, NULL);
 			return (NULL);
 		}
+		if (r > 0 && CONFIG->SHARED_CACHE_FILE != NULL &&
+		    !shared_context_persistent())
+			ERR("{core} Shared cache file %s is in use by another "
+			    "process, keeping the cache in memory\n",
+			    CONFIG->SHARED_CACHE_FILE);
+		else if (r > 0 && CONFIG->SHARED_CACHE_FILE != NULL)
+			LOG("{core} Restored %u sessions from %s\n",
+			    shared_context_restored(),
+			    CONFIG->SHARED_CACHE_FILE);
 		if (CONFIG->SHCUPD_PORT) {
-			RSA *rsa;
-			rsa = EVP_PKEY_get1_RSA(pkey);
-			if (rsa != NULL &&
-			    compute_secret(rsa, shared_secret) < 0) {
-				ERR("Unable to compute shared secret.\n");
-				EVP_PKEY_free(pkey);
-				sctx_free(sc, NULL);
-				return (NULL);
-			}
+			/* The shared secret is set by shared_secret_init() */
 
-			/* Force TLS tickets because keys differs. */
-			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+			/* Disable TLS tickets unless the peers share the
+			 * key file: the keys differ otherwise. */
+			if (CONFIG->TICKET_KEY_FILE == NULL)
+				SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
 
 			if (*shcupd_peers) {
 				shsess_set_new_cbk(shcupd_session_new);
 			}
 		}
+		AZ(pthread_mutex_unlock(&make_ctx_mtx));
 	}
 #endif
 	EVP_PKEY_free(pkey);
@@ -1232,47 +1943,153 @@ insert_sni_names(sslctx *sc, sni_name **sn_tab)
 	}
 }
 
-static sslctx *
-make_ctx(const struct cfg_cert_file *cf)
+static void
+cert_read_ahead_free(struct cfg_cert_file *cf)
 {
-	return (make_ctx_fr(cf, NULL, NULL));
+
+	CHECK_OBJ_NOTNULL(cf, CFG_CERT_FILE_MAGIC);
+	free(cf->pem);
+	free(cf->key_pem);
+	free(cf->ocsp);
+	free(cf->ocsp_cached);
+	cf->pem = cf->key_pem = cf->ocsp = cf->ocsp_cached = NULL;
+	cf->pem_len = cf->key_pem_len = cf->ocsp_len =
+	    cf->ocsp_cached_len = 0;
+}
+
+/* Read a whole file. The workers may not be allowed to. */
+static int
+read_ahead(const char *file, char **data, size_t *len)
+{
+	struct stat st;
+	ssize_t l;
+	size_t n;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return (-1);
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > INT_MAX) {
+		(void)close(fd);
+		errno = EINVAL;
+		return (-1);
+	}
+	*data = malloc(st.st_size);
+	AN(*data);
+	for (n = 0; n < (size_t)st.st_size; n += l) {
+		l = read(fd, *data + n, st.st_size - n);
+		if (l <= 0) {
+			free(*data);
+			*data = NULL;
+			(void)close(fd);
+			if (l == 0)
+				errno = EINVAL;
+			return (-1);
+		}
+	}
+	(void)close(fd);
+	*len = n;
+	return (0);
+}
+
+/* Read the files of a certificate ahead, unless it comes from a bundle.
+ * That includes its OCSP staples. */
+static int
+cert_read_ahead(struct cfg_cert_file *cf)
+{
+	char *fn;
+
+	CHECK_OBJ_NOTNULL(cf, CFG_CERT_FILE_MAGIC);
+	if (cf->bundle != NULL || cf->pem != NULL)
+		return (0);
+	if (read_ahead(cf->filename, &cf->pem, &cf->pem_len) != 0 ||
+	    (cf->priv_key_filename != NULL &&
+	    read_ahead(cf->priv_key_filename, &cf->key_pem,
+	    &cf->key_pem_len) != 0)) {
+		ERR("{core} Unable to read certificate '%s': %s\n",
+		    cf->filename, strerror(errno));
+		cert_read_ahead_free(cf);
+		return (-1);
+	}
+	if (cf->ocspfn != NULL &&
+	    read_ahead(cf->ocspfn, &cf->ocsp, &cf->ocsp_len) != 0) {
+		ERR("{core} Unable to read OCSP response '%s': %s\n",
+		    cf->ocspfn, strerror(errno));
+		cert_read_ahead_free(cf);
+		return (-1);
+	}
+	if (CONFIG->OCSP_DIR != NULL) {
+		/* Optional, see make_ctx_fr() */
+		fn = HOCSP_fn(cf->filename);
+		if (fn != NULL)
+			(void)read_ahead(fn, &cf->ocsp_cached,
+			    &cf->ocsp_cached_len);
+		free(fn);
+	}
+	return (0);
 }
+
 #ifndef OPENSSL_NO_TLSEXT
+static void
+push_sni_name(sslctx *so, char *servername)
+{
+	sni_name *sn;
+
+	AN(servername);
+	ALLOC_OBJ(sn, SNI_NAME_MAGIC);
+	AN(sn);
+	sn->servername = servername;
+	sn->is_wildcard = (strstr(sn->servername, "*.") == sn->servername);
+	sn->sni_key = sni_build_key(sn->servername);
+	sn->sctx = so;
+	VTAILQ_INSERT_TAIL(&so->sni_list, sn, list);
+}
+
+/* The names of a bundle entry were found when it was compiled */
+static int
+load_bundle_names(sslctx *so, const struct cfg_cert_file *cf)
+{
+	struct cb_entry e;
+	char *servername;
+	unsigned u;
+
+	if (CB_Entry(cf->bundle, cf->bundle_idx, &e) != 0) {
+		ERR("Invalid bundle entry for %s\n", so->filename);
+		return (1);
+	}
+	for (u = 0; u < e.nnames; u++) {
+		servername = strdup(e.names[u]);
+		AN(servername);
+		push_sni_name(so, servername);
+	}
+	CB_Entry_Free(&e);
+	return (0);
+}
+
 static int
 load_cert_ctx(sslctx *so)
 {
 	X509 *x509;
 	X509_NAME *x509_name;
 	X509_NAME_ENTRY *x509_entry;
-	BIO *f;
 	STACK_OF(GENERAL_NAME) *names = NULL;
 	GENERAL_NAME *name;
+	char *servername;
 	int i;
 
 #define PUSH_CTX(asn1_str, ctx)						\
 	do {								\
-		sni_name *sn;						\
-		ALLOC_OBJ(sn, SNI_NAME_MAGIC);				\
+		servername = NULL;					\
 		ASN1_STRING_to_UTF8(					\
-			(unsigned char **)&sn->servername, asn1_str);	\
-		sn->is_wildcard =					\
-		    (strstr(sn->servername, "*.") == sn->servername);	\
-		sn->sni_key = sni_build_key(sn->servername);		\
-		sn->sctx = so;						\
-		VTAILQ_INSERT_TAIL(&so->sni_list, sn, list);		\
+			(unsigned char **)&servername, asn1_str);	\
+		push_sni_name(so, servername);				\
 	} while (0)
 
-	f = BIO_new(BIO_s_file());
-	// TODO: error checking
-
-	if (!BIO_read_filename(f, so->filename)) {
+	x509 = so->x509;
+	if (x509 == NULL) {
 		ERR("Could not read certificate '%s'\n", so->filename);
 		return (1);
 	}
-	x509 = PEM_read_bio_X509_AUX(f, NULL, NULL, NULL);
-	BIO_free(f);
-
-	so->x509 = x509;
 
 	/* First, look for Subject Alternative Names. */
 	names = X509_get_ext_d2i(x509, NID_subject_alt_name, NULL, NULL);
@@ -1304,6 +2121,146 @@ load_cert_ctx(sslctx *so)
 
 	return (0);
 }
+
+/*
+ * Lazily loaded certificates.
+ *
+ * With lazy-certs, the parent only reads the names of the certificates
+ * to fill the SNI index, and keeps a stub context per certificate with a
+ * copy of its configuration. A worker loads the key and chain the first
+ * time a client asks for one of the names, and keeps the loaded contexts
+ * in an LRU list bounded by cert-cache-size. With cert-store, the stubs
+ * made by the parent refer to a shared store instead of the PEM contents.
+ */
+VTAILQ_HEAD(sslctx_head, sslctx_s);
+static struct sslctx_head lazy_lru = VTAILQ_HEAD_INITIALIZER(lazy_lru);
+static unsigned lazy_n;
+
+static struct lazy_stats {
+	uint64_t	hits;
+	uint64_t	loads;
+	uint64_t	evictions;
+	uint64_t	failures;
+} lazy_stats;
+
+static sslctx *
+make_lazy_ctx(const struct cfg_cert_file *cf, struct cert_store *cs)
+{
+	struct cfg_cert_file *lcf;
+	struct pem_objs po;
+	sslctx *sc;
+
+	lcf = cfg_cert_file_dup(cf);
+	AN(lcf);
+	/* A bundle is mapped and its names are ready */
+	if (cert_read_ahead(lcf) != 0) {
+		cfg_cert_file_free(&lcf);
+		return (NULL);
+	}
+
+	ALLOC_OBJ(sc, SSLCTX_MAGIC);
+	AN(sc);
+	sc->filename = strdup(cf->filename);
+	AN(sc->filename);
+	sc->mtim = cf->mtim;
+	sc->staple_vfy = cf->ocsp_vfy;
+	VTAILQ_INIT(&sc->sni_list);
+	sc->lazy_cf = lcf;
+
+	if (lcf->bundle != NULL) {
+		if (load_bundle_names(sc, lcf) != 0) {
+			sctx_free(sc, NULL);
+			return (NULL);
+		}
+		return (sc);
+	}
+
+	if (cs != NULL) {
+		/* Decoded into the store, see cert_store_map() */
+		if (compile_cert(cs, lcf, 0, sc, &lcf->bundle_idx) != 0) {
+			sctx_free(sc, NULL);
+			return (NULL);
+		}
+		return (sc);
+	}
+
+	if (pem_objs_load(&po, lcf->filename, lcf->pem, lcf->pem_len, NULL,
+	    PO_CERTS) == 0) {
+		sc->x509 = po.x509;
+		po.x509 = NULL;
+	}
+	pem_objs_free(&po);
+	if (load_cert_ctx(sc) != 0) {
+		sctx_free(sc, NULL);
+		return (NULL);
+	}
+	/* Only the names are needed until the certificate is used */
+	X509_free(sc->x509);
+	sc->x509 = NULL;
+	return (sc);
+}
+
+static void
+lazy_ctx_drop(sslctx *stub)
+{
+	sslctx *sc;
+
+	CHECK_OBJ_NOTNULL(stub, SSLCTX_MAGIC);
+	sc = stub->lazy_sc;
+	CHECK_OBJ_NOTNULL(sc, SSLCTX_MAGIC);
+	VTAILQ_REMOVE(&lazy_lru, stub, lazy_list);
+	assert(lazy_n > 0);
+	lazy_n--;
+	stub->lazy_sc = NULL;
+
+	/* Connections still using the SSL_CTX hold a reference to it */
+	sctx_free(sc, NULL);
+}
+
+/* Return the loaded context of a stub, loading it on first use */
+static sslctx *
+lazy_ctx_get(sslctx *stub)
+{
+	sslctx *sc;
+
+	CHECK_OBJ_NOTNULL(stub, SSLCTX_MAGIC);
+	AN(stub->lazy_cf);
+
+	if (stub->lazy_sc != NULL) {
+		lazy_stats.hits++;
+		if (stub != VTAILQ_FIRST(&lazy_lru)) {
+			VTAILQ_REMOVE(&lazy_lru, stub, lazy_list);
+			VTAILQ_INSERT_HEAD(&lazy_lru, stub, lazy_list);
+		}
+		return (stub->lazy_sc);
+	}
+
+	if (stub->lazy_failed)
+		return (NULL);
+
+	sc = make_ctx_fr(stub->lazy_cf, NULL, NULL);
+	if (sc == NULL) {
+		/* Don't retry on every handshake */
+		stub->lazy_failed = 1;
+		lazy_stats.failures++;
+		ERR("{core} Unable to load certificate '%s'\n",
+		    stub->filename);
+		return (NULL);
+	}
+	if (sc->ev_staple != NULL)
+		ev_stat_start(loop, sc->ev_staple);
+	lazy_stats.loads++;
+
+	stub->lazy_sc = sc;
+	VTAILQ_INSERT_HEAD(&lazy_lru, stub, lazy_list);
+	lazy_n++;
+	while (CONFIG->CERT_CACHE_SIZE > 0 &&
+	    lazy_n > (unsigned)CONFIG->CERT_CACHE_SIZE) {
+		lazy_ctx_drop(VTAILQ_LAST(&lazy_lru, sslctx_head));
+		lazy_stats.evictions++;
+	}
+	return (sc);
+}
 #endif /* OPENSSL_NO_TLSEXT */
 
 /* Check that we don't needlessly load a cert that's already loaded. */
@@ -1315,6 +2272,457 @@ find_ctx(const char *file)
 	return (so);
 }
 
+/*
+ * Shared contexts.
+ *
+ * A certificate used by several frontends, or by frontends and as a
+ * global certificate, is only loaded once. The contexts are indexed by
+ * certificate file: another use of the same files with the same TLS
+ * settings gets a context sharing the SSL_CTX of the first one, and
+ * other settings get an SSL_CTX of their own holding the certificates
+ * and private key already decoded.
+ *
+ * A context still shared when it is dropped is freed with the last
+ * context sharing it.
+ */
+struct ctx_src {
+	unsigned		magic;
+#define CTX_SRC_MAGIC		0x3c5a1e27
+	char			*filename;
+	VTAILQ_HEAD(, sslctx_s)	ctxs;
+	UT_hash_handle		hh;
+};
+
+static struct ctx_src *ctx_srcs = NULL;
+
+static void
+ctx_src_add(sslctx *sc)
+{
+	struct ctx_src *cs;
+
+	CHECK_OBJ_NOTNULL(sc, SSLCTX_MAGIC);
+	AZ(sc->src);
+	AZ(sc->shared);
+	AZ(sc->lazy_cf);
+	HASH_FIND_STR(ctx_srcs, sc->filename, cs);
+	if (cs == NULL) {
+		ALLOC_OBJ(cs, CTX_SRC_MAGIC);
+		AN(cs);
+		cs->filename = strdup(sc->filename);
+		AN(cs->filename);
+		VTAILQ_INIT(&cs->ctxs);
+		HASH_ADD_KEYPTR(hh, ctx_srcs, cs->filename,
+		    strlen(cs->filename), cs);
+	}
+	CHECK_OBJ(cs, CTX_SRC_MAGIC);
+	VTAILQ_INSERT_TAIL(&cs->ctxs, sc, src_list);
+	sc->src = cs;
+}
+
+static void
+ctx_src_del(sslctx *sc)
+{
+	struct ctx_src *cs;
+
+	CHECK_OBJ_NOTNULL(sc, SSLCTX_MAGIC);
+	if (sc->src == NULL)
+		return;
+	CAST_OBJ_NOTNULL(cs, sc->src, CTX_SRC_MAGIC);
+	VTAILQ_REMOVE(&cs->ctxs, sc, src_list);
+	sc->src = NULL;
+	if (VTAILQ_EMPTY(&cs->ctxs)) {
+		HASH_DEL(ctx_srcs, cs);
+		free(cs->filename);
+		FREE_OBJ(cs);
+	}
+}
+
+/* Find a context made out of the files of cf, preferably one with the
+ * same settings, in which case *same is set. */
+static sslctx *
+find_ctx_src(const struct cfg_cert_file *cf, const char *settings, int *same)
+{
+	struct ctx_src *cs;
+	sslctx *sc, *src = NULL;
+
+	*same = 0;
+	HASH_FIND_STR(ctx_srcs, cf->filename, cs);
+	if (cs == NULL)
+		return (NULL);
+	CHECK_OBJ(cs, CTX_SRC_MAGIC);
+	VTAILQ_FOREACH(sc, &cs->ctxs, src_list) {
+		CHECK_OBJ_NOTNULL(sc, SSLCTX_MAGIC);
+		if (sc->mtim != cf->mtim ||
+		    (sc->key_fn == NULL) != (cf->priv_key_filename == NULL) ||
+		    (sc->key_fn != NULL &&
+		    strcmp(sc->key_fn, cf->priv_key_filename) != 0))
+			continue;
+		if (strcmp(sc->settings, settings) == 0 &&
+		    sc->staple_vfy == cf->ocsp_vfy &&
+		    !ocsp_cfg_changed(cf, sc)) {
+			*same = 1;
+			return (sc);
+		}
+		if (src == NULL)
+			src = sc;
+	}
+	return (src);
+}
+
+/* A context for cf using the SSL_CTX of src */
+static sslctx *
+share_ctx(sslctx *src, const struct cfg_cert_file *cf)
+{
+	sslctx *sc;
+#ifndef OPENSSL_NO_TLSEXT
+	sni_name *sn;
+	char *servername;
+#endif
+
+	CHECK_OBJ_NOTNULL(src, SSLCTX_MAGIC);
+	AZ(src->shared);
+	ALLOC_OBJ(sc, SSLCTX_MAGIC);
+	AN(sc);
+	sc->filename = strdup(cf->filename);
+	AN(sc->filename);
+	sc->mtim = cf->mtim;
+	sc->staple_vfy = cf->ocsp_vfy;
+	VTAILQ_INIT(&sc->sni_list);
+	AN(SSL_CTX_up_ref(src->ctx));
+	sc->ctx = src->ctx;
+	if (src->x509 != NULL) {
+		AN(X509_up_ref(src->x509));
+		sc->x509 = src->x509;
+	}
+	sc->settings = strdup(src->settings);
+	AN(sc->settings);
+	if (src->key_fn != NULL) {
+		sc->key_fn = strdup(src->key_fn);
+		AN(sc->key_fn);
+	}
+#ifndef OPENSSL_NO_TLSEXT
+	VTAILQ_FOREACH(sn, &src->sni_list, list) {
+		CHECK_OBJ_NOTNULL(sn, SNI_NAME_MAGIC);
+		servername = strdup(sn->servername);
+		AN(servername);
+		push_sni_name(sc, servername);
+	}
+#endif
+	sc->shared = src;
+	src->nshared++;
+	return (sc);
+}
+
+/* Share the context of a certificate already loaded with the settings
+ * of fa. Otherwise *srcp is set to a context holding the certificates
+ * and key to use, if there is one. */
+static sslctx *
+cert_share(const struct cfg_cert_file *cf, const struct front_arg *fa,
+    const sslctx **srcp)
+{
+	sslctx *src;
+	char *settings;
+	int same;
+
+	AN(srcp);
+	*srcp = NULL;
+	if (CONFIG->PMODE == SSL_CLIENT)
+		return (NULL);
+	settings = ctx_settings_str(fa);
+	src = find_ctx_src(cf, settings, &same);
+	free(settings);
+	if (src == NULL)
+		return (NULL);
+	if (same)
+		return (share_ctx(src, cf));
+	*srcp = src;
+	return (NULL);
+}
+
+/* The context holding the OCSP staple of sc, or NULL when it is the
+ * one of a context listed on its own */
+static sslctx *
+staple_ctx(sslctx *sc)
+{
+
+	CHECK_OBJ_NOTNULL(sc, SSLCTX_MAGIC);
+	if (sc->shared == NULL)
+		return (sc);
+	if (sc->shared->dropped)
+		return (sc->shared);
+	return (NULL);
+}
+
+static sslctx *
+make_ctx(const struct cfg_cert_file *cf)
+{
+	const sslctx *src;
+	sslctx *sc;
+
+	sc = cert_share(cf, NULL, &src);
+	if (sc != NULL)
+		return (sc);
+	sc = make_ctx_fr(cf, NULL, src);
+	if (sc != NULL)
+		ctx_src_add(sc);
+	return (sc);
+}
+
+/* Make the context of a global certificate */
+static sslctx *
+make_cert_ctx(const struct cfg_cert_file *cf, int lazy, struct cert_store *cs)
+{
+
+#ifndef OPENSSL_NO_TLSEXT
+	if (lazy)
+		return (make_lazy_ctx(cf, cs));
+#else
+	(void)lazy;
+	(void)cs;
+#endif
+	return (make_ctx_fr(cf, NULL, NULL));
+}
+
+/*
+ * Shared certificate store.
+ *
+ * With cert-store, the lazy certificates loaded by the parent are decoded
+ * into a bundle built in memory, see compile_cert(), and their stubs
+ * refer to its entries instead of holding the contents of their PEM
+ * files. The bundle is mapped shared and read-only before the workers
+ * are forked, so that they all use the same pages, and only build the
+ * OpenSSL objects of the certificates they use. Every load makes its
+ * own store, released with the last stub referring to it.
+ */
+struct cert_store {
+	unsigned		magic;
+#define CERT_STORE_MAGIC	0x5e7c0a2b
+	pthread_mutex_t		mtx;
+	struct cb_writer	*w;
+};
+
+static struct cert_store *
+cert_store_new(struct cb_writer *w)
+{
+	struct cert_store *cs;
+
+	AN(w);
+	ALLOC_OBJ(cs, CERT_STORE_MAGIC);
+	AN(cs);
+	AZ(pthread_mutex_init(&cs->mtx, NULL));
+	cs->w = w;
+	return (cs);
+}
+
+/* The writer must have been closed or mapped */
+static void
+cert_store_free(struct cert_store **csp)
+{
+	struct cert_store *cs;
+
+	AN(csp);
+	cs = *csp;
+	*csp = NULL;
+	CHECK_OBJ_NOTNULL(cs, CERT_STORE_MAGIC);
+	AZ(cs->w);
+	AZ(pthread_mutex_destroy(&cs->mtx));
+	FREE_OBJ(cs);
+}
+
+/*
+ * Parallel certificate loading.
+ *
+ * Building a context is mostly file I/O, decoding and key checks, which
+ * are done by cert-load-threads threads. The callers insert the contexts
+ * in the SNI tables afterwards, in the configuration order.
+ */
+struct cert_load {
+	const struct cfg_cert_file	*cf;
+	const struct front_arg		*fa;
+	int				lazy;
+	struct cert_store		*cs;	/* For lazy, or NULL */
+	const sslctx			*src;	/* See cert_share() */
+	sslctx				*sc;
+	double				t;
+};
+
+struct cert_loader {
+	pthread_mutex_t			mtx;
+	struct cert_load		*cl;
+	unsigned			n;
+	unsigned			next;
+};
+
+static void
+cert_load_one(struct cert_load *cl)
+{
+	double t0;
+
+	if (cl->sc != NULL)
+		return;		/* Shared */
+	t0 = Time_now();
+	if (cl->lazy)
+		cl->sc = make_cert_ctx(cl->cf, 1, cl->cs);
+	else
+		cl->sc = make_ctx_fr(cl->cf, cl->fa, cl->src);
+	cl->t = Time_now() - t0;
+}
+
+static void *
+cert_load_thread(void *priv)
+{
+	struct cert_loader *ldr;
+	unsigned u;
+
+	ldr = priv;
+	for (;;) {
+		AZ(pthread_mutex_lock(&ldr->mtx));
+		u = ldr->next++;
+		AZ(pthread_mutex_unlock(&ldr->mtx));
+		if (u >= ldr->n)
+			break;
+		cert_load_one(&ldr->cl[u]);
+	}
+	return (NULL);
+}
+
+/* Map the store and point the lazy stubs of cl written to it at their
+ * entries. They keep the contents of their PEM files on failure. */
+static void
+cert_store_map(struct cert_store *cs, struct cert_load *cl, unsigned n)
+{
+	struct cfg_cert_file *lcf;
+	struct cert_bundle *cb;
+	unsigned u, nent = 0;
+
+	CHECK_OBJ_NOTNULL(cs, CERT_STORE_MAGIC);
+	cb = CB_Map(&cs->w);
+	if (cb == NULL) {
+		ERR("{core} Unable to map the certificate store: %s\n",
+		    strerror(errno));
+		return;
+	}
+	for (u = 0; u < n; u++) {
+		if (!cl[u].lazy || cl[u].sc == NULL)
+			continue;
+		lcf = cl[u].sc->lazy_cf;
+		CHECK_OBJ_NOTNULL(lcf, CFG_CERT_FILE_MAGIC);
+		if (lcf->bundle != NULL)
+			continue;	/* From cert-bundle */
+		lcf->bundle = CB_Ref(cb);
+		cert_read_ahead_free(lcf);
+		/* The key is in the store too */
+		free(lcf->priv_key_filename);
+		lcf->priv_key_filename = NULL;
+		nent++;
+	}
+	LOGL("{core} Stored %u certificates in %zu bytes of shared memory\n",
+	    nent, CB_Size(cb));
+	CB_Deref(&cb);
+}
+
+/* Load the contexts of an array of certificates. Returns the number of
+ * failures, the contexts of the others are in cl[].sc. */
+static unsigned
+load_certs(struct cert_load *cl, unsigned n)
+{
+	struct cert_loader ldr;
+	struct cert_store *cs = NULL;
+	pthread_t *thr;
+	sigset_t set, oset;
+	unsigned u, nthr, nload, nerr = 0, nshared = 0, slow = 0;
+	double t0, t;
+
+	if (n == 0)
+		return (0);
+
+	/* Only the parent has anything to share with the workers */
+	if (CONFIG->CERT_STORE && getpid() == master_pid) {
+		for (u = 0; u < n; u++)
+			if (cl[u].lazy)
+				break;
+		if (u < n)
+			cs = cert_store_new(CB_Create_Mem());
+	}
+	for (u = 0; u < n; u++)
+		cl[u].cs = cs;
+
+	/* The index of shared contexts is only used by this thread */
+	nload = n;
+	for (u = 0; u < n; u++) {
+		if (cl[u].lazy)
+			continue;
+		cl[u].sc = cert_share(cl[u].cf, cl[u].fa, &cl[u].src);
+		if (cl[u].sc != NULL) {
+			nshared++;
+			nload--;
+		}
+	}
+
+	nthr = CONFIG->CERT_LOAD_THREADS;
+	if (nthr == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthr = ncpu > 0 ? (unsigned)ncpu : 1;
+	}
+	if (nthr > nload)
+		nthr = nload > 0 ? nload : 1;
+
+	t0 = Time_now();
+	memset(&ldr, 0, sizeof ldr);
+	ldr.cl = cl;
+	ldr.n = n;
+	thr = NULL;
+	if (nthr > 1) {
+		thr = calloc(nthr, sizeof *thr);
+		AN(thr);
+		AZ(pthread_mutex_init(&ldr.mtx, NULL));
+		/* Signals are for the main thread */
+		AZ(sigfillset(&set));
+		AZ(pthread_sigmask(SIG_BLOCK, &set, &oset));
+		for (u = 0; u + 1 < nthr; u++)
+			if (pthread_create(&thr[u], NULL, cert_load_thread,
+			    &ldr) != 0)
+				break;
+		AZ(pthread_sigmask(SIG_SETMASK, &oset, NULL));
+		/* This thread is one of the loaders */
+		nthr = u + 1;
+		(void)cert_load_thread(&ldr);
+		for (u = 0; u + 1 < nthr; u++)
+			AZ(pthread_join(thr[u], NULL));
+		AZ(pthread_mutex_destroy(&ldr.mtx));
+		free(thr);
+	} else {
+		for (u = 0; u < n; u++)
+			cert_load_one(&cl[u]);
+	}
+	t = Time_now() - t0;
+
+	if (cs != NULL) {
+		cert_store_map(cs, cl, n);
+		cert_store_free(&cs);
+	}
+
+	for (u = 0; u < n; u++) {
+		if (cl[u].sc == NULL) {
+			nerr++;
+			continue;
+		}
+		if (cl[u].t > cl[slow].t)
+			slow = u;
+		if (!cl[u].lazy && cl[u].sc->shared == NULL)
+			ctx_src_add(cl[u].sc);
+	}
+	if (nload > 0)
+		LOGL("{core} Loaded %u certificates in %.3fs with %u threads, "
+		    "%.2fms per certificate, slowest %.2fms (%s)\n",
+		    nload - nerr, t, nthr, 1e3 * t / nload, 1e3 * cl[slow].t,
+		    cl[slow].cf->filename);
+	if (nshared > 0)
+		LOGL("{core} Shared %u certificates already loaded\n",
+		    nshared);
+	return (nerr);
+}
+
 /* Init library and load specified certificate.
  * Establishes a SSL_ctx, to act as a template for
  * each connection */
@@ -1345,11 +2753,61 @@ init_openssl(void)
 			ENGINE_free(e);
 		}
 	}
+
+	if (HOCSP_init() != 0) {
+		log_ssl_error(NULL, "{core} Unable to set up OCSP stapling");
+		exit(1);
+	}
 }
 
+#ifdef USE_SHARED_CACHE
+/* The secret of the cache updates, out of the private key of the
+ * default certificate, or else of the first one. The peers share it.
+ * Set once by the master, before any context is made: a reload keeps
+ * it. */
+static void
+shared_secret_init(void)
+{
+	struct front_arg *fa, *fatmp;
+	struct cfg_cert_file *cf;
+	struct pem_objs po;
+	EVP_PKEY *pkey;
+
+	if (!CONFIG->SHARED_CACHE || CONFIG->SHCUPD_PORT == NULL)
+		return;
+	cf = CONFIG->CERT_DEFAULT != NULL ? CONFIG->CERT_DEFAULT :
+	    CONFIG->CERT_FILES;
+	HASH_ITER(hh, CONFIG->LISTEN_ARGS, fa, fatmp) {
+		if (cf == NULL)
+			cf = fa->certs;
+	}
+	if (cf == NULL)
+		return;
+	CHECK_OBJ_NOTNULL(cf, CFG_CERT_FILE_MAGIC);
+
+	if (cf->priv_key_filename != NULL) {
+		pkey = load_privatekey(NULL, cf->priv_key_filename,
+		    cf->key_pem, cf->key_pem_len);
+	} else if (cert_objs_load(&po, cf, NULL, PO_KEY) == 0) {
+		pkey = po.pkey;
+		po.pkey = NULL;
+		pem_objs_free(&po);
+	} else
+		pkey = NULL;
+	if (pkey == NULL || compute_secret(pkey, shared_secret) < 0) {
+		ERR("Unable to compute shared secret from %s.\n",
+		    cf->filename);
+		exit(1);
+	}
+	EVP_PKEY_free(pkey);
+}
+#endif
+
 static void
 init_certs(void) {
 	struct cfg_cert_file *cf, *cftmp;
+	struct cert_load *cl;
+	unsigned u, n;
 	sslctx *so;
 
 	if (CONFIG->CERT_DEFAULT != NULL) {
@@ -1364,18 +2822,217 @@ init_certs(void) {
 	// Go through the list of PEMs and make some SSL contexts for
 	// them. We also keep track of the names associated with each
 	// cert so we can do SNI on them later
+	cl = calloc(HASH_COUNT(CONFIG->CERT_FILES) + 1, sizeof *cl);
+	AN(cl);
+	n = 0;
 	HASH_ITER(hh, CONFIG->CERT_FILES, cf, cftmp) {
 		if (find_ctx(cf->filename) == NULL) {
-			so = make_ctx(cf);
-			if (so == NULL)
-				exit(1);
-			HASH_ADD_KEYPTR(hh, ssl_ctxs, so->filename,
-			    strlen(so->filename), so);
+			cl[n].cf = cf;
+			cl[n].lazy = CONFIG->LAZY_CERTS;
+			n++;
+		}
+	}
+	if (load_certs(cl, n) != 0)
+		exit(1);
+	for (u = 0; u < n; u++) {
+		so = cl[u].sc;
+		HASH_ADD_KEYPTR(hh, ssl_ctxs, so->filename,
+		    strlen(so->filename), so);
 #ifndef OPENSSL_NO_TLSEXT
-			insert_sni_names(so, &sni_names);
+		insert_sni_names(so, &sni_names);
 #endif
+	}
+	free(cl);
+}
+
+/*
+ * Precompiled certificates.
+ *
+ * --compile-certs loads the global certificates of the configuration
+ * once, and writes their DER chains and keys along with their names to
+ * a bundle that cert-bundle maps at startup, see cert_bundle.c.
+ *
+ * The names are found with so if set, and kept in it. The index of the
+ * entry written is returned in idx if set.
+ */
+static int
+compile_cert(struct cert_store *cs, const struct cfg_cert_file *cf,
+    unsigned flags, sslctx *so, unsigned *idx)
+{
+	struct pem_objs po;
+	struct cb_entry e;
+	unsigned char **der = NULL;
+	unsigned char *key = NULL;
+	const char **names = NULL;
+	sslctx *sc = NULL;
+	sni_name *sn;
+	BIO *bio = NULL;
+	char *p;
+	unsigned u;
+	int i, r = -1;
+
+	memset(&e, 0, sizeof e);
+	if (cert_objs_load(&po, cf, NULL, PO_CERTS | PO_DH |
+	    (cf->priv_key_filename == NULL ? PO_KEY : 0)) != 0)
+		return (-1);
+	if (po.x509 == NULL) {
+		ERR("Could not read certificate '%s'\n", cf->filename);
+		goto out;
+	}
+	if (cf->priv_key_filename != NULL)
+		po.pkey = load_privatekey(NULL, cf->priv_key_filename,
+		    cf->key_pem, cf->key_pem_len);
+	if (po.pkey == NULL) {
+		ERR("Error loading private key (%s)\n",
+		    cf->priv_key_filename != NULL ?
+		    cf->priv_key_filename : cf->filename);
+		goto out;
+	}
+
+	if (so != NULL)
+		sc = so;
+	else {
+		ALLOC_OBJ(sc, SSLCTX_MAGIC);
+		AN(sc);
+		sc->filename = strdup(cf->filename);
+		AN(sc->filename);
+		VTAILQ_INIT(&sc->sni_list);
+	}
+	sc->x509 = po.x509;
+#ifndef OPENSSL_NO_TLSEXT
+	i = cf->bundle != NULL ? load_bundle_names(sc, cf) : load_cert_ctx(sc);
+	sc->x509 = NULL;
+	if (i != 0)
+		goto out;
+#else
+	sc->x509 = NULL;
+#endif
+	VTAILQ_FOREACH(sn, &sc->sni_list, list)
+		e.nnames++;
+	names = calloc(e.nnames + 1, sizeof *names);
+	AN(names);
+	u = 0;
+	VTAILQ_FOREACH(sn, &sc->sni_list, list)
+		names[u++] = sn->servername;
+	e.names = names;
+
+	e.ncerts = 1;
+	if (po.chain != NULL)
+		e.ncerts += sk_X509_num(po.chain);
+	der = calloc(e.ncerts, sizeof *der);
+	e.certs = calloc(e.ncerts, sizeof *e.certs);
+	AN(der);
+	AN(e.certs);
+	for (u = 0; u < e.ncerts; u++) {
+		i = i2d_X509(u == 0 ? po.x509 :
+		    sk_X509_value(po.chain, u - 1), &der[u]);
+		if (i <= 0) {
+			log_ssl_error(NULL, "{core} Error encoding %s",
+			    cf->filename);
+			goto out;
+		}
+		e.certs[u].ptr = der[u];
+		e.certs[u].len = i;
+	}
+	i = i2d_PrivateKey(po.pkey, &key);
+	if (i <= 0) {
+		log_ssl_error(NULL, "{core} Error encoding the key of %s",
+		    cf->filename);
+		goto out;
+	}
+	e.key.ptr = key;
+	e.key.len = i;
+
+#ifndef OPENSSL_NO_DH
+	if (po.dh != NULL) {
+		bio = BIO_new(BIO_s_mem());
+		AN(bio);
+		if ((DH_get0_q(po.dh) != NULL ?
+		    PEM_write_bio_DHxparams(bio, po.dh) :
+		    PEM_write_bio_DHparams(bio, po.dh)) != 1) {
+			log_ssl_error(NULL, "{core} Error encoding the DH"
+			    " parameters of %s", cf->filename);
+			goto out;
 		}
+		e.dh.len = BIO_get_mem_data(bio, &p);
+		e.dh.ptr = p;
 	}
+#endif
+
+	e.filename = cf->filename;
+	e.ocspfn = cf->ocspfn;
+	e.mtim = cf->mtim;
+	e.ocsp_vfy = cf->ocsp_vfy;
+	e.flags = flags;
+	CHECK_OBJ_NOTNULL(cs, CERT_STORE_MAGIC);
+	AZ(pthread_mutex_lock(&cs->mtx));
+	if (idx != NULL)
+		*idx = CB_Entries(cs->w);
+	r = CB_Write(cs->w, &e);
+	AZ(pthread_mutex_unlock(&cs->mtx));
+	if (r != 0)
+		ERR("{core} Unable to write %s: %s\n", cf->filename,
+		    strerror(errno));
+
+out:
+	if (der != NULL)
+		for (u = 0; u < e.ncerts; u++)
+			OPENSSL_free(der[u]);
+	free(der);
+	free(e.certs);
+	free(names);
+	OPENSSL_free(key);
+	BIO_free(bio);
+	if (sc != so)
+		sctx_free(sc, NULL);
+	pem_objs_free(&po);
+	return (r);
+}
+
+static int
+compile_certs(const char *path)
+{
+	struct cfg_cert_file *cf, *cftmp;
+	struct front_arg *fa, *fatmp;
+	struct cert_store *cs;
+	struct cb_writer *w;
+	unsigned n = 0;
+	int r = 0;
+
+	w = CB_Create(path);
+	if (w == NULL) {
+		ERR("{core} Unable to create %s: %s\n", path,
+		    strerror(errno));
+		return (1);
+	}
+	cs = cert_store_new(w);
+	if (CONFIG->CERT_DEFAULT != NULL) {
+		r = compile_cert(cs, CONFIG->CERT_DEFAULT, CB_DEFAULT, NULL,
+		    NULL);
+		n++;
+	}
+	HASH_ITER(hh, CONFIG->CERT_FILES, cf, cftmp) {
+		if (r != 0)
+			break;
+		r = compile_cert(cs, cf, 0, NULL, NULL);
+		n++;
+	}
+	HASH_ITER(hh, CONFIG->LISTEN_ARGS, fa, fatmp) {
+		if (HASH_CNT(hh, fa->certs) > 0)
+			ERR("{core} Warning: the certificates of frontend"
+			    " '%s' are not compiled\n", fa->pspec);
+	}
+	if (CB_Close(&cs->w, r == 0) != 0) {
+		ERR("{core} Unable to write %s: %s\n", path,
+		    strerror(errno));
+		cert_store_free(&cs);
+		return (1);
+	}
+	cert_store_free(&cs);
+	if (r != 0)
+		return (1);
+	fprintf(stderr, "Compiled %u certificates into %s\n", n, path);
+	return (0);
 }
 
 static void
@@ -1408,6 +3065,9 @@ destroy_frontend(struct frontend *fr)
 	}
 
 	AZ(HASH_COUNT(fr->sni_names));
+#ifndef OPENSSL_NO_TLSEXT
+	sni_index_free(&fr->sni_idx);
+#endif
 	FREE_OBJ(fr);
 }
 
@@ -1595,6 +3255,8 @@ create_frontend(const struct front_arg *fa)
 	int count = 0;
 	struct frontend_head tmp_list;
 	struct cfg_cert_file *cf;
+	struct cert_load *cl;
+	unsigned u, n;
 
 	CHECK_OBJ_NOTNULL(fa, FRONT_ARG_MAGIC);
 	ALLOC_OBJ(fr, FRONTEND_MAGIC);
@@ -1612,20 +3274,31 @@ create_frontend(const struct front_arg *fa)
 		return (NULL);
 	}
 
-	for (cf = fa->certs; cf != NULL; cf = cf->hh.next) {
-		so = make_ctx_fr(cf, fr, fa);
-		if (so == NULL) {
-			destroy_frontend(fr);
-			return (NULL);
-		}
+	n = HASH_COUNT(fa->certs);
+	cl = calloc(n + 1, sizeof *cl);
+	AN(cl);
+	for (u = 0, cf = fa->certs; cf != NULL; u++, cf = cf->hh.next) {
+		cl[u].cf = cf;
+		cl[u].fa = fa;
+	}
+	if (load_certs(cl, n) != 0) {
+		for (u = 0; u < n; u++)
+			sctx_free(cl[u].sc, NULL);
+		free(cl);
+		destroy_frontend(fr);
+		return (NULL);
+	}
+	for (u = 0; u < n; u++) {
+		so = cl[u].sc;
 		HASH_ADD_KEYPTR(hh, fr->ssl_ctxs,
 		    so->filename, strlen(so->filename), so);
 #ifndef OPENSSL_NO_TLSEXT
 		insert_sni_names(so, &fr->sni_names);
 #endif
-		if (cf->hh.next == NULL)
+		if (u == n - 1)
 			fr->default_ctx = so;
 	}
+	free(cl);
 
 	return (fr);
 }
@@ -1707,26 +3380,164 @@ create_back_socket(struct backend *b)
 	return (s);
 }
 
+static void uring_clear_read(proxystate *ps);
+static void uring_clear_write(proxystate *ps);
+
 /* Only enable a libev ev_io event if the proxied connection still
  * has both up and down connected */
 static void
 safe_enable_io(proxystate *ps, ev_io *w)
 {
 	CHECK_OBJ_NOTNULL(ps, PROXYSTATE_MAGIC);
-	if (!ps->want_shutdown)
+	if (ps->want_shutdown)
+		return;
+	if (ps->uring && w == &ps->ev_r_clear)
+		uring_clear_read(ps);
+	else if (ps->uring && w == &ps->ev_w_clear)
+		uring_clear_write(ps);
+	else
 		ev_io_start(loop, w);
 }
 
+/* Write out data a read handler just buffered. Instead of arming the
+ * write watcher and waiting for the next loop iteration, the write
+ * handler runs right away. If it drains the ring it stops the watcher
+ * again before libev syncs the fd with the kernel, so EV_WRITE only
+ * gets registered when the socket is actually full. The write handler
+ * may free ps, so this has to be the caller's last use of it. */
+static void
+flush_io(proxystate *ps, ev_io *w, ringbuffer *rb)
+{
+	CHECK_OBJ_NOTNULL(ps, PROXYSTATE_MAGIC);
+	if (ps->want_shutdown || ev_is_active(w) || ringbuffer_is_empty(rb))
+		return;
+	if (ps->uring && w == &ps->ev_w_clear) {
+		/* Queued, the send goes out with the next submission */
+		uring_clear_write(ps);
+		return;
+	}
+	ev_io_start(loop, w);
+	ev_invoke(loop, w, EV_WRITE);
+}
+
+/* Log the counters collected over the lifetime of a worker */
+static void
+worker_log_stats(void)
+{
+	struct hssl_ticket_stats tst;
+
+	/* Only workers have a ring pool */
+	if (ring_pool == NULL)
+		return;
+	CHECK_OBJ(ring_pool, RINGPOOL_MAGIC);
+	LOGL("Worker %d (gen: %d) I/O: %u loop iterations, "
+	    "%ju read events, %ju read calls, "
+	    "%ju write events, %ju write calls\n", core_id, worker_gen,
+	    ev_iteration(loop),
+	    (uintmax_t)worker_stats.read_events,
+	    (uintmax_t)worker_stats.read_calls,
+	    (uintmax_t)worker_stats.write_events,
+	    (uintmax_t)worker_stats.write_calls);
+	LOGL("Worker %d (gen: %d) accept: %ju clients in %ju wakeups, "
+	    "%.2f per wakeup, %u max\n", core_id, worker_gen,
+	    (uintmax_t)worker_stats.accepts,
+	    (uintmax_t)worker_stats.accept_wakeups,
+	    worker_stats.accept_wakeups == 0 ? 0. :
+	    (double)worker_stats.accepts / worker_stats.accept_wakeups,
+	    worker_stats.accept_max);
+	LOGL("Worker %d (gen: %d) ring pool: %ju hits, %ju misses, "
+	    "%ju drops, %u blocks retained\n", core_id, worker_gen,
+	    (uintmax_t)ring_pool->hits, (uintmax_t)ring_pool->misses,
+	    (uintmax_t)ring_pool->drops,
+	    ring_pool->n_free_data + ring_pool->n_free_slots);
+	if (URING_Active()) {
+		struct uring_stats ust;
+
+		URING_Stats(&ust);
+		LOGL("Worker %d (gen: %d) io_uring: %ju submissions in "
+		    "%ju system calls, %ju completions, %ju receives "
+		    "without a buffer\n", core_id, worker_gen,
+		    (uintmax_t)ust.sqes, (uintmax_t)ust.submits,
+		    (uintmax_t)ust.cqes, (uintmax_t)ust.nobufs);
+	}
+	if (HSSL_Async_Active())
+		LOGL("Worker %d (gen: %d) async sign: %ju private key "
+		    "operations offloaded\n", core_id, worker_gen,
+		    (uintmax_t)HSSL_Async_Jobs());
+#ifndef OPENSSL_NO_TLSEXT
+	if (CONFIG->LAZY_CERTS)
+		LOGL("Worker %d (gen: %d) lazy certs: %ju hits, %ju loads, "
+		    "%ju evictions, %ju failures, %u loaded\n", core_id,
+		    worker_gen, (uintmax_t)lazy_stats.hits,
+		    (uintmax_t)lazy_stats.loads,
+		    (uintmax_t)lazy_stats.evictions,
+		    (uintmax_t)lazy_stats.failures, lazy_n);
+#endif
+	HSSL_Tickets_Stats(&tst);
+	LOGL("Worker %d (gen: %d) tickets: %ju issued, %ju resumed, "
+	    "%ju renewed, %ju unknown keys\n", core_id, worker_gen,
+	    (uintmax_t)tst.issued, (uintmax_t)tst.resumed,
+	    (uintmax_t)tst.renewed, (uintmax_t)tst.unknown);
+#ifdef USE_SHARED_CACHE
+	if (CONFIG->SHCUPD_PORT && *shcupd_peers != NULL)
+		LOGL("Worker %d (gen: %d) session replication: %ju sessions "
+		    "sent in %ju datagrams, %ju send errors\n", core_id,
+		    worker_gen, (uintmax_t)shcupd_stats.sent_sessions,
+		    (uintmax_t)shcupd_stats.sent_dgrams,
+		    (uintmax_t)shcupd_stats.send_errors);
+	if (CONFIG->SHARED_CACHE) {
+		struct shctx_l1_stats st;
+
+		shared_context_l1_stats(&st);
+		LOGL("Worker %d (gen: %d) session cache: %ju lookups, "
+		    "%ju served locally, %ju stale\n", core_id, worker_gen,
+		    (uintmax_t)st.lookups, (uintmax_t)st.hits,
+		    (uintmax_t)st.stale);
+	}
+#endif
+}
+
 static void
 check_exit_state(void)
 {
 	if (worker_state == WORKER_EXITING && n_conns == 0) {
 		LOGL("Worker %d (gen: %d) in state EXITING "
 		    "is now exiting.\n", core_id, worker_gen);
+		worker_log_stats();
 		_exit(0);
 	}
 }
 
+#ifdef HAVE_KTLS
+static int
+splice_pipe_open(struct splice_pipe *sp)
+{
+	AZ(sp->cap);
+	if (pipe2(sp->fd, O_NONBLOCK | O_CLOEXEC) != 0)
+		return (-1);
+	sp->cap = fcntl(sp->fd[0], F_GETPIPE_SZ);
+	if (sp->cap <= 0) {
+		(void)close(sp->fd[0]);
+		(void)close(sp->fd[1]);
+		sp->cap = 0;
+		return (-1);
+	}
+	sp->len = 0;
+	return (0);
+}
+
+static void
+splice_pipe_close(struct splice_pipe *sp)
+{
+	if (sp->cap == 0)
+		return;
+	(void)close(sp->fd[0]);
+	(void)close(sp->fd[1]);
+	sp->cap = 0;
+	sp->len = 0;
+}
+#endif
+
 /* Only enable a libev ev_io event if the proxied connection still
  * has both up and down connected */
 static void
@@ -1734,17 +3545,36 @@ shutdown_proxy(proxystate *ps, SHUTDOWN_REQUESTOR req)
 {
 	CHECK_OBJ_NOTNULL(ps, PROXYSTATE_MAGIC);
 	LOGPROXY(ps, "proxy shutdown req=%s\n", SHUTDOWN_STR[req]);
+	if (ps->async_pending) {
+		/* The paused handshake job still runs on our SSL, tear
+		 * down once handshake_resume() has it back. */
+		ev_io_stop(loop, &ps->ev_w_ssl);
+		ev_io_stop(loop, &ps->ev_r_ssl);
+		ev_timer_stop(loop, &ps->ev_t_handshake);
+		ev_timer_stop(loop, &ps->ev_t_connect);
+		ev_io_stop(loop, &ps->ev_w_clear);
+		ev_io_stop(loop, &ps->ev_r_clear);
+		ps->async_shutdown = 1;
+		return;
+	}
 	if (ps->want_shutdown || req == SHUTDOWN_HARD) {
 		ev_io_stop(loop, &ps->ev_w_ssl);
 		ev_io_stop(loop, &ps->ev_r_ssl);
-		ev_io_stop(loop, &ps->ev_w_handshake);
-		ev_io_stop(loop, &ps->ev_r_handshake);
 		ev_timer_stop(loop, &ps->ev_t_handshake);
-		ev_io_stop(loop, &ps->ev_w_connect);
 		ev_timer_stop(loop, &ps->ev_t_connect);
 		ev_io_stop(loop, &ps->ev_w_clear);
 		ev_io_stop(loop, &ps->ev_r_clear);
-		ev_io_stop(loop, &ps->ev_proxy);
+		if (ps->uring_rd.pending || ps->uring_wr.pending) {
+			/* The ring still uses our socket and buffers, tear
+			 * down once the cancelled operations are back. */
+			if (!ps->uring_shutdown) {
+				URING_Cancel(&ps->uring_rd);
+				URING_Cancel(&ps->uring_wr);
+			}
+			ps->want_shutdown = 1;
+			ps->uring_shutdown = 1;
+			return;
+		}
 
 		(void)SSL_shutdown(ps->ssl);
 
@@ -1757,6 +3587,10 @@ shutdown_proxy(proxystate *ps, SHUTDOWN_REQUESTOR req)
 
 		ringbuffer_cleanup(&ps->ring_clear2ssl);
 		ringbuffer_cleanup(&ps->ring_ssl2clear);
+#ifdef HAVE_KTLS
+		splice_pipe_close(&ps->pipe_clear2ssl);
+		splice_pipe_close(&ps->pipe_ssl2clear);
+#endif
 		free(ps);
 
 		n_conns--;
@@ -1765,10 +3599,12 @@ shutdown_proxy(proxystate *ps, SHUTDOWN_REQUESTOR req)
 	else {
 		ps->want_shutdown = 1;
 		if (req == SHUTDOWN_CLEAR &&
-		    ringbuffer_is_empty(&ps->ring_clear2ssl))
+		    ringbuffer_is_empty(&ps->ring_clear2ssl) &&
+		    ps->pipe_clear2ssl.len == 0)
 			shutdown_proxy(ps, SHUTDOWN_HARD);
 		else if (req == SHUTDOWN_SSL &&
-		    ringbuffer_is_empty(&ps->ring_ssl2clear))
+		    ringbuffer_is_empty(&ps->ring_ssl2clear) &&
+		    ps->pipe_ssl2clear.len == 0)
 			shutdown_proxy(ps, SHUTDOWN_HARD);
 	}
 }
@@ -1788,6 +3624,244 @@ handle_socket_errno(proxystate *ps, int backend)
 	shutdown_proxy(ps, SHUTDOWN_CLEAR);
 }
 
+#ifdef HAVE_KTLS
+/*
+ * Kernel TLS. When OpenSSL managed to hand the session keys over to the
+ * kernel, data is moved between the two sockets with splice(2) through
+ * a pipe and never enters userspace. Each direction switches over on
+ * its own, once its ring buffer has drained. The pipe then plays the
+ * part of the ring buffer.
+ */
+
+static void ssl_read(struct ev_loop *loop, ev_io *w, int revents);
+static void clear_write(struct ev_loop *loop, ev_io *w, int revents);
+
+/* The type of the next record the kernel holds, and the first bytes of
+ * its contents. Returns -1 if there is none, with errno set. */
+static int
+ktls_record_peek(int fd, unsigned char *buf, size_t len)
+{
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+
+	memset(&msg, 0, sizeof msg);
+	memset(buf, 0, len);
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof cbuf;
+	if (recvmsg(fd, &msg, MSG_PEEK | MSG_DONTWAIT) < 0)
+		return (-1);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_TLS ||
+	    cmsg->cmsg_type != TLS_GET_RECORD_TYPE) {
+		errno = EPROTO;
+		return (-1);
+	}
+	return (*(unsigned char *)CMSG_DATA(cmsg));
+}
+
+/* Hand the ssl to clear direction back to SSL_read(), for a record the
+ * kernel does not splice. The pipe drains to the backend first. */
+static void
+ktls_ssl2clear_unsplice(proxystate *ps)
+{
+	CHECK_OBJ_NOTNULL(ps, PROXYSTATE_MAGIC);
+	ps->ktls_rx_hold = 1;
+	ev_io_stop(loop, &ps->ev_r_ssl);
+	if (ps->pipe_ssl2clear.len > 0)
+		return;	/* See ktls_splice_out() */
+	LOGPROXY(ps, "kTLS reading ssl through OpenSSL\n");
+	splice_pipe_close(&ps->pipe_ssl2clear);
+	ev_io_stop(loop, &ps->ev_w_clear);
+	ev_set_cb(&ps->ev_r_ssl, ssl_read);
+	ev_set_cb(&ps->ev_w_clear, clear_write);
+	safe_enable_io(ps, &ps->ev_r_ssl);
+}
+
+static void
+ktls_splice_in(proxystate *ps, struct splice_pipe *sp, ev_io *r, ev_io *w,
+    SHUTDOWN_REQUESTOR req)
+{
+	unsigned char alert[2];
+	ssize_t t;
+	int i;
+
+	t = splice(r->fd, NULL, sp->fd[1], NULL, sp->cap - sp->len,
+	    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (t > 0) {
+		sp->len += t;
+		if (sp->len == sp->cap)
+			ev_io_stop(loop, r);
+		safe_enable_io(ps, w);
+		return;
+	} else if (t == 0) {
+		LOGPROXY(ps, "Connection closed by %s\n",
+		    r->fd == ps->fd_down ? "backend" : "client");
+		shutdown_proxy(ps, req);
+		return;
+	} else if (req != SHUTDOWN_SSL || (errno != EINVAL && errno != EIO)) {
+		handle_socket_errno(ps, r->fd == ps->fd_down ? 1 : 0);
+		return;
+	}
+
+	/* The kernel does not splice non-data records: an alert, or a
+	 * post-handshake message such as a session ticket or a key
+	 * update. OpenSSL deals with all but a close_notify. */
+	i = ktls_record_peek(r->fd, alert, sizeof alert);
+	if (i == SSL3_RT_ALERT && alert[1] == SSL3_AD_CLOSE_NOTIFY) {
+		LOGPROXY(ps, "kTLS close_notify, closing\n");
+		shutdown_proxy(ps, SHUTDOWN_SSL);
+	} else if (i > 0 && i != SSL3_RT_APPLICATION_DATA) {
+		LOGPROXY(ps, "kTLS record type %d\n", i);
+		ktls_ssl2clear_unsplice(ps);
+	} else {
+		if (i >= 0)
+			errno = EPROTO;
+		handle_socket_errno(ps, r->fd == ps->fd_down ? 1 : 0);
+	}
+}
+
+static void
+ktls_splice_out(proxystate *ps, struct splice_pipe *sp, ev_io *r, ev_io *w)
+{
+	ssize_t t;
+
+	assert(sp->len > 0);
+	t = splice(sp->fd[0], NULL, w->fd, NULL, sp->len,
+	    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (t > 0) {
+		sp->len -= t;
+		safe_enable_io(ps, r);
+		if (sp->len == 0) {
+			if (ps->want_shutdown) {
+				shutdown_proxy(ps, SHUTDOWN_HARD);
+				return; // dealloc'd
+			}
+			ev_io_stop(loop, w);
+			if (sp == &ps->pipe_ssl2clear && ps->ktls_rx_hold)
+				ktls_ssl2clear_unsplice(ps);
+		}
+	} else {
+		assert(t == -1);
+		handle_socket_errno(ps, w->fd == ps->fd_down ? 1 : 0);
+	}
+}
+
+static void
+ktls_clear2ssl_read(struct ev_loop *loop, ev_io *w, int revents)
+{
+	proxystate *ps;
+
+	(void)revents;
+	CAST_OBJ_NOTNULL(ps, w->data, PROXYSTATE_MAGIC);
+	if (ps->want_shutdown) {
+		ev_io_stop(loop, &ps->ev_r_clear);
+		return;
+	}
+	ktls_splice_in(ps, &ps->pipe_clear2ssl, &ps->ev_r_clear,
+	    &ps->ev_w_ssl, SHUTDOWN_CLEAR);
+}
+
+static void
+ktls_clear2ssl_write(struct ev_loop *loop, ev_io *w, int revents)
+{
+	proxystate *ps;
+
+	(void)loop;
+	(void)revents;
+	CAST_OBJ_NOTNULL(ps, w->data, PROXYSTATE_MAGIC);
+	ktls_splice_out(ps, &ps->pipe_clear2ssl, &ps->ev_r_clear,
+	    &ps->ev_w_ssl);
+}
+
+static void
+ktls_ssl2clear_read(struct ev_loop *loop, ev_io *w, int revents)
+{
+	proxystate *ps;
+
+	(void)revents;
+	CAST_OBJ_NOTNULL(ps, w->data, PROXYSTATE_MAGIC);
+	if (ps->want_shutdown || ps->ktls_rx_hold) {
+		ev_io_stop(loop, &ps->ev_r_ssl);
+		return;
+	}
+	ktls_splice_in(ps, &ps->pipe_ssl2clear, &ps->ev_r_ssl,
+	    &ps->ev_w_clear, SHUTDOWN_SSL);
+}
+
+static void
+ktls_ssl2clear_write(struct ev_loop *loop, ev_io *w, int revents)
+{
+	proxystate *ps;
+
+	(void)loop;
+	(void)revents;
+	CAST_OBJ_NOTNULL(ps, w->data, PROXYSTATE_MAGIC);
+	ktls_splice_out(ps, &ps->pipe_ssl2clear, &ps->ev_r_ssl,
+	    &ps->ev_w_clear);
+}
+
+/* Move the clear to ssl direction over to splicing, if possible */
+static int
+ktls_try_clear2ssl(proxystate *ps)
+{
+	CHECK_OBJ_NOTNULL(ps, PROXYSTATE_MAGIC);
+	if (!ps->ktls_tx || !ps->handshaked ||
+	    !ringbuffer_is_empty(&ps->ring_clear2ssl))
+		return (0);
+	if (splice_pipe_open(&ps->pipe_clear2ssl) != 0) {
+		ERRPROXY(ps, "kTLS pipe: %s\n", strerror(errno));
+		ps->ktls_tx = 0;
+		return (0);
+	}
+	LOGPROXY(ps, "kTLS splicing clear to ssl\n");
+	ev_set_cb(&ps->ev_r_clear, ktls_clear2ssl_read);
+	ev_set_cb(&ps->ev_w_ssl, ktls_clear2ssl_write);
+	return (1);
+}
+
+/* Move the ssl to clear direction over to splicing, if possible. Any
+ * record OpenSSL already read must be drained through the ring first. */
+static int
+ktls_try_ssl2clear(proxystate *ps)
+{
+	CHECK_OBJ_NOTNULL(ps, PROXYSTATE_MAGIC);
+	if (!ps->ktls_rx || ps->ktls_rx_hold || !ps->handshaked ||
+	    !ps->clear_connected ||
+	    !ringbuffer_is_empty(&ps->ring_ssl2clear) ||
+	    SSL_has_pending(ps->ssl))
+		return (0);
+	if (splice_pipe_open(&ps->pipe_ssl2clear) != 0) {
+		ERRPROXY(ps, "kTLS pipe: %s\n", strerror(errno));
+		ps->ktls_rx = 0;
+		return (0);
+	}
+	LOGPROXY(ps, "kTLS splicing ssl to clear\n");
+	ev_set_cb(&ps->ev_r_ssl, ktls_ssl2clear_read);
+	ev_set_cb(&ps->ev_w_clear, ktls_ssl2clear_write);
+	return (1);
+}
+#endif
+
+static void handle_connect(struct ev_loop *loop, ev_io *w, int revents);
+
+/* The backend connect is watched by the write watcher of fd_down,
+ * which is the clear side in server mode and the ssl side in client
+ * mode. */
+static ev_io *
+connect_watcher(proxystate *ps)
+{
+	if (ps->ev_w_clear.fd == ps->fd_down)
+		return (&ps->ev_w_clear);
+	assert(ps->ev_w_ssl.fd == ps->fd_down);
+	return (&ps->ev_w_ssl);
+}
+
 /* Start connect to backend */
 static int
 start_connect(proxystate *ps)
@@ -1801,9 +3875,11 @@ start_connect(proxystate *ps)
 	addr = VSA_Get_Sockaddr(ps->backend->backaddr, &len);
 	AN(addr);
 
+	ps->connect_started = 1;
 	t = connect(ps->fd_down, addr, len);
 	if (t == 0 || errno == EINPROGRESS || errno == EINTR) {
-		ev_io_start(loop, &ps->ev_w_connect);
+		ev_set_cb(connect_watcher(ps), handle_connect);
+		ev_io_start(loop, connect_watcher(ps));
 		ev_timer_start(loop, &ps->ev_t_connect);
 		return (0);
 	}
@@ -1828,60 +3904,104 @@ clear_read(struct ev_loop *loop, ev_io *w, int revents)
 		ev_io_stop(loop, &ps->ev_r_clear);
 		return;
 	}
+#ifdef HAVE_KTLS
+	if (ktls_try_clear2ssl(ps)) {
+		ktls_clear2ssl_read(loop, w, revents);
+		return;
+	}
+#endif
 	int fd = w->fd;
-	char *buf = ringbuffer_write_ptr(&ps->ring_clear2ssl);
-	t = recv(fd, buf, ps->ring_clear2ssl.data_len, 0);
+	int got = 0;
+
+	worker_stats.read_events++;
+	/* Keep reading until the socket is drained, the ring is full or
+	 * the read budget for this event is spent. A short read means
+	 * the socket is drained. */
+	do {
+		char *buf = ringbuffer_write_ptr(&ps->ring_clear2ssl);
+		t = recv(fd, buf, ps->ring_clear2ssl.data_len, 0);
+		worker_stats.read_calls++;
+		if (t <= 0)
+			break;
+		ringbuffer_write_append(&ps->ring_clear2ssl, t);
+		got += t;
+		if (ringbuffer_is_full(&ps->ring_clear2ssl)) {
+			ev_io_stop(loop, &ps->ev_r_clear);
+			break;
+		}
+	} while (t == ps->ring_clear2ssl.data_len &&
+	    got < CONFIG->READ_BUDGET);
 
 	if (t > 0) {
-		ringbuffer_write_append(&ps->ring_clear2ssl, t);
-		if (ringbuffer_is_full(&ps->ring_clear2ssl))
+		if (ps->handshaked)
+			flush_io(ps, &ps->ev_w_ssl, &ps->ring_clear2ssl);
+		return;
+	}
+	if (t == -1 &&
+	    (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		/* Don't keep the tail block if nothing was read */
+		ringbuffer_release(&ps->ring_clear2ssl);
+		if (ps->uring) {
+			/* Drained, io_uring takes over again */
 			ev_io_stop(loop, &ps->ev_r_clear);
+			uring_clear_read(ps);
+		}
 		if (ps->handshaked)
-			safe_enable_io(ps, &ps->ev_w_ssl);
+			flush_io(ps, &ps->ev_w_ssl, &ps->ring_clear2ssl);
+		return;
 	}
-	else if (t == 0) {
+
+	/* Data read before the connection went away still goes out */
+	int err = errno;
+	if (ps->handshaked && !ringbuffer_is_empty(&ps->ring_clear2ssl))
+		safe_enable_io(ps, &ps->ev_w_ssl);
+	if (t == 0) {
 		LOGPROXY(ps,"Connection closed by %s\n",
 		    fd == ps->fd_down ? "backend" : "client");
 		shutdown_proxy(ps, SHUTDOWN_CLEAR);
-	}
-	else {
+	} else {
 		assert(t == -1);
+		errno = err;
 		handle_socket_errno(ps, fd == ps->fd_down ? 1 : 0);
 	}
 }
 
 
 /* Write some data, previously received on the secure upstream socket,
- * out of the downstream buffer and onto the backend socket */
+ * out of the downstream buffer and onto the backend socket. All used
+ * slots are handed to the kernel in a single sendmsg() call. */
 static void
 clear_write(struct ev_loop *loop, ev_io *w, int revents)
 {
 	(void)revents;
-	int t;
+	ssize_t t;
 	proxystate *ps;
 	int fd = w->fd;
-	int sz;
+	struct iovec iov[RING_IOV_MAX];
+	struct msghdr msg;
 
 	CAST_OBJ_NOTNULL(ps, w->data, PROXYSTATE_MAGIC);
 	assert(!ringbuffer_is_empty(&ps->ring_ssl2clear));
 
-	char *next = ringbuffer_read_next(&ps->ring_ssl2clear, &sz);
-	t = send(fd, next, sz, MSG_NOSIGNAL);
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = ringbuffer_read_iov(&ps->ring_ssl2clear, iov,
+	    RING_IOV_MAX);
+	t = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	worker_stats.write_events++;
+	worker_stats.write_calls++;
 
 	if (t > 0) {
-		if (t == sz) {
-			ringbuffer_read_pop(&ps->ring_ssl2clear);
-			if (ps->handshaked)
-				safe_enable_io(ps, &ps->ev_r_ssl);
-			if (ringbuffer_is_empty(&ps->ring_ssl2clear)) {
-				if (ps->want_shutdown) {
-					shutdown_proxy(ps, SHUTDOWN_HARD);
-					return; // dealloc'd
-				}
-				ev_io_stop(loop, &ps->ev_w_clear);
+		ringbuffer_read_consume(&ps->ring_ssl2clear, t);
+		if (ps->handshaked &&
+		    !ringbuffer_is_full(&ps->ring_ssl2clear))
+			safe_enable_io(ps, &ps->ev_r_ssl);
+		if (ringbuffer_is_empty(&ps->ring_ssl2clear)) {
+			if (ps->want_shutdown) {
+				shutdown_proxy(ps, SHUTDOWN_HARD);
+				return; // dealloc'd
 			}
-		} else {
-			ringbuffer_read_skip(&ps->ring_ssl2clear, t);
+			ev_io_stop(loop, &ps->ev_w_clear);
 		}
 	} else {
 		assert(t == -1);
@@ -1889,7 +4009,148 @@ clear_write(struct ev_loop *loop, ev_io *w, int revents)
 	}
 }
 
+/*
+ * The clear stream through io_uring, see uring.c. Each direction has
+ * at most one operation in flight, and only while its libev watcher is
+ * stopped: when a submission fails, the watcher takes the direction
+ * over until it stops itself again.
+ */
+
+static void
+uring_clear_read(proxystate *ps)
+{
+	if (ps->want_shutdown || ps->uring_rd.pending ||
+	    ev_is_active(&ps->ev_r_clear) ||
+	    ringbuffer_is_full(&ps->ring_clear2ssl))
+		return;
+	if (URING_Recv(&ps->uring_rd, ps->ev_r_clear.fd) != 0)
+		ev_io_start(loop, &ps->ev_r_clear);
+}
+
+static void
+uring_clear_write(proxystate *ps)
+{
+	struct msghdr *msg = &ps->uring_msg;
+
+	if (ps->uring_wr.pending || ev_is_active(&ps->ev_w_clear) ||
+	    ringbuffer_is_empty(&ps->ring_ssl2clear))
+		return;
+	memset(msg, 0, sizeof *msg);
+	msg->msg_iov = ps->uring_iov;
+	msg->msg_iovlen = ringbuffer_read_iov(&ps->ring_ssl2clear,
+	    ps->uring_iov, RING_IOV_MAX);
+	if (URING_Sendmsg(&ps->uring_wr, ps->ev_w_clear.fd, msg) != 0)
+		ev_io_start(loop, &ps->ev_w_clear);
+}
+
+/* A completion came back after shutdown_proxy() cancelled the rest */
+static void
+uring_shutdown_done(proxystate *ps)
+{
+	if (ps->uring_rd.pending == 0 && ps->uring_wr.pending == 0)
+		shutdown_proxy(ps, SHUTDOWN_HARD);
+}
+
+/* Receive completion, the io_uring counterpart of clear_read(). The
+ * provided buffer holding the data takes the place of the ring's tail
+ * block, which goes back to the kernel instead. */
+static void
+uring_clear_read_done(struct uring_op *op, int res, char **buf)
+{
+	proxystate *ps;
+	int fd;
+
+	CAST_OBJ_NOTNULL(ps, op->priv, PROXYSTATE_MAGIC);
+	if (ps->uring_shutdown) {
+		uring_shutdown_done(ps);
+		return;
+	}
+	fd = ps->ev_r_clear.fd;
+	worker_stats.read_events++;
+	worker_stats.read_calls++;
+
+	if (res > 0) {
+		AN(buf);
+		*buf = ringbuffer_write_swap(&ps->ring_clear2ssl, *buf, res);
+		uring_clear_read(ps);
+		if (ps->handshaked)
+			flush_io(ps, &ps->ev_w_ssl, &ps->ring_clear2ssl);
+		return;
+	}
+	if (res == -EAGAIN || res == -EINTR) {
+		uring_clear_read(ps);
+		return;
+	}
+	if (res == -ENOBUFS) {
+		/* All the provided buffers are in use, clear_read()
+		 * drains the socket instead */
+		if (!ps->want_shutdown)
+			ev_io_start(loop, &ps->ev_r_clear);
+		return;
+	}
+
+	/* Data read before the connection went away still goes out */
+	if (ps->handshaked && !ringbuffer_is_empty(&ps->ring_clear2ssl))
+		safe_enable_io(ps, &ps->ev_w_ssl);
+	if (res == 0) {
+		LOGPROXY(ps,"Connection closed by %s\n",
+		    fd == ps->fd_down ? "backend" : "client");
+		shutdown_proxy(ps, SHUTDOWN_CLEAR);
+	} else {
+		errno = -res;
+		handle_socket_errno(ps, fd == ps->fd_down ? 1 : 0);
+	}
+}
+
+/* Send completion, the io_uring counterpart of clear_write() */
+static void
+uring_clear_write_done(struct uring_op *op, int res, char **buf)
+{
+	proxystate *ps;
+
+	(void)buf;
+	CAST_OBJ_NOTNULL(ps, op->priv, PROXYSTATE_MAGIC);
+	if (ps->uring_shutdown) {
+		uring_shutdown_done(ps);
+		return;
+	}
+	worker_stats.write_events++;
+	worker_stats.write_calls++;
+
+	if (res > 0) {
+		ringbuffer_read_consume(&ps->ring_ssl2clear, res);
+		if (ps->handshaked &&
+		    !ringbuffer_is_full(&ps->ring_ssl2clear))
+			safe_enable_io(ps, &ps->ev_r_ssl);
+		if (ringbuffer_is_empty(&ps->ring_ssl2clear) &&
+		    ps->want_shutdown) {
+			shutdown_proxy(ps, SHUTDOWN_HARD);
+			return; // dealloc'd
+		}
+		uring_clear_write(ps);
+	} else if (res == 0 || res == -EAGAIN || res == -EINTR) {
+		uring_clear_write(ps);
+	} else {
+		errno = -res;
+		handle_socket_errno(ps,
+		    ps->ev_w_clear.fd == ps->fd_down ? 1 : 0);
+	}
+}
+
+/* Start writing the clear stream, also when it is half-closed */
+static void
+start_clear_write(proxystate *ps)
+{
+	if (ps->uring)
+		uring_clear_write(ps);
+	else
+		ev_io_start(loop, &ps->ev_w_clear);
+}
+
 static void start_handshake(proxystate *ps, int err);
+static void client_handshake(struct ev_loop *loop, ev_io *w, int revents);
+static void ssl_read(struct ev_loop *loop, ev_io *w, int revents);
+static void ssl_write(struct ev_loop *loop, ev_io *w, int revents);
 
 static unsigned
 sockaddr_port(const struct sockaddr *sa)
@@ -1928,7 +4189,7 @@ handle_connect(struct ev_loop *loop, ev_io *w, int revents)
 	t = connect(ps->fd_down, addr, len);
 
 	if (!t || errno == EISCONN || !errno) {
-		ev_io_stop(loop, &ps->ev_w_connect);
+		ev_io_stop(loop, w);
 		ev_timer_stop(loop, &ps->ev_t_connect);
 
 		if (!ps->clear_connected) {
@@ -1944,6 +4205,13 @@ handle_connect(struct ev_loop *loop, ev_io *w, int revents)
 			LOGPROXY(ps, "backend connected\n");
 
 			ps->clear_connected = 1;
+			ev_set_cb(w, clear_write);
+
+			/* An early connect can finish before the TLS
+			 * handshake. end_handshake() starts the clear
+			 * stream in that case. */
+			if (!ps->handshaked)
+				return;
 
 			/* if incoming buffer is not full */
 			if (!ringbuffer_is_full(&ps->ring_clear2ssl))
@@ -1953,7 +4221,7 @@ handle_connect(struct ev_loop *loop, ev_io *w, int revents)
 			if (!ringbuffer_is_empty(&ps->ring_ssl2clear))
 				// not safe.. we want to resume stream
 				// even during half-closed
-				ev_io_start(loop, &ps->ev_w_clear);
+				start_clear_write(ps);
 		} else {
 			/* Clear side already connected so connect is on
 			 * secure side: perform handshake */
@@ -1988,14 +4256,16 @@ start_handshake(proxystate *ps, int err)
 
 	ev_io_stop(loop, &ps->ev_r_ssl);
 	ev_io_stop(loop, &ps->ev_w_ssl);
+	ev_set_cb(&ps->ev_r_ssl, client_handshake);
+	ev_set_cb(&ps->ev_w_ssl, client_handshake);
 
 	ps->handshaked = 0;
 
 	LOGPROXY(ps,"ssl handshake start\n");
 	if (err == SSL_ERROR_WANT_READ)
-		ev_io_start(loop, &ps->ev_r_handshake);
+		ev_io_start(loop, &ps->ev_r_ssl);
 	else if (err == SSL_ERROR_WANT_WRITE)
-		ev_io_start(loop, &ps->ev_w_handshake);
+		ev_io_start(loop, &ps->ev_w_ssl);
 	ev_timer_start(loop, &ps->ev_t_handshake);
 }
 
@@ -2306,9 +4576,22 @@ static int is_alpn_shutdown_needed(proxystate *ps) {
  * for data transmission */
 static void end_handshake(proxystate *ps) {
 	CHECK_OBJ_NOTNULL(ps, PROXYSTATE_MAGIC);
-	ev_io_stop(loop, &ps->ev_r_handshake);
-	ev_io_stop(loop, &ps->ev_w_handshake);
+	ev_io_stop(loop, &ps->ev_r_ssl);
+	ev_io_stop(loop, &ps->ev_w_ssl);
 	ev_timer_stop(loop, &ps->ev_t_handshake);
+	ev_set_cb(&ps->ev_r_ssl, ssl_read);
+	ev_set_cb(&ps->ev_w_ssl, ssl_write);
+#ifdef HAVE_SSL_ASYNC
+	/* Keep SSL_read() and SSL_write() out of ASYNC jobs */
+	SSL_clear_mode(ps->ssl, SSL_MODE_ASYNC);
+#endif
+#ifdef HAVE_KTLS
+	/* Directions already spliced stay spliced */
+	if (ps->pipe_ssl2clear.cap != 0)
+		ev_set_cb(&ps->ev_r_ssl, ktls_ssl2clear_read);
+	if (ps->pipe_clear2ssl.cap != 0)
+		ev_set_cb(&ps->ev_w_ssl, ktls_clear2ssl_write);
+#endif
 
 #if defined(OPENSSL_WITH_NPN) || defined(OPENSSL_WITH_ALPN)
 	if (is_alpn_shutdown_needed(ps)) {
@@ -2329,26 +4612,49 @@ static void end_handshake(proxystate *ps) {
 #endif
 	ps->handshaked = 1;
 
-	/* Check if clear side is connected */
-	if (!ps->clear_connected) {
-		if (CONFIG->WRITE_PROXY_LINE_V1 ||
-		    CONFIG->WRITE_PROXY_LINE_V2) {
-			struct sockaddr_storage local;
-			socklen_t slen = sizeof local;
-			AZ(getsockname(ps->fd_up, (struct sockaddr *) &local,
-				&slen));
-			if (CONFIG->WRITE_PROXY_LINE_V1)
-				write_proxy_v1(ps, (struct sockaddr *) &local,
-				    slen);
-			else
-				write_proxy_v2(ps, (struct sockaddr *) &local);
-		} else if (CONFIG->WRITE_IP_OCTET) {
-			write_ip_octet(ps);
+#ifdef HAVE_KTLS
+	if (CONFIG->KTLS) {
+		ps->ktls_tx = BIO_get_ktls_send(SSL_get_wbio(ps->ssl)) ? 1 : 0;
+		ps->ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(ps->ssl)) ? 1 : 0;
+		LOGPROXY(ps, "kTLS tx=%s rx=%s\n",
+		    ps->ktls_tx ? "on" : "off", ps->ktls_rx ? "on" : "off");
+	}
+#endif
+
+	if (CONFIG->PMODE == SSL_SERVER) {
+		/* The PROXY header goes out ahead of any client data,
+		 * once, even if the backend connected during the
+		 * handshake. */
+		if (!ps->stream_started) {
+			ps->stream_started = 1;
+			if (CONFIG->WRITE_PROXY_LINE_V1 ||
+			    CONFIG->WRITE_PROXY_LINE_V2) {
+				struct sockaddr_storage local;
+				socklen_t slen = sizeof local;
+				AZ(getsockname(ps->fd_up,
+				    (struct sockaddr *) &local, &slen));
+				if (CONFIG->WRITE_PROXY_LINE_V1)
+					write_proxy_v1(ps,
+					    (struct sockaddr *) &local, slen);
+				else
+					write_proxy_v2(ps,
+					    (struct sockaddr *) &local);
+			} else if (CONFIG->WRITE_IP_OCTET) {
+				write_ip_octet(ps);
+			}
 		}
 
-		/* start connect now */
-		if (0 != start_connect(ps))
-			return;
+		if (!ps->connect_started) {
+			/* start connect now */
+			if (0 != start_connect(ps))
+				return;
+		} else if (ps->clear_connected) {
+			/* Backend connected during the handshake */
+			if (!ringbuffer_is_full(&ps->ring_clear2ssl))
+				safe_enable_io(ps, &ps->ev_r_clear);
+			if (!ringbuffer_is_empty(&ps->ring_ssl2clear))
+				start_clear_write(ps);
+		}
 	} else {
 		/* hitch used in client mode, keep client session ) */
 		if (!SSL_session_reused(ps->ssl)) {
@@ -2482,7 +4788,7 @@ client_proxy_proxy(struct ev_loop *loop, ev_io *w, int revents)
 		return;
 	}
 
-	ev_io_stop(loop, &ps->ev_proxy);
+	ev_io_stop(loop, &ps->ev_r_ssl);
 	start_handshake(ps, SSL_ERROR_WANT_READ);
 }
 
@@ -2502,6 +4808,7 @@ client_handshake(struct ev_loop *loop, ev_io *w, int revents)
 	CAST_OBJ_NOTNULL(ps, w->data, PROXYSTATE_MAGIC);
 
 	LOGPROXY(ps,"ssl client handshake revents=%x\n",revents);
+	HSSL_Async_Owner(ps);
 	t = SSL_do_handshake(ps->ssl);
 	if (t == 1) {
 		end_handshake(ps);
@@ -2519,11 +4826,19 @@ client_handshake(struct ev_loop *loop, ev_io *w, int revents)
 
 		LOGPROXY(ps,"ssl client handshake err=%s\n",errtok);
 		if (err == SSL_ERROR_WANT_READ) {
-			ev_io_stop(loop, &ps->ev_w_handshake);
-			ev_io_start(loop, &ps->ev_r_handshake);
+			ev_io_stop(loop, &ps->ev_w_ssl);
+			ev_io_start(loop, &ps->ev_r_ssl);
 		} else if (err == SSL_ERROR_WANT_WRITE) {
-			ev_io_stop(loop, &ps->ev_r_handshake);
-			ev_io_start(loop, &ps->ev_w_handshake);
+			ev_io_stop(loop, &ps->ev_r_ssl);
+			ev_io_start(loop, &ps->ev_w_ssl);
+#ifdef HAVE_SSL_ASYNC
+		} else if (err == SSL_ERROR_WANT_ASYNC) {
+			/* The private key operation is on a signer
+			 * thread, handshake_resume() takes it from here */
+			ev_io_stop(loop, &ps->ev_r_ssl);
+			ev_io_stop(loop, &ps->ev_w_ssl);
+			ps->async_pending = 1;
+#endif
 		} else if (err == SSL_ERROR_ZERO_RETURN) {
 			LOG("{%s} Connection closed (in handshake)\n",
 			    w->fd == ps->fd_up ? "client" : "backend");
@@ -2547,6 +4862,34 @@ client_handshake(struct ev_loop *loop, ev_io *w, int revents)
 	}
 }
 
+#ifdef HAVE_SSL_ASYNC
+/* Called from the signer pool's completion watcher when the private key
+ * operation of a paused handshake is done */
+static void
+handshake_resume(void *priv)
+{
+	proxystate *ps;
+	int t;
+
+	CAST_OBJ_NOTNULL(ps, priv, PROXYSTATE_MAGIC);
+	AN(ps->async_pending);
+	ps->async_pending = 0;
+	if (!ps->async_shutdown) {
+		client_handshake(loop, &ps->ev_r_ssl, 0);
+		return;
+	}
+
+	/* Let the job finish before its SSL goes away */
+	HSSL_Async_Owner(ps);
+	t = SSL_do_handshake(ps->ssl);
+	if (t != 1 && SSL_get_error(ps->ssl, t) == SSL_ERROR_WANT_ASYNC) {
+		ps->async_pending = 1;
+		return;
+	}
+	shutdown_proxy(ps, SHUTDOWN_HARD);
+}
+#endif
+
 static void
 handshake_timeout(EV_P_ ev_timer *w, int revents)
 {
@@ -2609,40 +4952,87 @@ ssl_read(struct ev_loop *loop, ev_io *w, int revents)
 		ev_io_stop(loop, &ps->ev_r_ssl);
 		return;
 	}
+#ifdef HAVE_KTLS
+	if (ktls_try_ssl2clear(ps)) {
+		ktls_ssl2clear_read(loop, w, revents);
+		return;
+	}
+#endif
+
+	int got = 0;
+	int len, room;
+
+	worker_stats.read_events++;
+	/* Keep reading records until OpenSSL wants more data, the ring is
+	 * full or the read budget for this event is spent. A slot is
+	 * filled with several records as long as a whole record fits, so
+	 * that OpenSSL is never left holding decrypted data that the
+	 * next readiness event would not pick up. */
+	do {
+		char *buf = ringbuffer_write_ptr(&ps->ring_ssl2clear);
+		len = 0;
+		do {
+			room = ps->ring_ssl2clear.data_len - len;
+			t = SSL_read(ps->ssl, buf + len, room);
+			worker_stats.read_calls++;
+			if (t > 0)
+				len += t;
+		} while (t > 0 &&
+		    ps->ring_ssl2clear.data_len - len >=
+		    SSL3_RT_MAX_PLAIN_LENGTH);
+
+		/* Fix CVE-2009-3555. Disable reneg if started by client. */
+		if (ps->renegotiation) {
+			shutdown_proxy(ps, SHUTDOWN_SSL);
+			return;
+		}
+
+		if (len > 0) {
+			ringbuffer_write_append(&ps->ring_ssl2clear, len);
+			got += len;
+			if (ringbuffer_is_full(&ps->ring_ssl2clear)) {
+				ev_io_stop(loop, &ps->ev_r_ssl);
+				break;
+			}
+		}
+	} while (t > 0 && got < CONFIG->READ_BUDGET);
+#ifdef HAVE_KTLS
+	/* OpenSSL had the record the kernel would not splice */
+	ps->ktls_rx_hold = 0;
+#endif
+
+	if (t > 0) {
+		if (ps->clear_connected)
+			flush_io(ps, &ps->ev_w_clear, &ps->ring_ssl2clear);
+		return;
+	}
 
-	char *buf = ringbuffer_write_ptr(&ps->ring_ssl2clear);
-	t = SSL_read(ps->ssl, buf, ps->ring_ssl2clear.data_len);
-
-	/* Fix CVE-2009-3555. Disable reneg if started by client. */
-	if (ps->renegotiation) {
-		shutdown_proxy(ps, SHUTDOWN_SSL);
+	int err = SSL_get_error(ps->ssl, t);
+	/* Don't keep the tail block if nothing was read */
+	ringbuffer_release(&ps->ring_ssl2clear);
+	if (err == SSL_ERROR_WANT_READ) {
+		/* Incomplete SSL data */
+		if (ps->clear_connected)
+			flush_io(ps, &ps->ev_w_clear, &ps->ring_ssl2clear);
 		return;
 	}
 
-	if (t > 0) {
-		ringbuffer_write_append(&ps->ring_ssl2clear, t);
-		if (ringbuffer_is_full(&ps->ring_ssl2clear))
-			ev_io_stop(loop, &ps->ev_r_ssl);
-		if (ps->clear_connected)
-			safe_enable_io(ps, &ps->ev_w_clear);
+	/* Data read before the error still goes out */
+	if (ps->clear_connected && !ringbuffer_is_empty(&ps->ring_ssl2clear))
+		safe_enable_io(ps, &ps->ev_w_clear);
+	if (err == SSL_ERROR_WANT_WRITE) {
+		start_handshake(ps, err);
 	} else {
-		int err = SSL_get_error(ps->ssl, t);
-		if (err == SSL_ERROR_WANT_WRITE) {
-			start_handshake(ps, err);
-		} else if (err == SSL_ERROR_WANT_READ) {
-			/* NOOP. Incomplete SSL data */
-		} else {
-			if (err == SSL_ERROR_SSL) {
-				log_ssl_error(ps, "SSL_read error");
-			}
-			handle_fatal_ssl_error(ps, err,
-			    w->fd == ps->fd_up ? 0 : 1);
+		if (err == SSL_ERROR_SSL) {
+			log_ssl_error(ps, "SSL_read error");
 		}
+		handle_fatal_ssl_error(ps, err, w->fd == ps->fd_up ? 0 : 1);
 	}
 }
 
 /* Write some previously-buffered backend data upstream on the
- * secure socket using OpenSSL */
+ * secure socket using OpenSSL. OpenSSL has no gather write, so keep
+ * writing slots until the ring is drained or the socket is full. */
 static void
 ssl_write(struct ev_loop *loop, ev_io *w, int revents)
 {
@@ -2654,59 +5044,72 @@ ssl_write(struct ev_loop *loop, ev_io *w, int revents)
 	CAST_OBJ_NOTNULL(ps, w->data, PROXYSTATE_MAGIC);
 
 	assert(!ringbuffer_is_empty(&ps->ring_clear2ssl));
-	char *next = ringbuffer_read_next(&ps->ring_clear2ssl, &sz);
-	t = SSL_write(ps->ssl, next, sz);
-	if (t > 0) {
-		if (t == sz) {
-			ringbuffer_read_pop(&ps->ring_clear2ssl);
-			if (ps->clear_connected)
-				// can be re-enabled b/c we've popped
-				safe_enable_io(ps, &ps->ev_r_clear);
-			if (ringbuffer_is_empty(&ps->ring_clear2ssl)) {
-				if (ps->want_shutdown) {
-					shutdown_proxy(ps, SHUTDOWN_HARD);
-					return;
-				}
-				ev_io_stop(loop, &ps->ev_w_ssl);
-			}
-		} else {
+	worker_stats.write_events++;
+	do {
+		char *next = ringbuffer_read_next(&ps->ring_clear2ssl, &sz);
+		t = SSL_write(ps->ssl, next, sz);
+		worker_stats.write_calls++;
+		if (t <= 0)
+			break;
+		if (t < sz) {
+			/* Partial write, the socket is full */
 			ringbuffer_read_skip(&ps->ring_clear2ssl, t);
+			return;
+		}
+		ringbuffer_read_pop(&ps->ring_clear2ssl);
+		if (ps->clear_connected)
+			// can be re-enabled b/c we've popped
+			safe_enable_io(ps, &ps->ev_r_clear);
+		if (ringbuffer_is_empty(&ps->ring_clear2ssl)) {
+			if (ps->want_shutdown) {
+				shutdown_proxy(ps, SHUTDOWN_HARD);
+				return;
+			}
+			ev_io_stop(loop, &ps->ev_w_ssl);
+			return;
 		}
+	} while (1);
+
+	int err = SSL_get_error(ps->ssl, t);
+	if (err == SSL_ERROR_WANT_READ) {
+		start_handshake(ps, err);
+	} else if (err == SSL_ERROR_WANT_WRITE) {
+		/* NOOP. Incomplete SSL data */
 	} else {
-		int err = SSL_get_error(ps->ssl, t);
-		if (err == SSL_ERROR_WANT_READ) {
-			start_handshake(ps, err);
-		} else if (err == SSL_ERROR_WANT_WRITE) {
-			/* NOOP. Incomplete SSL data */
+		if (err == SSL_ERROR_SSL) {
+			log_ssl_error(ps, "SSL_write error");
 		} else {
-			if (err == SSL_ERROR_SSL) {
-				log_ssl_error(ps, "SSL_write error");
-			} else {
-				LOG("{%s} SSL_write error: %d\n",
-				    w->fd == ps->fd_up ? "client" : "backend",
-				    err);
-			}
-			handle_fatal_ssl_error(ps, err,
-			    w->fd == ps->fd_up ? 0 : 1);
+			LOG("{%s} SSL_write error: %d\n",
+			    w->fd == ps->fd_up ? "client" : "backend", err);
 		}
+		handle_fatal_ssl_error(ps, err, w->fd == ps->fd_up ? 0 : 1);
 	}
 }
 
 
-/* libev read handler for the bound sockets.  Socket is accepted,
- * the proxystate is allocated and initalized, and we're off the races
- * connecting to the backend */
+/* Set up the io_uring operations of a new connection */
 static void
-handle_accept(struct ev_loop *loop, ev_io *w, int revents)
+uring_clear_init(proxystate *ps)
+{
+	ps->uring = URING_Recv_Active() && !CONFIG->KTLS;
+	ps->uring_shutdown = 0;
+	URING_Op_Init(&ps->uring_rd, uring_clear_read_done, ps);
+	URING_Op_Init(&ps->uring_wr, uring_clear_write_done, ps);
+}
+
+static int setup_ssl_client(struct frontend *fr, int client,
+    const struct sockaddr_storage *addr);
+
+/* Accept one client on a bound socket. Returns -1 when there was no
+ * client to accept, and like setup_ssl_client() otherwise. */
+static int
+accept_ssl_client(ev_io *w)
 {
-	(void)revents;
-	(void)loop;
 	struct sockaddr_storage addr;
-	sslctx *so;
 	struct frontend *fr;
-	proxystate *ps;
 	socklen_t sl = sizeof(addr);
 
+	CAST_OBJ_NOTNULL(fr, w->data, FRONTEND_MAGIC);
 #if HAVE_ACCEPT4==1
 	int client = accept4(w->fd, (struct sockaddr *) &addr, &sl,
 	    SOCK_NONBLOCK);
@@ -2732,9 +5135,23 @@ handle_accept(struct ev_loop *loop, ev_io *w, int revents)
 				SOCKERR("{client} accept() failed");
 			}
 		}
-		return;
+		return (-1);
 	}
+	return (setup_ssl_client(fr, client, &addr));
+}
+
+/* Set up an accepted client. The proxystate is allocated and
+ * initalized, and we're off the races connecting to the backend.
+ * Returns 0 when the client was dropped during setup and 1 when it
+ * was accepted. */
+static int
+setup_ssl_client(struct frontend *fr, int client,
+    const struct sockaddr_storage *addr)
+{
+	sslctx *so;
+	proxystate *ps;
 
+	CHECK_OBJ_NOTNULL(fr, FRONTEND_MAGIC);
 	int flag = 1;
 	int ret = setsockopt(client, IPPROTO_TCP, TCP_NODELAY,
 	    (char *)&flag, sizeof(flag) );
@@ -2753,7 +5170,7 @@ handle_accept(struct ev_loop *loop, ev_io *w, int revents)
 	if (setnonblocking(client) < 0) {
 		SOCKERR("{client} setnonblocking failed");
 		(void) close(client);
-		return;
+		return (0);
 	}
 #endif
 
@@ -2763,7 +5180,7 @@ handle_accept(struct ev_loop *loop, ev_io *w, int revents)
 	if (ps == NULL) {
 		(void)close(client);
 		ERR("{malloc-err}: %s\n", strerror(errno));
-		return;
+		return (0);
 	}
 
 	ps->backend = backend_ref();
@@ -2773,14 +5190,14 @@ handle_accept(struct ev_loop *loop, ev_io *w, int revents)
 		backend_deref(&ps->backend);
 		free(ps);
 		ERR("{backend-socket}: %s\n", strerror(errno));
-		return;
+		return (0);
 	}
 
-
-	CAST_OBJ_NOTNULL(fr, w->data, FRONTEND_MAGIC);
-	if (fr->default_ctx != NULL)
+	if (fr->default_ctx != NULL) {
 		CAST_OBJ_NOTNULL(so, fr->default_ctx, SSLCTX_MAGIC);
-	else
+		/* Names are looked up in the certificates of fr first */
+		ps->sni_fr = fr;
+	} else
 		CAST_OBJ_NOTNULL(so, default_ctx, SSLCTX_MAGIC);
 
 	SSL *ssl = SSL_new(so->ctx);
@@ -2790,14 +5207,22 @@ handle_accept(struct ev_loop *loop, ev_io *w, int revents)
 		backend_deref(&ps->backend);
 		free(ps);
 		ERR("{SSL_new}: %s\n", strerror(errno));
-		return;
+		return (0);
 	}
 
 	long mode = SSL_MODE_ENABLE_PARTIAL_WRITE;
 #ifdef SSL_MODE_RELEASE_BUFFERS
 	mode |= SSL_MODE_RELEASE_BUFFERS;
+#endif
+#ifdef HAVE_SSL_ASYNC
+	if (HSSL_Async_Active())
+		mode |= SSL_MODE_ASYNC;
 #endif
 	SSL_set_mode(ssl, mode);
+#ifdef HAVE_KTLS
+	if (CONFIG->KTLS)
+		SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
 	SSL_set_accept_state(ssl);
 	SSL_set_fd(ssl, client);
 
@@ -2807,25 +5232,23 @@ handle_accept(struct ev_loop *loop, ev_io *w, int revents)
 	ps->clear_connected = 0;
 	ps->handshaked = 0;
 	ps->renegotiation = 0;
-	ps->remote_ip = addr;
+	ps->remote_ip = *addr;
 	ps->connect_port = 0;
+	ps->connect_started = 0;
+	ps->stream_started = 0;
+	ps->async_pending = 0;
+	ps->async_shutdown = 0;
 
-	ringbuffer_init(&ps->ring_clear2ssl, CONFIG->RING_SLOTS,
-	    CONFIG->RING_DATA_LEN);
-	ringbuffer_init(&ps->ring_ssl2clear, CONFIG->RING_SLOTS,
-	    CONFIG->RING_DATA_LEN);
+	ringbuffer_init(&ps->ring_clear2ssl, ring_pool);
+	ringbuffer_init(&ps->ring_ssl2clear, ring_pool);
 
 	/* set up events */
 	ev_io_init(&ps->ev_r_ssl, ssl_read, client, EV_READ);
 	ev_io_init(&ps->ev_w_ssl, ssl_write, client, EV_WRITE);
 
-	ev_io_init(&ps->ev_r_handshake, client_handshake, client, EV_READ);
-	ev_io_init(&ps->ev_w_handshake, client_handshake, client, EV_WRITE);
 	ev_timer_init(&ps->ev_t_handshake, handshake_timeout,
 	    CONFIG->SSL_HANDSHAKE_TIMEOUT, 0.);
 
-	ev_io_init(&ps->ev_proxy, client_proxy_proxy, client, EV_READ);
-	ev_io_init(&ps->ev_w_connect, handle_connect, ps->fd_down, EV_WRITE);
 	ev_timer_init(&ps->ev_t_connect, connect_timeout,
 	    CONFIG->BACKEND_CONNECT_TIMEOUT, 0.);
 
@@ -2836,12 +5259,9 @@ handle_accept(struct ev_loop *loop, ev_io *w, int revents)
 	ps->ev_w_ssl.data = ps;
 	ps->ev_r_clear.data = ps;
 	ps->ev_w_clear.data = ps;
-	ps->ev_proxy.data = ps;
-	ps->ev_w_connect.data = ps;
 	ps->ev_t_connect.data = ps;
-	ps->ev_r_handshake.data = ps;
-	ps->ev_w_handshake.data = ps;
 	ps->ev_t_handshake.data = ps;
+	uring_clear_init(ps);
 
 	/* Link back proxystate to SSL state */
 	SSL_set_app_data(ssl, ps);
@@ -2849,13 +5269,133 @@ handle_accept(struct ev_loop *loop, ev_io *w, int revents)
 	n_conns++;
 
 	LOGPROXY(ps, "proxy connect\n");
+	/* Overlap the backend connect with the TLS handshake. The
+	 * PROXY header is written by end_handshake(). */
+	if (CONFIG->BACKEND_CONNECT_EARLY && 0 != start_connect(ps))
+		return (1);
 	if (CONFIG->PROXY_PROXY_LINE) {
-		ev_io_start(loop, &ps->ev_proxy);
+		ev_set_cb(&ps->ev_r_ssl, client_proxy_proxy);
+		ev_io_start(loop, &ps->ev_r_ssl);
 	} else {
 		/* for client-first handshake */
 		start_handshake(ps, SSL_ERROR_WANT_READ);
 	}
+	return (1);
+}
+
+/* Account for one listener wakeup that accepted n clients */
+static void
+accept_stats(unsigned n)
+{
+	worker_stats.accept_wakeups++;
+	worker_stats.accepts += n;
+	if (n > worker_stats.accept_max)
+		worker_stats.accept_max = n;
+}
+
+/* libev read handler for the bound sockets. Accepts up to accept-batch
+ * clients per wakeup, so that a burst of connections does not cost an
+ * event loop iteration each. */
+static void
+handle_accept(struct ev_loop *loop, ev_io *w, int revents)
+{
+	unsigned n = 0;
+	int r;
+
+	(void)loop;
+	(void)revents;
+	/* Only clients that were accepted count against the batch */
+	while ((r = accept_ssl_client(w)) >= 0) {
+		if (r > 0 && ++n >= (unsigned)CONFIG->ACCEPT_BATCH)
+			break;
+	}
+	accept_stats(n);
+}
+
+static int setup_clear_client(struct frontend *fr, int client,
+    const struct sockaddr_storage *addr);
+
+/* Clients accepted through io_uring since the last reap */
+static unsigned uring_accepts = 0;
+
+/* Start accepting clients on a bound socket. With io_uring a single
+ * multishot accept keeps producing clients, otherwise libev watches
+ * the socket. */
+static void
+listener_start(struct listen_sock *ls)
+{
+	CHECK_OBJ_NOTNULL(ls, LISTEN_SOCK_MAGIC);
+	if (URING_Active() && URING_Accept(&ls->uring_accept, ls->sock) == 0)
+		return;
+	ev_io_start(loop, &ls->listener);
+}
+
+static void
+listener_close(struct ev_loop *loop, struct listen_sock *ls)
+{
+	CHECK_OBJ_NOTNULL(ls, LISTEN_SOCK_MAGIC);
+	ev_io_stop(loop, &ls->listener);
+	URING_Cancel(&ls->uring_accept);
+	if (ls->sock >= 0)
+		(void)close(ls->sock);
+	ls->sock = -1;
+}
+
+/* io_uring completion of a listener's multishot accept */
+static void
+uring_accept_done(struct uring_op *op, int res, char **buf)
+{
+	struct sockaddr_storage addr;
+	struct listen_sock *ls;
+	struct frontend *fr;
+	socklen_t sl = sizeof(addr);
+	int r;
+
+	(void)buf;
+	CAST_OBJ_NOTNULL(ls, op->priv, LISTEN_SOCK_MAGIC);
+	CAST_OBJ_NOTNULL(fr, ls->listener.data, FRONTEND_MAGIC);
+	if (res >= 0) {
+		if (getpeername(res, (struct sockaddr *)&addr, &sl) != 0) {
+			/* Already gone */
+			(void)close(res);
+			r = 0;
+		} else if (CONFIG->PMODE == SSL_CLIENT)
+			r = setup_clear_client(fr, res, &addr);
+		else
+			r = setup_ssl_client(fr, res, &addr);
+		if (r > 0)
+			uring_accepts++;
+	} else if (res == -EMFILE) {
+		ERR("{client} accept() failed; "
+		    "too many open files for this process\n");
+	} else if (res == -ENFILE) {
+		ERR("{client} accept() failed; "
+		    "too many open files for this system\n");
+	} else if (res != -ECANCELED) {
+		errno = -res;
+		SOCKERR("{client} accept() failed");
+	}
+
+	if (op->pending || ls->sock < 0 || worker_state != WORKER_ACTIVE)
+		return;
+	/* The kernel ended the multishot accept. After an error libev
+	 * watches the socket from now on, so that a lasting one does not
+	 * turn into a busy loop. */
+	if (res < 0 || URING_Accept(&ls->uring_accept, ls->sock) != 0)
+		ev_io_start(loop, &ls->listener);
+}
+
+#ifdef HAVE_IO_URING
+/* Called once the completions of a loop iteration were handled */
+static void
+uring_reaped(void)
+{
+	if (uring_accepts == 0)
+		return;
+	accept_stats(uring_accepts);
+	uring_accepts = 0;
 }
+#endif
 
 
 static void
@@ -2871,11 +5411,8 @@ check_ppid(struct ev_loop *loop, ev_timer *w, int revents)
 		ev_timer_stop(loop, w);
 		VTAILQ_FOREACH(fr, &frontends, list) {
 			CHECK_OBJ_NOTNULL(fr, FRONTEND_MAGIC);
-			VTAILQ_FOREACH(ls, &fr->socks, list) {
-				CHECK_OBJ_NOTNULL(ls, LISTEN_SOCK_MAGIC);
-				ev_io_stop(loop, &ls->listener);
-				close(ls->sock);
-			}
+			VTAILQ_FOREACH(ls, &fr->socks, list)
+				listener_close(loop, ls);
 		}
 	}
 }
@@ -2903,13 +5440,69 @@ Get_Sockaddr(const struct sockaddr *sa, socklen_t *sl)
 	return (sa);
 }
 
+/* Read a message following an update. The master is writing it. */
+static int
+mgt_read(int fd, void *p, size_t len)
+{
+	struct pollfd pfd;
+	char *b = p;
+	ssize_t l;
+
+	while (len > 0) {
+		l = read(fd, b, len);
+		if (l > 0) {
+			b += l;
+			len -= l;
+			continue;
+		}
+		if (l == 0) {
+			errno = EPIPE;
+			return (-1);
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EWOULDBLOCK && errno != EAGAIN)
+			return (-1);
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return (-1);
+	}
+	return (0);
+}
+
+/* Stop accepting new connections, and exit once the current ones are
+ * done */
 static void
-handle_mgt_rd(struct ev_loop *loop, ev_io *w, int revents)
+worker_retire(struct ev_loop *loop)
 {
-	ssize_t r;
 	struct frontend *fr;
 	struct listen_sock *ls;
+
+	if (worker_state == WORKER_EXITING)
+		return;
+	worker_state = WORKER_EXITING;
+
+	VTAILQ_FOREACH(fr, &frontends, list) {
+		CHECK_OBJ_NOTNULL(fr, FRONTEND_MAGIC);
+		VTAILQ_FOREACH(ls, &fr->socks, list)
+			listener_close(loop, ls);
+	}
+
+	check_exit_state();
+
+	LOGL("Worker %d (gen: %d): State %s\n", core_id, worker_gen,
+	(worker_state == WORKER_EXITING) ? "EXITING" : "ACTIVE");
+}
+
+static void
+handle_mgt_rd(struct ev_loop *loop, ev_io *w, int revents)
+{
+	ssize_t r;
 	struct worker_update wu;
+	char *msg;
+	int i;
 
 	(void) revents;
 	r = read(w->fd, &wu, sizeof(wu));
@@ -2924,30 +5517,15 @@ handle_mgt_rd(struct ev_loop *loop, ev_io *w, int revents)
 		 * process start it back up. */
 		_exit(1);
 	} else if (r == 0) {
-		/* Parent died .. */
+		/* Parent died .. unless it told us to terminate first */
+		if (n_sigterm != 0)
+			terminate(n_sigterm);
 		_exit(1);
 	}
 
 	if (wu.type == WORKER_GEN && wu.payload.gen != worker_gen) {
 		/* This means this process has reached its retirement age. */
-		if (worker_state == WORKER_EXITING)
-			return;
-		worker_state = WORKER_EXITING;
-
-		/* Stop accepting new connections. */
-		VTAILQ_FOREACH(fr, &frontends, list) {
-			CHECK_OBJ_NOTNULL(fr, FRONTEND_MAGIC);
-			VTAILQ_FOREACH(ls, &fr->socks, list) {
-				CHECK_OBJ_NOTNULL(ls, LISTEN_SOCK_MAGIC);
-				ev_io_stop(loop, &ls->listener);
-				close(ls->sock);
-			}
-		}
-
-		check_exit_state();
-
-		LOGL("Worker %d (gen: %d): State %s\n", core_id, worker_gen,
-		(worker_state == WORKER_EXITING) ? "EXITING" : "ACTIVE");
+		worker_retire(loop);
 	} else if (wu.type == WORKER_GEN && wu.payload.gen == worker_gen) {
 		return;
 	} else if (wu.type == BACKEND_REFRESH) {
@@ -2956,20 +5534,42 @@ handle_mgt_rd(struct ev_loop *loop, ev_io *w, int revents)
 		backend_deref(&backaddr);
 		backaddr = b;
 		AN(VSA_Sane(backaddr->backaddr));
+	} else if (wu.type == CERT_UPDATE) {
+		msg = malloc(wu.payload.certs_len);
+		AN(msg);
+		if (mgt_read(w->fd, msg, wu.payload.certs_len) != 0) {
+			LOGL("Error in mgt->worker read operation. "
+			    "Restarting process.");
+			_exit(1);
+		}
+		/* A worker out of sync with the master is replaced by
+		 * one forked from it, once the master got the answer */
+		i = worker_state == WORKER_ACTIVE ?
+		    hot_apply(msg, wu.payload.certs_len) : 0;
+		free(msg);
+		if (i != 0)
+			ERR("{core} Worker %d: Unable to update the "
+			    "certificates, retiring.\n", core_id);
+		if (write(w->fd, &i, sizeof i) != sizeof i)
+			ERR("{core} Worker %d: Unable to answer the "
+			    "certificate update: %s\n", core_id,
+			    strerror(errno));
+		if (i != 0)
+			worker_retire(loop);
 	} else
 		WRONG("Invalid worker update state");
 }
 
-static void
-handle_clear_accept(struct ev_loop *loop, ev_io *w, int revents)
+/* Accept one client in client mode, where the backend is the TLS
+ * side. Returns like accept_ssl_client(). */
+static int
+accept_clear_client(ev_io *w)
 {
-	(void)revents;
-	(void)loop;
 	struct sockaddr_storage addr;
 	struct frontend *fr;
-	sslctx *so;
-	proxystate *ps;
 	socklen_t sl = sizeof(addr);
+
+	CAST_OBJ_NOTNULL(fr, w->data, FRONTEND_MAGIC);
 	int client = accept(w->fd, (struct sockaddr *) &addr, &sl);
 	if (client == -1) {
 		switch (errno) {
@@ -2990,9 +5590,21 @@ handle_clear_accept(struct ev_loop *loop, ev_io *w, int revents)
 			}
 			break;
 		}
-		return;
+		return (-1);
 	}
+	return (setup_clear_client(fr, client, &addr));
+}
+
+/* Set up a client accepted in client mode. Returns like
+ * setup_ssl_client(). */
+static int
+setup_clear_client(struct frontend *fr, int client,
+    const struct sockaddr_storage *addr)
+{
+	sslctx *so;
+	proxystate *ps;
 
+	CHECK_OBJ_NOTNULL(fr, FRONTEND_MAGIC);
 	int flag = 1;
 	int ret = setsockopt(client, IPPROTO_TCP, TCP_NODELAY,
 	    (char *)&flag, sizeof(flag) );
@@ -3012,7 +5624,7 @@ handle_clear_accept(struct ev_loop *loop, ev_io *w, int revents)
 	if (setnonblocking(client)) {
 		SOCKERR("{client} setnonblocking failed");
 		(void) close(client);
-		return;
+		return (0);
 	}
 
 	settcpkeepalive(client);
@@ -3025,10 +5637,9 @@ handle_clear_accept(struct ev_loop *loop, ev_io *w, int revents)
 		close(client);
 		free(ps);
 		ERR("{backend-socket}: %s\n", strerror(errno));
-		return;
+		return (0);
 	}
 
-	CAST_OBJ_NOTNULL(fr, w->data, FRONTEND_MAGIC);
 	if (fr->default_ctx != NULL)
 		CAST_OBJ_NOTNULL(so, fr->default_ctx, SSLCTX_MAGIC);
 	else
@@ -3039,6 +5650,10 @@ handle_clear_accept(struct ev_loop *loop, ev_io *w, int revents)
 	mode |= SSL_MODE_RELEASE_BUFFERS;
 #endif
 	SSL_set_mode(ssl, mode);
+#ifdef HAVE_KTLS
+	if (CONFIG->KTLS)
+		SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
 	SSL_set_connect_state(ssl);
 	SSL_set_fd(ssl, ps->fd_down);
 	if (client_session)
@@ -3050,24 +5665,17 @@ handle_clear_accept(struct ev_loop *loop, ev_io *w, int revents)
 	ps->clear_connected = 1;
 	ps->handshaked = 0;
 	ps->renegotiation = 0;
-	ps->remote_ip = addr;
-	ringbuffer_init(&ps->ring_clear2ssl, CONFIG->RING_SLOTS,
-	    CONFIG->RING_DATA_LEN);
-	ringbuffer_init(&ps->ring_ssl2clear, CONFIG->RING_SLOTS,
-	    CONFIG->RING_DATA_LEN);
+	ps->remote_ip = *addr;
+	ringbuffer_init(&ps->ring_clear2ssl, ring_pool);
+	ringbuffer_init(&ps->ring_ssl2clear, ring_pool);
 
 	/* set up events */
 	ev_io_init(&ps->ev_r_clear, clear_read, client, EV_READ);
 	ev_io_init(&ps->ev_w_clear, clear_write, client, EV_WRITE);
 
-	ev_io_init(&ps->ev_w_connect, handle_connect, ps->fd_down, EV_WRITE);
 	ev_timer_init(&ps->ev_t_connect, connect_timeout,
 	    CONFIG->BACKEND_CONNECT_TIMEOUT, 0.);
 
-	ev_io_init(&ps->ev_r_handshake, client_handshake,
-	    ps->fd_down, EV_READ);
-	ev_io_init(&ps->ev_w_handshake, client_handshake,
-	    ps->fd_down, EV_WRITE);
 	ev_timer_init(&ps->ev_t_handshake, handshake_timeout,
 	    CONFIG->SSL_HANDSHAKE_TIMEOUT, 0.);
 
@@ -3078,18 +5686,51 @@ handle_clear_accept(struct ev_loop *loop, ev_io *w, int revents)
 	ps->ev_w_ssl.data = ps;
 	ps->ev_r_clear.data = ps;
 	ps->ev_w_clear.data = ps;
-	ps->ev_w_connect.data = ps;
-	ps->ev_r_handshake.data = ps;
-	ps->ev_w_handshake.data = ps;
+	ps->ev_t_connect.data = ps;
 	ps->ev_t_handshake.data = ps;
+	uring_clear_init(ps);
 
 	/* Link back proxystate to SSL state */
 	SSL_set_app_data(ssl, ps);
 
 	n_conns++;
 
-	ev_io_start(loop, &ps->ev_r_clear);
+	safe_enable_io(ps, &ps->ev_r_clear);
 	start_connect(ps); /* start connect */
+	return (1);
+}
+
+/* libev read handler for the bound sockets in client mode */
+static void
+handle_clear_accept(struct ev_loop *loop, ev_io *w, int revents)
+{
+	unsigned n = 0;
+	int r;
+
+	(void)loop;
+	(void)revents;
+	/* Only clients that were accepted count against the batch */
+	while ((r = accept_clear_client(w)) >= 0) {
+		if (r > 0 && ++n >= (unsigned)CONFIG->ACCEPT_BATCH)
+			break;
+	}
+	accept_stats(n);
+}
+
+/* libev flags for the worker event loop */
+static unsigned
+worker_loop_flags(void)
+{
+	switch (CONFIG->EVENT_BACKEND) {
+	case EVENT_BACKEND_EPOLL:
+		return (EVBACKEND_EPOLL);
+#ifdef HAVE_EV_IOURING
+	case EVENT_BACKEND_IOURING:
+		return (EVBACKEND_IOURING);
+#endif
+	default:
+		return (EVFLAG_AUTO);
+	}
 }
 
 /* Set up the child (worker) process including libev event loop, read event
@@ -3128,7 +5769,52 @@ handle_connections(int mgt_fd)
 		    "do you have that many cores?\n", core_id);
 #endif
 
-	loop = ev_default_loop(EVFLAG_AUTO);
+	/* A loop of our own: the default one may be the master's, with
+	 * its backend and watchers */
+	loop = ev_loop_new(worker_loop_flags());
+	if (loop == NULL) {
+		ERR("{core} Worker %d: %s event backend unavailable, "
+		    "using the default\n", core_id,
+		    CONFIG->EVENT_BACKEND == EVENT_BACKEND_IOURING ?
+		    "io_uring" : "epoll");
+		loop = ev_loop_new(EVFLAG_AUTO);
+	}
+	AN(loop);
+	LOG("{core} Worker %d event backend: %s\n", core_id,
+	    ev_backend(loop) == EVBACKEND_EPOLL ? "epoll" :
+#ifdef HAVE_EV_IOURING
+	    ev_backend(loop) == EVBACKEND_IOURING ? "io_uring" :
+#endif
+	    "other");
+
+	ring_pool = ringpool_new(CONFIG->RING_SLOTS, CONFIG->RING_DATA_LEN,
+	    CONFIG->RING_POOL_MAX);
+
+#ifdef HAVE_IO_URING
+	if (CONFIG->EVENT_BACKEND == EVENT_BACKEND_IOURING) {
+		if (URING_Init(loop, CONFIG->URING_RECV_BUFS,
+		    ring_pool->data_len, uring_reaped) != 0)
+			ERR("{core} Worker %d: Unable to set up io_uring, "
+			    "socket I/O goes through the event loop: %s\n",
+			    core_id, strerror(errno));
+		else if (CONFIG->URING_RECV_BUFS > 0 && !URING_Recv_Active())
+			ERR("{core} Worker %d: No io_uring receive buffers, "
+			    "receiving through the event loop\n", core_id);
+	}
+#endif
+
+#ifdef HAVE_SSL_ASYNC
+	if (CONFIG->ASYNC_SIGN_THREADS > 0 && CONFIG->PMODE == SSL_SERVER) {
+		if (HSSL_Async_Init(loop, CONFIG->ASYNC_SIGN_THREADS,
+		    handshake_resume) != 0)
+			ERR("{core} Worker %d: Unable to start signer "
+			    "threads, signing in the event loop: %s\n",
+			    core_id, strerror(errno));
+		else
+			LOG("{core} Worker %d: %d signer threads\n",
+			    core_id, CONFIG->ASYNC_SIGN_THREADS);
+	}
+#endif
 
 	ev_timer timer_ppid_check;
 	ev_timer_init(&timer_ppid_check, check_ppid, 1.0, 1.0);
@@ -3141,30 +5827,36 @@ handle_connections(int mgt_fd)
 			    handle_clear_accept : handle_accept,
 			    ls->sock, EV_READ);
 			ls->listener.data = fr;
-			ev_io_start(loop, &ls->listener);
+			URING_Op_Init(&ls->uring_accept, uring_accept_done,
+			    ls);
+			listener_start(ls);
 		}
 	}
 
 	if (CONFIG->OCSP_DIR != NULL) {
 		HASH_ITER(hh, ssl_ctxs, sc, sctmp) {
-			if (sc->ev_staple)
+			sc = staple_ctx(sc);
+			if (sc != NULL && sc->ev_staple)
 				ev_stat_start(loop, sc->ev_staple);
 		}
 
 		VTAILQ_FOREACH(fr, &frontends, list) {
 			HASH_ITER(hh, fr->ssl_ctxs, sc, sctmp) {
-			    if (sc->ev_staple)
+			    sc = staple_ctx(sc);
+			    if (sc != NULL && sc->ev_staple)
 				    ev_stat_start(loop, sc->ev_staple);
 			}
 		}
 
-		if (default_ctx != NULL && default_ctx->ev_staple != NULL)
-			ev_stat_start(loop, default_ctx->ev_staple);
+		sc = default_ctx != NULL ? staple_ctx(default_ctx) : NULL;
+		if (sc != NULL && sc->ev_staple != NULL)
+			ev_stat_start(loop, sc->ev_staple);
 	}
 
 	AZ(setnonblocking(mgt_fd));
 	ev_io_init(&mgt_rd, handle_mgt_rd, mgt_fd, EV_READ);
 	ev_io_start(loop, &mgt_rd);
+	terminate_watch(loop);
 
 	ev_loop(loop, 0);
 	ERR("Worker %d (gen: %d) exiting.\n", core_id, worker_gen);
@@ -3193,30 +5885,73 @@ handle_ocsp_task(void) {
 	}
 
 	(void) umask(027);
-	loop = ev_default_loop(EVFLAG_AUTO);
+	loop = ev_loop_new(EVFLAG_AUTO);
 
 	/* Create ocspquery work items for any eligible ocsp queries */
 
 	HASH_ITER(hh, ssl_ctxs, sc, sctmp) {
-		HOCSP_mktask(sc, NULL, -1.0);
+		/* Lazy certificates are not loaded here */
+		sc = staple_ctx(sc);
+		if (sc != NULL && sc->lazy_cf == NULL)
+			HOCSP_mktask(sc, NULL, -1.0);
 	}
 
 	VTAILQ_FOREACH(fr, &frontends, list) {
 		HASH_ITER(hh, fr->ssl_ctxs, sc, sctmp) {
-			HOCSP_mktask(sc, NULL, -1.0);
+			sc = staple_ctx(sc);
+			if (sc != NULL)
+				HOCSP_mktask(sc, NULL, -1.0);
+		}
+	}
+
+	sc = default_ctx != NULL ? staple_ctx(default_ctx) : NULL;
+	if (sc != NULL)
+		HOCSP_mktask(sc, NULL, -1.0);
+
+	ev_timer_init(&timer_ppid_check, check_ppid, 1.0, 1.0);
+	ev_timer_start(loop, &timer_ppid_check);
+	terminate_watch(loop);
+
+	ev_loop(loop, 0);
+
+	_exit(0);
+}
+
+#ifdef USE_SHARED_CACHE
+/*
+   Session cache replication process.
+*/
+static void
+handle_shcupd_task(void)
+{
+	struct frontend *fr;
+	struct listen_sock *ls;
+	ev_timer timer_ppid_check;
+
+	shcupd_replicator = 1;
+
+	/* we don't accept incoming connections for this process.  */
+	VTAILQ_FOREACH(fr, &frontends, list) {
+		CHECK_OBJ_NOTNULL(fr, FRONTEND_MAGIC);
+		VTAILQ_FOREACH(ls, &fr->socks, list) {
+			CHECK_OBJ_NOTNULL(ls, LISTEN_SOCK_MAGIC);
+			close(ls->sock);
 		}
 	}
 
-	if (default_ctx != NULL)
-		HOCSP_mktask(default_ctx, NULL, -1.0);
+	loop = ev_default_loop(EVFLAG_AUTO);
+	ev_io_init(&shcupd_listener, handle_shcupd, shcupd_socket, EV_READ);
+	ev_io_start(loop, &shcupd_listener);
 
 	ev_timer_init(&timer_ppid_check, check_ppid, 1.0, 1.0);
 	ev_timer_start(loop, &timer_ppid_check);
+	terminate_watch(loop);
 
 	ev_loop(loop, 0);
 
 	_exit(0);
 }
+#endif
 
 void
 change_root()
@@ -3388,7 +6123,7 @@ start_workers(int start_index, int count)
 	for (core_id = start_index;
 	    core_id < start_index + count; core_id++) {
 		ALLOC_OBJ(c, WORKER_PROC_MAGIC);
-		AZ(pipe(pfd));
+		AZ(socketpair(AF_UNIX, SOCK_STREAM, 0, pfd));
 		c->pfd = pfd[1];
 		c->gen = worker_gen;
 		c->pid = fork();
@@ -3414,6 +6149,7 @@ start_workers(int start_index, int count)
 			exit(0);
 		} else { /* parent. Track new child. */
 			close(pfd[0]);
+			AZ(setnonblocking(c->pfd));
 			VTAILQ_INSERT_TAIL(&worker_procs, c, list);
 		}
 	}
@@ -3439,6 +6175,28 @@ start_ocsp_proc(void)
 	AN(ocsp_proc_pid);
 }
 
+#ifdef USE_SHARED_CACHE
+static void
+start_shcupd_proc(void)
+{
+	shcupd_proc_pid = fork();
+
+	if (shcupd_proc_pid == -1) {
+		ERR("{core}: fork() failed: %s: Exiting.\n", strerror(errno));
+		exit(1);
+	} else if (shcupd_proc_pid == 0) {
+		if (CONFIG->UID >= 0 || CONFIG->GID >= 0)
+			drop_privileges();
+		if (!verify_privileges())
+			_exit(1);
+		handle_shcupd_task();
+	}
+
+	/* child proc should never return. */
+	AN(shcupd_proc_pid);
+}
+#endif
+
 
 /* Forks a new child to replace the old, dead, one with the given PID.*/
 void
@@ -3450,6 +6208,8 @@ replace_child_with_pid(pid_t pid)
 	VTAILQ_FOREACH_SAFE(c, &worker_procs, list, cp) {
 		if (c->pid == pid) {
 			VTAILQ_REMOVE(&worker_procs, c, list);
+			if (c->pfd >= 0)
+				(void)close(c->pfd);
 			/* Only replace if it matches current generation. */
 			if (c->gen == worker_gen)
 				start_workers(c->core_id, 1);
@@ -3505,6 +6265,11 @@ do_wait(void)
 		    } else {
 			    ocsp_proc_pid = 0;
 		    });
+
+#ifdef USE_SHARED_CACHE
+	if (shcupd_proc_pid != 0)
+		WAIT_PID(shcupd_proc_pid, start_shcupd_proc());
+#endif
 }
 
 static void
@@ -3515,12 +6280,27 @@ sigchld_handler(int signum)
 }
 
 
+static struct ev_loop *term_loop;
+static ev_async term_async;
+
+/* Nothing but flags in there: the signal may have interrupted a holder
+ * of the log lock. The master checks n_sigterm in its main loop, the
+ * other processes handle the signal in their event loop, see
+ * terminate_watch(). */
 static void
-sigh_terminate (int __attribute__ ((unused)) signo)
+sigh_terminate(int signo)
 {
-	struct worker_proc *c;
 	/* don't create any more children */
 	create_workers = 0;
+	n_sigterm = signo;
+	if (term_loop != NULL)
+		ev_async_send(term_loop, &term_async);
+}
+
+static void
+terminate(int signo)
+{
+	struct worker_proc *c;
 
 	/* are we the master? */
 	if (getpid() == master_pid) {
@@ -3539,12 +6319,46 @@ sigh_terminate (int __attribute__ ((unused)) signo)
 
 		if (ocsp_proc_pid != 0)
 			kill(ocsp_proc_pid, SIGTERM);
-	}
+#ifdef USE_SHARED_CACHE
+		if (shcupd_proc_pid != 0)
+			kill(shcupd_proc_pid, SIGTERM);
+		shared_cache_log_stats();
+		if (CONFIG->SHCUPD_PORT && !CONFIG->SHCUPD_REPLICATOR)
+			shcupd_log_recv_stats();
+	} else if (shcupd_replicator) {
+		shcupd_log_recv_stats();
+#endif
+	} else
+		worker_log_stats();
 
 	/* this is it, we're done... */
 	exit(0);
 }
 
+static void
+terminate_cb(struct ev_loop *l, ev_async *w, int revents)
+{
+
+	(void)l;
+	(void)w;
+	(void)revents;
+	terminate(n_sigterm);
+}
+
+/* SIGINT and SIGTERM in a child process */
+static void
+terminate_watch(struct ev_loop *l)
+{
+
+	create_workers = 0;
+	ev_async_init(&term_async, terminate_cb);
+	ev_async_start(l, &term_async);
+	term_loop = l;
+	/* Caught before the watcher was started */
+	if (n_sigterm != 0)
+		terminate(n_sigterm);
+}
+
 static void
 sighup_handler(int signum)
 {
@@ -3552,6 +6366,13 @@ sighup_handler(int signum)
 	n_sighup++;
 }
 
+static void
+sigalrm_handler(int signum)
+{
+	assert(signum == SIGALRM);
+	n_sigalrm++;
+}
+
 static void
 init_signals()
 {
@@ -3595,6 +6416,49 @@ init_signals()
 		exit(1);
 	}
 
+	/* Ticket key rotation */
+	act.sa_handler = sigalrm_handler;
+	if (sigaction(SIGALRM, &act, NULL) != 0) {
+		ERR("Unable to register SIGALRM signal handler: %s\n",
+		    strerror(errno));
+		exit(1);
+	}
+}
+
+/* Load the ticket key file again, or rotate the random keys. The
+ * current keys are kept on failure. */
+static int
+ticket_keys_refresh(int rotate)
+{
+	unsigned line = 0;
+
+	if (CONFIG->TICKET_KEY_FILE == NULL) {
+		if (rotate)
+			HSSL_Tickets_Rotate();
+		return (0);
+	}
+	if (HSSL_Tickets_Load(CONFIG->TICKET_KEY_FILE, &line) == 0)
+		return (0);
+	if (errno == EINVAL)
+		ERR("{core} Invalid ticket key at %s line %u\n",
+		    CONFIG->TICKET_KEY_FILE, line);
+	else
+		ERR("{core} Unable to load ticket keys from %s: %s\n",
+		    CONFIG->TICKET_KEY_FILE, strerror(errno));
+	return (-1);
+}
+
+static void
+init_ticket_keys(void)
+{
+
+	if (HSSL_Tickets_Init() != 0) {
+		ERR("{core} Unable to map ticket keys: %s\n",
+		    strerror(errno));
+		exit(1);
+	}
+	if (ticket_keys_refresh(0) != 0)
+		exit(1);
 }
 
 static void
@@ -3735,6 +6599,22 @@ static void cert_commit(struct cfg_tpc_obj *o);
 static int
 ocsp_cfg_changed(const struct cfg_cert_file *cf, const sslctx *sc)
 {
+	if (sc->shared != NULL) {
+		/* Reloaded once the context it shares is dropped */
+		if (sc->shared->dropped)
+			return (1);
+		sc = sc->shared;
+	}
+
+	if (sc->lazy_cf != NULL) {
+		/* The staple of a lazy certificate is loaded with it */
+		if ((sc->lazy_cf->ocspfn == NULL) != (cf->ocspfn == NULL))
+			return (1);
+		return (cf->ocspfn != NULL &&
+		    (strcmp(sc->lazy_cf->ocspfn, cf->ocspfn) != 0
+		    || sc->lazy_cf->ocsp_mtim < cf->ocsp_mtim));
+	}
+
 	if (sc->staple != NULL && cf->ocspfn == NULL)
 		return (1); 	/* Dropped OCSP definition */
 
@@ -3750,14 +6630,34 @@ ocsp_cfg_changed(const struct cfg_cert_file *cf, const sslctx *sc)
 	return (0);
 }
 
+/* Queue the loaded contexts for commit, the failed ones are left out and
+ * make the caller roll back. */
+static void
+cert_load_queue(const struct cert_load *cl, unsigned n, struct frontend *fr,
+    struct cfg_tpc_obj_head *cfg_objs)
+{
+	struct cfg_tpc_obj *o;
+	unsigned u;
+
+	for (u = 0; u < n; u++) {
+		if (cl[u].sc == NULL)
+			continue;
+		o = make_cfg_obj(CFG_CERT, CFG_TPC_NEW,
+		    cl[u].sc, fr, cert_rollback, cert_commit);
+		VTAILQ_INSERT_TAIL(cfg_objs, o, list);
+	}
+}
+
 /* Query frontend-specific certificates.  */
 static int
 cert_fr_query(struct frontend *fr, struct front_arg *fa,
-    struct cfg_tpc_obj_head *cfg_objs)
+    struct cfg_tpc_obj_head *cfg_objs, int hot)
 {
 	struct cfg_cert_file *cf, *cftmp;
 	sslctx *sc, *sctmp;
 	struct cfg_tpc_obj *o;
+	struct cert_load *cl;
+	unsigned n, nerr;
 
 	HASH_ITER(hh, fr->ssl_ctxs, sc, sctmp) {
 		HASH_FIND_STR(fa->certs, sc->filename, cf);
@@ -3771,27 +6671,38 @@ cert_fr_query(struct frontend *fr, struct front_arg *fa,
 		}
 	}
 
+	cl = calloc(HASH_COUNT(fa->certs) + 1, sizeof *cl);
+	AN(cl);
+	n = 0;
+	nerr = 0;
 	HASH_ITER(hh, fa->certs, cf, cftmp) {
 		if (cf->mark)
 			continue;
-		sc = make_ctx_fr(cf, fr, fa);
-		if (sc == NULL)
-			return (-1);
-		o = make_cfg_obj(CFG_CERT, CFG_TPC_NEW,
-		    sc, fr, cert_rollback, cert_commit);
-		VTAILQ_INSERT_TAIL(cfg_objs, o, list);
+		if (hot && cert_read_ahead(cf) != 0) {
+			nerr++;
+			continue;
+		}
+		cl[n].cf = cf;
+		cl[n].fa = fa;
+		n++;
 	}
+	nerr += load_certs(cl, n);
+	cert_load_queue(cl, n, fr, cfg_objs);
+	free(cl);
 
-	return (0);
+	return (nerr == 0 ? 0 : -1);
 }
 
 /* Query reload of listen sockets.
    Returns -1 on failure.
    Failure: Caller calls .rollback() on the objects added in cfg_objs.
    Success: Caller calls .commit()
+   With hot set, the certificate files loaded are read ahead for
+   hot_msg().
 */
 static int
-frontend_query(struct front_arg *new_set, struct cfg_tpc_obj_head *cfg_objs)
+frontend_query(struct front_arg *new_set, struct cfg_tpc_obj_head *cfg_objs,
+    int hot)
 {
 	struct frontend *fr;
 	struct front_arg *fa, *ftmp;
@@ -3803,7 +6714,7 @@ frontend_query(struct front_arg *new_set, struct cfg_tpc_obj_head *cfg_objs)
 			fa->mark = 1;
 			o = make_cfg_obj(CFG_FRONTEND, CFG_TPC_KEEP, fr, NULL,
 			    frontend_rollback, frontend_commit);
-			if(cert_fr_query(fr, fa, cfg_objs) < 0) {
+			if(cert_fr_query(fr, fa, cfg_objs, hot) < 0) {
 				FREE_OBJ(o);
 				return (-1);
 			}
@@ -3906,11 +6817,13 @@ dcert_commit(struct cfg_tpc_obj *o)
 
 /* Query reload of certificate files */
 static int
-cert_query(hitch_config *cfg, struct cfg_tpc_obj_head *cfg_objs)
+cert_query(hitch_config *cfg, struct cfg_tpc_obj_head *cfg_objs, int hot)
 {
 	struct cfg_cert_file *cf, *cftmp;
 	sslctx *sc, *sctmp;
 	struct cfg_tpc_obj *o;
+	struct cert_load *cl;
+	unsigned n, nerr;
 
 	/* NB: The ordering here is significant. It is imperative that
 	 * all DROP objects are inserted before any NEW objects, in
@@ -3918,7 +6831,8 @@ cert_query(hitch_config *cfg, struct cfg_tpc_obj_head *cfg_objs)
 	HASH_ITER(hh, ssl_ctxs, sc, sctmp) {
 		HASH_FIND_STR(cfg->CERT_FILES, sc->filename, cf);
 		if (cf != NULL && cf->mtim <= sc->mtim
-		    && !ocsp_cfg_changed(cf, sc)) {
+		    && !ocsp_cfg_changed(cf, sc)
+		    && (sc->lazy_cf != NULL) == (cfg->LAZY_CERTS != 0)) {
 			cf->mark = 1;
 		} else {
 			o = make_cfg_obj(CFG_CERT, CFG_TPC_DROP,
@@ -3927,72 +6841,650 @@ cert_query(hitch_config *cfg, struct cfg_tpc_obj_head *cfg_objs)
 		}
 	}
 
-	/* handle default cert. Default cert has its own
-	 * rollback/commit functions. */
-	if (cfg->CERT_DEFAULT != NULL) {
-		cf = cfg->CERT_DEFAULT;
-		CHECK_OBJ_NOTNULL(default_ctx, SSLCTX_MAGIC);
-		if (strcmp(default_ctx->filename, cf->filename) != 0
-		    || cf->mtim > default_ctx->mtim
-		    || ocsp_cfg_changed(cf, default_ctx)) {
-			sc = make_ctx(cf);
-			if (sc == NULL)
-				return (-1);
-			o = make_cfg_obj(CFG_CERT, CFG_TPC_NEW,
-			    sc, NULL, dcert_rollback, dcert_commit);
-			VTAILQ_INSERT_TAIL(cfg_objs, o, list);
+	/* handle default cert. Default cert has its own
+	 * rollback/commit functions. */
+	if (cfg->CERT_DEFAULT != NULL) {
+		cf = cfg->CERT_DEFAULT;
+		CHECK_OBJ_NOTNULL(default_ctx, SSLCTX_MAGIC);
+		if (strcmp(default_ctx->filename, cf->filename) != 0
+		    || cf->mtim > default_ctx->mtim
+		    || ocsp_cfg_changed(cf, default_ctx)) {
+			if (hot && cert_read_ahead(cf) != 0)
+				return (-1);
+			sc = make_ctx(cf);
+			if (sc == NULL)
+				return (-1);
+			o = make_cfg_obj(CFG_CERT, CFG_TPC_NEW,
+			    sc, NULL, dcert_rollback, dcert_commit);
+			VTAILQ_INSERT_TAIL(cfg_objs, o, list);
+		}
+	}
+
+	cl = calloc(HASH_COUNT(cfg->CERT_FILES) + 1, sizeof *cl);
+	AN(cl);
+	n = 0;
+	nerr = 0;
+	HASH_ITER(hh, cfg->CERT_FILES, cf, cftmp) {
+		if (cf->mark)
+			continue;
+		if (hot && cert_read_ahead(cf) != 0) {
+			nerr++;
+			continue;
+		}
+		cl[n].cf = cf;
+		cl[n].lazy = cfg->LAZY_CERTS;
+		n++;
+	}
+	nerr += load_certs(cl, n);
+	cert_load_queue(cl, n, NULL, cfg_objs);
+	free(cl);
+
+	return (nerr == 0 ? 0 : -1);
+}
+
+/* The default context of a frontend is the one of its last certificate */
+static void
+frontend_default_ctx(struct frontend *fr, const struct front_arg *fa)
+{
+	struct cfg_cert_file *cf;
+	sslctx *sc;
+
+	CHECK_OBJ_NOTNULL(fr, FRONTEND_MAGIC);
+	CHECK_OBJ_NOTNULL(fa, FRONT_ARG_MAGIC);
+	if (HASH_COUNT(fr->ssl_ctxs) == 0) {
+		fr->default_ctx = NULL;
+		return;
+	}
+
+	cf = fa->certs;
+	CHECK_OBJ_NOTNULL(cf, CFG_CERT_FILE_MAGIC);
+	while (cf->hh.next != NULL)
+		cf = cf->hh.next;
+	HASH_FIND_STR(fr->ssl_ctxs, cf->filename, sc);
+	CHECK_OBJ_NOTNULL(sc, SSLCTX_MAGIC);
+	fr->default_ctx = sc;
+}
+
+/*
+ * Hot certificate reload.
+ *
+ * A reload that only changes certificates, see config_same_settings(),
+ * is applied to the running workers instead of starting new ones. The
+ * master reads ahead the files of the certificates it loads, and sends
+ * the changes it commits to the workers over the mgt socket: the
+ * contexts dropped, and the contents of the certificates added. The
+ * workers load those the way the master did, and commit the same
+ * changes. They can't be expected to read any file: that includes the
+ * OCSP staples and the client verification CA files.
+ *
+ * A message is a sequence of records, in host byte order:
+ *
+ *	u32 op, str frontend (empty for the global certificates), str file
+ *
+ * followed for HOT_ADD and HOT_DEFAULT by:
+ *
+ *	str key file, str OCSP file, double mtim, double ocsp_mtim,
+ *	i32 ocsp_vfy, str PEM contents, str key PEM contents,
+ *	str OCSP contents, str cached OCSP contents
+ *
+ * and for HOT_CA, which comes before the certificates, by:
+ *
+ *	str CA file contents
+ *
+ * where a str is a u32 length and the bytes, and empty for NULL.
+ *
+ * Each worker answers a message with an int, 0 once it applied it. The
+ * master retires a worker that can't, and forks its replacement.
+ */
+enum hot_op {
+	HOT_DROP = 1,
+	HOT_ADD,
+	HOT_DEFAULT,
+	HOT_CA
+};
+
+struct hot_cert {
+	enum hot_op		op;
+	struct frontend		*fr;
+	struct cfg_cert_file	*cf;
+	sslctx			*sc;
+};
+
+static void
+hot_put_str(struct vsb *vsb, const char *p, size_t len)
+{
+	uint32_t l;
+
+	l = p != NULL ? len : 0;
+	AZ(VSB_bcat(vsb, &l, sizeof l));
+	if (l > 0)
+		AZ(VSB_bcat(vsb, p, l));
+}
+
+static void
+hot_put_cert(struct vsb *vsb, enum hot_op op, const struct frontend *fr,
+    const char *filename, const struct cfg_cert_file *cf)
+{
+	uint32_t u;
+	int32_t i;
+
+	AN(filename);
+	u = op;
+	AZ(VSB_bcat(vsb, &u, sizeof u));
+	hot_put_str(vsb, fr != NULL ? fr->arg->pspec : NULL,
+	    fr != NULL ? strlen(fr->arg->pspec) : 0);
+	hot_put_str(vsb, filename, strlen(filename));
+	if (op == HOT_DROP)
+		return;
+
+	CHECK_OBJ_NOTNULL(cf, CFG_CERT_FILE_MAGIC);
+	AN(cf->pem);
+	hot_put_str(vsb, cf->priv_key_filename, cf->priv_key_filename ?
+	    strlen(cf->priv_key_filename) : 0);
+	hot_put_str(vsb, cf->ocspfn, cf->ocspfn ? strlen(cf->ocspfn) : 0);
+	AZ(VSB_bcat(vsb, &cf->mtim, sizeof cf->mtim));
+	AZ(VSB_bcat(vsb, &cf->ocsp_mtim, sizeof cf->ocsp_mtim));
+	i = cf->ocsp_vfy;
+	AZ(VSB_bcat(vsb, &i, sizeof i));
+	hot_put_str(vsb, cf->pem, cf->pem_len);
+	hot_put_str(vsb, cf->key_pem, cf->key_pem_len);
+	hot_put_str(vsb, cf->ocsp, cf->ocsp_len);
+	hot_put_str(vsb, cf->ocsp_cached, cf->ocsp_cached_len);
+}
+
+static int
+hot_put_ca(struct vsb *vsb, const char *fn)
+{
+	char *pem;
+	size_t len;
+	uint32_t u;
+
+	AN(fn);
+	if (read_ahead(fn, &pem, &len) != 0) {
+		ERR("{core} Unable to read client-verify-ca '%s': %s\n",
+		    fn, strerror(errno));
+		return (-1);
+	}
+	u = HOT_CA;
+	AZ(VSB_bcat(vsb, &u, sizeof u));
+	hot_put_str(vsb, NULL, 0);
+	hot_put_str(vsb, fn, strlen(fn));
+	hot_put_str(vsb, pem, len);
+	free(pem);
+	return (0);
+}
+
+/* The client verification CA files of cfg */
+static int
+hot_put_cas(struct vsb *vsb, const hitch_config *cfg)
+{
+	struct front_arg *fa, *fatmp;
+
+	if (cfg->CLIENT_VERIFY != SSL_VERIFY_NONE &&
+	    hot_put_ca(vsb, cfg->CLIENT_VERIFY_CA) != 0)
+		return (-1);
+	HASH_ITER(hh, cfg->LISTEN_ARGS, fa, fatmp) {
+		CHECK_OBJ_NOTNULL(fa, FRONT_ARG_MAGIC);
+		if (fa->client_verify_ca != NULL &&
+		    hot_put_ca(vsb, fa->client_verify_ca) != 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/* The message of the changes queried in cfg_objs, before they are
+ * committed. Returns NULL if they can't be applied to the workers. */
+static struct vsb *
+hot_msg(const struct cfg_tpc_obj_head *cfg_objs, const hitch_config *cfg)
+{
+	struct cfg_tpc_obj *o;
+	struct front_arg *fa;
+	struct cfg_cert_file *cf;
+	struct frontend *fr;
+	struct vsb *vsb;
+	sslctx *sc;
+	int cas = 0;
+
+	vsb = VSB_new_auto();
+	AN(vsb);
+	VTAILQ_FOREACH(o, cfg_objs, list) {
+		CHECK_OBJ_NOTNULL(o, CFG_TPC_OBJ_MAGIC);
+		if (o->type == CFG_FRONTEND) {
+			if (o->handling != CFG_TPC_KEEP)
+				break;
+			continue;
+		}
+		assert(o->type == CFG_CERT);
+		CAST_OBJ_NOTNULL(sc, o->p[0], SSLCTX_MAGIC);
+		fr = NULL;
+		if (o->p[1] != NULL)
+			CAST_OBJ_NOTNULL(fr, o->p[1], FRONTEND_MAGIC);
+
+		if (o->handling == CFG_TPC_DROP) {
+			hot_put_cert(vsb, HOT_DROP, fr, sc->filename, NULL);
+			continue;
+		}
+		assert(o->handling == CFG_TPC_NEW);
+		if (o->commit == dcert_commit) {
+			cf = cfg->CERT_DEFAULT;
+		} else if (fr != NULL) {
+			HASH_FIND_STR(cfg->LISTEN_ARGS, fr->arg->pspec, fa);
+			CHECK_OBJ_NOTNULL(fa, FRONT_ARG_MAGIC);
+			HASH_FIND_STR(fa->certs, sc->filename, cf);
+		} else
+			HASH_FIND_STR(cfg->CERT_FILES, sc->filename, cf);
+		CHECK_OBJ_NOTNULL(cf, CFG_CERT_FILE_MAGIC);
+		if (cf->pem == NULL)
+			break;	/* Out of a bundle */
+		if (!cas && hot_put_cas(vsb, cfg) != 0)
+			break;
+		cas = 1;
+		hot_put_cert(vsb, o->commit == dcert_commit ? HOT_DEFAULT :
+		    HOT_ADD, fr, cf->filename, cf);
+	}
+	AZ(VSB_finish(vsb));
+	if (o != NULL) {
+		VSB_delete(vsb);
+		return (NULL);
+	}
+	return (vsb);
+}
+
+static int
+hot_get(const char **p, size_t *len, void *dst, size_t l)
+{
+
+	if (*len < l)
+		return (-1);
+	memcpy(dst, *p, l);
+	*p += l;
+	*len -= l;
+	return (0);
+}
+
+/* A copy of a str, NULL if it is empty */
+static int
+hot_get_str(const char **p, size_t *len, char **dst, size_t *lp)
+{
+	uint32_t l;
+
+	*dst = NULL;
+	if (hot_get(p, len, &l, sizeof l) != 0 || *len < l)
+		return (-1);
+	if (lp != NULL)
+		*lp = l;
+	if (l == 0)
+		return (0);
+	*dst = malloc(l + 1);
+	AN(*dst);
+	memcpy(*dst, *p, l);
+	(*dst)[l] = '\0';
+	*p += l;
+	*len -= l;
+	return (0);
+}
+
+static int
+hot_get_cert(const char **p, size_t *len, struct hot_cert *hc)
+{
+	struct cfg_cert_file *cf;
+	struct frontend *fr;
+	char *pspec, *pem;
+	size_t l;
+	uint32_t u;
+	int32_t i;
+
+	memset(hc, 0, sizeof *hc);
+	if (hot_get(p, len, &u, sizeof u) != 0 ||
+	    (u != HOT_DROP && u != HOT_ADD && u != HOT_DEFAULT &&
+	    u != HOT_CA) ||
+	    hot_get_str(p, len, &pspec, NULL) != 0)
+		return (-1);
+	hc->op = u;
+	if (pspec != NULL) {
+		VTAILQ_FOREACH(fr, &frontends, list) {
+			CHECK_OBJ_NOTNULL(fr, FRONTEND_MAGIC);
+			if (strcmp(fr->arg->pspec, pspec) == 0)
+				break;
+		}
+		free(pspec);
+		if (fr == NULL)
+			return (-1);
+		hc->fr = fr;
+	}
+
+	cf = cfg_cert_file_new();
+	hc->cf = cf;
+	if (hot_get_str(p, len, &cf->filename, NULL) != 0 ||
+	    cf->filename == NULL)
+		return (-1);
+	if (hc->op == HOT_DROP)
+		return (0);
+	if (hc->op == HOT_CA) {
+		if (hot_get_str(p, len, &pem, &l) != 0 || pem == NULL)
+			return (-1);
+		ca_pem_set(cf->filename, pem, l);
+		cf->filename = NULL;
+		cfg_cert_file_free(&hc->cf);
+		return (0);
+	}
+	if (hot_get_str(p, len, &cf->priv_key_filename, NULL) != 0 ||
+	    hot_get_str(p, len, &cf->ocspfn, NULL) != 0 ||
+	    hot_get(p, len, &cf->mtim, sizeof cf->mtim) != 0 ||
+	    hot_get(p, len, &cf->ocsp_mtim, sizeof cf->ocsp_mtim) != 0 ||
+	    hot_get(p, len, &i, sizeof i) != 0 ||
+	    hot_get_str(p, len, &cf->pem, &cf->pem_len) != 0 ||
+	    cf->pem == NULL ||
+	    hot_get_str(p, len, &cf->key_pem, &cf->key_pem_len) != 0 ||
+	    hot_get_str(p, len, &cf->ocsp, &cf->ocsp_len) != 0 ||
+	    hot_get_str(p, len, &cf->ocsp_cached, &cf->ocsp_cached_len) != 0)
+		return (-1);
+	cf->ocsp_vfy = i;
+	return (0);
+}
+
+/* Apply a message of the master in a worker. Returns -1 if any of it
+ * can't be, in which case nothing is changed. */
+static int
+hot_apply(const char *msg, size_t len)
+{
+	struct hot_cert *hc = NULL;
+	struct cert_load *cl;
+	struct cfg_tpc_obj *o;
+	struct frontend *fr;
+	sslctx *sc, **ctxs;
+	unsigned u, n = 0, nload = 0, ndrop = 0, nerr = 0;
+	double t0;
+
+	t0 = Time_now();
+	while (len > 0) {
+		if (n % 16 == 0) {
+			hc = realloc(hc, (n + 16) * sizeof *hc);
+			AN(hc);
+		}
+		if (hot_get_cert(&msg, &len, &hc[n]) != 0) {
+			ERR("{core} Worker %d: Invalid certificate update\n",
+			    core_id);
+			if (hc[n].cf != NULL)
+				cfg_cert_file_free(&hc[n].cf);
+			nerr++;
+			break;
+		}
+		if (hc[n].op == HOT_CA)
+			continue;
+		if (hc[n].op == HOT_DROP) {
+			ctxs = hc[n].fr != NULL ? &hc[n].fr->ssl_ctxs :
+			    &ssl_ctxs;
+			HASH_FIND_STR(*ctxs, hc[n].cf->filename, hc[n].sc);
+			if (hc[n].sc == NULL) {
+				ERR("{core} Worker %d: Certificate '%s' is "
+				    "not loaded\n", core_id,
+				    hc[n].cf->filename);
+				nerr++;
+			}
+			ndrop++;
+		}
+		n++;
+	}
+
+	cl = calloc(n + 1, sizeof *cl);
+	AN(cl);
+	for (u = 0; nerr == 0 && u < n; u++) {
+		if (hc[u].op == HOT_DEFAULT) {
+			hc[u].sc = make_ctx(hc[u].cf);
+			if (hc[u].sc == NULL)
+				nerr++;
+		} else if (hc[u].op == HOT_ADD) {
+			cl[nload].cf = hc[u].cf;
+			if (hc[u].fr != NULL)
+				cl[nload].fa = hc[u].fr->arg;
+			else
+				cl[nload].lazy = CONFIG->LAZY_CERTS;
+			nload++;
+		}
+	}
+	if (nerr == 0)
+		nerr = load_certs(cl, nload);
+	nload = 0;
+	for (u = 0; u < n; u++) {
+		if (hc[u].op == HOT_ADD)
+			hc[u].sc = cl[nload++].sc;
+	}
+	free(cl);
+
+	for (u = 0; u < n; u++) {
+		if (nerr != 0) {
+			if (hc[u].op != HOT_DROP)
+				sctx_free(hc[u].sc, NULL);
+		} else {
+			/* In the order the master committed them */
+			o = make_cfg_obj(CFG_CERT, hc[u].op == HOT_DROP ?
+			    CFG_TPC_DROP : CFG_TPC_NEW, hc[u].sc, hc[u].fr,
+			    cert_rollback, hc[u].op == HOT_DEFAULT ?
+			    dcert_commit : cert_commit);
+			o->commit(o);
+			FREE_OBJ(o);
+		}
+		cfg_cert_file_free(&hc[u].cf);
+	}
+	if (nerr != 0) {
+		free(hc);
+		return (-1);
+	}
+
+	VTAILQ_FOREACH(fr, &frontends, list)
+		frontend_default_ctx(fr, fr->arg);
+#ifndef OPENSSL_NO_TLSEXT
+	rebuild_sni_indexes();
+#endif
+	for (u = 0; CONFIG->OCSP_DIR != NULL && u < n; u++) {
+		if (hc[u].op == HOT_DROP)
+			continue;
+		sc = staple_ctx(hc[u].sc);
+		if (sc != NULL && sc->ev_staple != NULL &&
+		    !ev_is_active(sc->ev_staple))
+			ev_stat_start(loop, sc->ev_staple);
+	}
+	free(hc);
+
+	LOGL("{core} Worker %d: Updated %u certificates, dropped %u, "
+	    "in %.3fs\n", core_id, n - ndrop, ndrop, Time_now() - t0);
+	return (0);
+}
+
+/* How long a worker has to take an update from the master, and to apply
+ * a hot_msg(). The master waits for them meanwhile. */
+#define MGT_TIMEOUT	10.
+
+/* Write all of a buffer to the socket of a worker, until the deadline */
+static int
+mgt_write(int fd, const void *p, size_t len, double deadline)
+{
+	struct pollfd pfd;
+	const char *b = p;
+	ssize_t l;
+	double t;
+
+	while (len > 0) {
+		l = write(fd, b, len);
+		if (l > 0) {
+			b += l;
+			len -= l;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EWOULDBLOCK && errno != EAGAIN)
+			return (-1);
+		t = deadline - Time_now();
+		if (t <= 0) {
+			errno = ETIMEDOUT;
+			return (-1);
+		}
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, (int)(t * 1e3) + 1) < 0 && errno != EINTR)
+			return (-1);
+	}
+	return (0);
+}
+
+/* Retire a worker of the current generation, and fork its replacement
+ * right away */
+static void
+worker_replace(struct worker_proc *c)
+{
+	struct worker_update wu;
+
+	CHECK_OBJ_NOTNULL(c, WORKER_PROC_MAGIC);
+	assert(c->gen == worker_gen);
+	c->gen = worker_gen - 1;
+	c->hot_pending = 0;
+	memset(&wu, 0, sizeof wu);
+	wu.type = WORKER_GEN;
+	wu.payload.gen = c->gen;
+	if (mgt_write(c->pfd, &wu, sizeof wu, Time_now() + MGT_TIMEOUT) != 0) {
+		ERR("WARNING: {core} Unable to gracefully reload worker %d"
+		    " (%s).\n", c->pid, strerror(errno));
+		(void)kill(c->pid, SIGTERM);
+	}
+	start_workers(c->core_id, 1);
+}
+
+/* Send a hot_msg() to the workers of the current generation, and wait
+ * for their answers. A worker that can't be updated is replaced, by a
+ * worker forked from the master. */
+static void
+notify_workers_certs(const struct vsb *msg)
+{
+	struct worker_update wu;
+	struct worker_proc *c, *ctmp;
+	struct pollfd *pfd;
+	double deadline, t;
+	int i, n, r;
+
+	memset(&wu, 0, sizeof wu);
+	wu.type = CERT_UPDATE;
+	wu.payload.certs_len = VSB_len(msg);
+	n = 0;
+	deadline = Time_now() + MGT_TIMEOUT;
+	VTAILQ_FOREACH(c, &worker_procs, list) {
+		if (c->gen != worker_gen)
+			continue;
+		if (mgt_write(c->pfd, &wu, sizeof wu, deadline) != 0 ||
+		    mgt_write(c->pfd, VSB_data(msg), VSB_len(msg),
+		    deadline) != 0) {
+			/* Killed midway through a message, replaced in
+			 * do_wait() */
+			ERR("WARNING: {core} Unable to send the certificates"
+			    " to worker %d (%s).\n", c->pid, strerror(errno));
+			(void)kill(c->pid, SIGTERM);
+			continue;
+		}
+		c->hot_pending = 1;
+		n++;
+	}
+
+	pfd = calloc(n + 1, sizeof *pfd);
+	AN(pfd);
+	deadline = Time_now() + MGT_TIMEOUT;
+	for (;;) {
+		n = 0;
+		VTAILQ_FOREACH(c, &worker_procs, list) {
+			if (!c->hot_pending)
+				continue;
+			pfd[n].fd = c->pfd;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			n++;
+		}
+		t = deadline - Time_now();
+		if (n == 0 || t <= 0)
+			break;
+		if (poll(pfd, n, (int)(t * 1e3) + 1) < 0 && errno != EINTR)
+			break;
+		/* Replacements are appended to worker_procs */
+		n = 0;
+		VTAILQ_FOREACH_SAFE(c, &worker_procs, list, ctmp) {
+			if (!c->hot_pending)
+				continue;
+			if (pfd[n++].revents == 0)
+				continue;
+			r = read(c->pfd, &i, sizeof i);
+			if (r < 0 && (errno == EINTR || errno == EAGAIN ||
+			    errno == EWOULDBLOCK))
+				continue;
+			c->hot_pending = 0;
+			/* Gone if r is 0, and replaced in do_wait() */
+			if (r == 0 || (r == sizeof i && i == 0))
+				continue;
+			ERR("WARNING: {core} Worker %d could not apply the "
+			    "certificates, replacing it.\n", c->pid);
+			worker_replace(c);
 		}
 	}
+	free(pfd);
 
-	HASH_ITER(hh, cfg->CERT_FILES, cf, cftmp) {
-		if (cf->mark)
+	VTAILQ_FOREACH_SAFE(c, &worker_procs, list, ctmp) {
+		if (!c->hot_pending)
 			continue;
-		sc = make_ctx(cf);
-		if (sc == NULL)
-			return (-1);
-		o = make_cfg_obj(CFG_CERT, CFG_TPC_NEW,
-		    sc, NULL, cert_rollback, cert_commit);
-		VTAILQ_INSERT_TAIL(cfg_objs, o, list);
+		ERR("WARNING: {core} Worker %d did not apply the "
+		    "certificates in time, replacing it.\n", c->pid);
+		worker_replace(c);
 	}
-
-	return (0);
 }
 
 static void
 notify_workers(struct worker_update *wu)
 {
 	struct worker_proc *c;
-	int i;
+	double deadline;
+
+	deadline = Time_now() + MGT_TIMEOUT;
 	VTAILQ_FOREACH(c, &worker_procs, list) {
+		if (c->pfd < 0)
+			continue;
 		if ((wu->type == WORKER_GEN && wu->payload.gen != c->gen) ||
 		     (wu->type == BACKEND_REFRESH)) {
-			errno = 0;
-			do {
-				i = write(c->pfd, (void*)wu, sizeof(*wu));
-				if (i == -1 && errno != EINTR) {
-					if (wu->type == WORKER_GEN)
-						ERR("WARNING: {core} Unable to "
-						"gracefully reload worker %d"
-						" (%s).\n",
-						c->pid, strerror(errno));
-					else
-						ERR("WARNING: {core} Unable to "
-						"notify worker %d "
-						"with changed backend address (%s).\n",
-						c->pid, strerror(errno));
-
-					(void)kill(c->pid, SIGTERM);
-					break;
-				}
-			} while (i == -1 && errno == EINTR);
+			if (mgt_write(c->pfd, wu, sizeof *wu, deadline) != 0) {
+				if (wu->type == WORKER_GEN)
+					ERR("WARNING: {core} Unable to "
+					"gracefully reload worker %d"
+					" (%s).\n",
+					c->pid, strerror(errno));
+				else
+					ERR("WARNING: {core} Unable to "
+					"notify worker %d "
+					"with changed backend address (%s).\n",
+					c->pid, strerror(errno));
+
+				(void)kill(c->pid, SIGTERM);
+			}
 
-			if (wu->type == WORKER_GEN)
+			if (wu->type == WORKER_GEN) {
 				(void)close(c->pfd);
-
+				c->pfd = -1;
+			}
 		}
 	}
 }
 
+/* Start the workers of a new generation, and retire the others */
+static void
+workers_new_gen(void)
+{
+	struct worker_update wu;
+
+	worker_gen++;
+	start_workers(0, CONFIG->NCORES);
+
+	memset(&wu, 0, sizeof wu);
+	wu.type = WORKER_GEN;
+	wu.payload.gen = worker_gen;
+	notify_workers(&wu);
+}
+
 /*
  * Print Hitch's listen enpoints to a file.
  * Used for testing purposes.
@@ -4029,6 +7521,447 @@ listen_endpoint_print(const char *fn)
 	return (0);
 }
 
+/*
+ * pem-dir watcher.
+ *
+ * With pem-dir-watch, the parent process watches pem-dir with inotify.
+ * The names of the files changed are collected until no change was seen
+ * for pem-dir-watch-delay seconds, or for at most ten times as long
+ * under a steady stream of changes. Only those files are then looked at
+ * again, and the certificates added, changed or removed are applied to
+ * the workers like a hot certificate reload. Whatever can't be handled
+ * that way, such as a change of the default certificate, results in a
+ * full reload.
+ */
+#ifdef HAVE_SYS_INOTIFY_H
+struct pem_dir_change {
+	unsigned		magic;
+#define PEM_DIR_CHANGE_MAGIC	0x6c0b93d1
+	char			*name;
+	UT_hash_handle		hh;
+};
+
+#define PEM_DIR_RM	1
+#define PEM_DIR_ERR	2
+
+static int pem_dir_fd = -1;
+static char *pem_dir_path;
+static struct pem_dir_change *pem_dir_changes;
+static int pem_dir_full;	/* A full reload is needed */
+static int pem_dir_lost;	/* The watch is gone with the directory */
+static double pem_dir_first;	/* Time of the first pending change */
+static double pem_dir_due;	/* When to apply them, 0 if none */
+#ifdef USE_SHARED_CACHE
+static ev_io pem_dir_ev;	/* For the cache update event loop */
+static ev_timer pem_dir_tmo;
+#endif
+
+static void
+pem_dir_clear(void)
+{
+	struct pem_dir_change *pc, *pctmp;
+
+	HASH_ITER(hh, pem_dir_changes, pc, pctmp) {
+		CHECK_OBJ_NOTNULL(pc, PEM_DIR_CHANGE_MAGIC);
+		HASH_DEL(pem_dir_changes, pc);
+		free(pc->name);
+		FREE_OBJ(pc);
+	}
+	pem_dir_full = 0;
+	pem_dir_first = 0;
+	pem_dir_due = 0;
+}
+
+/* Start, keep or stop watching pem-dir after a configuration load */
+static void
+pem_dir_watch(void)
+{
+
+	if (pem_dir_fd >= 0 && !pem_dir_lost && CONFIG->PEM_DIR_WATCH &&
+	    CONFIG->PEM_DIR != NULL && strcmp(pem_dir_path, CONFIG->PEM_DIR) == 0)
+		return;
+
+	if (pem_dir_fd >= 0) {
+#ifdef USE_SHARED_CACHE
+		/* The next inotify descriptor may get the same number */
+		if (ev_is_active(&pem_dir_ev))
+			ev_io_stop(loop, &pem_dir_ev);
+#endif
+		(void)close(pem_dir_fd);
+		pem_dir_fd = -1;
+		free(pem_dir_path);
+		pem_dir_path = NULL;
+		pem_dir_lost = 0;
+		pem_dir_clear();
+	}
+	if (!CONFIG->PEM_DIR_WATCH || CONFIG->PEM_DIR == NULL)
+		return;
+
+	pem_dir_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (pem_dir_fd < 0) {
+		ERR("{core} Unable to watch pem-dir: %s\n", strerror(errno));
+		return;
+	}
+	if (inotify_add_watch(pem_dir_fd, CONFIG->PEM_DIR, IN_CLOSE_WRITE |
+	    IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB |
+	    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR) < 0) {
+		ERR("{core} Unable to watch pem-dir '%s': %s\n",
+		    CONFIG->PEM_DIR, strerror(errno));
+		(void)close(pem_dir_fd);
+		pem_dir_fd = -1;
+		return;
+	}
+	pem_dir_path = strdup(CONFIG->PEM_DIR);
+	AN(pem_dir_path);
+	LOG("{core} Watching pem-dir '%s' for changes\n", pem_dir_path);
+}
+
+/* Collect the changes reported by inotify */
+static void
+pem_dir_read(void)
+{
+	char buf[4096]
+	    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct pem_dir_change *pc;
+	unsigned n = 0;
+	ssize_t l;
+	double now;
+	char *p;
+
+	while ((l = read(pem_dir_fd, buf, sizeof buf)) > 0) {
+		for (p = buf; p < buf + l; p += sizeof *ev + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF |
+			    IN_IGNORED))
+				pem_dir_lost = 1;
+			if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF |
+			    IN_MOVE_SELF | IN_IGNORED)) {
+				pem_dir_full = 1;
+				n++;
+				continue;
+			}
+			if (ev->len == 0 || (ev->mask & IN_ISDIR))
+				continue;
+			if (CONFIG->PEM_DIR_GLOB != NULL &&
+			    fnmatch(CONFIG->PEM_DIR_GLOB, ev->name, 0))
+				continue;
+			n++;
+			HASH_FIND_STR(pem_dir_changes, ev->name, pc);
+			if (pc != NULL)
+				continue;
+			ALLOC_OBJ(pc, PEM_DIR_CHANGE_MAGIC);
+			AN(pc);
+			pc->name = strdup(ev->name);
+			AN(pc->name);
+			HASH_ADD_KEYPTR(hh, pem_dir_changes, pc->name,
+			    strlen(pc->name), pc);
+		}
+	}
+	if (l < 0 && errno != EAGAIN && errno != EINTR)
+		ERR("{core} Unable to read pem-dir changes: %s\n",
+		    strerror(errno));
+	if (n == 0)
+		return;
+
+	now = Time_now();
+	if (pem_dir_first == 0)
+		pem_dir_first = now;
+	pem_dir_due = now + CONFIG->PEM_DIR_WATCH_DELAY;
+	if (pem_dir_due > pem_dir_first + 10. * CONFIG->PEM_DIR_WATCH_DELAY)
+		pem_dir_due = pem_dir_first + 10. * CONFIG->PEM_DIR_WATCH_DELAY;
+}
+
+#ifdef USE_SHARED_CACHE
+static void
+pem_dir_ev_read(struct ev_loop *loop, ev_io *w, int revents)
+{
+
+	(void)loop;
+	(void)w;
+	(void)revents;
+	pem_dir_read();
+}
+
+static void
+pem_dir_ev_due(struct ev_loop *loop, ev_timer *w, int revents)
+{
+
+	/* Only wakes the loop up, the caller applies the changes */
+	(void)loop;
+	(void)w;
+	(void)revents;
+}
+
+/* The master waits in the cache update event loop rather than in
+ * master_sleep(): watch pem-dir from there. Returns -1 if the pending
+ * changes are due. */
+static int
+pem_dir_ev_sync(struct ev_loop *loop)
+{
+	double now;
+
+	if (pem_dir_fd < 0) {
+		if (ev_is_active(&pem_dir_ev))
+			ev_io_stop(loop, &pem_dir_ev);
+	} else if (!ev_is_active(&pem_dir_ev)) {
+		ev_io_init(&pem_dir_ev, pem_dir_ev_read, pem_dir_fd, EV_READ);
+		ev_io_start(loop, &pem_dir_ev);
+	}
+
+	ev_timer_stop(loop, &pem_dir_tmo);
+	if (pem_dir_due == 0)
+		return (0);
+	now = Time_now();
+	if (now >= pem_dir_due)
+		return (-1);
+	ev_timer_init(&pem_dir_tmo, pem_dir_ev_due, pem_dir_due - now, 0.);
+	ev_timer_start(loop, &pem_dir_tmo);
+	return (0);
+}
+#endif
+
+/* Apply the pending pem-dir changes. Returns -1 if a full reload is
+ * needed instead. */
+static int
+pem_dir_update(void)
+{
+	struct cfg_tpc_obj_head cfg_objs;
+	struct cfg_tpc_obj *o, *otmp;
+	struct pem_dir_change *pc, *pctmp;
+	struct cfg_cert_file *cf, *ocf, **cfa;
+	struct cert_load *cl;
+	struct frontend *fr;
+	struct vsb *vsb;
+	const char *dflt = NULL;
+	unsigned u, k, n, ncf, nadd, nrm, nerr;
+	size_t l;
+	double t0;
+	sslctx *sc;
+
+	if (pem_dir_full || !CONFIG->HOT_CERT_RELOAD ||
+	    CONFIG->CERT_BUNDLE != NULL) {
+		pem_dir_clear();
+		return (-1);
+	}
+
+	t0 = Time_now();
+	AN(CONFIG->PEM_DIR);
+	l = strlen(CONFIG->PEM_DIR);
+	/* A file sorted before a pem-dir default certificate may take
+	 * its place. */
+	if (CONFIG->CERT_DEFAULT != NULL &&
+	    strncmp(CONFIG->CERT_DEFAULT->filename, CONFIG->PEM_DIR, l) == 0)
+		dflt = CONFIG->CERT_DEFAULT->filename + l;
+
+	/* The files changed, with mark set to PEM_DIR_RM for those that
+	 * went away and to PEM_DIR_ERR for those that fail to load. */
+	VTAILQ_INIT(&cfg_objs);
+	cfa = calloc(HASH_COUNT(pem_dir_changes) + 1, sizeof *cfa);
+	AN(cfa);
+	ncf = 0;
+	HASH_ITER(hh, pem_dir_changes, pc, pctmp) {
+		CHECK_OBJ_NOTNULL(pc, PEM_DIR_CHANGE_MAGIC);
+		if (dflt != NULL && strcoll(pc->name, dflt) <= 0)
+			break;
+
+		cf = cfg_cert_file_new();
+		cf->filename = malloc(l + strlen(pc->name) + 1);
+		AN(cf->filename);
+		strcpy(cf->filename, CONFIG->PEM_DIR);
+		strcat(cf->filename, pc->name);
+
+		/* Also a frontend or pem-file certificate */
+		VTAILQ_FOREACH(fr, &frontends, list) {
+			HASH_FIND_STR(fr->ssl_ctxs, cf->filename, sc);
+			if (sc != NULL)
+				break;
+		}
+		HASH_FIND_STR(CONFIG->CERT_FILES, cf->filename, ocf);
+		if (fr != NULL || (ocf != NULL &&
+		    (ocf->priv_key_filename != NULL || ocf->ocspfn != NULL))) {
+			cfg_cert_file_free(&cf);
+			break;
+		}
+
+		HASH_FIND_STR(ssl_ctxs, cf->filename, sc);
+		if (!cfg_cert_vfy(cf)) {
+			if (sc == NULL && ocf == NULL) {
+				cfg_cert_file_free(&cf);
+				continue;
+			}
+			cf->mark = PEM_DIR_RM;
+		} else if (sc != NULL && cf->mtim <= sc->mtim &&
+		    !ocsp_cfg_changed(cf, sc)) {
+			cfg_cert_file_free(&cf);
+			continue;
+		}
+		cfa[ncf++] = cf;
+
+		if (sc != NULL) {
+			o = make_cfg_obj(CFG_CERT, CFG_TPC_DROP,
+			    sc, NULL, cert_rollback, cert_commit);
+			VTAILQ_INSERT_TAIL(&cfg_objs, o, list);
+		}
+	}
+
+	if (pc != NULL) {
+		VTAILQ_FOREACH_SAFE(o, &cfg_objs, list, otmp) {
+			VTAILQ_REMOVE(&cfg_objs, o, list);
+			FREE_OBJ(o);
+		}
+		for (u = 0; u < ncf; u++)
+			cfg_cert_file_free(&cfa[u]);
+		free(cfa);
+		pem_dir_clear();
+		return (-1);
+	}
+	pem_dir_clear();
+
+	cl = calloc(ncf + 1, sizeof *cl);
+	AN(cl);
+	n = 0;
+	for (u = 0; u < ncf; u++) {
+		if (cfa[u]->mark == PEM_DIR_RM)
+			continue;
+		if (cert_read_ahead(cfa[u]) != 0) {
+			cfa[u]->mark = PEM_DIR_ERR;
+			continue;
+		}
+		cl[n].cf = cfa[u];
+		cl[n].lazy = CONFIG->LAZY_CERTS;
+		n++;
+	}
+	(void)load_certs(cl, n);
+	cert_load_queue(cl, n, NULL, &cfg_objs);
+	for (u = 0, k = 0; u < ncf; u++) {
+		if (cfa[u]->mark != 0)
+			continue;
+		assert(cl[k].cf == cfa[u]);
+		if (cl[k++].sc == NULL)
+			cfa[u]->mark = PEM_DIR_ERR;
+	}
+	assert(k == n);
+	free(cl);
+
+	/* A certificate that fails to load keeps its previous version */
+	nadd = nrm = nerr = 0;
+	for (u = 0; u < ncf; u++) {
+		cf = cfa[u];
+		if (cf->mark == PEM_DIR_ERR) {
+			VTAILQ_FOREACH(o, &cfg_objs, list) {
+				CAST_OBJ_NOTNULL(sc, o->p[0], SSLCTX_MAGIC);
+				if (o->handling == CFG_TPC_DROP &&
+				    strcmp(sc->filename, cf->filename) == 0)
+					break;
+			}
+			if (o != NULL) {
+				VTAILQ_REMOVE(&cfg_objs, o, list);
+				FREE_OBJ(o);
+			}
+			cfg_cert_file_free(&cfa[u]);
+			nerr++;
+			continue;
+		}
+		HASH_FIND_STR(CONFIG->CERT_FILES, cf->filename, ocf);
+		if (ocf != NULL) {
+			HASH_DEL(CONFIG->CERT_FILES, ocf);
+			cfg_cert_file_free(&ocf);
+		}
+		if (cf->mark == PEM_DIR_RM) {
+			cfg_cert_file_free(&cfa[u]);
+			nrm++;
+			continue;
+		}
+		cfg_cert_add(cf, &CONFIG->CERT_FILES);
+		nadd++;
+	}
+
+	if (VTAILQ_EMPTY(&cfg_objs)) {
+		free(cfa);
+		return (0);
+	}
+
+	/* NULL if a client verification CA file can't be read */
+	vsb = hot_msg(&cfg_objs, CONFIG);
+	VTAILQ_FOREACH_SAFE(o, &cfg_objs, list, otmp) {
+		VTAILQ_REMOVE(&cfg_objs, o, list);
+		AN(o->commit);
+		o->commit(o);
+		FREE_OBJ(o);
+	}
+#ifndef OPENSSL_NO_TLSEXT
+	rebuild_sni_indexes();
+#endif
+
+	/* The workers got the contents, no need to keep them around */
+	for (u = 0; u < ncf; u++) {
+		if (cfa[u] == NULL)
+			continue;
+		cert_read_ahead_free(cfa[u]);
+	}
+	free(cfa);
+
+	if (vsb != NULL) {
+		LOGL("{core} pem-dir: %u certificates loaded, %u removed, "
+		    "%u failed, in %.2lf seconds. Updating child processes "
+		    "(%zd bytes).\n", nadd, nrm, nerr, Time_now() - t0,
+		    VSB_len(vsb));
+		notify_workers_certs(vsb);
+		VSB_delete(vsb);
+	} else {
+		LOGL("{core} pem-dir: %u certificates loaded, %u removed, "
+		    "%u failed, in %.2lf seconds. Starting new child "
+		    "processes.\n", nadd, nrm, nerr, Time_now() - t0);
+		workers_new_gen();
+	}
+
+	/* Restarted with the new certificates in do_wait() */
+	if (ocsp_proc_pid > 0)
+		(void)kill(ocsp_proc_pid, SIGTERM);
+	return (0);
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/* Sleep until a signal arrives, pem-dir changes are due, or for timeout
+ * seconds if it is positive. Returns -1 if woken up early. */
+static int
+master_sleep(double timeout)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	struct pollfd pfd;
+	double now, end, t;
+
+	if (pem_dir_fd >= 0) {
+		end = timeout > 0 ? Time_now() + timeout : 0;
+		for (;;) {
+			now = Time_now();
+			if (pem_dir_due > 0 && now >= pem_dir_due)
+				return (-1);
+			if (end > 0 && now >= end)
+				return (0);
+			t = end > 0 ? end - now : -1;
+			if (pem_dir_due > 0 && (t < 0 || pem_dir_due - now < t))
+				t = pem_dir_due - now;
+			pfd.fd = pem_dir_fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, t < 0 ? -1 : (int)(t * 1e3) + 1) < 0)
+				return (-1);
+			if (pfd.revents & POLLIN)
+				pem_dir_read();
+		}
+	}
+#endif
+	if (timeout <= 0) {
+		pause();
+		return (-1);
+	}
+	if (usleep(timeout * 1000000) == -1 && errno == EINTR)
+		return (-1);
+	return (0);
+}
+
 static void
 reconfigure(int argc, char **argv)
 {
@@ -4037,8 +7970,9 @@ reconfigure(int argc, char **argv)
 	struct cfg_tpc_obj *cto, *cto_tmp;
 	struct timeval tv;
 	double t0, t1;
-	struct worker_update wu;
 	struct frontend *fr;
+	struct vsb *hot_vsb = NULL;
+	int hot;
 
 	LOGL("Received SIGHUP: Initiating configuration reload.\n");
 	AZ(gettimeofday(&tv, NULL));
@@ -4053,10 +7987,15 @@ reconfigure(int argc, char **argv)
 		return;
 	}
 
+	/* Only certificates can change: try to update the workers in
+	 * place. Those of a bundle are mapped by the master. */
+	hot = cfg_new->HOT_CERT_RELOAD && cfg_new->CERT_BUNDLE == NULL &&
+	    config_same_settings(CONFIG, cfg_new);
+
 	/* NB: the ordering of the foo_query() calls here is
 	 * significant. */
-	if (frontend_query(cfg_new->LISTEN_ARGS, &cfg_objs) < 0
-	    || cert_query(cfg_new, &cfg_objs) < 0) {
+	if (frontend_query(cfg_new->LISTEN_ARGS, &cfg_objs, hot) < 0
+	    || cert_query(cfg_new, &cfg_objs, hot) < 0) {
 		VTAILQ_FOREACH_SAFE(cto, &cfg_objs, list, cto_tmp) {
 			VTAILQ_REMOVE(&cfg_objs, cto, list);
 			AN(cto->rollback);
@@ -4066,6 +8005,8 @@ reconfigure(int argc, char **argv)
 		ERR("{core} Config reload failed.\n");
 		return;
 	} else {
+		if (hot)
+			hot_vsb = hot_msg(&cfg_objs, cfg_new);
 		VTAILQ_FOREACH_SAFE(cto, &cfg_objs, list, cto_tmp) {
 			VTAILQ_REMOVE(&cfg_objs, cto, list);
 			AN(cto->commit);
@@ -4078,8 +8019,6 @@ reconfigure(int argc, char **argv)
 	 * a reload */
 	VTAILQ_FOREACH(fr, &frontends, list) {
 		struct front_arg *fa;
-		struct cfg_cert_file *cf;
-		sslctx *sc;
 
 		HASH_FIND_STR(cfg_new->LISTEN_ARGS, fr->arg->pspec, fa);
 		CHECK_OBJ_NOTNULL(fa, FRONT_ARG_MAGIC);
@@ -4088,39 +8027,40 @@ reconfigure(int argc, char **argv)
 		 * below when we config_destroy() the old
 		 * configuration set. */
 		fr->arg = fa;
-
-		if (HASH_COUNT(fr->ssl_ctxs) == 0) {
-			fr->default_ctx = NULL;
-			continue;
-		}
-
-		cf = fa->certs;
-		CHECK_OBJ_NOTNULL(cf, CFG_CERT_FILE_MAGIC);
-		while (cf->hh.next != NULL)
-			cf = cf->hh.next;
-		HASH_FIND_STR(fr->ssl_ctxs, cf->filename, sc);
-		CHECK_OBJ_NOTNULL(sc, SSLCTX_MAGIC);
-		fr->default_ctx = sc;
+		frontend_default_ctx(fr, fa);
 	}
+#ifndef OPENSSL_NO_TLSEXT
+	rebuild_sni_indexes();
+#endif
 
 	AZ(gettimeofday(&tv, NULL));
 	t1 = tv.tv_sec + 1e-6 * tv.tv_usec;
 
-	LOGL("{core} Config reloaded in %.2lf seconds. "
-	    "Starting new child processes.\n", t1 - t0);
+	if (hot_vsb != NULL)
+		LOGL("{core} Certificates reloaded in %.2lf seconds. "
+		    "Updating child processes (%zd bytes).\n", t1 - t0,
+		    VSB_len(hot_vsb));
+	else
+		LOGL("{core} Config reloaded in %.2lf seconds. "
+		    "Starting new child processes.\n", t1 - t0);
 
 	config_destroy(CONFIG);
 	CONFIG = cfg_new;
+	(void)ticket_keys_refresh(0);
+	(void)alarm(CONFIG->TICKET_KEY_ROTATE);
 
-	worker_gen++;
-	start_workers(0, CONFIG->NCORES);
+	if (hot_vsb != NULL) {
+		if (VSB_len(hot_vsb) > 0)
+			notify_workers_certs(hot_vsb);
+		VSB_delete(hot_vsb);
+	} else
+		workers_new_gen();
 
 	if (CONFIG->DEBUG_LISTEN_ADDR)
 		listen_endpoint_print(CONFIG->DEBUG_LISTEN_ADDR);
-
-	wu.type = WORKER_GEN;
-	wu.payload.gen = worker_gen;
-	notify_workers(&wu);
+#ifdef HAVE_SYS_INOTIFY_H
+	pem_dir_watch();
+#endif
 
 	if (ocsp_proc_pid > 0) {
 		(void) kill(ocsp_proc_pid, SIGTERM);
@@ -4138,14 +8078,12 @@ sleep_and_refresh(hitch_config *CONFIG)
 {
 	/* static backend address */
 	if (!CONFIG->BACKEND_REFRESH_TIME) {
-		pause();
+		(void)master_sleep(0);
 		return;
 	}
 
-	int rv = 0;
 	while (1) {
-		rv = usleep(CONFIG->BACKEND_REFRESH_TIME*1000000);
-		if (rv == -1 && errno == EINTR)
+		if (master_sleep(CONFIG->BACKEND_REFRESH_TIME) == -1)
 			break;
 		else if(backaddr_init()) {
 			struct worker_update wu;
@@ -4198,6 +8136,11 @@ main(int argc, char **argv)
 	}
 	AZ(setvbuf(logfile, NULL, _IONBF, BUFSIZ));
 
+	if (CONFIG->COMPILE_CERTS != NULL) {
+		init_openssl();
+		return (compile_certs(CONFIG->COMPILE_CERTS));
+	}
+
 	if (CONFIG->TEST) {
 		/* Override log level for config test */
 		CONFIG->LOG_LEVEL = 3;
@@ -4205,6 +8148,7 @@ main(int argc, char **argv)
 		    " certificates\n");
 		init_globals();
 		init_openssl();
+		init_ticket_keys();
 		init_certs();
 		fprintf(stderr, "%s configuration looks ok.\n",
 		    basename(argv[0]));
@@ -4215,10 +8159,18 @@ main(int argc, char **argv)
 	create_workers = 1;
 
 	openssl_check_version();
+#ifndef HAVE_KTLS
+	if (CONFIG->KTLS)
+		ERR("{core} Warning: kernel TLS is not supported by this "
+		    "build, 'ktls' is ignored.\n");
+#endif
 
 	init_signals();
 	init_globals();
 	init_openssl();
+#ifdef USE_SHARED_CACHE
+	shared_secret_init();
+#endif
 
 	HASH_ITER(hh, CONFIG->LISTEN_ARGS, fa, ftmp) {
 		struct frontend *fr = create_frontend(fa);
@@ -4230,7 +8182,11 @@ main(int argc, char **argv)
 	/* load certificates, pass to handle_connections */
 	LOGL("{core} Loading certificate pem files (%d)\n",
 	    HASH_COUNT(CONFIG->CERT_FILES) + 1); /* XXX: TODO */
+	init_ticket_keys();
 	init_certs();
+#ifndef OPENSSL_NO_TLSEXT
+	rebuild_sni_indexes();
+#endif
 
 #ifdef USE_SHARED_CACHE
 	if (CONFIG->SHCUPD_PORT) {
@@ -4281,6 +8237,7 @@ main(int argc, char **argv)
 	}
 
 	start_workers(0, CONFIG->NCORES);
+	(void)alarm(CONFIG->TICKET_KEY_ROTATE);
 
 	if (CONFIG->DEBUG_LISTEN_ADDR) {
 		listen_endpoint_print(CONFIG->DEBUG_LISTEN_ADDR);
@@ -4289,8 +8246,14 @@ main(int argc, char **argv)
 	if (CONFIG->OCSP_DIR != NULL)
 		start_ocsp_proc();
 
+#ifdef HAVE_SYS_INOTIFY_H
+	pem_dir_watch();
+#endif
+
 #ifdef USE_SHARED_CACHE
-	if (CONFIG->SHCUPD_PORT) {
+	if (CONFIG->SHCUPD_PORT && CONFIG->SHCUPD_REPLICATOR)
+		start_shcupd_proc();
+	else if (CONFIG->SHCUPD_PORT) {
 		/* start event loop to receive cache updates */
 		loop = ev_default_loop(EVFLAG_AUTO);
 		ev_io_init(&shcupd_listener, handle_shcupd, shcupd_socket,
@@ -4302,8 +8265,13 @@ main(int argc, char **argv)
 	LOGL("{core} %s initialization complete\n", PACKAGE_STRING);
 	for (;;) {
 #ifdef USE_SHARED_CACHE
-		if (CONFIG->SHCUPD_PORT) {
-			while (n_sighup == 0 && n_sigchld == 0) {
+		if (CONFIG->SHCUPD_PORT && !CONFIG->SHCUPD_REPLICATOR) {
+			while (n_sighup == 0 && n_sigchld == 0 &&
+			    n_sigalrm == 0 && n_sigterm == 0) {
+#ifdef HAVE_SYS_INOTIFY_H
+				if (pem_dir_ev_sync(loop) != 0)
+					break;
+#endif
 				/* event loop to receive cache updates */
 				ev_loop(loop, EVRUN_ONCE);
 			}
@@ -4316,11 +8284,26 @@ main(int argc, char **argv)
 		 * Parent will be woken up if a signal arrives */
 #endif /* USE_SHARED_CACHE */
 
+		if (n_sigterm != 0)
+			terminate(n_sigterm);
+
 		while (n_sighup != 0) {
 			n_sighup = 0;
 			reconfigure(argc, argv);
 		}
 
+#ifdef HAVE_SYS_INOTIFY_H
+		if (pem_dir_due > 0 && Time_now() >= pem_dir_due &&
+		    pem_dir_update() != 0)
+			reconfigure(argc, argv);
+#endif
+
+		while (n_sigalrm != 0) {
+			n_sigalrm = 0;
+			(void)ticket_keys_refresh(1);
+			(void)alarm(CONFIG->TICKET_KEY_ROTATE);
+		}
+
 		while (n_sigchld != 0) {
 			n_sigchld = 0;
 			do_wait();
@@ -52,6 +52,7 @@
 
 #include "configuration.h"
 #include "ringbuffer.h"
+#include "uring.h"
 #include "foreign/asn_gentm.h"
 #include "foreign/miniobj.h"
 #include "foreign/vas.h"
@@ -62,6 +63,7 @@
 typedef struct sslstaple_s sslstaple;
 
 struct sni_name_s;
+struct cfg_cert_file;
 VTAILQ_HEAD(sni_name_head, sni_name_s);
 
 /* SSL contexts. */
@@ -78,6 +80,19 @@ struct sslctx_s {
 	ev_stat			*ev_staple;
 	struct sni_name_head	sni_list;
 	UT_hash_handle		hh;
+	/* Lazily loaded certificates */
+	struct cfg_cert_file	*lazy_cf;
+	struct sslctx_s		*lazy_sc;	/* Loaded context */
+	int			lazy_failed;
+	VTAILQ_ENTRY(sslctx_s)	lazy_list;
+	/* Contexts shared by frontends, see share_ctx() */
+	char			*settings;	/* TLS settings of ctx */
+	char			*key_fn;	/* Private key file or NULL */
+	struct sslctx_s		*shared;	/* The context shared */
+	unsigned		nshared;	/* Contexts sharing this one */
+	int			dropped;	/* Freed when no longer shared */
+	struct ctx_src		*src;		/* Entry in the source index */
+	VTAILQ_ENTRY(sslctx_s)	src_list;
 };
 typedef struct sslctx_s sslctx;
 
@@ -86,6 +101,7 @@ typedef struct sslctx_s sslctx;
 struct sslstaple_s {
 	unsigned	magic;
 #define SSLSTAPLE_MAGIC	0x20fe53fd
+	unsigned	refcnt;
 	unsigned char	*staple;
 	double		mtim;
 	double		nextupd;
@@ -109,6 +125,15 @@ extern sni_name *sni_names;
 #endif /* OPENSSL_NO_TLSEXT */
 
 struct backend;
+struct frontend;
+
+/* A pipe holding data spliced between two sockets */
+struct splice_pipe {
+	int			fd[2];
+	int			len;		/* Bytes in the pipe */
+	int			cap;		/* Pipe capacity, 0 when
+						 * not open */
+};
 
 /*
  * Proxied State
@@ -124,19 +149,16 @@ typedef struct proxystate {
 	ringbuffer		ring_clear2ssl;	/* Pushing bytes from
 						 * clear to secure
 						 * stream */
-	ev_io 			ev_r_ssl;	/* Secure stream write event */
-	ev_io			ev_w_ssl;	/* Secure stream read event */
-	ev_io			ev_r_handshake;	/* Secure stream handshake
-						 * write event */
-	ev_io			ev_w_handshake;	/* Secure stream handshake
-						 * read event */
+	/* One read and one write watcher per socket. Their callbacks
+	 * follow the connection state: PROXY line, connect, handshake
+	 * and data transfer. */
+	ev_io 			ev_r_ssl;	/* Secure stream read event */
+	ev_io			ev_w_ssl;	/* Secure stream write event */
 	ev_timer		ev_t_handshake;	/* handshake timer */
-	ev_io			ev_w_connect;	/* Backend connect event */
 	ev_timer		ev_t_connect;	/* backend connect timer */
 
-	ev_io			ev_r_clear;	/* Clear stream write event */
-	ev_io			ev_w_clear;	/* Clear stream read event */
-	ev_io			ev_proxy;	/* PROXY read event */
+	ev_io			ev_r_clear;	/* Clear stream read event */
+	ev_io			ev_w_clear;	/* Clear stream write event */
 
 	int			fd_up;		/* Upstream (client) socket */
 	int			fd_down;	/* Downstream (backend)
@@ -156,8 +178,37 @@ typedef struct proxystate {
 						     * a certificate
 						     * over the current
 						     * connection */
+	int			ktls_tx:1;	/* Kernel encrypts
+						 * outgoing records */
+	int			ktls_rx:1;	/* Kernel decrypts
+						 * incoming records */
+	int			ktls_rx_hold:1;	/* Next record is for
+						 * OpenSSL */
+	int			connect_started:1; /* Backend connect()
+						    * was issued */
+	int			stream_started:1; /* Backend stream
+						   * set up after the
+						   * first handshake */
+	int			async_pending:1; /* Handshake paused on
+						  * a signer thread */
+	int			async_shutdown:1; /* Shut down once the
+						   * signer is done */
+	int			uring:1;	/* Clear stream goes
+						 * through io_uring */
+	int			uring_shutdown:1; /* Shut down once the
+						   * ring is done */
+
+	struct splice_pipe	pipe_clear2ssl;	/* kTLS splice pipes */
+	struct splice_pipe	pipe_ssl2clear;
+
+	struct uring_op		uring_rd;	/* Clear stream io_uring */
+	struct uring_op		uring_wr;	/* operations */
+	struct msghdr		uring_msg;
+	struct iovec		uring_iov[RING_IOV_MAX];
 
 	SSL			*ssl;		/* OpenSSL SSL state */
+	const struct frontend	*sni_fr;	/* Frontend whose certificates
+						 * are looked up first */
 
 	struct sockaddr_storage	remote_ip;	/* Remote ip returned
 						 * from `accept` */
@@ -0,0 +1,408 @@
+/*-
+ * Copyright (c) 2026 Varnish Software
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Asynchronous private key operations.
+ *
+ * RSA keys are wrapped in an RSA_METHOD whose private key operations,
+ * when called from inside an OpenSSL ASYNC job (SSL_MODE_ASYNC), are
+ * queued to a pool of signer threads owned by the worker. The job is
+ * paused and SSL_do_handshake() returns SSL_ERROR_WANT_ASYNC. A signer
+ * thread finishing an operation wakes the worker's event loop through
+ * an eventfd, and the resume callback calls SSL_do_handshake() again,
+ * which picks up the job where it left off.
+ *
+ * Outside of a job, or in a process without a signer pool (the master,
+ * the OCSP child), the wrapped key signs synchronously like any other.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+#endif
+
+#include <openssl/err.h>
+#include <openssl/rsa.h>
+#ifdef HAVE_SSL_ASYNC
+#  include <openssl/async.h>
+#endif
+
+#include "foreign/miniobj.h"
+#include "foreign/vas.h"
+#include "foreign/vqueue.h"
+#include "hssl_async.h"
+
+#ifdef HAVE_SSL_ASYNC
+
+enum hssl_async_op {
+	HSSL_ASYNC_PRIV_ENC,
+	HSSL_ASYNC_PRIV_DEC,
+};
+
+struct hssl_async_req {
+	unsigned		magic;
+#define HSSL_ASYNC_REQ_MAGIC	0x4a1c93e5
+	VTAILQ_ENTRY(hssl_async_req) list;
+	enum hssl_async_op	op;
+	int			flen;
+	const unsigned char	*from;
+	unsigned char		*to;
+	RSA			*rsa;
+	int			padding;
+	int			ret;
+	int			done;	/* Only touched by the event loop */
+	void			*priv;
+};
+
+VTAILQ_HEAD(hssl_async_head, hssl_async_req);
+
+struct hssl_async {
+	unsigned		magic;
+#define HSSL_ASYNC_MAGIC	0x1f0b6d72
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	struct hssl_async_head	todo;	/* Waiting for a signer thread */
+	struct hssl_async_head	done;	/* Waiting for the event loop */
+	int			fd[2];	/* Completion notification */
+	ev_io			ev_done;
+	hssl_async_resume_f	*resume;
+	void			*owner;	/* Handshake being driven */
+	uint64_t		jobs;
+};
+
+static RSA_METHOD *hssl_async_rsa = NULL;
+static struct hssl_async *hssl_async = NULL;
+
+static int
+hssl_async_rsa_op(enum hssl_async_op op, int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
+{
+	const RSA_METHOD *m = RSA_PKCS1_OpenSSL();
+
+	if (op == HSSL_ASYNC_PRIV_ENC)
+		return (RSA_meth_get_priv_enc(m)(flen, from, to, rsa, padding));
+	return (RSA_meth_get_priv_dec(m)(flen, from, to, rsa, padding));
+}
+
+static void *
+hssl_async_signer(void *arg)
+{
+	struct hssl_async *ha;
+	struct hssl_async_req *req;
+	uint64_t one = 1;
+	int notify;
+
+	CAST_OBJ_NOTNULL(ha, arg, HSSL_ASYNC_MAGIC);
+	while (1) {
+		AZ(pthread_mutex_lock(&ha->mtx));
+		while ((req = VTAILQ_FIRST(&ha->todo)) == NULL)
+			AZ(pthread_cond_wait(&ha->cond, &ha->mtx));
+		VTAILQ_REMOVE(&ha->todo, req, list);
+		AZ(pthread_mutex_unlock(&ha->mtx));
+
+		CHECK_OBJ_NOTNULL(req, HSSL_ASYNC_REQ_MAGIC);
+		req->ret = hssl_async_rsa_op(req->op, req->flen, req->from,
+		    req->to, req->rsa, req->padding);
+		ERR_clear_error();
+
+		/* One wakeup for however many completions pile up before
+		 * the event loop gets to them */
+		AZ(pthread_mutex_lock(&ha->mtx));
+		notify = VTAILQ_EMPTY(&ha->done);
+		VTAILQ_INSERT_TAIL(&ha->done, req, list);
+		AZ(pthread_mutex_unlock(&ha->mtx));
+		if (notify)
+			(void)write(ha->fd[1], &one, sizeof one);
+	}
+	return (NULL);
+}
+
+/* Hand the completed operations back to their handshakes. The
+ * notification is drained before the list is taken, so a completion
+ * racing with us is either in this batch or wakes us up again. */
+static void
+hssl_async_done(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct hssl_async *ha;
+	struct hssl_async_head done;
+	struct hssl_async_req *req;
+	char buf[64];
+
+	(void)loop;
+	(void)revents;
+	CAST_OBJ_NOTNULL(ha, w->data, HSSL_ASYNC_MAGIC);
+	(void)read(ha->fd[0], buf, sizeof buf);
+
+	VTAILQ_INIT(&done);
+	AZ(pthread_mutex_lock(&ha->mtx));
+	VTAILQ_CONCAT(&done, &ha->done, list);
+	AZ(pthread_mutex_unlock(&ha->mtx));
+
+	while ((req = VTAILQ_FIRST(&done)) != NULL) {
+		CHECK_OBJ_NOTNULL(req, HSSL_ASYNC_REQ_MAGIC);
+		VTAILQ_REMOVE(&done, req, list);
+		req->done = 1;
+		/* The resumed job frees req */
+		ha->resume(req->priv);
+	}
+}
+
+static int
+hssl_async_offload(enum hssl_async_op op, int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
+{
+	struct hssl_async *ha = hssl_async;
+	struct hssl_async_req *req;
+	int ret;
+
+	if (ha == NULL || ASYNC_get_current_job() == NULL)
+		return (hssl_async_rsa_op(op, flen, from, to, rsa, padding));
+
+	ALLOC_OBJ(req, HSSL_ASYNC_REQ_MAGIC);
+	if (req == NULL)
+		return (hssl_async_rsa_op(op, flen, from, to, rsa, padding));
+	req->op = op;
+	req->flen = flen;
+	req->from = from;
+	req->to = to;
+	req->rsa = rsa;
+	req->padding = padding;
+	req->priv = ha->owner;
+	ha->jobs++;
+
+	AZ(pthread_mutex_lock(&ha->mtx));
+	VTAILQ_INSERT_TAIL(&ha->todo, req, list);
+	AZ(pthread_cond_signal(&ha->cond));
+	AZ(pthread_mutex_unlock(&ha->mtx));
+
+	/* The job may be resumed before the signer is done with it */
+	do
+		AN(ASYNC_pause_job());
+	while (!req->done);
+
+	ret = req->ret;
+	FREE_OBJ(req);
+	return (ret);
+}
+
+static int
+hssl_async_priv_enc(int flen, const unsigned char *from, unsigned char *to,
+    RSA *rsa, int padding)
+{
+
+	return (hssl_async_offload(HSSL_ASYNC_PRIV_ENC, flen, from, to, rsa,
+	    padding));
+}
+
+static int
+hssl_async_priv_dec(int flen, const unsigned char *from, unsigned char *to,
+    RSA *rsa, int padding)
+{
+
+	return (hssl_async_offload(HSSL_ASYNC_PRIV_DEC, flen, from, to, rsa,
+	    padding));
+}
+
+/* Returns a key whose private key operations may be offloaded. Keys
+ * other than RSA are returned as is. Takes over the reference to pkey. */
+EVP_PKEY *
+HSSL_Async_WrapKey(EVP_PKEY *pkey)
+{
+	EVP_PKEY *wrapped;
+	RSA *rsa;
+
+	AN(pkey);
+	if (EVP_PKEY_base_id(pkey) != EVP_PKEY_RSA)
+		return (pkey);
+
+	if (hssl_async_rsa == NULL) {
+		hssl_async_rsa = RSA_meth_dup(RSA_PKCS1_OpenSSL());
+		if (hssl_async_rsa == NULL)
+			return (pkey);
+		AN(RSA_meth_set1_name(hssl_async_rsa, "hitch async"));
+		AN(RSA_meth_set_priv_enc(hssl_async_rsa, hssl_async_priv_enc));
+		AN(RSA_meth_set_priv_dec(hssl_async_rsa, hssl_async_priv_dec));
+	}
+
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	if (rsa == NULL)
+		return (pkey);
+	wrapped = EVP_PKEY_new();
+	if (wrapped == NULL || !RSA_set_method(rsa, hssl_async_rsa) ||
+	    !EVP_PKEY_assign_RSA(wrapped, rsa)) {
+		EVP_PKEY_free(wrapped);
+		RSA_free(rsa);
+		return (pkey);
+	}
+	EVP_PKEY_free(pkey);
+	return (wrapped);
+}
+
+/* Start the signer pool of a worker. The resume callback is called
+ * from the event loop with the owner of each completed operation. */
+int
+HSSL_Async_Init(struct ev_loop *loop, unsigned nthreads,
+    hssl_async_resume_f *resume)
+{
+	struct hssl_async *ha;
+	sigset_t set, oset;
+	pthread_t thr;
+	unsigned u;
+
+	AZ(hssl_async);
+	AN(resume);
+	if (nthreads == 0 || !ASYNC_is_capable()) {
+		errno = ENOTSUP;
+		return (-1);
+	}
+
+	ALLOC_OBJ(ha, HSSL_ASYNC_MAGIC);
+	if (ha == NULL)
+		return (-1);
+#ifdef HAVE_SYS_EVENTFD_H
+	ha->fd[0] = ha->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ha->fd[0] < 0) {
+		FREE_OBJ(ha);
+		return (-1);
+	}
+#else
+	if (pipe(ha->fd) != 0) {
+		FREE_OBJ(ha);
+		return (-1);
+	}
+	for (u = 0; u < 2; u++) {
+		(void)fcntl(ha->fd[u], F_SETFL, O_NONBLOCK);
+		(void)fcntl(ha->fd[u], F_SETFD, FD_CLOEXEC);
+	}
+#endif
+	AZ(pthread_mutex_init(&ha->mtx, NULL));
+	AZ(pthread_cond_init(&ha->cond, NULL));
+	VTAILQ_INIT(&ha->todo);
+	VTAILQ_INIT(&ha->done);
+	ha->resume = resume;
+
+	/* Signals are for the event loop thread */
+	AZ(sigfillset(&set));
+	AZ(pthread_sigmask(SIG_BLOCK, &set, &oset));
+	for (u = 0; u < nthreads; u++) {
+		if (pthread_create(&thr, NULL, hssl_async_signer, ha) != 0)
+			break;
+		AZ(pthread_detach(thr));
+	}
+	AZ(pthread_sigmask(SIG_SETMASK, &oset, NULL));
+	if (u == 0) {
+		AZ(pthread_cond_destroy(&ha->cond));
+		AZ(pthread_mutex_destroy(&ha->mtx));
+		(void)close(ha->fd[0]);
+		if (ha->fd[1] != ha->fd[0])
+			(void)close(ha->fd[1]);
+		FREE_OBJ(ha);
+		return (-1);
+	}
+
+	ev_io_init(&ha->ev_done, hssl_async_done, ha->fd[0], EV_READ);
+	ha->ev_done.data = ha;
+	ev_io_start(loop, &ha->ev_done);
+	hssl_async = ha;
+	return (0);
+}
+
+int
+HSSL_Async_Active(void)
+{
+
+	return (hssl_async != NULL);
+}
+
+/* Set the owner handed to the resume callback for operations started by
+ * the next SSL call. */
+void
+HSSL_Async_Owner(void *priv)
+{
+
+	if (hssl_async != NULL)
+		hssl_async->owner = priv;
+}
+
+uint64_t
+HSSL_Async_Jobs(void)
+{
+
+	return (hssl_async == NULL ? 0 : hssl_async->jobs);
+}
+
+#else /* HAVE_SSL_ASYNC */
+
+EVP_PKEY *
+HSSL_Async_WrapKey(EVP_PKEY *pkey)
+{
+
+	return (pkey);
+}
+
+int
+HSSL_Async_Init(struct ev_loop *loop, unsigned nthreads,
+    hssl_async_resume_f *resume)
+{
+
+	(void)loop;
+	(void)nthreads;
+	(void)resume;
+	errno = ENOTSUP;
+	return (-1);
+}
+
+int
+HSSL_Async_Active(void)
+{
+
+	return (0);
+}
+
+void
+HSSL_Async_Owner(void *priv)
+{
+
+	(void)priv;
+}
+
+uint64_t
+HSSL_Async_Jobs(void)
+{
+
+	return (0);
+}
+
+#endif /* HAVE_SSL_ASYNC */
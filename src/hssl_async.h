@@ -0,0 +1,22 @@
+/*-
+ * Asynchronous private key operations, see hssl_async.c
+ */
+
+#ifndef HSSL_ASYNC_H_INCLUDED
+#define HSSL_ASYNC_H_INCLUDED
+
+#include <stdint.h>
+
+#include <ev.h>
+#include <openssl/evp.h>
+
+typedef void hssl_async_resume_f(void *priv);
+
+EVP_PKEY *HSSL_Async_WrapKey(EVP_PKEY *pkey);
+int HSSL_Async_Init(struct ev_loop *loop, unsigned nthreads,
+    hssl_async_resume_f *resume);
+int HSSL_Async_Active(void);
+void HSSL_Async_Owner(void *priv);
+uint64_t HSSL_Async_Jobs(void);
+
+#endif	/* HSSL_ASYNC_H_INCLUDED */
@@ -0,0 +1,354 @@
+/*-
+ * Copyright (c) 2026 Varnish Software
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Session ticket keys.
+ *
+ * The master keeps a ring of ticket keys in shared memory, mapped before
+ * the workers are forked, so that every worker of every generation uses
+ * the same keys. The ring holds up to HSSL_TICKET_KEYS keys: tickets are
+ * encrypted with the current one, and any key of the ring decrypts. A
+ * ticket decrypted with another key than the current one is renewed.
+ *
+ * Without a key file the ring is previous, current and next random keys,
+ * and a rotation shifts them by one. With a key file, the last keys of
+ * the file are used, the second to last one being current as the last
+ * one is the next one. Every node loading the same file shares tickets,
+ * and rotating is done by appending a key to the file.
+ *
+ * The ring is only written by the master. Readers use a sequence count
+ * to get a consistent copy of a key.
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#endif
+
+#include "foreign/vas.h"
+#include "hssl_tickets.h"
+
+#define HSSL_TICKET_KEYS	3
+#define HSSL_TICKET_NAME_LEN	16
+
+struct hssl_ticket_key {
+	unsigned char	name[HSSL_TICKET_NAME_LEN];
+	unsigned char	hmac_key[32];
+	unsigned char	aes_key[32];
+	unsigned	key_len;	/* 16 or 32 */
+};
+
+struct hssl_ticket_ring {
+	unsigned		seq;	/* Odd while being written */
+	unsigned		nkeys;
+	unsigned		current;
+	struct hssl_ticket_key	keys[HSSL_TICKET_KEYS];
+};
+
+static struct hssl_ticket_ring *ring;
+static struct hssl_ticket_stats stats;
+
+static void
+ring_write_begin(void)
+{
+
+	ring->seq++;
+	__sync_synchronize();
+}
+
+static void
+ring_write_end(void)
+{
+
+	__sync_synchronize();
+	ring->seq++;
+}
+
+/* Copy the current key, or the key named name. Returns -1 if no key has
+ * that name, 1 if the key is not the current one and 0 otherwise. */
+static int
+ring_get(const unsigned char *name, struct hssl_ticket_key *key)
+{
+	unsigned seq, u;
+	int idx, old = 0;
+
+	do {
+		while ((seq = *(volatile unsigned *)&ring->seq) & 1)
+			continue;
+		__sync_synchronize();
+		idx = -1;
+		if (name == NULL)
+			idx = ring->current;
+		for (u = 0; idx < 0 && u < ring->nkeys; u++)
+			if (!memcmp(ring->keys[u].name, name,
+			    HSSL_TICKET_NAME_LEN))
+				idx = u;
+		if (idx >= 0) {
+			*key = ring->keys[idx];
+			old = ((unsigned)idx != ring->current);
+		}
+		__sync_synchronize();
+	} while (*(volatile unsigned *)&ring->seq != seq);
+	return (idx < 0 ? -1 : old);
+}
+
+static int
+ticket_key_random(struct hssl_ticket_key *key)
+{
+
+	key->key_len = 32;
+	if (RAND_bytes(key->name, sizeof key->name) != 1 ||
+	    RAND_bytes(key->hmac_key, sizeof key->hmac_key) != 1 ||
+	    RAND_bytes(key->aes_key, sizeof key->aes_key) != 1)
+		return (-1);
+	return (0);
+}
+
+/* Map the ring and fill it with random keys */
+int
+HSSL_Tickets_Init(void)
+{
+	struct hssl_ticket_key keys[HSSL_TICKET_KEYS];
+	unsigned u;
+
+	if (ring != NULL)
+		return (0);
+	for (u = 0; u < HSSL_TICKET_KEYS; u++)
+		if (ticket_key_random(&keys[u]) != 0) {
+			errno = EIO;
+			return (-1);
+		}
+
+	ring = mmap(NULL, sizeof *ring, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		ring = NULL;
+		return (-1);
+	}
+	memcpy(ring->keys, keys, sizeof keys);
+	ring->nkeys = HSSL_TICKET_KEYS;
+	ring->current = 1;
+	return (0);
+}
+
+/* Replace the keys of the ring with the last ones of a file holding one
+ * base64 encoded key per line, 48 bytes for AES-128 or 80 bytes for
+ * AES-256: name, AES key and HMAC key, like HAProxy's tls-ticket-keys.
+ * Empty lines and lines starting with '#' are skipped. On a bad line, it
+ * is returned in *line. */
+int
+HSSL_Tickets_Load(const char *file, unsigned *line)
+{
+	struct hssl_ticket_key keys[HSSL_TICKET_KEYS], *key;
+	unsigned char raw[96];
+	char buf[256], *p, *e;
+	unsigned n = 0, len;
+	int r;
+	FILE *f;
+
+	AN(ring);
+	AN(file);
+	AN(line);
+	*line = 0;
+
+	f = fopen(file, "r");
+	if (f == NULL)
+		return (-1);
+
+	while (fgets(buf, sizeof buf, f) != NULL) {
+		(*line)++;
+		for (p = buf; isspace((unsigned char)*p); p++)
+			continue;
+		for (e = p + strlen(p); e > p && isspace((unsigned char)e[-1]);)
+			*--e = '\0';
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		len = e - p;
+		r = -1;
+		if (len % 4 == 0 && len <= 4 * sizeof raw / 3)
+			r = EVP_DecodeBlock(raw, (unsigned char *)p, len);
+		/* EVP_DecodeBlock() counts the padding */
+		for (; r > 0 && e > p && e[-1] == '='; e--)
+			r--;
+		if (r != 48 && r != 80) {
+			(void)fclose(f);
+			errno = EINVAL;
+			return (-1);
+		}
+
+		/* keep the last keys */
+		if (n == HSSL_TICKET_KEYS) {
+			memmove(keys, keys + 1, sizeof keys - sizeof *keys);
+			n--;
+		}
+		key = &keys[n++];
+		memset(key, 0, sizeof *key);
+		key->key_len = (r - HSSL_TICKET_NAME_LEN) / 2;
+		memcpy(key->name, raw, HSSL_TICKET_NAME_LEN);
+		memcpy(key->aes_key, raw + HSSL_TICKET_NAME_LEN,
+		    key->key_len);
+		memcpy(key->hmac_key, raw + HSSL_TICKET_NAME_LEN +
+		    key->key_len, key->key_len);
+	}
+	(void)fclose(f);
+	OPENSSL_cleanse(raw, sizeof raw);
+	OPENSSL_cleanse(buf, sizeof buf);
+
+	if (n == 0) {
+		*line = 0;
+		errno = ENOENT;
+		return (-1);
+	}
+
+	ring_write_begin();
+	memcpy(ring->keys, keys, n * sizeof *keys);
+	ring->nkeys = n;
+	ring->current = n > 1 ? n - 2 : 0;
+	ring_write_end();
+	OPENSSL_cleanse(keys, sizeof keys);
+	return (0);
+}
+
+/* Shift the random keys: current becomes previous, next becomes current */
+void
+HSSL_Tickets_Rotate(void)
+{
+	struct hssl_ticket_key key;
+
+	AN(ring);
+	if (ticket_key_random(&key) != 0)
+		return;
+	ring_write_begin();
+	memmove(ring->keys, ring->keys + 1,
+	    sizeof ring->keys - sizeof *ring->keys);
+	ring->keys[HSSL_TICKET_KEYS - 1] = key;
+	ring->nkeys = HSSL_TICKET_KEYS;
+	ring->current = 1;
+	ring_write_end();
+	OPENSSL_cleanse(&key, sizeof key);
+}
+
+#define TICKET_CIPHER(key) \
+	((key)->key_len == 32 ? EVP_aes_256_cbc() : EVP_aes_128_cbc())
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int
+ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int
+ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+#endif
+{
+	struct hssl_ticket_key key;
+	int old = 0, r = -1;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[3];
+#endif
+
+	(void)ssl;
+	if (enc) {
+		AZ(ring_get(NULL, &key));
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(TICKET_CIPHER(&key)))
+		    != 1)
+			goto out;
+		memcpy(name, key.name, HSSL_TICKET_NAME_LEN);
+		if (EVP_EncryptInit_ex(ectx, TICKET_CIPHER(&key), NULL,
+		    key.aes_key, iv) != 1)
+			goto out;
+		stats.issued++;
+	} else {
+		old = ring_get(name, &key);
+		if (old < 0) {
+			stats.unknown++;
+			return (0);
+		}
+		if (EVP_DecryptInit_ex(ectx, TICKET_CIPHER(&key), NULL,
+		    key.aes_key, iv) != 1)
+			goto out;
+		stats.resumed++;
+		if (old)
+			stats.renewed++;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+	    key.hmac_key, key.key_len);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+	    (char *)"SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if (EVP_MAC_CTX_set_params(hctx, params) != 1)
+		goto out;
+#else
+	if (HMAC_Init_ex(hctx, key.hmac_key, key.key_len, EVP_sha256(),
+	    NULL) != 1)
+		goto out;
+#endif
+	/* renew tickets of old keys */
+	r = (!enc && old) ? 2 : 1;
+
+out:
+	OPENSSL_cleanse(&key, sizeof key);
+	return (r);
+}
+
+/* Use the ring for the tickets of a context */
+void
+HSSL_Tickets_Install(SSL_CTX *ctx)
+{
+
+	AN(ctx);
+	if (ring == NULL)
+		return;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	AN(SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb));
+#else
+	AN(SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb));
+#endif
+}
+
+/* Ticket counters of this process */
+void
+HSSL_Tickets_Stats(struct hssl_ticket_stats *st)
+{
+
+	AN(st);
+	*st = stats;
+}
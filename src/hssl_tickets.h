@@ -0,0 +1,25 @@
+/*-
+ * Session ticket keys shared by all processes, see hssl_tickets.c
+ */
+
+#ifndef HSSL_TICKETS_H_INCLUDED
+#define HSSL_TICKETS_H_INCLUDED
+
+#include <stdint.h>
+
+#include <openssl/ssl.h>
+
+struct hssl_ticket_stats {
+	uint64_t	issued;		/* Tickets encrypted */
+	uint64_t	resumed;	/* Tickets decrypted */
+	uint64_t	renewed;	/* Decrypted with an old key */
+	uint64_t	unknown;	/* Key not in the ring */
+};
+
+int HSSL_Tickets_Init(void);
+int HSSL_Tickets_Load(const char *file, unsigned *line);
+void HSSL_Tickets_Rotate(void);
+void HSSL_Tickets_Install(SSL_CTX *ctx);
+void HSSL_Tickets_Stats(struct hssl_ticket_stats *st);
+
+#endif	/* HSSL_TICKETS_H_INCLUDED */
@@ -47,6 +47,7 @@
 #include <libgen.h>
 #include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <sched.h>
 #include <signal.h>
@@ -74,6 +75,10 @@ FILE * logfile;
 struct stat logf_st;
 time_t logf_check_t;
 
+/* The log file is reopened under this lock, the certificate loading
+ * threads log too. */
+static pthread_mutex_t logf_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 double
 Time_now(void)
 {
@@ -102,6 +107,7 @@ VWLOG(int level, const char *fmt, va_list ap)
 		return;
 	}
 	AZ(gettimeofday(&tv, NULL));
+	AZ(pthread_mutex_lock(&logf_mtx));
 	if (logfile != stdout && logfile != stderr
 	    && tv.tv_sec >= logf_check_t + LOG_REOPEN_INTERVAL) {
 		struct stat st;
@@ -123,6 +129,7 @@ VWLOG(int level, const char *fmt, va_list ap)
 	snprintf(buf + n, sizeof(buf) - n, ".%06d [%5d] %s",
 	    (int) tv.tv_usec, getpid(), fmt);
 	vfprintf(logfile, buf, ap1);
+	AZ(pthread_mutex_unlock(&logf_mtx));
 	va_end(ap1);
 }
 
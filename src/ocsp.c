@@ -43,16 +43,68 @@
 extern hitch_config *CONFIG;
 extern struct ev_loop *loop;
 
+/* A staple is referenced by its sslctx and by the SSL_CTX it is the
+ * status callback argument of. Handshakes in progress may still use the
+ * SSL_CTX after the sslctx is freed, the reference of the SSL_CTX is
+ * dropped when OpenSSL frees it. */
+static int hocsp_ctx_idx = -1;
+
 void
 HOCSP_free(sslstaple **staple)
 {
 	if (*staple == NULL)
 		return;
-	free((*staple)->staple);
-	FREE_OBJ(*staple);
+	CHECK_OBJ(*staple, SSLSTAPLE_MAGIC);
+	assert((*staple)->refcnt > 0);
+	if (--(*staple)->refcnt == 0) {
+		free((*staple)->staple);
+		FREE_OBJ(*staple);
+	}
 	*staple = NULL;
 }
 
+static void
+hocsp_ctx_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx,
+    long argl, void *argp)
+{
+	sslstaple *staple = ptr;
+
+	(void)parent;
+	(void)ad;
+	(void)idx;
+	(void)argl;
+	(void)argp;
+	HOCSP_free(&staple);
+}
+
+/* Before any thread can set a staple */
+int
+HOCSP_init(void)
+{
+
+	if (hocsp_ctx_idx < 0)
+		hocsp_ctx_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+		    hocsp_ctx_free);
+	return (hocsp_ctx_idx < 0);
+}
+
+/* Make staple the status callback argument of ctx, in place of the
+ * previous one. */
+static int
+hocsp_ctx_set(SSL_CTX *ctx, sslstaple *staple)
+{
+	sslstaple *old;
+
+	assert(hocsp_ctx_idx >= 0);
+	if (!SSL_CTX_set_tlsext_status_arg(ctx, staple))
+		return (1);
+	old = SSL_CTX_get_ex_data(ctx, hocsp_ctx_idx);
+	AN(SSL_CTX_set_ex_data(ctx, hocsp_ctx_idx, staple));
+	staple->refcnt++;
+	HOCSP_free(&old);
+	return (0);
+}
+
 
 int
 HOCSP_verify(sslctx *sc, OCSP_RESPONSE *resp, double *nextupd)
@@ -199,6 +251,7 @@ HOCSP_init_resp(sslctx *sc, OCSP_RESPONSE *resp)
 
 	ALLOC_OBJ(staple, SSLSTAPLE_MAGIC);
 	AN(staple);
+	staple->refcnt = 1;
 	staple->staple = buf;
 	staple->len = len;
 
@@ -209,7 +262,7 @@ HOCSP_init_resp(sslctx *sc, OCSP_RESPONSE *resp)
 	if (!SSL_CTX_set_tlsext_status_cb(sc->ctx, HOCSP_staple_cb)) {
 		ERR("Error configuring status callback.\n");
 		goto err;
-	} else if (!SSL_CTX_set_tlsext_status_arg(sc->ctx, staple)) {
+	} else if (hocsp_ctx_set(sc->ctx, staple) != 0) {
 		ERR("Error setting status callback argument.\n");
 		goto err;
 	}
@@ -393,11 +446,30 @@ err:
 }
 
 
+static int
+hocsp_init_bio(BIO *bio, const char *ocspfn, sslctx *sc)
+{
+	OCSP_RESPONSE *resp;
+	int r;
+
+	resp = d2i_OCSP_RESPONSE_bio(bio, NULL);
+	BIO_free(bio);
+	if (resp == NULL) {
+		ERR("Error parsing OCSP staple in '%s'\n", ocspfn);
+		return (1);
+	}
+
+	r = HOCSP_init_resp(sc, resp);
+	if (r == 0)
+		CHECK_OBJ_NOTNULL(sc->staple, SSLSTAPLE_MAGIC);
+	OCSP_RESPONSE_free(resp);
+	return (r != 0);
+}
+
 int
 HOCSP_init_file(const char *ocspfn, sslctx *sc, int is_cached)
 {
 	BIO *bio;
-	OCSP_RESPONSE *resp;
 
 	if (ocspfn == NULL) {
 		return (1);
@@ -410,25 +482,21 @@ HOCSP_init_file(const char *ocspfn, sslctx *sc, int is_cached)
 		ERR("Error loading status file '%s'\n", ocspfn);
 		return (1);
 	}
+	return (hocsp_init_bio(bio, ocspfn, sc));
+}
 
-	resp = d2i_OCSP_RESPONSE_bio(bio, NULL);
-	BIO_free(bio);
-	if (resp == NULL) {
-		ERR("Error parsing OCSP staple in '%s'\n", ocspfn);
-		return (1);
-	}
-
-	if (HOCSP_init_resp(sc, resp) != 0)
-		goto err;
-
-	CHECK_OBJ_NOTNULL(sc->staple, SSLSTAPLE_MAGIC);
-	OCSP_RESPONSE_free(resp);
-	return (0);
+/* The contents of ocspfn, read by the master */
+int
+HOCSP_init_mem(const char *ocspfn, const void *p, size_t len, sslctx *sc)
+{
+	BIO *bio;
 
-err:
-	if (resp != NULL)
-		OCSP_RESPONSE_free(resp);
-	return (1);
+	AN(ocspfn);
+	AN(p);
+	assert(len <= INT_MAX);
+	bio = BIO_new_mem_buf(p, (int)len);
+	AN(bio);
+	return (hocsp_init_bio(bio, ocspfn, sc));
 }
 
 
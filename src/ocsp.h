@@ -15,12 +15,15 @@ typedef struct ocspquery_s {
 	/*  */
 } ocspquery;
 
+int HOCSP_init(void);
 void HOCSP_free(sslstaple **staple);
 int HOCSP_init_resp(sslctx *sc, OCSP_RESPONSE *resp);
 int HOCSP_verify(sslctx *sc, OCSP_RESPONSE *resp, double *nextupd);
 
 char * HOCSP_fn(const char *certfn);
 int HOCSP_init_file(const char *ocspfn, sslctx *sc, int is_cached);
+int HOCSP_init_mem(const char *ocspfn, const void *p, size_t len,
+    sslctx *sc);
 void HOCSP_mktask(sslctx *sc, ocspquery *oq, double refresh_hint);
 void HOCSP_ev_stat(sslctx *sc);
 
@@ -31,26 +31,87 @@
 
 #include <stdlib.h>
 
+#include "foreign/miniobj.h"
 #include "foreign/vas.h"
 #include "ringbuffer.h"
 
-/* Initialize a ringbuffer structure to empty */
+/* A released block, linked through its own first bytes */
+struct ringpool_ent {
+	struct ringpool_ent *next;
+};
+
+struct ringpool *
+ringpool_new(int num_slots, int data_len, unsigned max_free)
+{
+	struct ringpool *rp;
+
+	ALLOC_OBJ(rp, RINGPOOL_MAGIC);
+	AN(rp);
+	rp->num_slots = num_slots ?: DEF_RING_SLOTS;
+	rp->data_len = data_len ?: DEF_RING_DATA_LEN;
+	assert((size_t)rp->data_len >= sizeof(struct ringpool_ent));
+	rp->max_free = max_free;
+	return (rp);
+}
+
+static void *
+ringpool_get(struct ringpool *rp, struct ringpool_ent **list, unsigned *n,
+    size_t len)
+{
+	struct ringpool_ent *e;
+
+	CHECK_OBJ_NOTNULL(rp, RINGPOOL_MAGIC);
+	if (*list != NULL) {
+		e = *list;
+		*list = e->next;
+		(*n)--;
+		rp->hits++;
+		return (e);
+	}
+	rp->misses++;
+	e = malloc(len);
+	AN(e);
+	return (e);
+}
+
+static void
+ringpool_put(struct ringpool *rp, struct ringpool_ent **list, unsigned *n,
+    void *p)
+{
+	struct ringpool_ent *e = p;
+
+	CHECK_OBJ_NOTNULL(rp, RINGPOOL_MAGIC);
+	if (e == NULL)
+		return;
+	if (*n >= rp->max_free) {
+		rp->drops++;
+		free(e);
+		return;
+	}
+	e->next = *list;
+	*list = e;
+	(*n)++;
+}
+
+/* Initialize a ringbuffer structure to empty. Data blocks are taken
+ * from the pool on first write, see ringbuffer_write_ptr() */
 
 void
-ringbuffer_init(ringbuffer *rb, int num_slots, int data_len)
+ringbuffer_init(ringbuffer *rb, struct ringpool *rp)
 {
-	rb->num_slots = num_slots ?: DEF_RING_SLOTS;
-	rb->data_len = data_len ?: DEF_RING_DATA_LEN;
-	rb->slots = malloc(rb->num_slots * sizeof(rb->slots[0]));
-	AN(rb->slots);
+	CHECK_OBJ_NOTNULL(rp, RINGPOOL_MAGIC);
+	rb->pool = rp;
+	rb->num_slots = rp->num_slots;
+	rb->data_len = rp->data_len;
+	rb->slots = ringpool_get(rp, &rp->free_slots, &rp->n_free_slots,
+	    rb->num_slots * sizeof(rb->slots[0]));
 
 	rb->head = &rb->slots[0];
 	rb->tail = &rb->slots[0];
 	int x;
 	for (x=0; x < rb->num_slots; x++) {
 		rb->slots[x].next = &(rb->slots[(x + 1) % rb->num_slots]);
-		rb->slots[x].data = malloc(rb->data_len);
-		AN(rb->slots[x].data);
+		rb->slots[x].data = NULL;
 	}
 	rb->used = 0;
 	rb->bytes_written = 0;
@@ -59,11 +120,35 @@ ringbuffer_init(ringbuffer *rb, int num_slots, int data_len)
 void
 ringbuffer_cleanup(ringbuffer *rb)
 {
+	struct ringpool *rp;
+	int x;
+
+	rp = rb->pool;
+	CHECK_OBJ_NOTNULL(rp, RINGPOOL_MAGIC);
+	for (x=0; x < rb->num_slots; x++) {
+		ringpool_put(rp, &rp->free_data, &rp->n_free_data,
+		    rb->slots[x].data);
+	}
+	ringpool_put(rp, &rp->free_slots, &rp->n_free_slots, rb->slots);
+	rb->slots = NULL;
+}
+
+/* Hand the data blocks of an empty ringbuffer back to the pool */
+void
+ringbuffer_release(ringbuffer *rb)
+{
+	struct ringpool *rp;
 	int x;
+
+	if (rb->used != 0)
+		return;
+	rp = rb->pool;
+	CHECK_OBJ_NOTNULL(rp, RINGPOOL_MAGIC);
 	for (x=0; x < rb->num_slots; x++) {
-		free(rb->slots[x].data);
+		ringpool_put(rp, &rp->free_data, &rp->n_free_data,
+		    rb->slots[x].data);
+		rb->slots[x].data = NULL;
 	}
-	free(rb->slots);
 }
 
 /** READ FUNCTIONS **/
@@ -86,23 +171,67 @@ ringbuffer_read_skip(ringbuffer *rb, int length)
 	rb->head->left -= length;
 }
 
-/* Pop a consumed (fully read) head from the buffer */
+/* Pop a consumed (fully read) head from the buffer. Once the last
+ * slot is consumed the data blocks are released. */
 void
 ringbuffer_read_pop(ringbuffer *rb)
 {
 	assert(rb->used);
 	rb->head = rb->head->next;
 	rb->used--;
+	if (rb->used == 0)
+		ringbuffer_release(rb);
 }
 
+/* Fill in iov with the unconsumed part of up to iovcnt used slots,
+ * starting at the head. Returns the number of entries filled in. */
+int
+ringbuffer_read_iov(ringbuffer *rb, struct iovec *iov, int iovcnt)
+{
+	bufent *b;
+	int i;
+
+	assert(rb->used);
+	b = rb->head;
+	for (i = 0; i < rb->used && i < iovcnt; i++) {
+		iov[i].iov_base = b->ptr;
+		iov[i].iov_len = b->left;
+		b = b->next;
+	}
+	return (i);
+}
+
+/* Mark consumption of `length` bytes from the head, popping every slot
+ * that is completely consumed */
+void
+ringbuffer_read_consume(ringbuffer *rb, size_t length)
+{
+	while (length > 0) {
+		assert(rb->used);
+		if (length < rb->head->left) {
+			ringbuffer_read_skip(rb, length);
+			return;
+		}
+		length -= rb->head->left;
+		ringbuffer_read_pop(rb);
+	}
+}
 
 /** WRITE FUNCTIONS **/
 
-/* Return the tail ptr (current target of new writes) */
+/* Return the tail ptr (current target of new writes), taking a data
+ * block from the pool if the tail slot has none yet */
 char *
 ringbuffer_write_ptr(ringbuffer *rb)
 {
+	struct ringpool *rp;
+
 	assert(rb->used < rb->num_slots);
+	if (rb->tail->data == NULL) {
+		rp = rb->pool;
+		rb->tail->data = ringpool_get(rp, &rp->free_data,
+		    &rp->n_free_data, rb->data_len);
+	}
 	return (rb->tail->data);
 }
 
@@ -120,6 +249,22 @@ ringbuffer_write_append(ringbuffer *rb, int length)
 	rb->tail = rb->tail->next;
 }
 
+/* Append `data`, a block of data_len bytes holding `length` bytes that
+ * were written elsewhere, in place of the tail's own block. Returns the
+ * block it replaced, taken from the pool if the tail had none, for the
+ * caller to reuse. */
+char *
+ringbuffer_write_swap(ringbuffer *rb, char *data, int length)
+{
+	char *old;
+
+	AN(data);
+	old = ringbuffer_write_ptr(rb);
+	rb->tail->data = data;
+	ringbuffer_write_append(rb, length);
+	return (old);
+}
+
 /** RING STATE FUNCTIONS **/
 
 /* Used size of the ringbuffer */
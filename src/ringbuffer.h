@@ -31,11 +31,45 @@
 #define RINGBUFFER_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 /* Tweak these for potential memory/throughput tradeoffs */
 #define DEF_RING_SLOTS 3
 #define DEF_RING_DATA_LEN (1024 * 32)
 
+/* Maximum number of slots gathered by ringbuffer_read_iov() */
+#define RING_IOV_MAX 16
+
+/* Default number of released blocks a ringpool keeps around for reuse */
+#define DEF_RING_POOL_MAX 512
+
+/*
+ * Per-worker free list of ring slot memory. Blocks released by a
+ * closing connection are handed to the next accepted one instead of
+ * going back to malloc. At most max_free blocks of each kind are
+ * retained, the rest are freed.
+ */
+struct ringpool_ent;
+
+struct ringpool {
+	unsigned		magic;
+#define RINGPOOL_MAGIC		0x2a5e7d13
+	int			num_slots;
+	int			data_len;
+	unsigned		max_free;
+	unsigned		n_free_data;
+	unsigned		n_free_slots;
+	struct ringpool_ent	*free_data;
+	struct ringpool_ent	*free_slots;
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		drops;
+};
+
+struct ringpool *ringpool_new(int num_slots, int data_len,
+    unsigned max_free);
+
 typedef struct bufent {
     char *data;
     char *ptr;
@@ -51,17 +85,22 @@ typedef struct ringbuffer {
     int num_slots;
     int data_len;
     size_t bytes_written;
+    struct ringpool *pool;
 } ringbuffer;
 
-void ringbuffer_init(ringbuffer *rb, int num_slots, int data_len);
+void ringbuffer_init(ringbuffer *rb, struct ringpool *rp);
 void ringbuffer_cleanup(ringbuffer *rb);
+void ringbuffer_release(ringbuffer *rb);
 
 char * ringbuffer_read_next(ringbuffer *rb, int * length);
 void ringbuffer_read_skip(ringbuffer *rb, int length);
 void ringbuffer_read_pop(ringbuffer *rb);
+int ringbuffer_read_iov(ringbuffer *rb, struct iovec *iov, int iovcnt);
+void ringbuffer_read_consume(ringbuffer *rb, size_t length);
 
 char * ringbuffer_write_ptr(ringbuffer *rb);
 void ringbuffer_write_append(ringbuffer *rb, int length);
+char * ringbuffer_write_swap(ringbuffer *rb, char *data, int length);
 
 int ringbuffer_size(ringbuffer *rb);
 int ringbuffer_capacity(ringbuffer *rb);
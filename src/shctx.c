@@ -9,10 +9,18 @@
 
 #include "config.h"
 
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifdef USE_SYSCALL_FUTEX
-#  include <unistd.h>
 #  include <linux/futex.h>
 #  include <sys/syscall.h>
 #else
@@ -23,29 +31,102 @@
 #include "foreign/vas.h"
 #include "shctx.h"
 
+/*
+ * Sessions are stored in chunks holding the session header followed by
+ * its ASN1 encoding. Chunks come in size classes with room for
+ * SHSESS_MIN_DATA_LEN bytes of session data, doubling up to
+ * SHSESS_MAX_DATA_LEN. Each shard cuts its memory in pages, handed out
+ * to the size classes as they need them. Every class has its own free
+ * list and LRU list; a class that is out of free chunks evicts its least
+ * recently used session, or takes over a page from the class holding the
+ * most pages if it has no session to give up.
+ *
+ * The cache can live in a file, so that a new hitch process picks up the
+ * sessions of the previous one. Pointers are not kept across processes:
+ * on attach the trees and lists are rebuilt from the chunk headers, and
+ * damaged or expired sessions are dropped.
+ */
+
+#define SHCTX_FILE_MAGIC	0x48534331	/* "HSC1" */
+#define SHCTX_FILE_VERSION	1
+
+#define SHSESS_MIN_DATA_LEN	256U
+#define SHSESS_MAX_CLASSES	16
+#define SHSESS_PAGE_LEN		(32 * 1024)
+
+/* Session data in the common case fits the stack buffers of the
+ * callbacks, which can run on the small stack of an ASYNC job */
+#define SHSESS_STACK_DATA_LEN	512
+
 struct shared_session {
 	struct ebmb_node	key;
 	unsigned char		key_data[SSL_MAX_SSL_SESSION_ID_LENGTH];
 	long			c_date;
-	int			data_len;
-	unsigned char		data[SHSESS_MAX_DATA_LEN];
+	unsigned		data_len;	/* 0 when free */
+	unsigned		cls;
+	uint32_t		sum;		/* Of key and data, if in a file */
 	struct shared_session	*p;
 	struct shared_session	*n;
+	unsigned char		data[];
 };
 
-struct shared_context {
+struct shared_class {
+	unsigned		chunk_len;	/* Header and data */
+	unsigned		npages;
+	struct shared_session	active;		/* Most recent first */
+	struct shared_session	free;
+};
+
+/* One independently locked part of the cache. Sessions are spread over
+ * the shards by a hash of their ID, and each shard has its own tree,
+ * pages and size classes. Shards are kept on separate cache lines. */
+struct shared_shard {
 #ifdef USE_SYSCALL_FUTEX
 	unsigned		waiters;
 #else
 	pthread_mutex_t		mutex;
 #endif
-	struct shared_session	active;
-	struct shared_session	free;
+	struct shctx_shard_stats stats;	/* Updated under the lock */
+	unsigned		removals;	/* Bumped on session removal */
+	struct eb_root		tree;
+	unsigned char		*pages;
+	unsigned		npages;
+	unsigned		next_page;	/* First unassigned page */
+	struct shared_class	classes[SHSESS_MAX_CLASSES];
+} __attribute__((aligned(64)));
+
+struct shared_context {
+	uint32_t		magic;		/* SHCTX_FILE_MAGIC */
+	uint32_t		layout_sum;	/* Of the fields below */
+	uint32_t		version;
+	unsigned		nshards;
+	unsigned		nclasses;
+	unsigned		page_len;
+	unsigned		shard_len;
+	unsigned		session_len;
+	uint64_t		size;		/* Of the whole mapping */
+	unsigned		persistent;
+	struct shared_shard	shards[];
 };
 
 /* Static shared context */
 static struct shared_context *shctx = NULL;
 
+/*
+ * Each worker keeps the sessions it recently stored or looked up, already
+ * decoded, in a small direct mapped cache in front of the shared one. An
+ * entry is trusted as long as no session was removed from its shard since
+ * it was filled, so that removals done by other workers are honoured.
+ */
+struct shared_l1_entry {
+	unsigned char		key[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	SSL_SESSION		*sess;
+	unsigned		removals;	/* Of the shard when filled */
+};
+
+static struct shared_l1_entry shsess_l1[SHSESS_L1_SIZE];
+static struct shctx_l1_stats shsess_l1_stats;
+
 /* Callbacks */
 shsess_new_f *shared_session_new_cbk;
 
@@ -86,36 +167,74 @@ atomic_dec(unsigned *ptr)
 }
 
 static inline void
-shared_context_lock(void)
+shared_context_lock(struct shared_shard *sh)
 {
 	unsigned x;
 
-	x = cmpxchg(&shctx->waiters, 0, 1);
+	x = cmpxchg(&sh->waiters, 0, 1);
 	if (x) {
 		if (x != 2)
-			x = xchg(&shctx->waiters, 2);
+			x = xchg(&sh->waiters, 2);
 
 		while (x) {
-			syscall(SYS_futex, &shctx->waiters, FUTEX_WAIT, 2, NULL, 0, 0);
-			x = xchg(&shctx->waiters, 2);
+			syscall(SYS_futex, &sh->waiters, FUTEX_WAIT, 2, NULL, 0, 0);
+			x = xchg(&sh->waiters, 2);
 		}
+		sh->stats.contended++;
 	}
+	sh->stats.locks++;
 }
 
 static inline void
-shared_context_unlock(void)
+shared_context_unlock(struct shared_shard *sh)
 {
-	if (atomic_dec(&shctx->waiters)) {
-		shctx->waiters = 0;
-		syscall(SYS_futex, &shctx->waiters, FUTEX_WAKE, 1, NULL, 0, 0);
+	if (atomic_dec(&sh->waiters)) {
+		sh->waiters = 0;
+		syscall(SYS_futex, &sh->waiters, FUTEX_WAKE, 1, NULL, 0, 0);
 	}
 }
 
 #else /* USE_SYSCALL_FUTEX */
-#  define shared_context_lock(v) pthread_mutex_lock(&shctx->mutex)
-#  define shared_context_unlock(v) pthread_mutex_unlock(&shctx->mutex)
+static inline void
+shared_context_lock(struct shared_shard *sh)
+{
+
+	if (pthread_mutex_trylock(&sh->mutex) != 0) {
+		AZ(pthread_mutex_lock(&sh->mutex));
+		sh->stats.contended++;
+	}
+	sh->stats.locks++;
+}
+
+#  define shared_context_unlock(sh) pthread_mutex_unlock(&(sh)->mutex)
 #endif
 
+/* FNV-1a */
+static inline uint32_t
+shsess_fnv(uint32_t h, const unsigned char *p, size_t len)
+{
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+/* Hash of a zero padded session ID */
+#define shsess_hash(key) \
+	shsess_fnv(2166136261U, (key), SSL_MAX_SSL_SESSION_ID_LENGTH)
+
+/* Integrity check of a stored session */
+#define shsess_sum(s) \
+	shsess_fnv(shsess_hash((s)->key_data), (s)->data, (s)->data_len)
+
+/* Pick the shard of a session ID hash */
+#define shared_context_shard(h)	(&shctx->shards[(h) % shctx->nshards])
+
+/* Current removal count of a shard, read without its lock */
+#define shared_context_removals(sh) (*(volatile unsigned *)&(sh)->removals)
+
 /* List Macros */
 
 #define shsess_unset(s)			\
@@ -124,40 +243,27 @@ shared_context_unlock(void)
 		(s)->p->n = (s)->n;	\
 	} while (0)
 
-#define shsess_set_free(s)		\
+#define shsess_insert(head, s)		\
 	do {				\
-		shsess_unset(s);	\
-		(s)->p = &shctx->free;	\
-		(s)->n = shctx->free.n;	\
-		shctx->free.n->p = s;	\
-		shctx->free.n = s;	\
+		(s)->p = (head);	\
+		(s)->n = (head)->n;	\
+		(head)->n->p = (s);	\
+		(head)->n = (s);	\
 	} while (0)
 
-
-#define shsess_set_active(s)			\
-	do {					\
-		shsess_unset(s);		\
-		(s)->p = &shctx->active;	\
-		(s)->n = shctx->active.n;	\
-		shctx->active.n->p = s;		\
-		shctx->active.n = s;		\
-	} while (0)
-
-
-#define shsess_get_next()	\
-	(shctx->free.p == shctx->free.n ? shctx->active.p : shctx->free.p)
+#define shsess_list_empty(head)	((head)->n == (head))
 
 /* Tree Macros */
 
 #define shsess_tree_delete(s) ebmb_delete(&(s)->key)
 
-#define shsess_tree_insert(s) \
-	(struct shared_session *)ebmb_insert(&shctx->active.key.node.branches, \
-	    &(s)->key, SSL_MAX_SSL_SESSION_ID_LENGTH);
+#define shsess_tree_insert(sh, s) \
+	(struct shared_session *)ebmb_insert(&(sh)->tree, \
+	    &(s)->key, SSL_MAX_SSL_SESSION_ID_LENGTH)
 
-#define shsess_tree_lookup(k) \
-	(struct shared_session *)ebmb_lookup(&shctx->active.key.node.branches, \
-	    (k), SSL_MAX_SSL_SESSION_ID_LENGTH);
+#define shsess_tree_lookup(sh, k) \
+	(struct shared_session *)ebmb_lookup(&(sh)->tree, \
+	    (k), SSL_MAX_SSL_SESSION_ID_LENGTH)
 
 /* Copy-with-padding Macros */
 
@@ -170,11 +276,193 @@ shared_context_unlock(void)
 			    (dlen) - (slen));			\
 	} while (0)
 
-#define shsess_set_key(s, k, l)					\
-	do {							\
-		shsess_memcpypad((s)->key_data,			\
-		    SSL_MAX_SSL_SESSION_ID_LENGTH, (k), (l));	\
-	} while (0)
+/* Chunk management, all called with the shard locked */
+
+/* Smallest class with room for len bytes of session data */
+static struct shared_class *
+shsess_class(struct shared_shard *sh, unsigned len)
+{
+	unsigned i;
+
+	for (i = 0; i < shctx->nclasses; i++)
+		if ((SHSESS_MIN_DATA_LEN << i) >= len)
+			return (&sh->classes[i]);
+	return (NULL);
+}
+
+/* Cut a page into free chunks of a class */
+static void
+shsess_carve(struct shared_shard *sh, struct shared_class *cl,
+    unsigned char *page)
+{
+	struct shared_session *s;
+	unsigned off;
+
+	for (off = 0; off + cl->chunk_len <= SHSESS_PAGE_LEN;
+	    off += cl->chunk_len) {
+		s = (struct shared_session *)(page + off);
+		memset(s, 0, sizeof *s);
+		s->cls = cl - sh->classes;
+		shsess_insert(&cl->free, s);
+	}
+	cl->npages++;
+}
+
+/* Drop a session from the tree and put its chunk on the free list */
+static void
+shsess_free(struct shared_shard *sh, struct shared_session *s)
+{
+	struct shared_class *cl = &sh->classes[s->cls];
+
+	shsess_tree_delete(s);
+	shsess_unset(s);
+	s->data_len = 0;
+	shsess_insert(&cl->free, s);
+}
+
+/* Take the page holding the least recently used session of the class
+ * with the most pages, and give it to cl */
+static void
+shsess_steal_page(struct shared_shard *sh, struct shared_class *cl)
+{
+	struct shared_class *victim = NULL;
+	struct shared_session *s;
+	unsigned char *page;
+	unsigned i, off;
+
+	for (i = 0; i < shctx->nclasses; i++) {
+		if (&sh->classes[i] == cl)
+			continue;
+		if (victim == NULL ||
+		    sh->classes[i].npages > victim->npages)
+			victim = &sh->classes[i];
+	}
+	AN(victim);
+	assert(victim->npages > 0);
+
+	s = shsess_list_empty(&victim->active) ?
+	    victim->free.n : victim->active.p;
+	page = sh->pages + ((unsigned char *)s - sh->pages) /
+	    SHSESS_PAGE_LEN * SHSESS_PAGE_LEN;
+
+	for (off = 0; off + victim->chunk_len <= SHSESS_PAGE_LEN;
+	    off += victim->chunk_len) {
+		s = (struct shared_session *)(page + off);
+		if (s->data_len != 0) {
+			shsess_tree_delete(s);
+			sh->stats.evictions++;
+		}
+		shsess_unset(s);
+	}
+	victim->npages--;
+	sh->stats.page_moves++;
+	shsess_carve(sh, cl, page);
+}
+
+/* Get a chunk for a new session of a class, evicting if need be */
+static struct shared_session *
+shsess_alloc(struct shared_shard *sh, struct shared_class *cl)
+{
+	struct shared_session *s;
+
+	if (shsess_list_empty(&cl->free)) {
+		if (sh->next_page < sh->npages)
+			shsess_carve(sh, cl,
+			    sh->pages + sh->next_page++ * SHSESS_PAGE_LEN);
+		else if (!shsess_list_empty(&cl->active)) {
+			shsess_free(sh, cl->active.p);
+			sh->stats.evictions++;
+		} else
+			shsess_steal_page(sh, cl);
+	}
+	AZ(shsess_list_empty(&cl->free));
+	s = cl->free.n;
+	shsess_unset(s);
+	return (s);
+}
+
+/* Store a session under a padded key, replacing any previous one */
+static void
+shsess_store(struct shared_shard *sh, const unsigned char *key,
+    const unsigned char *data, unsigned data_len, long cdate)
+{
+	struct shared_class *cl;
+	struct shared_session *shsess;
+
+	cl = shsess_class(sh, data_len);
+	AN(cl);
+
+	shsess = shsess_tree_lookup(sh, key);
+	if (shsess != NULL) {
+		shsess_free(sh, shsess);
+		sh->removals++;
+	}
+
+	shsess = shsess_alloc(sh, cl);
+	memcpy(shsess->key_data, key, SSL_MAX_SSL_SESSION_ID_LENGTH);
+	shsess = shsess_tree_insert(sh, shsess);
+	AN(shsess);
+
+	/* store ASN1 encoded session into cache */
+	shsess->data_len = data_len;
+	memcpy(shsess->data, data, data_len);
+
+	/* store creation date */
+	shsess->c_date = cdate;
+
+	if (shctx->persistent)
+		shsess->sum = shsess_sum(shsess);
+
+	shsess_insert(&cl->active, shsess);
+	sh->stats.stores++;
+}
+
+/* Per worker cache of decoded sessions */
+
+static SSL_SESSION *
+shsess_l1_get(const unsigned char *key, uint32_t h, struct shared_shard *sh)
+{
+	struct shared_l1_entry *e = &shsess_l1[h % SHSESS_L1_SIZE];
+
+	shsess_l1_stats.lookups++;
+	if (e->sess == NULL ||
+	    memcmp(e->key, key, SSL_MAX_SSL_SESSION_ID_LENGTH) != 0)
+		return (NULL);
+	if (e->removals != shared_context_removals(sh)) {
+		SSL_SESSION_free(e->sess);
+		e->sess = NULL;
+		shsess_l1_stats.stale++;
+		return (NULL);
+	}
+	shsess_l1_stats.hits++;
+	return (e->sess);
+}
+
+static void
+shsess_l1_put(const unsigned char *key, uint32_t h, SSL_SESSION *sess,
+    unsigned removals)
+{
+	struct shared_l1_entry *e = &shsess_l1[h % SHSESS_L1_SIZE];
+
+	if (e->sess != NULL)
+		SSL_SESSION_free(e->sess);
+	AN(SSL_SESSION_up_ref(sess));
+	memcpy(e->key, key, SSL_MAX_SSL_SESSION_ID_LENGTH);
+	e->sess = sess;
+	e->removals = removals;
+}
+
+static void
+shsess_l1_drop(const unsigned char *key, uint32_t h)
+{
+	struct shared_l1_entry *e = &shsess_l1[h % SHSESS_L1_SIZE];
+
+	if (e->sess == NULL ||
+	    memcmp(e->key, key, SSL_MAX_SSL_SESSION_ID_LENGTH) != 0)
+		return;
+	SSL_SESSION_free(e->sess);
+	e->sess = NULL;
+}
 
 /* SSL context callbacks */
 
@@ -182,55 +470,54 @@ shared_context_unlock(void)
 int
 shctx_new_cb(SSL *ssl, SSL_SESSION *sess)
 {
-	struct shared_session *shsess;
-	unsigned char *data,*p;
+	struct shared_shard *sh;
+	unsigned char *encsess, *data, *p;
 	const unsigned char *key;
 	unsigned keylen;
-	unsigned data_len;
-	unsigned char encsess[SHSESS_MAX_ENCODED_LEN];
+	unsigned data_len, removals;
+	uint32_t h;
+	unsigned char buf[SSL_MAX_SSL_SESSION_ID_LENGTH +
+	    SHSESS_STACK_DATA_LEN + SHSESS_MAX_FOOTER_LEN];
 
 	AN(ssl);
 
 	data_len = i2d_SSL_SESSION(sess, NULL);
-	if (data_len > SHSESS_MAX_DATA_LEN)
+	if (data_len == 0 || data_len > SHSESS_MAX_DATA_LEN)
 		return (1);
 
+	encsess = buf;
+	if (data_len > SHSESS_STACK_DATA_LEN) {
+		encsess = malloc(SSL_MAX_SSL_SESSION_ID_LENGTH + data_len +
+		    SHSESS_MAX_FOOTER_LEN);
+		if (encsess == NULL)
+			return (1);
+	}
+
 	/* process ASN1 session encoding before the lock: lower cost */
 	p = data = encsess+SSL_MAX_SSL_SESSION_ID_LENGTH;
 	i2d_SSL_SESSION(sess, &p);
 
-	shared_context_lock();
-
-	shsess = shsess_get_next();
-
-	shsess_tree_delete(shsess);
-
 	key = SSL_SESSION_get_id(sess, &keylen);
-	shsess_set_key(shsess, key, keylen);
+	shsess_memcpypad(encsess, SSL_MAX_SSL_SESSION_ID_LENGTH, key, keylen);
+	h = shsess_hash(encsess);
+	sh = shared_context_shard(h);
 
-	shsess = shsess_tree_insert(shsess);
-	AN(shsess);
-
-	/* store ASN1 encoded session into cache */
-	shsess->data_len = data_len;
-	memcpy(shsess->data, data, data_len);
+	shared_context_lock(sh);
+	shsess_store(sh, encsess, data, data_len, SSL_SESSION_get_time(sess));
+	removals = sh->removals;
+	shared_context_unlock(sh);
 
-	/* store creation date */
-	shsess->c_date = SSL_SESSION_get_time(sess);
-
-	shsess_set_active(shsess);
-
-	shared_context_unlock();
+	shsess_l1_put(encsess, h, sess, removals);
 
 	if (shared_session_new_cbk) { /* if user level callback is set */
-		shsess_memcpypad(encsess, SSL_MAX_SSL_SESSION_ID_LENGTH,
-		    key, keylen);
-
 		shared_session_new_cbk(encsess,
 		    SSL_MAX_SSL_SESSION_ID_LENGTH + data_len,
 		    SSL_SESSION_get_time(sess));
 	}
 
+	if (encsess != buf)
+		free(encsess);
+
 	return (0); /* do not increment session reference count */
 }
 
@@ -243,12 +530,14 @@ static SSL_SESSION *
 shctx_get_cb(SSL *ssl, const unsigned char *key, int key_len, int *do_copy)
 #endif
 {
+	struct shared_shard *sh;
 	struct shared_session *shsess;
-	unsigned char data[SHSESS_MAX_DATA_LEN], *p;
+	unsigned char buf[SHSESS_STACK_DATA_LEN], *data, *p;
 	unsigned char padded_key[SSL_MAX_SSL_SESSION_ID_LENGTH];
-	unsigned data_len;
+	unsigned data_len, removals;
 	long cdate;
 	SSL_SESSION *sess;
+	uint32_t h;
 
 	AN(ssl);
 
@@ -256,33 +545,55 @@ shctx_get_cb(SSL *ssl, const unsigned char *key, int key_len, int *do_copy)
 	*do_copy = 0;
 
 	shsess_memcpypad(padded_key, sizeof padded_key, key, (size_t)key_len);
+	h = shsess_hash(padded_key);
+	sh = shared_context_shard(h);
+
+	/* recently seen by this worker: no lock, no decoding */
+	sess = shsess_l1_get(padded_key, h, sh);
+	if (sess != NULL) {
+		AN(SSL_SESSION_up_ref(sess));
+		return (sess);
+	}
 
-	shared_context_lock();
+	shared_context_lock(sh);
 
-	shsess = shsess_tree_lookup(padded_key);
+	sh->stats.lookups++;
+	shsess = shsess_tree_lookup(sh, padded_key);
 	if(shsess == NULL) {
-		shared_context_unlock();
+		shared_context_unlock(sh);
 		return (NULL);
 	}
+	sh->stats.hits++;
 
 	/* backup creation date to reset in session after ASN1 decode */
 	cdate = shsess->c_date;
 
 	/* copy ASN1 session data to decode outside the lock */
 	data_len = shsess->data_len;
-	memcpy(data, shsess->data, shsess->data_len);
+	data = buf;
+	if (data_len > sizeof buf && (data = malloc(data_len)) == NULL) {
+		shared_context_unlock(sh);
+		return (NULL);
+	}
+	memcpy(data, shsess->data, data_len);
 
-	shsess_set_active(shsess);
+	shsess_unset(shsess);
+	shsess_insert(&sh->classes[shsess->cls].active, shsess);
+	removals = sh->removals;
 
-	shared_context_unlock();
+	shared_context_unlock(sh);
 
 	/* decode ASN1 session */
         p = data;
 	sess = d2i_SSL_SESSION(NULL, (const unsigned char **)&p, data_len);
+	if (data != buf)
+		free(data);
 
 	/* reset creation date */
-	if (sess)
+	if (sess) {
 		SSL_SESSION_set_time(sess, cdate);
+		shsess_l1_put(padded_key, h, sess, removals);
+	}
 
 	return (sess);
 }
@@ -291,31 +602,40 @@ shctx_get_cb(SSL *ssl, const unsigned char *key, int key_len, int *do_copy)
 void
 shctx_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess)
 {
+	struct shared_shard *sh;
 	struct shared_session *shsess;
 	unsigned char padded_key[SSL_MAX_SSL_SESSION_ID_LENGTH];
 	const unsigned char *key;
 	unsigned keylen;
+	uint32_t h;
 
 	AN(ctx);
 
 	key = SSL_SESSION_get_id(sess, &keylen);
 	shsess_memcpypad(padded_key, sizeof padded_key, key, (size_t)keylen);
+	h = shsess_hash(padded_key);
+	sh = shared_context_shard(h);
 
-	shared_context_lock();
+	shsess_l1_drop(padded_key, h);
 
-	shsess = shsess_tree_lookup(padded_key);
-	if (shsess != NULL)
-		shsess_set_free(shsess);
+	shared_context_lock(sh);
+
+	shsess = shsess_tree_lookup(sh, padded_key);
+	if (shsess != NULL) {
+		shsess_free(sh, shsess);
+		/* stale for the other workers */
+		sh->removals++;
+	}
 
 	/* unlock cache */
-	shared_context_unlock();
+	shared_context_unlock(sh);
 }
 
 /* User level function called to add a session to the cache (remote updates) */
 void
 shctx_sess_add(const unsigned char *encsess, unsigned len, long cdate)
 {
-	struct shared_session *shsess;
+	struct shared_shard *sh;
 
 	/* check buffer is at least padded key long + 1 byte
 		and data_len not too long */
@@ -323,26 +643,12 @@ shctx_sess_add(const unsigned char *encsess, unsigned len, long cdate)
 	    len > SHSESS_MAX_DATA_LEN + SSL_MAX_SSL_SESSION_ID_LENGTH)
 		return;
 
-	shared_context_lock();
-
-	shsess = shsess_get_next();
-	shsess_tree_delete(shsess);
-	shsess_set_key(shsess, encsess, SSL_MAX_SSL_SESSION_ID_LENGTH);
-
-	shsess = shsess_tree_insert(shsess);
-	AN(shsess);
-
-	/* store into cache and update earlier on session get events */
-	if (cdate)
-		shsess->c_date = (long)cdate;
-
-	/* copy ASN1 session data into cache */
-	shsess->data_len = len - SSL_MAX_SSL_SESSION_ID_LENGTH;
-	memcpy(shsess->data, encsess+SSL_MAX_SSL_SESSION_ID_LENGTH, shsess->data_len);
+	sh = shared_context_shard(shsess_hash(encsess));
 
-	shsess_set_active(shsess);
-
-	shared_context_unlock();
+	shared_context_lock(sh);
+	shsess_store(sh, encsess, encsess + SSL_MAX_SSL_SESSION_ID_LENGTH,
+	    len - SSL_MAX_SSL_SESSION_ID_LENGTH, cdate);
+	shared_context_unlock(sh);
 }
 
 /* Function used to set a callback on new session creation */
@@ -354,70 +660,237 @@ shsess_set_new_cbk(shsess_new_f *func)
 	shared_session_new_cbk = func;
 }
 
-/* Init shared memory context if not allocated and set SSL context callbacks
- * size is the max number of stored session
- * Returns: -1 on alloc failure, size if performs context alloc, and 0 if just perform
- * callbacks registration */
-
-static int
-shared_context_alloc(int size)
+static void
+shared_shard_init(struct shared_shard *sh, unsigned char *pages,
+    unsigned npages)
 {
-	struct shared_session *prev,*cur;
+	struct shared_class *cl;
 #ifndef USE_SYSCALL_FUTEX
 	pthread_mutexattr_t attr;
 #endif
-	int i;
-
-	assert(size > 0);
-
-	shctx = mmap(NULL,
-	    sizeof *shctx + (size * sizeof(struct shared_session)),
-	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-
-	if (shctx == MAP_FAILED)
-		return (-1);
+	unsigned i;
 
 #ifdef USE_SYSCALL_FUTEX
-	shctx->waiters = 0;
+	sh->waiters = 0;
 #else
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
-	pthread_mutex_init(&shctx->mutex, &attr);
+	pthread_mutex_init(&sh->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
 #endif
-	memset(&shctx->active.key, 0, sizeof(struct ebmb_node));
-	memset(&shctx->free.key, 0, sizeof(struct ebmb_node));
+	memset(&sh->stats, 0, sizeof sh->stats);
 
 	/* No duplicate authorized in tree: */
-	shctx->active.key.node.branches.b[1] = (void *)1;
+	sh->tree.b[0] = NULL;
+	sh->tree.b[1] = (void *)1;
+
+	sh->pages = pages;
+	sh->npages = npages;
+	sh->next_page = 0;
+	sh->removals = 0;
+
+	for (i = 0; i < shctx->nclasses; i++) {
+		cl = &sh->classes[i];
+		/* Keep the chunks aligned */
+		cl->chunk_len = (sizeof(struct shared_session) +
+		    (SHSESS_MIN_DATA_LEN << i) + 15) & ~15U;
+		assert(cl->chunk_len <= SHSESS_PAGE_LEN);
+		cl->npages = 0;
+		cl->active.n = cl->active.p = &cl->active;
+		cl->free.n = cl->free.p = &cl->free;
+	}
+}
+
+/* Put the sessions left in a shard's pages by a previous process back
+ * in its tree and lists. Pages are given to the class recorded in their
+ * first chunk; a page whose chunks can't be trusted is carved anew. */
+static unsigned
+shared_shard_restore(struct shared_shard *sh, unsigned next_page,
+    long now, long timeout)
+{
+	struct shared_class *cl;
+	struct shared_session *s;
+	unsigned char *page;
+	unsigned i, off, cls, n = 0;
+
+	if (next_page > sh->npages)
+		next_page = 0;
+
+	for (i = 0; i < next_page; i++) {
+		page = sh->pages + i * SHSESS_PAGE_LEN;
+		cls = ((struct shared_session *)page)->cls;
+		if (cls >= shctx->nclasses) {
+			shsess_carve(sh, &sh->classes[0], page);
+			continue;
+		}
+		cl = &sh->classes[cls];
+		cl->npages++;
+		for (off = 0; off + cl->chunk_len <= SHSESS_PAGE_LEN;
+		    off += cl->chunk_len) {
+			s = (struct shared_session *)(page + off);
+			if (s->cls == cls && s->data_len > 0 &&
+			    s->data_len <= SHSESS_MIN_DATA_LEN << cls &&
+			    s->c_date + timeout > now &&
+			    s->sum == shsess_sum(s) &&
+			    shsess_tree_insert(sh, s) == s) {
+				shsess_insert(&cl->active, s);
+				n++;
+				continue;
+			}
+			memset(s, 0, sizeof *s);
+			s->cls = cls;
+			shsess_insert(&cl->free, s);
+		}
+	}
+	sh->next_page = next_page;
+	return (n);
+}
+
+static uint32_t
+shared_context_layout_sum(void)
+{
+	const unsigned char *p = (const unsigned char *)&shctx->version;
+
+	return (shsess_fnv(2166136261U, p,
+	    offsetof(struct shared_context, persistent) -
+	    offsetof(struct shared_context, version)));
+}
 
-	cur = &shctx->active;
-	cur->n = cur->p = cur;
+/* Sessions found in the cache file when it was attached */
+static unsigned shctx_restored;
+
+static int
+shared_context_alloc(size_t size, int nshards, const char *path,
+    long timeout)
+{
+	unsigned char *pages;
+	size_t hdr, len, npages;
+	unsigned nclasses, next_page;
+	struct stat st;
+	int fd = -1, i, restore = 0;
 
-	cur = &shctx->free;
-	for (i = 0 ; i < size ; i++) {
-		prev = cur;
-		cur++;
-		prev->n = cur;
-		cur->p = prev;
+	assert(size > 0);
+	assert(nshards > 0);
+
+	for (nclasses = 1; (SHSESS_MIN_DATA_LEN << (nclasses - 1)) <
+	    SHSESS_MAX_DATA_LEN; nclasses++)
+		continue;
+	assert(nclasses <= SHSESS_MAX_CLASSES);
+
+	/* Every shard gets at least a page per size class */
+	npages = size / SHSESS_PAGE_LEN;
+	if (npages < nclasses)
+		npages = nclasses;
+	if ((size_t)nshards > npages / nclasses)
+		nshards = npages / nclasses;
+
+	hdr = sizeof *shctx + nshards * sizeof(struct shared_shard);
+	hdr = (hdr + 63) & ~(size_t)63;
+	len = hdr + npages * SHSESS_PAGE_LEN;
+
+	if (path != NULL) {
+		fd = open(path, O_RDWR | O_CREAT, 0600);
+		if (fd < 0)
+			return (-1);
+		/* Only one process may own the file. When the workers of
+		 * a previous hitch are still draining, start with a cache
+		 * in memory rather than not at all. */
+		if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+			if (errno != EWOULDBLOCK)
+				goto fail;
+			(void)close(fd);
+			fd = -1;
+		}
+	}
+	if (fd >= 0) {
+		if (fstat(fd, &st) < 0)
+			goto fail;
+		restore = (st.st_size == (off_t)len);
+		if (!restore && ftruncate(fd, 0) < 0)
+			goto fail;
+		/* Reserve the blocks, running out of them later would
+		 * fault the workers */
+		errno = posix_fallocate(fd, 0, len);
+		if (errno != 0)
+			goto fail;
 	}
-	cur->n = &shctx->free;
-	shctx->free.p = cur;
 
-	return (size);
+	shctx = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    fd < 0 ? MAP_SHARED | MAP_ANONYMOUS : MAP_SHARED, fd, 0);
+
+	if (shctx == MAP_FAILED) {
+		shctx = NULL;
+		goto fail;
+	}
+	/* The file stays open, and locked, in this process and its
+	 * children: the workers use it until they exit, and it must not
+	 * be initialized again before that. */
+
+	if (restore && (shctx->magic != SHCTX_FILE_MAGIC ||
+	    shctx->version != SHCTX_FILE_VERSION ||
+	    shctx->nshards != (unsigned)nshards ||
+	    shctx->nclasses != nclasses ||
+	    shctx->page_len != SHSESS_PAGE_LEN ||
+	    shctx->shard_len != sizeof(struct shared_shard) ||
+	    shctx->session_len != sizeof(struct shared_session) ||
+	    shctx->size != len ||
+	    shctx->layout_sum != shared_context_layout_sum()))
+		restore = 0;
+	if (!restore)
+		memset(shctx, 0, hdr);
+
+	shctx->version = SHCTX_FILE_VERSION;
+	shctx->nshards = nshards;
+	shctx->nclasses = nclasses;
+	shctx->page_len = SHSESS_PAGE_LEN;
+	shctx->shard_len = sizeof(struct shared_shard);
+	shctx->session_len = sizeof(struct shared_session);
+	shctx->size = len;
+	shctx->persistent = (fd >= 0);
+	pages = (unsigned char *)shctx + hdr;
+	for (i = 0; i < nshards; i++) {
+		size_t n = npages / nshards + ((size_t)i < npages % nshards);
+		next_page = shctx->shards[i].next_page;
+		shared_shard_init(&shctx->shards[i], pages, n);
+		if (restore)
+			shctx_restored += shared_shard_restore(
+			    &shctx->shards[i], next_page, (long)time(NULL),
+			    timeout);
+		pages += n * SHSESS_PAGE_LEN;
+	}
+	shctx->layout_sum = shared_context_layout_sum();
+	shctx->magic = SHCTX_FILE_MAGIC;
+
+	return (1);
+
+fail:
+	i = errno;
+	if (fd >= 0)
+		(void)close(fd);
+	errno = i;
+	return (-1);
 }
 
+/* Init shared memory context if not allocated and set SSL context callbacks
+ * size is the memory of the cache in bytes, path the file backing it or
+ * NULL for anonymous memory
+ * Returns: -1 on alloc failure, 1 if performs context alloc, and 0 if just
+ * perform callbacks registration */
 int
-shared_context_init(SSL_CTX *ctx, int size)
+shared_context_init(SSL_CTX *ctx, size_t size, int nshards, const char *path)
 {
 	int ret = 0;
 
 	AN(ctx);
 
 	if (shctx == NULL)
-		ret = shared_context_alloc(size);
+		ret = shared_context_alloc(size, nshards, path,
+		    SSL_CTX_get_timeout(ctx));
 
-	/* set SSL internal cache size to external cache / 8  + 123 */
-	SSL_CTX_sess_set_cache_size(ctx, size >> 3 | 0x3ff);
+	/* The per worker decoded cache takes the place of the internal
+	 * one, which would hide removals done by other workers */
+	SSL_CTX_set_session_cache_mode(ctx,
+	    SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
 
 	/* Set callbacks */
 	SSL_CTX_sess_set_new_cb(ctx, shctx_new_cb);
@@ -426,3 +899,50 @@ shared_context_init(SSL_CTX *ctx, int size)
 
 	return (ret);
 }
+
+/* Number of shards of the shared context, 0 if it is not allocated */
+int
+shared_context_nshards(void)
+{
+
+	return (shctx == NULL ? 0 : (int)shctx->nshards);
+}
+
+/* Copy the counters of a shard. They are read without the shard's lock,
+ * which is fine for reporting. */
+void
+shared_context_shard_stats(int shard, struct shctx_shard_stats *st)
+{
+
+	AN(shctx);
+	assert(shard >= 0 && shard < (int)shctx->nshards);
+	AN(st);
+	*st = shctx->shards[shard].stats;
+}
+
+/* Whether the cache is kept in a file, which is not the case when the
+ * file was in use by another process */
+int
+shared_context_persistent(void)
+{
+
+	AN(shctx);
+	return (shctx->persistent);
+}
+
+/* Number of sessions found in the cache file when it was attached */
+unsigned
+shared_context_restored(void)
+{
+
+	return (shctx_restored);
+}
+
+/* Copy the counters of the decoded session cache of this process */
+void
+shared_context_l1_stats(struct shctx_l1_stats *st)
+{
+
+	AN(st);
+	*st = shsess_l1_stats;
+}
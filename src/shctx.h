@@ -18,9 +18,18 @@
 #endif 
 
 #ifndef SHSESS_MAX_DATA_LEN
-#  define SHSESS_MAX_DATA_LEN 512
+#  define SHSESS_MAX_DATA_LEN 8192
 #endif
 
+/* Entries of the per worker cache of decoded sessions */
+#ifndef SHSESS_L1_SIZE
+#  define SHSESS_L1_SIZE 256
+#endif
+
+/* Bytes of cache per session, used to size the cache when it is
+ * configured as a number of sessions */
+#define SHSESS_ENTRY_LEN 640
+
 #define SHSESS_MAX_ENCODED_LEN \
     SSL_MAX_SSL_SESSION_ID_LENGTH + \
     SHSESS_MAX_DATA_LEN + \
@@ -52,9 +61,39 @@ void shsess_set_new_cbk(shsess_new_f *cb);
 void shctx_sess_add(const unsigned char *sess, unsigned len, long cdate);
 
 /* Init shared memory context if not allocated and set SSL context callbacks
- * size is the max number of stored session 
- * Returns: -1 on alloc failure, size if performs context alloc, and 0 if just
+ * size is the memory of the cache in bytes, spread over nshards
+ * independently locked shards. Fewer shards are used when size is too
+ * small to give each one a page per size class.
+ * When path is not NULL the cache lives in that file, and the sessions a
+ * previous process left there are used unless they have expired.
+ * Returns: -1 on alloc failure, 1 if performs context alloc, and 0 if just
  * perform callbacks registration */
-int shared_context_init(SSL_CTX *ctx, int size);
+int shared_context_init(SSL_CTX *ctx, size_t size, int nshards,
+    const char *path);
+
+/* Lock, lookup and storage counters of one shard */
+struct shctx_shard_stats {
+	uint64_t	locks;		/* Lock acquisitions */
+	uint64_t	contended;	/* Acquisitions that had to wait */
+	uint64_t	lookups;	/* Session lookups */
+	uint64_t	hits;		/* Lookups that found the session */
+	uint64_t	stores;		/* Sessions stored */
+	uint64_t	evictions;	/* Sessions dropped to make room */
+	uint64_t	page_moves;	/* Pages moved between size classes */
+};
+
+int shared_context_nshards(void);
+void shared_context_shard_stats(int shard, struct shctx_shard_stats *st);
+int shared_context_persistent(void);
+unsigned shared_context_restored(void);
+
+/* Lookup counters of the per worker cache of decoded sessions */
+struct shctx_l1_stats {
+	uint64_t	lookups;	/* Session lookups */
+	uint64_t	hits;		/* Lookups served without the lock */
+	uint64_t	stale;		/* Entries dropped after a removal */
+};
+
+void shared_context_l1_stats(struct shctx_l1_stats *st);
 
 #endif /* SHCTX_H */
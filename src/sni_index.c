@@ -0,0 +1,340 @@
+/*-
+ * Copyright (c) 2026 Varnish Software
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * SNI name index.
+ *
+ * Names are lowercased once when added, and looked up with the client's
+ * servername as is: bytes are folded on the fly, nothing is copied or
+ * allocated. The index is an open addressing table of slots holding the
+ * hash and length of the name, so that a probe rarely needs to look at
+ * the name itself. Names are packed in a single string area.
+ *
+ * A name is hashed in two parts split at its first dot, the first label
+ * and the rest, eight lowercased bytes at a time. A wildcard name "*.example.com"
+ * is stored as ".example.com" with the hash of the rest only, which is
+ * also the second part of the hash of "www.example.com". A single scan
+ * of the servername thus gives the hashes of both the exact and the
+ * wildcard candidate.
+ *
+ * The index is filled when certificates are loaded and never modified
+ * once the workers are started.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "foreign/miniobj.h"
+#include "foreign/vas.h"
+#include "sni_index.h"
+
+#define SNI_HASH_MUL		0x9e3779b97f4a7c15ULL
+#define SNI_MIN_SLOTS		16
+
+struct sni_slot {
+	uint32_t		hash;
+	uint32_t		len;	/* 0 if the slot is free */
+	uint32_t		off;	/* Name in the string area */
+	uint32_t		wildcard;
+	void			*priv;
+};
+
+struct sni_index {
+	unsigned		magic;
+#define SNI_INDEX_MAGIC		0x5e1d3a07
+	unsigned		nslots;	/* Power of two */
+	unsigned		nnames;
+	struct sni_slot		*slots;
+	char			*names;
+	size_t			names_len;
+	size_t			names_sz;
+};
+
+/* ASCII only, hostnames are not subject to the locale */
+static inline unsigned char
+sni_lower(unsigned char c)
+{
+
+	if (c >= 'A' && c <= 'Z')
+		return (c + ('a' - 'A'));
+	return (c);
+}
+
+#define SNI_ONES		0x0101010101010101ULL
+
+/* Load up to eight bytes and lowercase them all at once: 0x20 is set in
+ * every byte between 'A' and 'Z'. */
+static inline uint64_t
+sni_load(const char *p, size_t n)
+{
+	uint64_t w = 0, x, ge_a, gt_z;
+
+	memcpy(&w, p, n < 8 ? n : 8);
+	x = w & (0x7f * SNI_ONES);
+	ge_a = x + (0x80 - 'A') * SNI_ONES;
+	gt_z = x + (0x80 - 'Z' - 1) * SNI_ONES;
+	return (w | ((ge_a & ~gt_z & ~w & (0x80 * SNI_ONES)) >> 2));
+}
+
+static inline uint64_t
+sni_mix(uint64_t h, uint64_t w)
+{
+
+	h = (h ^ w) * SNI_HASH_MUL;
+	return (h ^ (h >> 29));
+}
+
+static inline uint64_t
+sni_hash_part(const char *p, size_t len)
+{
+	uint64_t h = len;
+	size_t n;
+
+	for (n = 0; n < len; n += 8)
+		h = sni_mix(h, sni_load(p + n, len - n));
+	return (h);
+}
+
+/* The hash of a name out of the hashes of its first label and of the
+ * rest. Wildcard names only have the rest. */
+static inline uint32_t
+sni_hash_name(uint64_t hl, uint64_t hr)
+{
+
+	return ((uint32_t)sni_mix(hl, hr));
+}
+
+/* Length of the first label */
+static inline size_t
+sni_label_len(const char *name, size_t len)
+{
+	const char *dot;
+
+	dot = memchr(name, '.', len);
+	return (dot == NULL ? len : (size_t)(dot - name));
+}
+
+static uint32_t
+sni_hash(const char *name, size_t len, int wildcard)
+{
+	size_t ll;
+
+	if (wildcard)
+		return (sni_hash_name(0, sni_hash_part(name, len)));
+	ll = sni_label_len(name, len);
+	return (sni_hash_name(sni_hash_part(name, ll),
+	    sni_hash_part(name + ll, len - ll)));
+}
+
+/* The key is lowercase, the name may not be */
+static inline int
+sni_eq(const char *key, const char *name, size_t len)
+{
+	size_t n;
+
+	for (n = 0; n < len; n += 8)
+		if (sni_load(key + n, len - n) != sni_load(name + n, len - n))
+			return (0);
+	return (1);
+}
+
+static struct sni_slot *
+sni_find(const struct sni_index *si, uint32_t h, const char *name,
+    size_t len, int wildcard)
+{
+	struct sni_slot *s;
+	unsigned mask, u;
+
+	mask = si->nslots - 1;
+	for (u = h & mask; ; u = (u + 1) & mask) {
+		s = &si->slots[u];
+		if (s->len == 0)
+			return (s);
+		if (s->hash == h && s->len == len &&
+		    s->wildcard == (unsigned)wildcard &&
+		    sni_eq(si->names + s->off, name, len))
+			return (s);
+	}
+}
+
+static int
+sni_grow(struct sni_index *si)
+{
+	struct sni_slot *old, *s;
+	unsigned n, u, mask;
+
+	old = si->slots;
+	n = si->nslots;
+	si->slots = calloc(n * 2, sizeof *si->slots);
+	if (si->slots == NULL) {
+		si->slots = old;
+		return (-1);
+	}
+	si->nslots = n * 2;
+	mask = si->nslots - 1;
+	for (u = 0; u < n; u++) {
+		if (old[u].len == 0)
+			continue;
+		for (s = &si->slots[old[u].hash & mask]; s->len != 0;
+		    s = &si->slots[(s - si->slots + 1) & mask])
+			continue;
+		*s = old[u];
+	}
+	free(old);
+	return (0);
+}
+
+struct sni_index *
+sni_index_new(void)
+{
+	struct sni_index *si;
+
+	ALLOC_OBJ(si, SNI_INDEX_MAGIC);
+	if (si == NULL)
+		return (NULL);
+	si->nslots = SNI_MIN_SLOTS;
+	si->slots = calloc(si->nslots, sizeof *si->slots);
+	if (si->slots == NULL) {
+		FREE_OBJ(si);
+		return (NULL);
+	}
+	return (si);
+}
+
+/* Add a name, "*.example.com" for a wildcard. A name added again is
+ * overridden. */
+int
+sni_index_add(struct sni_index *si, const char *name, void *priv)
+{
+	struct sni_slot *s;
+	size_t len, sz;
+	int wildcard;
+	char *p;
+	uint32_t h;
+
+	CHECK_OBJ_NOTNULL(si, SNI_INDEX_MAGIC);
+	AN(name);
+
+	wildcard = (name[0] == '*' && name[1] == '.');
+	if (wildcard)
+		name++;
+	len = strlen(name);
+	if (len == 0 || len > UINT32_MAX - si->names_len)
+		return (-1);
+
+	h = sni_hash(name, len, wildcard);
+	s = sni_find(si, h, name, len, wildcard);
+	if (s->len != 0) {
+		s->priv = priv;
+		return (0);
+	}
+
+	/* Keep the load factor under one half */
+	if ((si->nnames + 1) * 2 > si->nslots) {
+		if (sni_grow(si) != 0)
+			return (-1);
+		s = sni_find(si, h, name, len, wildcard);
+	}
+
+	if (si->names_len + len + 1 > si->names_sz) {
+		sz = si->names_sz ? si->names_sz * 2 : 4096;
+		while (sz < si->names_len + len + 1)
+			sz *= 2;
+		p = realloc(si->names, sz);
+		if (p == NULL)
+			return (-1);
+		si->names = p;
+		si->names_sz = sz;
+	}
+	p = si->names + si->names_len;
+	for (sz = 0; sz < len; sz++)
+		p[sz] = sni_lower(name[sz]);
+	p[len] = '\0';
+
+	s->hash = h;
+	s->len = len;
+	s->off = si->names_len;
+	s->wildcard = wildcard;
+	s->priv = priv;
+	si->names_len += len + 1;
+	si->nnames++;
+	return (0);
+}
+
+/* Return the value of the name matching the servername, an exact match
+ * first, or else a wildcard one. */
+void *
+sni_index_lookup(const struct sni_index *si, const char *name)
+{
+	const struct sni_slot *s;
+	uint64_t hr;
+	size_t len, ll;
+
+	if (si == NULL)
+		return (NULL);
+	CHECK_OBJ(si, SNI_INDEX_MAGIC);
+	AN(name);
+
+	len = strlen(name);
+	ll = sni_label_len(name, len);
+	hr = sni_hash_part(name + ll, len - ll);
+
+	s = sni_find(si, sni_hash_name(sni_hash_part(name, ll), hr), name,
+	    len, 0);
+	if (s->len == 0 && ll < len)
+		s = sni_find(si, sni_hash_name(0, hr), name + ll, len - ll, 1);
+	return (s->len == 0 ? NULL : s->priv);
+}
+
+unsigned
+sni_index_count(const struct sni_index *si)
+{
+
+	if (si == NULL)
+		return (0);
+	CHECK_OBJ(si, SNI_INDEX_MAGIC);
+	return (si->nnames);
+}
+
+void
+sni_index_free(struct sni_index **sip)
+{
+	struct sni_index *si;
+
+	AN(sip);
+	si = *sip;
+	*sip = NULL;
+	if (si == NULL)
+		return;
+	CHECK_OBJ(si, SNI_INDEX_MAGIC);
+	free(si->slots);
+	free(si->names);
+	FREE_OBJ(si);
+}
@@ -0,0 +1,16 @@
+/*-
+ * Case-insensitive SNI name index, see sni_index.c
+ */
+
+#ifndef SNI_INDEX_H_INCLUDED
+#define SNI_INDEX_H_INCLUDED
+
+struct sni_index;
+
+struct sni_index *sni_index_new(void);
+int sni_index_add(struct sni_index *si, const char *name, void *priv);
+void *sni_index_lookup(const struct sni_index *si, const char *name);
+unsigned sni_index_count(const struct sni_index *si);
+void sni_index_free(struct sni_index **sip);
+
+#endif	/* SNI_INDEX_H_INCLUDED */
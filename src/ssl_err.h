@@ -38,3 +38,6 @@ SSL_ERR(SSL_ERROR_WANT_ACCEPT)
 SSL_ERR(SSL_ERROR_WANT_X509_LOOKUP)
 SSL_ERR(SSL_ERROR_SYSCALL)
 SSL_ERR(SSL_ERROR_SSL)
+#ifdef SSL_ERROR_WANT_ASYNC
+SSL_ERR(SSL_ERROR_WANT_ASYNC)
+#endif
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Test backend-connect-early: the PROXY header still reaches the backend
+# first, and carries the negotiated TLS parameters.
+
+. hitch_test.sh
+
+BACKENDPORT=$(expr $LISTENPORT + 1700)
+
+parse_proxy_v2 $BACKENDPORT >proxy.dump &
+
+start_hitch \
+	--backend=[127.0.0.1]:$BACKENDPORT \
+	--frontend="[localhost]:$LISTENPORT" \
+	--write-proxy-v2 \
+	--backend-connect-early \
+	${CERTSDIR}/site1.example.com
+
+sleep 0.1
+
+s_client -tls1_2 -cipher ECDHE-RSA-AES256-GCM-SHA384 >s_client.dump
+
+! grep ERROR proxy.dump
+
+run_cmd grep -q "PROXY v2 detected" proxy.dump
+run_cmd grep -q ECDHE-RSA-AES256-GCM-SHA384 proxy.dump
+run_cmd grep -q TLSv1.2 proxy.dump
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Test async-sign-threads: full handshakes complete with the private key
+# operations done on the signer threads.
+
+. hitch_test.sh
+
+BACKENDPORT=$(expr $LISTENPORT + 1800)
+
+parse_proxy_v2 $BACKENDPORT >proxy.dump &
+
+start_hitch \
+	--backend=[127.0.0.1]:$BACKENDPORT \
+	--frontend="[localhost]:$LISTENPORT" \
+	--write-proxy-v2 \
+	--async-sign-threads=2 \
+	${CERTSDIR}/site1.example.com
+
+sleep 0.1
+
+s_client -tls1_2 -cipher ECDHE-RSA-AES256-GCM-SHA384 >s_client.dump
+subject_field_eq CN "site1.example.com" s_client.dump
+
+! grep ERROR proxy.dump
+
+run_cmd grep -q "PROXY v2 detected" proxy.dump
+run_cmd grep -q ECDHE-RSA-AES256-GCM-SHA384 proxy.dump
+
+s_client -tls1_3 >s_client13.dump
+subject_field_eq CN "site1.example.com" s_client13.dump
+
+# The workers log how many private key operations went to the signer
+# threads when they exit, which may be after the master is gone.
+stop_hitch
+for i in 1 2 3 4 5
+do
+	grep -q "async sign:" hitch.log && break
+	sleep 1
+done
+run_cmd grep -q "async sign: [1-9][0-9]* private key operations offloaded" \
+	hitch.log
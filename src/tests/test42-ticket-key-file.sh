@@ -0,0 +1,40 @@
+#!/bin/sh
+# Test ticket-key-file: a ticket issued by one hitch instance is resumed
+# by another one loading the same keys.
+
+. hitch_test.sh
+
+BACKENDPORT=$(expr $LISTENPORT + 1900)
+
+openssl rand 80 | openssl base64 -A >ticket.keys
+echo >>ticket.keys
+openssl rand 48 | openssl base64 -A >>ticket.keys
+echo >>ticket.keys
+
+parse_proxy_v2 $BACKENDPORT >proxy.dump &
+
+start_hitch \
+	--backend=[127.0.0.1]:$BACKENDPORT \
+	--frontend="[localhost]:$LISTENPORT" \
+	--ticket-key-file="$PWD/ticket.keys" \
+	${CERTSDIR}/site1.example.com
+
+s_client -tls1_2 -sess_out sess_ticket.txt >out.dump
+run_cmd grep -q "TLS session ticket:" out.dump
+
+stop_hitch
+
+start_hitch \
+	--backend=[127.0.0.1]:$BACKENDPORT \
+	--frontend="[localhost]:$LISTENPORT" \
+	--ticket-key-file="$PWD/ticket.keys" \
+	${CERTSDIR}/site1.example.com
+
+s_client -tls1_2 -sess_in sess_ticket.txt >in.dump
+run_cmd grep Reused, in.dump
+
+# A key that isn't base64 is refused
+echo "not a key" >>ticket.keys
+run_cmd -s 1 hitch --test \
+	--ticket-key-file="$PWD/ticket.keys" \
+	${CERTSDIR}/site1.example.com
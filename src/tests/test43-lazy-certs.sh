@@ -0,0 +1,31 @@
+#!/bin/sh
+# Test lazy-certs: certificates are loaded by the workers on first use,
+# and loaded again after being evicted from the certificate cache.
+
+. hitch_test.sh
+
+start_hitch \
+	--backend='[hitch-tls.org]:80' \
+	--frontend="[localhost]:$LISTENPORT" \
+	--lazy-certs \
+	--cert-cache-size=1 \
+	"${CERTSDIR}/site1.example.com" \
+	"${CERTSDIR}/site2.example.com" \
+	"${CERTSDIR}/wildcard.example.com" \
+	"${CERTSDIR}/default.example.com"
+
+s_client -servername site1.example.com >s_client1.dump
+subject_field_eq CN "site1.example.com" s_client1.dump
+
+s_client -servername site2.example.com >s_client2.dump
+subject_field_eq CN "site2.example.com" s_client2.dump
+
+# Evicted by site2
+s_client -servername SITE1.example.com >s_client3.dump
+subject_field_eq CN "site1.example.com" s_client3.dump
+
+s_client -servername foo.example.com >s_client4.dump
+subject_field_eq CN "*.example.com" s_client4.dump
+
+s_client -servername nosuch.example.org >s_client5.dump
+subject_field_eq CN "default.example.com" s_client5.dump
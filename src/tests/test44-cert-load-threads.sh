@@ -0,0 +1,26 @@
+#!/bin/sh
+# Test cert-load-threads: certificates loaded in parallel are all found
+# by SNI.
+
+. hitch_test.sh
+
+start_hitch \
+	--backend='[hitch-tls.org]:80' \
+	--frontend="[localhost]:$LISTENPORT" \
+	--cert-load-threads=3 \
+	"${CERTSDIR}/site1.example.com" \
+	"${CERTSDIR}/site2.example.com" \
+	"${CERTSDIR}/site3.example.com" \
+	"${CERTSDIR}/wildcard.example.com" \
+	"${CERTSDIR}/default.example.com"
+
+run_cmd grep -q "Loaded 4 certificates" hitch.log
+
+for SITE in site1 site2 site3
+do
+	s_client -servername $SITE.example.com >s_client.$SITE.dump
+	subject_field_eq CN "$SITE.example.com" s_client.$SITE.dump
+done
+
+s_client -servername foo.example.com >s_client.wild.dump
+subject_field_eq CN "*.example.com" s_client.wild.dump
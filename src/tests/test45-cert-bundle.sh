@@ -0,0 +1,37 @@
+#!/bin/sh
+# Test --compile-certs and cert-bundle: certificates compiled into a
+# bundle are found by SNI without their PEM files.
+
+. hitch_test.sh
+
+for SITE in site1 site2 wildcard default
+do
+	cp "${CERTSDIR}/$SITE.example.com" $SITE.pem
+done
+
+run_cmd hitch --compile-certs=certs.bundle \
+	--backend='[hitch-tls.org]:80' \
+	site1.pem site2.pem wildcard.pem default.pem
+
+run_cmd rm site1.pem site2.pem wildcard.pem default.pem
+
+printf 'HITCHCB\n' >bad.bundle
+run_cmd -s 1 hitch --test --cert-bundle=bad.bundle \
+	--backend='[hitch-tls.org]:80'
+
+start_hitch \
+	--backend='[hitch-tls.org]:80' \
+	--frontend="[localhost]:$LISTENPORT" \
+	--cert-bundle=certs.bundle
+
+s_client -servername site1.example.com >s_client1.dump
+subject_field_eq CN "site1.example.com" s_client1.dump
+
+s_client -servername site2.example.com >s_client2.dump
+subject_field_eq CN "site2.example.com" s_client2.dump
+
+s_client -servername foo.example.com >s_client3.dump
+subject_field_eq CN "*.example.com" s_client3.dump
+
+s_client -servername nosuch.example.org >s_client4.dump
+subject_field_eq CN "default.example.com" s_client4.dump
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Test that a certificate used by several frontends and as a global
+# certificate is only loaded once, and still found by each of them.
+
+. hitch_test.sh
+
+PORT2=$(expr $LISTENPORT + 1700)
+
+start_hitch \
+	--backend='[hitch-tls.org]:80' \
+	--frontend="[localhost]:$LISTENPORT+${CERTSDIR}/site1.example.com" \
+	--frontend="[localhost]:$PORT2+${CERTSDIR}/site1.example.com" \
+	"${CERTSDIR}/site1.example.com" \
+	"${CERTSDIR}/site2.example.com" \
+	"${CERTSDIR}/default.example.com"
+
+run_cmd grep -q "Shared 1 certificates" hitch.log
+
+s_client -connect localhost:$LISTENPORT >s_client1.dump
+subject_field_eq CN site1.example.com s_client1.dump
+
+s_client -connect localhost:$PORT2 >s_client2.dump
+subject_field_eq CN site1.example.com s_client2.dump
+
+s_client -connect localhost:$PORT2 -servername site1.example.com \
+	>s_client3.dump
+subject_field_eq CN site1.example.com s_client3.dump
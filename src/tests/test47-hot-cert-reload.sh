@@ -0,0 +1,29 @@
+#!/bin/sh
+# Test that a reload changing only certificates is applied to the
+# running workers instead of starting a new generation.
+
+. hitch_test.sh
+
+cp ${CERTSDIR}/default.example.com cert.pem
+
+cat >hitch.cfg <<EOF2
+pem-file = "$PWD/cert.pem"
+frontend = "[localhost]:$LISTENPORT"
+backend = "[hitch-tls.org]:80"
+workers = 1
+EOF2
+
+start_hitch --config=$PWD/hitch.cfg
+
+s_client >s_client1.dump
+subject_field_eq CN "default.example.com" s_client1.dump
+
+cp ${CERTSDIR}/ecc.example.com.pem cert.pem
+kill -HUP $(hitch_pid)
+sleep 2
+
+run_cmd grep -q "Updating child processes" hitch.log
+run_cmd grep -q "Worker 0: Updated 1 certificates" hitch.log
+
+s_client >s_client2.dump
+subject_field_eq CN "ecc.example.com" s_client2.dump
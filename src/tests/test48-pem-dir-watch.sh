@@ -0,0 +1,44 @@
+#!/bin/sh
+# Test that certificates added to and removed from a watched pem-dir are
+# picked up without a reload.
+
+. hitch_test.sh
+
+test "$(uname)" = Linux || skip "inotify not available"
+
+mkdir certs.d
+cp ${CERTSDIR}/default.example.com certs.d/
+
+cat >hitch.cfg <<EOF2
+frontend = "[localhost]:$LISTENPORT"
+backend = "[hitch-tls.org]:80"
+pem-dir = "$PWD/certs.d"
+pem-dir-glob = "*.example.com"
+pem-dir-watch = on
+pem-dir-watch-delay = 1
+sni-nomatch-abort = on
+EOF2
+
+start_hitch --config=$PWD/hitch.cfg
+
+! s_client -servername site1.example.com >site1a.dump
+run_cmd grep 'unrecognized name' site1a.dump
+
+# Written elsewhere and moved in, like most certificate automation does
+cp ${CERTSDIR}/site1.example.com site1.tmp
+mv site1.tmp certs.d/site1.example.com
+cp ${CERTSDIR}/site2.example.com certs.d/site2.example.com.tmp
+sleep 3
+
+run_cmd grep -q "pem-dir: 1 certificates loaded" hitch.log
+
+s_client -servername site1.example.com >site1b.dump
+subject_field_eq CN "site1.example.com" site1b.dump
+
+rm certs.d/site1.example.com
+sleep 3
+
+run_cmd grep -q "pem-dir: 0 certificates loaded, 1 removed" hitch.log
+
+! s_client -servername site1.example.com >site1c.dump
+run_cmd grep 'unrecognized name' site1c.dump
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Test cert-store: lazy certificates are loaded by the workers out of the
+# store shared with the parent, also after a reload.
+
+. hitch_test.sh
+
+cp ${CERTSDIR}/site1.example.com site1.pem
+
+cat >hitch.cfg <<EOF2
+frontend = "[localhost]:$LISTENPORT"
+backend = "[hitch-tls.org]:80"
+lazy-certs = on
+cert-store = on
+cert-cache-size = 1
+pem-file = "$PWD/site1.pem"
+pem-file = "${CERTSDIR}/site2.example.com"
+pem-file = "${CERTSDIR}/default.example.com"
+EOF2
+
+start_hitch --config=$PWD/hitch.cfg
+
+run_cmd grep -q "Stored 2 certificates" hitch.log
+
+s_client -servername site1.example.com >s_client1.dump
+subject_field_eq CN "site1.example.com" s_client1.dump
+
+s_client -servername site2.example.com >s_client2.dump
+subject_field_eq CN "site2.example.com" s_client2.dump
+
+# Evicted by site2
+s_client -servername site1.example.com >s_client3.dump
+subject_field_eq CN "site1.example.com" s_client3.dump
+
+cp ${CERTSDIR}/site3.example.com site1.pem
+kill -HUP $(hitch_pid)
+sleep 2
+
+run_cmd grep -q "Stored 1 certificates" hitch.log
+
+s_client -servername site3.example.com >s_client4.dump
+subject_field_eq CN "site3.example.com" s_client4.dump
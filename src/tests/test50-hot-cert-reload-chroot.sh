@@ -0,0 +1,50 @@
+#!/bin/sh
+# Test that a hot certificate reload doesn't need the workers to read
+# any file: they run in an empty chroot, with client verification and an
+# OCSP staple.
+
+. hitch_test.sh
+
+mkdir chroot
+cp ${CERTSDIR}/default.example.com cert.pem
+cp ${CERTSDIR}/valid.example.com valid.pem
+
+cat >hitch.cfg <<EOF2
+frontend = "[localhost]:$LISTENPORT"
+backend = "[hitch-tls.org]:80"
+workers = 2
+chroot = "$PWD/chroot"
+client-verify = optional
+client-verify-ca = "${CERTSDIR}/client-ca.pem"
+
+pem-file = "$PWD/cert.pem"
+
+pem-file = {
+	cert = "$PWD/valid.pem"
+	ocsp-resp-file = "${CERTSDIR}/valid.example.com.ocsp"
+	ocsp-verify-staple = off
+}
+EOF2
+
+start_hitch --config=$PWD/hitch.cfg
+
+s_client -servername default.example.com >s_client1.dump
+subject_field_eq CN "default.example.com" s_client1.dump
+
+cp ${CERTSDIR}/ecc.example.com.pem cert.pem
+touch valid.pem
+kill -HUP $(hitch_pid)
+sleep 2
+
+run_cmd grep -q "Worker 0: Updated 2 certificates" hitch.log
+run_cmd grep -q "Worker 1: Updated 2 certificates" hitch.log
+! grep -q "retiring" hitch.log ||
+fail "a worker failed to update its certificates"
+
+s_client -servername ecc.example.com \
+    -cert "${CERTSDIR}/client-cert01.pem" >s_client2.dump
+subject_field_eq CN "ecc.example.com" s_client2.dump
+
+s_client -servername valid.example.com -status >s_client3.dump
+subject_field_eq CN "valid.example.com" s_client3.dump
+run_cmd grep -q "OCSP Response Status: successful" s_client3.dump
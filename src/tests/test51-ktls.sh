@@ -0,0 +1,28 @@
+#!/bin/sh
+# Test ktls: with kernel TLS in both directions, data is spliced between
+# the client and backend sockets each way, and the client's close_notify
+# closes the connection. Skipped where the kernel or OpenSSL cannot
+# offload TLS.
+
+. hitch_test.sh
+
+BACKENDPORT=$(expr $LISTENPORT + 1800)
+
+start_hitch \
+	--backend=[127.0.0.1]:$BACKENDPORT \
+	--frontend="[127.0.0.1]:$LISTENPORT" \
+	--log-level=2 \
+	--ktls \
+	${CERTSDIR}/site1.example.com
+
+# Download then upload, checking every byte
+run_cmd io_bench -c 1 -m 4 -f 127.0.0.1:$LISTENPORT -b $BACKENDPORT \
+	>io_bench.dump
+sleep 0.5
+
+grep -q "kTLS tx=on rx=on" hitch.log ||
+skip "kTLS is not available in both directions"
+
+run_cmd grep -q "kTLS splicing clear to ssl" hitch.log
+run_cmd grep -q "kTLS splicing ssl to clear" hitch.log
+run_cmd grep -q "kTLS close_notify, closing" hitch.log
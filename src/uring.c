@@ -0,0 +1,663 @@
+/*-
+ * Copyright (c) 2026 Varnish Software
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Worker socket I/O through io_uring.
+ *
+ * Each worker owns one ring next to its libev loop. Listeners use a
+ * multishot accept, so a single submission keeps producing clients.
+ * Receives pick a buffer from a ring of provided buffers when data
+ * arrives, instead of pinning one per idle connection, and the caller
+ * may swap that buffer straight into its ring buffer. Sends hand the
+ * ring buffer's iovec to the kernel.
+ *
+ * Submissions are only queued when they are made. A prepare watcher
+ * hands all of them to the kernel in a single io_uring_enter() call
+ * right before the loop blocks, so a loop iteration costs one system
+ * call however many connections it touched. Completions wake the loop
+ * through an eventfd registered with the ring.
+ *
+ * An operation is a struct uring_op embedded in its owner, which must
+ * not be freed while the operation is pending: URING_Cancel() it and
+ * wait for the completion first.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_IO_URING
+#  include <sys/eventfd.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <linux/io_uring.h>
+#endif
+
+#include "foreign/miniobj.h"
+#include "foreign/vas.h"
+#include "uring.h"
+
+void
+URING_Op_Init(struct uring_op *op, uring_done_f *done, void *priv)
+{
+
+	AN(op);
+	AN(done);
+	memset(op, 0, sizeof *op);
+	op->magic = URING_OP_MAGIC;
+	op->done = done;
+	op->priv = priv;
+}
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES		256
+#define URING_BGID		1
+#define URING_MAX_BUFS		32768
+
+struct uring {
+	unsigned		magic;
+#define URING_MAGIC		0x7c1d04a9
+	int			fd;
+	int			efd;		/* Completion notification */
+	ev_io			ev_cq;
+	ev_prepare		ev_submit;
+	uring_reaped_f		*reaped;
+
+	void			*sq_map;
+	size_t			sq_map_len;
+	void			*cq_map;
+	size_t			cq_map_len;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_len;
+
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_flags;
+	unsigned		*sq_array;
+	unsigned		sq_mask;
+	unsigned		sq_entries;
+	unsigned		sq_queued;	/* Not handed to the kernel */
+
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	struct io_uring_cqe	*cqes;
+	unsigned		cq_mask;
+
+	struct io_uring_buf_ring *br;	/* Provided receive buffers */
+	size_t			br_len;
+	unsigned		nbufs;
+	char			**bufs;
+	size_t			buf_len;
+
+	struct uring_stats	stats;
+};
+
+static struct uring *uring = NULL;
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+
+	return ((int)syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+uring_enter(int fd, unsigned to_submit, unsigned flags)
+{
+
+	return ((int)syscall(__NR_io_uring_enter, fd, to_submit, 0, flags,
+	    NULL, 0));
+}
+
+static int
+uring_register(int fd, unsigned op, void *arg, unsigned nargs)
+{
+
+	return ((int)syscall(__NR_io_uring_register, fd, op, arg, nargs));
+}
+
+/* Hand the queued submissions to the kernel */
+static void
+uring_submit(struct uring *u)
+{
+	int r;
+
+	while (u->sq_queued > 0) {
+		r = uring_enter(u->fd, u->sq_queued, 0);
+		if (r < 0) {
+			/* EAGAIN and EBUSY clear up once completions are
+			 * reaped, the next loop iteration tries again. */
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		u->stats.submits++;
+		if (r == 0)
+			break;
+		assert((unsigned)r <= u->sq_queued);
+		u->sq_queued -= r;
+	}
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *u, const struct uring_op *op)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+	    u->sq_entries) {
+		uring_submit(u);
+		if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+		    u->sq_entries)
+			return (NULL);
+	}
+	idx = tail & u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof *sqe);
+	sqe->user_data = (uintptr_t)op;
+	u->sq_array[idx] = idx;
+	return (sqe);
+}
+
+/* Publish the entry filled in after uring_sqe() */
+static void
+uring_queue(struct uring *u)
+{
+
+	__atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+	u->sq_queued++;
+	u->stats.sqes++;
+}
+
+static void
+uring_buf_put(struct uring *u, unsigned bid)
+{
+	struct io_uring_buf *b;
+	unsigned short tail;
+
+	tail = __atomic_load_n(&u->br->tail, __ATOMIC_RELAXED);
+	b = &u->br->bufs[tail & (u->nbufs - 1)];
+	b->addr = (uintptr_t)u->bufs[bid];
+	b->len = u->buf_len;
+	b->bid = bid;
+	__atomic_store_n(&u->br->tail, (unsigned short)(tail + 1),
+	    __ATOMIC_RELEASE);
+}
+
+static void
+uring_reap(struct uring *u)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_op *op;
+	unsigned head, flags, bid;
+	uint64_t data;
+	char *buf;
+	int res;
+
+	head = *u->cq_head;
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &u->cqes[head & u->cq_mask];
+		data = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		__atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+		u->stats.cqes++;
+
+		/* Cancellations carry no operation */
+		if (data == 0)
+			continue;
+		CAST_OBJ_NOTNULL(op, (void *)(uintptr_t)data, URING_OP_MAGIC);
+		if (!(flags & IORING_CQE_F_MORE)) {
+			assert(op->pending > 0);
+			op->pending--;
+		}
+		if (res == -ENOBUFS)
+			u->stats.nobufs++;
+
+		/* The callback may free the owner of op */
+		if (flags & IORING_CQE_F_BUFFER) {
+			bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			assert(bid < u->nbufs);
+			buf = u->bufs[bid];
+			op->done(op, res, &buf);
+			AN(buf);
+			u->bufs[bid] = buf;
+			uring_buf_put(u, bid);
+		} else
+			op->done(op, res, NULL);
+	}
+}
+
+static void
+uring_cq_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct uring *u;
+	uint64_t n;
+
+	(void)loop;
+	(void)revents;
+	CAST_OBJ_NOTNULL(u, w->data, URING_MAGIC);
+	(void)read(u->efd, &n, sizeof n);
+	uring_reap(u);
+
+	/* Completions the CQ had no room for are flushed by the next
+	 * enter, and do not signal the eventfd again. */
+	while (__atomic_load_n(u->sq_flags, __ATOMIC_ACQUIRE) &
+	    IORING_SQ_CQ_OVERFLOW) {
+		if (uring_enter(u->fd, 0, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			break;
+		uring_reap(u);
+	}
+	if (u->reaped != NULL)
+		u->reaped();
+}
+
+static void
+uring_submit_cb(struct ev_loop *loop, ev_prepare *w, int revents)
+{
+	struct uring *u;
+
+	(void)loop;
+	(void)revents;
+	CAST_OBJ_NOTNULL(u, w->data, URING_MAGIC);
+	uring_submit(u);
+}
+
+static int
+uring_bufs_init(struct uring *u, unsigned nbufs, size_t buf_len)
+{
+	struct io_uring_buf_reg reg;
+	unsigned i;
+
+	/* The kernel wants a power of two */
+	if (nbufs > URING_MAX_BUFS)
+		nbufs = URING_MAX_BUFS;
+	while (nbufs & (nbufs - 1))
+		nbufs &= nbufs - 1;
+
+	u->br_len = nbufs * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		return (-1);
+	}
+	u->bufs = calloc(nbufs, sizeof *u->bufs);
+	if (u->bufs == NULL)
+		return (-1);
+	u->nbufs = nbufs;
+	u->buf_len = buf_len;
+	for (i = 0; i < nbufs; i++) {
+		u->bufs[i] = malloc(buf_len);
+		if (u->bufs[i] == NULL)
+			return (-1);
+	}
+
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uintptr_t)u->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = URING_BGID;
+	if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return (-1);
+	for (i = 0; i < nbufs; i++)
+		uring_buf_put(u, i);
+	return (0);
+}
+
+static void
+uring_bufs_free(struct uring *u)
+{
+	unsigned i;
+
+	if (u->bufs != NULL) {
+		for (i = 0; i < u->nbufs; i++)
+			free(u->bufs[i]);
+		free(u->bufs);
+		u->bufs = NULL;
+	}
+	if (u->br != NULL)
+		(void)munmap(u->br, u->br_len);
+	u->br = NULL;
+	u->nbufs = 0;
+}
+
+static void
+uring_free(struct uring *u)
+{
+	int e = errno;
+
+	uring_bufs_free(u);
+	if (u->sqes != NULL)
+		(void)munmap(u->sqes, u->sqes_len);
+	if (u->cq_map != NULL && u->cq_map != u->sq_map)
+		(void)munmap(u->cq_map, u->cq_map_len);
+	if (u->sq_map != NULL)
+		(void)munmap(u->sq_map, u->sq_map_len);
+	if (u->efd >= 0)
+		(void)close(u->efd);
+	if (u->fd >= 0)
+		(void)close(u->fd);
+	FREE_OBJ(u);
+	errno = e;
+}
+
+static void *
+uring_mmap(int fd, size_t len, off_t off)
+{
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, off);
+	return (p == MAP_FAILED ? NULL : p);
+}
+
+int
+URING_Init(struct ev_loop *loop, unsigned nbufs, size_t buf_len,
+    uring_reaped_f *reaped)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	char *sq, *cq;
+
+	AN(loop);
+	AZ(uring);
+	ALLOC_OBJ(u, URING_MAGIC);
+	if (u == NULL)
+		return (-1);
+	u->efd = -1;
+	u->reaped = reaped;
+
+	memset(&p, 0, sizeof p);
+	u->fd = uring_setup(URING_ENTRIES, &p);
+	if (u->fd < 0)
+		goto err;
+	if (!(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_SUBMIT_STABLE)) {
+		errno = ENOTSUP;
+		goto err;
+	}
+
+	u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_map_len = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_map_len > u->sq_map_len)
+			u->sq_map_len = u->cq_map_len;
+		u->cq_map_len = u->sq_map_len;
+	}
+	u->sq_map = uring_mmap(u->fd, u->sq_map_len, IORING_OFF_SQ_RING);
+	if (u->sq_map == NULL)
+		goto err;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_map = u->sq_map;
+	else {
+		u->cq_map = uring_mmap(u->fd, u->cq_map_len,
+		    IORING_OFF_CQ_RING);
+		if (u->cq_map == NULL)
+			goto err;
+	}
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = uring_mmap(u->fd, u->sqes_len, IORING_OFF_SQES);
+	if (u->sqes == NULL)
+		goto err;
+
+	sq = u->sq_map;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	cq = u->cq_map;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+
+	u->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (u->efd < 0)
+		goto err;
+	if (uring_register(u->fd, IORING_REGISTER_EVENTFD, &u->efd, 1) < 0)
+		goto err;
+
+	/* Without provided buffers, accepts still go through the ring
+	 * and receives stay with the event loop. */
+	if (nbufs > 0 && uring_bufs_init(u, nbufs, buf_len) != 0)
+		uring_bufs_free(u);
+
+	ev_io_init(&u->ev_cq, uring_cq_cb, u->efd, EV_READ);
+	u->ev_cq.data = u;
+	ev_io_start(loop, &u->ev_cq);
+	ev_prepare_init(&u->ev_submit, uring_submit_cb);
+	u->ev_submit.data = u;
+	ev_prepare_start(loop, &u->ev_submit);
+
+	uring = u;
+	return (0);
+
+  err:
+	uring_free(u);
+	return (-1);
+}
+
+int
+URING_Active(void)
+{
+
+	return (uring != NULL);
+}
+
+int
+URING_Recv_Active(void)
+{
+
+	return (uring != NULL && uring->br != NULL);
+}
+
+int
+URING_Accept(struct uring_op *op, int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	CHECK_OBJ_NOTNULL(op, URING_OP_MAGIC);
+	CHECK_OBJ_NOTNULL(uring, URING_MAGIC);
+	AZ(op->pending);
+	sqe = uring_sqe(uring, op);
+	if (sqe == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	uring_queue(uring);
+	op->fd = fd;
+	op->pending++;
+	return (0);
+}
+
+int
+URING_Recv(struct uring_op *op, int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	CHECK_OBJ_NOTNULL(op, URING_OP_MAGIC);
+	CHECK_OBJ_NOTNULL(uring, URING_MAGIC);
+	AZ(op->pending);
+	if (uring->br == NULL)
+		return (-1);
+	sqe = uring_sqe(uring, op);
+	if (sqe == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->len = uring->buf_len;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	/* The socket was just drained, do not try it before it polls
+	 * readable. */
+	sqe->ioprio = IORING_RECVSEND_POLL_FIRST;
+	uring_queue(uring);
+	op->fd = fd;
+	op->pending++;
+	return (0);
+}
+
+int
+URING_Sendmsg(struct uring_op *op, int fd, const struct msghdr *msg)
+{
+	struct io_uring_sqe *sqe;
+
+	CHECK_OBJ_NOTNULL(op, URING_OP_MAGIC);
+	CHECK_OBJ_NOTNULL(uring, URING_MAGIC);
+	AN(msg);
+	AZ(op->pending);
+	sqe = uring_sqe(uring, op);
+	if (sqe == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	uring_queue(uring);
+	op->fd = fd;
+	op->pending++;
+	return (0);
+}
+
+void
+URING_Cancel(struct uring_op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	CHECK_OBJ_NOTNULL(op, URING_OP_MAGIC);
+	if (op->pending == 0)
+		return;
+	CHECK_OBJ_NOTNULL(uring, URING_MAGIC);
+	sqe = uring_sqe(uring, NULL);
+	if (sqe == NULL) {
+		/* The kernel takes no submissions right now, waking the
+		 * operation up through its socket ends it just as well. */
+		(void)shutdown(op->fd, SHUT_RDWR);
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)op;
+	uring_queue(uring);
+}
+
+void
+URING_Stats(struct uring_stats *st)
+{
+
+	AN(st);
+	if (uring == NULL)
+		memset(st, 0, sizeof *st);
+	else
+		*st = uring->stats;
+}
+
+#else /* HAVE_IO_URING */
+
+int
+URING_Init(struct ev_loop *loop, unsigned nbufs, size_t buf_len,
+    uring_reaped_f *reaped)
+{
+
+	(void)loop;
+	(void)nbufs;
+	(void)buf_len;
+	(void)reaped;
+	errno = ENOTSUP;
+	return (-1);
+}
+
+int
+URING_Active(void)
+{
+
+	return (0);
+}
+
+int
+URING_Recv_Active(void)
+{
+
+	return (0);
+}
+
+int
+URING_Accept(struct uring_op *op, int fd)
+{
+
+	(void)op;
+	(void)fd;
+	return (-1);
+}
+
+int
+URING_Recv(struct uring_op *op, int fd)
+{
+
+	(void)op;
+	(void)fd;
+	return (-1);
+}
+
+int
+URING_Sendmsg(struct uring_op *op, int fd, const struct msghdr *msg)
+{
+
+	(void)op;
+	(void)fd;
+	(void)msg;
+	return (-1);
+}
+
+void
+URING_Cancel(struct uring_op *op)
+{
+
+	(void)op;
+}
+
+void
+URING_Stats(struct uring_stats *st)
+{
+
+	AN(st);
+	memset(st, 0, sizeof *st);
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,53 @@
+/*-
+ * Worker socket I/O through io_uring, see uring.c
+ */
+
+#ifndef URING_H_INCLUDED
+#define URING_H_INCLUDED
+
+#include <sys/socket.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ev.h>
+
+struct uring_op;
+
+/* Called for each completion of op. For a receive, *buf is the provided
+ * buffer holding the data, which the callback may exchange for another
+ * one of the same size. */
+typedef void uring_done_f(struct uring_op *op, int res, char **buf);
+
+/* Called once all the completions available were handled */
+typedef void uring_reaped_f(void);
+
+struct uring_op {
+	unsigned		magic;
+#define URING_OP_MAGIC		0x5f2e93c1
+	unsigned		pending;	/* Submitted, not completed */
+	int			fd;		/* Of the last submission */
+	uring_done_f		*done;
+	void			*priv;
+};
+
+struct uring_stats {
+	uint64_t		submits;	/* io_uring_enter() calls */
+	uint64_t		sqes;
+	uint64_t		cqes;
+	uint64_t		nobufs;		/* Receives without a
+						 * provided buffer */
+};
+
+void URING_Op_Init(struct uring_op *op, uring_done_f *done, void *priv);
+int URING_Init(struct ev_loop *loop, unsigned nbufs, size_t buf_len,
+    uring_reaped_f *reaped);
+int URING_Active(void);
+int URING_Recv_Active(void);
+int URING_Accept(struct uring_op *op, int fd);
+int URING_Recv(struct uring_op *op, int fd);
+int URING_Sendmsg(struct uring_op *op, int fd, const struct msghdr *msg);
+void URING_Cancel(struct uring_op *op);
+void URING_Stats(struct uring_stats *st);
+
+#endif	/* URING_H_INCLUDED */
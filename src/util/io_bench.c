@@ -0,0 +1,303 @@
+/*-
+ * Copyright (c) 2026 Varnish Software
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+/*
+ * Bulk transfer benchmark through a running hitch.
+ *
+ * Serves as hitch's backend on the given port, and runs parallel TLS
+ * clients against its frontend: each of them downloads, then uploads,
+ * the given number of megabytes. -d and -u run only one direction.
+ *
+ *	LD_PRELOAD=./iocount.so hitch -n 1 \
+ *	    --frontend='[127.0.0.1]:8443' --backend='[127.0.0.1]:8080' cert.pem
+ *	io_bench -d -f 127.0.0.1:8443 -b 8080
+ *	kill hitch
+ *
+ * Dividing the counts iocount.so printed for the worker by the megabytes
+ * transferred gives the system calls per megabyte of that direction.
+ *
+ * Usage: io_bench [-d|-u] [-c clients] [-m megabytes] -f host:port -b port
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define BENCH_BUF	(16 * 1024)
+
+static SSL_CTX *ctx;
+static struct addrinfo *frontend;
+static size_t total;		/* Bytes per client and direction */
+
+static pthread_mutex_t backend_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backend_cond = PTHREAD_COND_INITIALIZER;
+static unsigned backend_done;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + 1e-9 * ts.tv_nsec);
+}
+
+/* Fail on anything but total bytes of 'x' */
+static void
+check(const char *what, const char *buf, size_t len, size_t n)
+{
+	size_t u;
+
+	for (u = 0; u < len; u++) {
+		if (buf[u] != 'x') {
+			fprintf(stderr, "%s: bad byte at %zu\n", what, n + u);
+			exit(1);
+		}
+	}
+	if (len == 0 && n != total) {
+		fprintf(stderr, "%s: stopped after %zu bytes\n", what, n);
+		exit(1);
+	}
+}
+
+/* Backend connection: 'D' gets total bytes, 'U' is read until EOF */
+static void *
+backend_conn(void *priv)
+{
+	char buf[BENCH_BUF], cmd;
+	size_t n;
+	ssize_t l;
+	int fd = (int)(intptr_t)priv;
+
+	if (read(fd, &cmd, 1) != 1) {
+		(void)close(fd);
+		return (NULL);
+	}
+	memset(buf, 'x', sizeof buf);
+	if (cmd == 'D') {
+		for (n = 0; n < total; n += l) {
+			l = write(fd, buf, total - n < sizeof buf ?
+			    total - n : sizeof buf);
+			if (l <= 0)
+				break;
+		}
+	} else {
+		for (n = 0; (l = read(fd, buf, sizeof buf)) > 0; n += l)
+			check("Upload", buf, l, n);
+		check("Upload", buf, 0, n);
+	}
+	(void)close(fd);
+	(void)pthread_mutex_lock(&backend_mtx);
+	backend_done++;
+	(void)pthread_cond_signal(&backend_cond);
+	(void)pthread_mutex_unlock(&backend_mtx);
+	return (NULL);
+}
+
+static void *
+backend(void *priv)
+{
+	pthread_t thr;
+	int fd, lfd = (int)(intptr_t)priv;
+
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		if (pthread_create(&thr, NULL, backend_conn,
+		    (void *)(intptr_t)fd) != 0)
+			abort();
+		(void)pthread_detach(thr);
+	}
+	return (NULL);
+}
+
+static void *
+client(void *priv)
+{
+	char buf[BENCH_BUF], cmd = *(char *)priv;
+	size_t n = 0;
+	SSL *ssl;
+	int fd, l = 0;
+
+	fd = socket(frontend->ai_family, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, frontend->ai_addr,
+	    frontend->ai_addrlen) != 0) {
+		perror("connect");
+		exit(1);
+	}
+	ssl = SSL_new(ctx);
+	if (ssl == NULL || !SSL_set_fd(ssl, fd) || SSL_connect(ssl) != 1 ||
+	    SSL_write(ssl, &cmd, 1) != 1) {
+		ERR_print_errors_fp(stderr);
+		exit(1);
+	}
+	memset(buf, 'x', sizeof buf);
+	if (cmd == 'D') {
+		for (; n < total && (l = SSL_read(ssl, buf, sizeof buf)) > 0;
+		    n += l)
+			check("Download", buf, l, n);
+	} else {
+		for (; n < total; n += l) {
+			l = SSL_write(ssl, buf, total - n < sizeof buf ?
+			    total - n : sizeof buf);
+			if (l <= 0)
+				break;
+		}
+	}
+	check(cmd == 'D' ? "Download" : "Upload", buf, 0, n);
+	/* Closing with unread data would reset the connection before
+	 * hitch passed the end of the upload on */
+	(void)SSL_shutdown(ssl);
+	while (SSL_read(ssl, buf, sizeof buf) > 0)
+		continue;
+	SSL_free(ssl);
+	(void)close(fd);
+	return (NULL);
+}
+
+static void
+run(char cmd, unsigned clients)
+{
+	pthread_t *thr;
+	unsigned u;
+	double t0, t;
+
+	thr = calloc(clients, sizeof *thr);
+	if (thr == NULL)
+		abort();
+	backend_done = 0;
+	t0 = now();
+	for (u = 0; u < clients; u++)
+		if (pthread_create(&thr[u], NULL, client, &cmd) != 0)
+			abort();
+	for (u = 0; u < clients; u++)
+		(void)pthread_join(thr[u], NULL);
+	/* Uploads are only complete once the backend has read them */
+	(void)pthread_mutex_lock(&backend_mtx);
+	while (backend_done < clients)
+		(void)pthread_cond_wait(&backend_cond, &backend_mtx);
+	(void)pthread_mutex_unlock(&backend_mtx);
+	t = now() - t0;
+	printf("%s: %u x %zu MB in %.2f s, %.1f MB/s\n",
+	    cmd == 'D' ? "download" : "upload", clients, total >> 20, t,
+	    clients * (total >> 20) / t);
+	free(thr);
+}
+
+static void
+usage(const char *prog)
+{
+
+	fprintf(stderr, "Usage: %s [-d|-u] [-c clients] [-m megabytes] "
+	    "-f host:port -b port\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct addrinfo hints;
+	struct sockaddr_in sin;
+	pthread_t thr;
+	char *host = NULL, *port;
+	unsigned clients = 4;
+	int opt, lfd, bport = 0, down = 1, up = 1, one = 1;
+
+	total = 30 << 20;
+	while ((opt = getopt(argc, argv, "b:c:df:m:u")) != -1) {
+		switch (opt) {
+		case 'b':
+			bport = atoi(optarg);
+			break;
+		case 'c':
+			clients = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			up = 0;
+			break;
+		case 'f':
+			host = optarg;
+			break;
+		case 'm':
+			total = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'u':
+			down = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (host == NULL || bport <= 0 || clients == 0 || total == 0 ||
+	    (port = strrchr(host, ':')) == NULL)
+		usage(argv[0]);
+	*port++ = '\0';
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &frontend) != 0) {
+		fprintf(stderr, "Unable to resolve %s:%s\n", host, port);
+		return (1);
+	}
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(bport);
+	if (lfd < 0 ||
+	    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) ||
+	    bind(lfd, (struct sockaddr *)&sin, sizeof sin) != 0 ||
+	    listen(lfd, 128) != 0) {
+		perror("backend");
+		return (1);
+	}
+	if (pthread_create(&thr, NULL, backend, (void *)(intptr_t)lfd) != 0)
+		return (1);
+
+	ctx = SSL_CTX_new(TLS_client_method());
+	if (ctx == NULL) {
+		ERR_print_errors_fp(stderr);
+		return (1);
+	}
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+	if (down)
+		run('D', clients);
+	if (up)
+		run('U', clients);
+	return (0);
+}
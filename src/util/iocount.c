@@ -0,0 +1,145 @@
+/*-
+ * Copyright (c) 2026 Varnish Software
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+/*
+ * System call counter, to be preloaded into hitch:
+ *
+ *	LD_PRELOAD=./iocount.so hitch ...
+ *
+ * Counts the socket I/O calls and epoll_wait() wakeups of each process
+ * and prints them to stderr when it exits, or appends them to the file
+ * named by IOCOUNT_LOG, which the workers' user must be able to write.
+ * Processes leaving through _exit() print nothing. See io_bench.c for
+ * the traffic.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+enum {
+	IOC_READ,
+	IOC_RECV,
+	IOC_WRITE,
+	IOC_SEND,
+	IOC_SENDMSG,
+	IOC_EPOLL_WAIT,
+	IOC_MAX
+};
+
+static const char * const ioc_names[IOC_MAX] = {
+	"read", "recv", "write", "send", "sendmsg", "epoll_wait"
+};
+
+static unsigned long ioc_count[IOC_MAX];
+
+#define IOC_COUNT(n)	__atomic_add_fetch(&ioc_count[n], 1, __ATOMIC_RELAXED)
+
+#define IOC_REAL(ret, name, args)					\
+	static ret (*real_##name) args;					\
+	if (real_##name == NULL)					\
+		real_##name = (ret (*) args)dlsym(RTLD_NEXT, #name);	\
+	if (real_##name == NULL)					\
+		abort()
+
+ssize_t
+read(int fd, void *buf, size_t len)
+{
+	IOC_REAL(ssize_t, read, (int, void *, size_t));
+
+	IOC_COUNT(IOC_READ);
+	return (real_read(fd, buf, len));
+}
+
+ssize_t
+recv(int fd, void *buf, size_t len, int flags)
+{
+	IOC_REAL(ssize_t, recv, (int, void *, size_t, int));
+
+	IOC_COUNT(IOC_RECV);
+	return (real_recv(fd, buf, len, flags));
+}
+
+ssize_t
+write(int fd, const void *buf, size_t len)
+{
+	IOC_REAL(ssize_t, write, (int, const void *, size_t));
+
+	IOC_COUNT(IOC_WRITE);
+	return (real_write(fd, buf, len));
+}
+
+ssize_t
+send(int fd, const void *buf, size_t len, int flags)
+{
+	IOC_REAL(ssize_t, send, (int, const void *, size_t, int));
+
+	IOC_COUNT(IOC_SEND);
+	return (real_send(fd, buf, len, flags));
+}
+
+ssize_t
+sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	IOC_REAL(ssize_t, sendmsg, (int, const struct msghdr *, int));
+
+	IOC_COUNT(IOC_SENDMSG);
+	return (real_sendmsg(fd, msg, flags));
+}
+
+int
+epoll_wait(int epfd, struct epoll_event *ev, int maxev, int timeout)
+{
+	IOC_REAL(int, epoll_wait, (int, struct epoll_event *, int, int));
+
+	IOC_COUNT(IOC_EPOLL_WAIT);
+	return (real_epoll_wait(epfd, ev, maxev, timeout));
+}
+
+static void __attribute__((destructor))
+ioc_report(void)
+{
+	const char *fn;
+	FILE *f = stderr;
+	int i;
+
+	fn = getenv("IOCOUNT_LOG");
+	if (fn != NULL && (f = fopen(fn, "a")) == NULL)
+		return;
+	fprintf(f, "iocount: pid %d:", (int)getpid());
+	for (i = 0; i < IOC_MAX; i++)
+		fprintf(f, " %s %lu", ioc_names[i], ioc_count[i]);
+	fprintf(f, "\n");
+	if (f != stderr)
+		(void)fclose(f);
+}
@@ -0,0 +1,214 @@
+/*-
+ * Copyright (c) 2026 Varnish Software
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+/*
+ * Microbenchmark of the SNI lookup.
+ *
+ * Builds a table of certificate names, a tenth of them wildcards, and
+ * looks up a mix of exact matches, wildcard matches and misses in mixed
+ * case, with the SNI index and with the lowercased copy and hash table
+ * lookups it replaced. Both must agree on every servername.
+ *
+ * Usage: sni_bench [-n names] [-l lookups]
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "foreign/uthash.h"
+#include "sni_index.h"
+
+struct bench_name {
+	char		*key;		/* Lowercase, ".suffix" for wildcards */
+	int		is_wildcard;
+	UT_hash_handle	hh;
+};
+
+static struct bench_name *names;
+
+/* The lookup done by sni_switch_ctx() before the SNI index */
+static const struct bench_name *
+uthash_lookup(const char *servername)
+{
+	struct bench_name *bn;
+	char *key, *c, *s;
+
+	key = strdup(servername);
+	if (key == NULL)
+		abort();
+	for (c = key; *c != '\0'; c++)
+		*c = tolower(*c);
+	HASH_FIND_STR(names, key, bn);
+	if (bn == NULL) {
+		s = strchr(key, '.');
+		if (s != NULL)
+			HASH_FIND_STR(names, s, bn);
+		if (bn != NULL && !bn->is_wildcard)
+			bn = NULL;
+	}
+	free(key);
+	return (bn);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + 1e-9 * ts.tv_nsec);
+}
+
+/* Flip the case of some letters */
+static void
+mix_case(char *s, unsigned seed)
+{
+
+	for (; *s != '\0'; s++, seed = seed * 1103515245 + 12345)
+		if ((seed >> 16) & 1)
+			*s = toupper(*s);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sni_index *si;
+	struct bench_name *bn;
+	char **queries, buf[256];
+	const void *p;
+	unsigned n_names = 50000, n_lookups = 1000000;
+	unsigned u, n_queries, found, found_hash;
+	double t0, t_idx, t_hash;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:l:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n_names = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			n_lookups = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n names] [-l lookups]\n",
+			    argv[0]);
+			return (1);
+		}
+	}
+	if (n_names == 0 || n_lookups == 0)
+		return (1);
+
+	si = sni_index_new();
+	if (si == NULL)
+		return (1);
+	for (u = 0; u < n_names; u++) {
+		bn = calloc(1, sizeof *bn);
+		if (bn == NULL)
+			return (1);
+		if (u % 10 == 0) {
+			bn->is_wildcard = 1;
+			(void)snprintf(buf, sizeof buf, "*.wild%u.example.com",
+			    u);
+			bn->key = strdup(buf + 1);
+		} else {
+			(void)snprintf(buf, sizeof buf,
+			    "www%u.site%u.example.com", u, u / 7);
+			bn->key = strdup(buf);
+		}
+		if (bn->key == NULL || sni_index_add(si, buf, bn) != 0)
+			return (1);
+		HASH_ADD_KEYPTR(hh, names, bn->key, strlen(bn->key), bn);
+	}
+
+	/* A third each of exact matches, wildcard matches and misses */
+	n_queries = 4096;
+	queries = calloc(n_queries, sizeof *queries);
+	if (queries == NULL)
+		return (1);
+	for (u = 0; u < n_queries; u++) {
+		unsigned r = (u * 2654435761U) % n_names;
+
+		switch (u % 3) {
+		case 0:
+			r -= r % 10;
+			(void)snprintf(buf, sizeof buf,
+			    "host%u.wild%u.example.com", u, r);
+			break;
+		case 1:
+			if (r % 10 == 0)
+				r++;
+			(void)snprintf(buf, sizeof buf,
+			    "www%u.site%u.example.com", r, r / 7);
+			break;
+		default:
+			(void)snprintf(buf, sizeof buf,
+			    "www%u.nosuch%u.example.org", r, u);
+			break;
+		}
+		mix_case(buf, u);
+		queries[u] = strdup(buf);
+		if (queries[u] == NULL)
+			return (1);
+	}
+
+	for (u = 0; u < n_queries; u++) {
+		p = sni_index_lookup(si, queries[u]);
+		if (p != uthash_lookup(queries[u])) {
+			fprintf(stderr, "Mismatch for %s\n", queries[u]);
+			return (1);
+		}
+	}
+
+	found = 0;
+	t0 = now();
+	for (u = 0; u < n_lookups; u++)
+		found += sni_index_lookup(si, queries[u % n_queries]) != NULL;
+	t_idx = now() - t0;
+
+	found_hash = 0;
+	t0 = now();
+	for (u = 0; u < n_lookups; u++)
+		found_hash += uthash_lookup(queries[u % n_queries]) != NULL;
+	t_hash = now() - t0;
+	if (found_hash != found) {
+		fprintf(stderr, "Found %u with sni_index, %u with uthash\n",
+		    found, found_hash);
+		return (1);
+	}
+
+	printf("%u names (%u indexed), %u lookups, %u found\n", n_names,
+	    sni_index_count(si), n_lookups, found);
+	printf("sni_index: %8.1f ns/lookup\n", 1e9 * t_idx / n_lookups);
+	printf("uthash:    %8.1f ns/lookup\n", 1e9 * t_hash / n_lookups);
+
+	sni_index_free(&si);
+	return (0);
+}